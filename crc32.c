@@ -3,37 +3,363 @@
 // CRC32 code based on public domain/zlib implementation:
 // https://opensource.org/license/zlib/
 // Author: Mark Adler (original table generation), public domain
+// Slicing-by-8/16 after Intel's "slicing-by-8" paper (Kounavis & Berry),
+// PCLMULQDQ folding after Intel's "Fast CRC Computation Using PCLMULQDQ" (Gopal et al.)
+// with the reflected CRC-32 constants used by zlib/Chromium/Linux.
 
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include "crc32.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define CRC32_HAVE_X86 1
+#endif
+
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#include <arm_acle.h>
+#define CRC32_HAVE_ARMV8 1
+#endif
 
 #define POLY 0xEDB88320
+#define POLY_C 0x82F63B78
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CRC32_LITTLE_ENDIAN 1
+#endif
+
+// crc_table[0] is the classic byte table; crc_table[k][i] advances crc_table[k-1][i] by one more zero byte
+static uint32_t crc_table[16][256];
+static uint32_t crc32c_table[8][256];
 
-static uint32_t crc_table[256];
+typedef uint32_t (*crc_kernel_fn)(uint32_t crc, const uint8_t *buf, size_t n);
 
-// Generate the table once
-static void generate_crc32_table(void) {
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static crc_kernel_fn active_crc32;
+static Crc32Kernel active_kernel = CRC32_KERNEL_BYTEWISE;
+static crc_kernel_fn active_crc32c;
+static bool crc32c_hardware = false;
+static bool kernel_available[CRC32_KERNEL_COUNT];
+
+static void generate_table(uint32_t table[][256], int slices, uint32_t poly)
+{
     for (uint32_t i = 0; i < 256; i++) {
         uint32_t crc = i;
         for (int j = 0; j < 8; j++)
-            crc = (crc >> 1) ^ (POLY & -(crc & 1));
-        crc_table[i] = crc;
+            crc = (crc >> 1) ^ (poly & -(crc & 1));
+        table[0][i] = crc;
+    }
+    for (int k = 1; k < slices; k++) {
+        for (uint32_t i = 0; i < 256; i++)
+            table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+    }
+}
+
+static inline uint32_t load32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t crc_bytewise(uint32_t crc, const uint8_t *buf, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ buf[i]) & 0xFF];
+    return crc;
+}
+
+static uint32_t slice8(const uint32_t t[][256], uint32_t crc, const uint8_t *buf, size_t n)
+{
+#ifdef CRC32_LITTLE_ENDIAN
+    while (n >= 8) {
+        uint32_t one = load32(buf) ^ crc;
+        uint32_t two = load32(buf + 4);
+        crc = t[7][one & 0xFF] ^ t[6][(one >> 8) & 0xFF] ^ t[5][(one >> 16) & 0xFF] ^ t[4][one >> 24] ^
+              t[3][two & 0xFF] ^ t[2][(two >> 8) & 0xFF] ^ t[1][(two >> 16) & 0xFF] ^ t[0][two >> 24];
+        buf += 8;
+        n -= 8;
+    }
+#endif
+    while (n--)
+        crc = (crc >> 8) ^ t[0][(crc ^ *buf++) & 0xFF];
+    return crc;
+}
+
+static uint32_t crc_slice8(uint32_t crc, const uint8_t *buf, size_t n)
+{
+    return slice8((const uint32_t (*)[256])crc_table, crc, buf, n);
+}
+
+static uint32_t crc_slice16(uint32_t crc, const uint8_t *buf, size_t n)
+{
+#ifdef CRC32_LITTLE_ENDIAN
+    const uint32_t (*t)[256] = (const uint32_t (*)[256])crc_table;
+    while (n >= 16) {
+        uint32_t w0 = load32(buf) ^ crc;
+        uint32_t w1 = load32(buf + 4);
+        uint32_t w2 = load32(buf + 8);
+        uint32_t w3 = load32(buf + 12);
+        crc = t[15][w0 & 0xFF] ^ t[14][(w0 >> 8) & 0xFF] ^ t[13][(w0 >> 16) & 0xFF] ^ t[12][w0 >> 24] ^
+              t[11][w1 & 0xFF] ^ t[10][(w1 >> 8) & 0xFF] ^ t[9][(w1 >> 16) & 0xFF] ^ t[8][w1 >> 24] ^
+              t[7][w2 & 0xFF] ^ t[6][(w2 >> 8) & 0xFF] ^ t[5][(w2 >> 16) & 0xFF] ^ t[4][w2 >> 24] ^
+              t[3][w3 & 0xFF] ^ t[2][(w3 >> 8) & 0xFF] ^ t[1][(w3 >> 16) & 0xFF] ^ t[0][w3 >> 24];
+        buf += 16;
+        n -= 16;
+    }
+#endif
+    return crc_slice8(crc, buf, n);
+}
+
+static uint32_t crc32c_slice8(uint32_t crc, const uint8_t *buf, size_t n)
+{
+    return slice8((const uint32_t (*)[256])crc32c_table, crc, buf, n);
+}
+
+#ifdef CRC32_HAVE_X86
+// folds 64-byte blocks with carry-less multiplies; needs n >= 64 and n % 16 == 0
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc_pclmul_fold(uint32_t crc, const uint8_t *buf, size_t n)
+{
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) = {0x0154442bd4, 0x01c6e41596};
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) = {0x01751997d0, 0x00ccaa009e};
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) = {0x0163cd6124, 0x0000000000};
+    static const uint64_t poly[2] __attribute__((aligned(16))) = {0x01db710641, 0x01f7011641};
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    buf += 64;
+    n -= 64;
+
+    // fold four 128-bit lanes in parallel
+    while (n >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        buf += 64;
+        n -= 64;
+    }
+
+    // fold the four lanes into one
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // remaining 16-byte blocks
+    while (n >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        n -= 16;
+    }
+
+    // 128 -> 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc_pclmul(uint32_t crc, const uint8_t *buf, size_t n)
+{
+    if (n >= 64) {
+        size_t chunk = n & ~(size_t)15;
+        crc = crc_pclmul_fold(crc, buf, chunk);
+        buf += chunk;
+        n -= chunk;
+    }
+    return crc_slice8(crc, buf, n);
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *buf, size_t n)
+{
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    while (n >= 8) {
+        uint64_t v;
+        memcpy(&v, buf, sizeof(v));
+        crc64 = _mm_crc32_u64(crc64, v);
+        buf += 8;
+        n -= 8;
+    }
+    crc = (uint32_t)crc64;
+#endif
+    while (n--)
+        crc = _mm_crc32_u8(crc, *buf++);
+    return crc;
+}
+#endif
+
+#ifdef CRC32_HAVE_ARMV8
+__attribute__((target("+crc")))
+static uint32_t crc_armv8(uint32_t crc, const uint8_t *buf, size_t n)
+{
+    while (n >= 8) {
+        uint64_t v;
+        memcpy(&v, buf, sizeof(v));
+        crc = __crc32d(crc, v);
+        buf += 8;
+        n -= 8;
+    }
+    while (n--)
+        crc = __crc32b(crc, *buf++);
+    return crc;
+}
+
+__attribute__((target("+crc")))
+static uint32_t crc32c_armv8(uint32_t crc, const uint8_t *buf, size_t n)
+{
+    while (n >= 8) {
+        uint64_t v;
+        memcpy(&v, buf, sizeof(v));
+        crc = __crc32cd(crc, v);
+        buf += 8;
+        n -= 8;
+    }
+    while (n--)
+        crc = __crc32cb(crc, *buf++);
+    return crc;
+}
+#endif
+
+static const crc_kernel_fn kernels[CRC32_KERNEL_COUNT] = {
+    [CRC32_KERNEL_BYTEWISE] = crc_bytewise,
+    [CRC32_KERNEL_SLICE8] = crc_slice8,
+    [CRC32_KERNEL_SLICE16] = crc_slice16,
+#ifdef CRC32_HAVE_X86
+    [CRC32_KERNEL_PCLMUL] = crc_pclmul,
+#endif
+#ifdef CRC32_HAVE_ARMV8
+    [CRC32_KERNEL_ARMV8] = crc_armv8,
+#endif
+};
+
+static const char *kernel_names[CRC32_KERNEL_COUNT] = {
+    [CRC32_KERNEL_BYTEWISE] = "bytewise",
+    [CRC32_KERNEL_SLICE8] = "slice-by-8",
+    [CRC32_KERNEL_SLICE16] = "slice-by-16",
+    [CRC32_KERNEL_PCLMUL] = "pclmulqdq",
+    [CRC32_KERNEL_ARMV8] = "armv8-crc",
+};
+
+// builds the tables and picks kernels from CPUID / HWCAP; runs exactly once
+static void crc_init(void)
+{
+    generate_table(crc_table, 16, POLY);
+    generate_table(crc32c_table, 8, POLY_C);
+
+    kernel_available[CRC32_KERNEL_BYTEWISE] = true;
+    kernel_available[CRC32_KERNEL_SLICE8] = true;
+    kernel_available[CRC32_KERNEL_SLICE16] = true;
+    active_kernel = CRC32_KERNEL_SLICE16;
+    active_crc32c = crc32c_slice8;
+
+#ifdef CRC32_HAVE_X86
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        if ((ecx & bit_PCLMUL) && (ecx & bit_SSE4_1)) {
+            kernel_available[CRC32_KERNEL_PCLMUL] = true;
+            active_kernel = CRC32_KERNEL_PCLMUL;
+        }
+        if (ecx & bit_SSE4_2) {
+            active_crc32c = crc32c_sse42;
+            crc32c_hardware = true;
+        }
     }
+#endif
+#ifdef CRC32_HAVE_ARMV8
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        kernel_available[CRC32_KERNEL_ARMV8] = true;
+        active_kernel = CRC32_KERNEL_ARMV8;
+        active_crc32c = crc32c_armv8;
+        crc32c_hardware = true;
+    }
+#endif
+    active_crc32 = kernels[active_kernel];
 }
 
 // Calculate CRC32 over a buffer
 uint32_t crc32(const void *data, size_t n_bytes) {
-    static int table_initialized = 0;
-    if (!table_initialized) {
-        generate_crc32_table();
-        table_initialized = 1;
-    }
+    pthread_once(&crc_once, crc_init);
+    return ~active_crc32(0xFFFFFFFF, (const uint8_t *)data, n_bytes);
+}
 
-    uint32_t crc = 0xFFFFFFFF;
-    const uint8_t *buf = (const uint8_t *)data;
+uint32_t crc32c(const void *data, size_t n_bytes) {
+    pthread_once(&crc_once, crc_init);
+    return ~active_crc32c(0xFFFFFFFF, (const uint8_t *)data, n_bytes);
+}
 
-    for (size_t i = 0; i < n_bytes; i++)
-        crc = (crc >> 8) ^ crc_table[(crc ^ buf[i]) & 0xFF];
+bool crc32_kernel_available(Crc32Kernel kernel) {
+    pthread_once(&crc_once, crc_init);
+    return kernel >= 0 && kernel < CRC32_KERNEL_COUNT && kernel_available[kernel];
+}
+
+const char *crc32_kernel_name(Crc32Kernel kernel) {
+    if (kernel < 0 || kernel >= CRC32_KERNEL_COUNT)
+        return "unknown";
+    return kernel_names[kernel];
+}
+
+Crc32Kernel crc32_active_kernel(void) {
+    pthread_once(&crc_once, crc_init);
+    return active_kernel;
+}
+
+// runs a specific kernel; falls back to the active one if <kernel> isn't supported here
+uint32_t crc32_with_kernel(Crc32Kernel kernel, const void *data, size_t n_bytes) {
+    pthread_once(&crc_once, crc_init);
+    crc_kernel_fn fn = crc32_kernel_available(kernel) ? kernels[kernel] : active_crc32;
+    return ~fn(0xFFFFFFFF, (const uint8_t *)data, n_bytes);
+}
 
-    return ~crc;
+const char *crc32c_kernel_name(void) {
+    pthread_once(&crc_once, crc_init);
+    return crc32c_hardware ? "hardware" : "slice-by-8";
 }
@@ -8,7 +8,30 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 
+// CRC-32 (IEEE 802.3, reflected 0xEDB88320) as stored in every TinyFS checksum.
+// The fastest kernel the CPU supports is picked once (thread-safely) on first use.
 uint32_t crc32(const void *data, size_t n_bytes);
 
+// CRC-32C (Castagnoli, reflected 0x82F63B78), the polynomial SSE4.2 implements in hardware.
+// Not used for on-disk structures (that would change the format); meant for new records.
+uint32_t crc32c(const void *data, size_t n_bytes);
+
+typedef enum {
+    CRC32_KERNEL_BYTEWISE = 0,  // original one-table, byte-at-a-time loop
+    CRC32_KERNEL_SLICE8,        // 8 tables, 8 bytes per step
+    CRC32_KERNEL_SLICE16,       // 16 tables, 16 bytes per step
+    CRC32_KERNEL_PCLMUL,        // x86-64 carry-less multiply folding (PCLMULQDQ + SSE4.1)
+    CRC32_KERNEL_ARMV8,         // AArch64 CRC32 instructions
+    CRC32_KERNEL_COUNT
+} Crc32Kernel;
+
+// kernel selection, exposed for benchmarking
+bool crc32_kernel_available(Crc32Kernel kernel);
+const char *crc32_kernel_name(Crc32Kernel kernel);
+Crc32Kernel crc32_active_kernel(void);
+uint32_t crc32_with_kernel(Crc32Kernel kernel, const void *data, size_t n_bytes);
+const char *crc32c_kernel_name(void); // "hardware" or "slice-by-8"
+
 #endif
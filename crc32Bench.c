@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "crc32.h"
+
+// Microbenchmark for the CRC32 kernels in crc32.c.
+// Prints MB/s per kernel for a Datablock-sized buffer and larger buffers,
+// with the speedup against the original byte-at-a-time loop.
+
+#define TARGET_BYTES (256u * 1024 * 1024) // hashed per kernel per size
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// keeps the compiler from dropping the checksum loop
+static volatile uint32_t sink;
+
+static double bench_kernel(Crc32Kernel kernel, const unsigned char *buf, size_t size)
+{
+    size_t iterations = TARGET_BYTES / size;
+    if (iterations == 0)
+        iterations = 1;
+    if (kernel == CRC32_KERNEL_BYTEWISE)
+        iterations = iterations / 4 + 1; // slow path, keep the run short
+
+    uint32_t acc = 0;
+    double start = now_seconds();
+    for (size_t i = 0; i < iterations; i++)
+        acc ^= crc32_with_kernel(kernel, buf, size);
+    double elapsed = now_seconds() - start;
+    sink = acc;
+    return (double)iterations * size / elapsed / 1e6;
+}
+
+static double bench_crc32c(const unsigned char *buf, size_t size)
+{
+    size_t iterations = TARGET_BYTES / size;
+    uint32_t acc = 0;
+    double start = now_seconds();
+    for (size_t i = 0; i < iterations; i++)
+        acc ^= crc32c(buf, size);
+    double elapsed = now_seconds() - start;
+    sink = acc;
+    return (double)iterations * size / elapsed / 1e6;
+}
+
+int main(void)
+{
+    const size_t sizes[] = {254, 4096, 1 << 20}; // Datablock data segment, page, large
+    const int num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+
+    unsigned char *buf = malloc(sizes[num_sizes - 1]);
+    if (buf == NULL)
+    {
+        perror("malloc");
+        return 1;
+    }
+    srand(453);
+    for (size_t i = 0; i < sizes[num_sizes - 1]; i++)
+        buf[i] = (unsigned char)rand();
+
+    // every kernel must agree with the reference loop before it is timed
+    for (int k = 0; k < CRC32_KERNEL_COUNT; k++)
+    {
+        if (!crc32_kernel_available(k))
+            continue;
+        for (int s = 0; s < num_sizes; s++)
+        {
+            if (crc32_with_kernel(k, buf, sizes[s]) != crc32_with_kernel(CRC32_KERNEL_BYTEWISE, buf, sizes[s]))
+            {
+                printf("Error: %s disagrees with bytewise on %zu bytes.\n", crc32_kernel_name(k), sizes[s]);
+                return 1;
+            }
+        }
+    }
+
+    printf("crc32() dispatches to: %s | crc32c(): %s\n\n", crc32_kernel_name(crc32_active_kernel()), crc32c_kernel_name());
+    printf("%-12s", "kernel");
+    for (int s = 0; s < num_sizes; s++)
+        printf("  %9zu B (MB/s, x)", sizes[s]);
+    printf("\n");
+
+    double baseline[8] = {0};
+    for (int k = 0; k < CRC32_KERNEL_COUNT; k++)
+    {
+        if (!crc32_kernel_available(k))
+            continue;
+        printf("%-12s", crc32_kernel_name(k));
+        for (int s = 0; s < num_sizes; s++)
+        {
+            double mbps = bench_kernel(k, buf, sizes[s]);
+            if (k == CRC32_KERNEL_BYTEWISE)
+                baseline[s] = mbps;
+            printf("  %10.1f %8.1fx", mbps, mbps / baseline[s]);
+        }
+        printf("\n");
+    }
+
+    printf("%-12s", "crc32c");
+    for (int s = 0; s < num_sizes; s++)
+    {
+        double mbps = bench_crc32c(buf, sizes[s]);
+        printf("  %10.1f %8.1fx", mbps, mbps / baseline[s]);
+    }
+    printf("\n");
+
+    free(buf);
+    return 0;
+}
@@ -13,6 +13,8 @@ typedef enum {
     DISK_ERR_DISK_INACTIVE = -5,
     DISK_ERR_OPEN_DISK_BAD_ALIGNMENT = -6,
     DISK_ERR_DISK_ARRAY_FULL = -7,
+    DISK_ERR_BAD_BLOCK_SIZE = -8,
+    DISK_ERR_ASYNC_ENGINE_UNAVAILABLE = -9,
 } DiskError;
 
 typedef enum {
@@ -39,6 +41,15 @@ typedef enum {
     FS_ERR_INVALID_FILE_PERMISSION = -70,
     FS_ERR_INVALID_OFFSET = -71,
     FS_ERR_BITMAP_FULL = -72,
+    FS_ERR_INVALID_READ_SIZE = -73,
+    FS_ERR_FILE_EXISTS = -74,
+    FS_ERR_CORRUPT_EXTENT_TREE = -75,
+    FS_ERR_LOG_FULL = -76,
+    FS_ERR_LOG_DEVICE_MISSING = -77,
+    FS_ERR_CORRUPT_LOG_RECORD = -78,
+    FS_ERR_NOT_A_DIRECTORY = -79,
+    FS_ERR_IS_A_DIRECTORY = -80,
+    FS_ERR_CORRUPT_DIRECTORY = -81,
 
 } FSError;
 
@@ -0,0 +1,846 @@
+#include "errors.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "libDisk.h"
+#include "libCache.h"
+
+#ifndef RETURN_IF_ERR
+#define RETURN_IF_ERR(call)        \
+    do {                           \
+        int err = (call);          \
+        if (err != SUCCESS)        \
+            return err;            \
+    } while (0)
+#endif
+
+#define WRITE_STAMPS 1024   // hashed per-block write sequence numbers: tell a prefetch its copy went stale
+
+typedef enum {
+    LIST_NONE = 0,
+    LIST_T1,    // resident, referenced once
+    LIST_T2,    // resident, referenced more than once
+    LIST_B1,    // ghost of T1
+    LIST_B2,    // ghost of T2
+    LIST_COUNT
+} CacheListId;
+
+typedef struct CacheEntry {
+    int bNum;
+    uint8_t list;
+    bool dirty;
+    bool prefetched;            // installed ahead of demand and not referenced since: its first hit stays in T1
+    bool fetching;              // a cachePrefetch() batch is reading the block: demand reads wait for it
+    uint8_t *data;              // NULL while on a ghost list
+    struct CacheEntry *prev;    // towards MRU
+    struct CacheEntry *next;    // towards LRU
+    struct CacheEntry *hnext;   // hash chain
+} CacheEntry;
+
+typedef struct {
+    CacheEntry *head;   // MRU
+    CacheEntry *tail;   // LRU
+    uint32_t size;
+} CacheList;
+
+struct BlockCache {
+    int disk;
+    int nBlocks;
+    size_t blockSize;           // the disk's block size when the cache was opened
+    uint32_t c;                 // capacity in resident blocks
+    uint32_t p;                 // adaptive target for |T1|
+    CacheList lists[LIST_COUNT];
+
+    CacheEntry *entries;        // 2c + c/4 entries: resident + ghosts never exceed 2c, and blocks being
+                                // prefetched that are neither (hashed, on no list) never exceed c/4
+    CacheEntry *freeEntries;    // singly linked through hnext
+    uint8_t *dataPool;          // c * blockSize
+    uint8_t **freeData;         // stack of unused data buffers
+    uint32_t nFreeData;
+
+    CacheEntry **buckets;
+    uint32_t bucketMask;
+
+    uint64_t writeSeq;          // bumped by every write of a block
+    uint64_t writeStamps[WRITE_STAMPS]; // writeSeq of the last write of any block hashing here
+    uint32_t prefetches;        // cachePrefetch() batches still in flight
+    uint32_t fetchingBlocks;    // blocks they are reading, at most c/4
+    pthread_cond_t prefetchDone;
+
+    CacheStats stats;
+    pthread_mutex_t lock;       // every public call holds it, so a scrub thread can share the cache
+};
+
+// a cachePrefetch() batch: the blocks are read into private buffers and only installed when they arrive
+typedef struct {
+    BlockCache *cache;
+    uint64_t writeSeq;          // of the cache when the reads were issued
+    int count;
+    int *bNums;
+    void **bufs;
+    uint8_t *blocks;
+} Prefetch;
+
+#pragma region
+static uint32_t hash_block(const BlockCache *cache, int bNum)
+{
+    return ((uint32_t)bNum * 2654435761u) & cache->bucketMask;
+}
+
+static uint64_t *write_stamp(BlockCache *cache, int bNum)
+{
+    return &cache->writeStamps[((uint32_t)bNum * 2654435761u) % WRITE_STAMPS];
+}
+
+static CacheEntry *lookup(BlockCache *cache, int bNum)
+{
+    CacheEntry *e = cache->buckets[hash_block(cache, bNum)];
+    while (e != NULL && e->bNum != bNum)
+        e = e->hnext;
+    return e;
+}
+
+static void hash_insert(BlockCache *cache, CacheEntry *e)
+{
+    uint32_t h = hash_block(cache, e->bNum);
+    e->hnext = cache->buckets[h];
+    cache->buckets[h] = e;
+}
+
+static void hash_remove(BlockCache *cache, CacheEntry *e)
+{
+    CacheEntry **link = &cache->buckets[hash_block(cache, e->bNum)];
+    while (*link != e)
+        link = &(*link)->hnext;
+    *link = e->hnext;
+    e->hnext = NULL;
+}
+
+static void list_unlink(BlockCache *cache, CacheEntry *e)
+{
+    CacheList *l = &cache->lists[e->list];
+    if (e->prev) e->prev->next = e->next; else l->head = e->next;
+    if (e->next) e->next->prev = e->prev; else l->tail = e->prev;
+    e->prev = e->next = NULL;
+    e->list = LIST_NONE;
+    l->size--;
+}
+
+static void list_push_mru(BlockCache *cache, CacheEntry *e, CacheListId id)
+{
+    CacheList *l = &cache->lists[id];
+    e->list = id;
+    e->prev = NULL;
+    e->next = l->head;
+    if (l->head) l->head->prev = e; else l->tail = e;
+    l->head = e;
+    l->size++;
+}
+
+static void release_data(BlockCache *cache, CacheEntry *e)
+{
+    cache->freeData[cache->nFreeData++] = e->data;
+    e->data = NULL;
+    e->prefetched = false;
+}
+
+// writes a dirty resident block back to disk
+static int write_back(BlockCache *cache, CacheEntry *e)
+{
+    if (!e->dirty)
+        return SUCCESS;
+    cache->stats.diskWrites++;
+    RETURN_IF_ERR(writeBlock(cache->disk, e->bNum, e->data));
+    cache->stats.writebacks++;
+    e->dirty = false;
+    cache->stats.dirtyBlocks--;
+    return SUCCESS;
+}
+
+// drops an entry from the cache entirely (resident or ghost); one still being prefetched stays hashed, on no list
+static int discard(BlockCache *cache, CacheEntry *e)
+{
+    if (e->data != NULL)
+    {
+        RETURN_IF_ERR(write_back(cache, e));
+        release_data(cache, e);
+        cache->stats.evictions++;
+    }
+    list_unlink(cache, e);
+    if (e->fetching)
+        return SUCCESS;
+    hash_remove(cache, e);
+    e->hnext = cache->freeEntries;
+    cache->freeEntries = e;
+    return SUCCESS;
+}
+
+// ARC REPLACE(): demotes the LRU of T1 or T2 to its ghost list, freeing one data buffer
+static int replace(BlockCache *cache, bool hitInB2)
+{
+    CacheList *t1 = &cache->lists[LIST_T1];
+    CacheList *t2 = &cache->lists[LIST_T2];
+    CacheEntry *victim;
+    CacheListId ghost;
+
+    if (t1->size > 0 && (t1->size > cache->p || (hitInB2 && t1->size == cache->p) || t2->size == 0))
+    {
+        victim = t1->tail;
+        ghost = LIST_B1;
+    }
+    else
+    {
+        victim = t2->tail;
+        ghost = LIST_B2;
+    }
+
+    RETURN_IF_ERR(write_back(cache, victim));
+    list_unlink(cache, victim);
+    release_data(cache, victim);
+    list_push_mru(cache, victim, ghost);
+    cache->stats.evictions++;
+    return SUCCESS;
+}
+
+// makes room for a brand new block per the ARC miss case
+static int make_room_for_miss(BlockCache *cache)
+{
+    CacheList *t1 = &cache->lists[LIST_T1];
+    CacheList *b1 = &cache->lists[LIST_B1];
+    uint32_t l1 = t1->size + b1->size;
+    uint32_t total = l1 + cache->lists[LIST_T2].size + cache->lists[LIST_B2].size;
+
+    if (l1 == cache->c)
+    {
+        if (t1->size < cache->c)
+        {
+            RETURN_IF_ERR(discard(cache, b1->tail));
+            if (cache->nFreeData == 0)
+                RETURN_IF_ERR(replace(cache, false));
+        }
+        else
+        {
+            RETURN_IF_ERR(discard(cache, t1->tail));
+        }
+    }
+    else if (total >= cache->c)
+    {
+        if (total >= 2 * cache->c)
+            RETURN_IF_ERR(discard(cache, cache->lists[LIST_B2].tail));
+        if (cache->nFreeData == 0)
+            RETURN_IF_ERR(replace(cache, false));
+    }
+    return SUCCESS;
+}
+
+// takes a free entry for bNum (no data yet) into the hash table
+static CacheEntry *new_entry(BlockCache *cache, int bNum)
+{
+    CacheEntry *e = cache->freeEntries;
+    cache->freeEntries = e->hnext;
+    e->bNum = bNum;
+    e->dirty = false;
+    e->prefetched = false;
+    e->fetching = false;
+    e->data = NULL;
+    hash_insert(cache, e);
+    return e;
+}
+
+// Finds or installs bNum as a resident block, updating the ARC lists.
+// When <load> is false the caller is about to overwrite the whole block, so a miss skips the disk read.
+static int access_block(BlockCache *cache, int bNum, bool load, CacheEntry **out)
+{
+    if (bNum < 0 || bNum >= cache->nBlocks)
+    {
+        return DISK_ERR_DISK_ACCESS_DENIED;
+    }
+
+    CacheEntry *e = lookup(cache, bNum);
+    CacheListId dest = LIST_T2;
+
+    if (e != NULL && (e->list == LIST_T1 || e->list == LIST_T2))
+    { // hit
+        cache->stats.hits++;
+        list_unlink(cache, e);
+        list_push_mru(cache, e, e->prefetched ? LIST_T1 : LIST_T2); // a sequential scan stays out of T2
+        e->prefetched = false;
+        *out = e;
+        return SUCCESS;
+    }
+
+    cache->stats.misses++;
+
+    if (e != NULL && e->list != LIST_NONE)
+    { // ghost hit: adapt p towards the list that would have kept it
+        uint32_t b1 = cache->lists[LIST_B1].size;
+        uint32_t b2 = cache->lists[LIST_B2].size;
+        bool inB2 = (e->list == LIST_B2);
+        if (!inB2)
+        {
+            uint32_t delta = (b2 > b1) ? b2 / b1 : 1;
+            cache->p = (cache->p + delta > cache->c) ? cache->c : cache->p + delta;
+            cache->stats.ghostHitsRecent++;
+        }
+        else
+        {
+            uint32_t delta = (b1 > b2) ? b1 / b2 : 1;
+            cache->p = (delta > cache->p) ? 0 : cache->p - delta;
+            cache->stats.ghostHitsFrequent++;
+        }
+        if (cache->nFreeData == 0)
+            RETURN_IF_ERR(replace(cache, inB2));
+        list_unlink(cache, e);
+    }
+    else
+    {
+        RETURN_IF_ERR(make_room_for_miss(cache));
+        dest = LIST_T1;
+        if (e == NULL)
+            e = new_entry(cache, bNum); // else being prefetched: it has an entry already
+    }
+
+    e->data = cache->freeData[--cache->nFreeData];
+    if (load)
+    {
+        cache->stats.diskReads++;
+        int err = readBlock(cache->disk, bNum, e->data);
+        if (err != SUCCESS)
+        { // forget the block entirely rather than keep a garbage buffer
+            release_data(cache, e);
+            if (!e->fetching)
+            {
+                hash_remove(cache, e);
+                e->hnext = cache->freeEntries;
+                cache->freeEntries = e;
+            }
+            return err;
+        }
+    }
+    list_push_mru(cache, e, dest);
+    *out = e;
+    return SUCCESS;
+}
+
+#pragma endregion
+
+BlockCache *openCache(int disk, size_t budgetBytes)
+{
+    int nBlocks = diskNumBlocks(disk);
+    int blockSize = diskBlockSize(disk);
+    if (nBlocks < 0 || blockSize < 0)
+        return NULL;
+
+    BlockCache *cache = calloc(1, sizeof(BlockCache));
+    if (cache == NULL)
+        return NULL;
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->prefetchDone, NULL);
+    cache->disk = disk;
+    cache->nBlocks = nBlocks;
+    cache->blockSize = (size_t)blockSize;
+    cache->c = (uint32_t)(budgetBytes / cache->blockSize);
+    cache->stats.capacityBlocks = cache->c;
+    if (cache->c == 0)
+        return cache; // pass-through
+
+    uint32_t nBuckets = 1;
+    while (nBuckets < 2 * cache->c)
+        nBuckets <<= 1;
+
+    uint32_t nEntries = 2 * cache->c + cache->c / 4;
+    cache->entries = calloc(nEntries, sizeof(CacheEntry));
+    cache->dataPool = malloc((size_t)cache->c * cache->blockSize);
+    cache->freeData = malloc((size_t)cache->c * sizeof(uint8_t *));
+    cache->buckets = calloc(nBuckets, sizeof(CacheEntry *));
+    if (!cache->entries || !cache->dataPool || !cache->freeData || !cache->buckets)
+    {
+        perror("malloc() failed in openCache()");
+        free(cache->entries);
+        free(cache->dataPool);
+        free(cache->freeData);
+        free(cache->buckets);
+        pthread_cond_destroy(&cache->prefetchDone);
+        pthread_mutex_destroy(&cache->lock);
+        free(cache);
+        return NULL;
+    }
+    cache->bucketMask = nBuckets - 1;
+
+    for (uint32_t i = 0; i < nEntries; i++)
+    {
+        cache->entries[i].hnext = cache->freeEntries;
+        cache->freeEntries = &cache->entries[i];
+    }
+    for (uint32_t i = 0; i < cache->c; i++)
+    {
+        cache->freeData[i] = cache->dataPool + (size_t)i * cache->blockSize;
+    }
+    cache->nFreeData = cache->c;
+    return cache;
+}
+
+// true while a cachePrefetch() batch is fetching bNum
+static bool prefetching(BlockCache *cache, int bNum)
+{
+    CacheEntry *e = lookup(cache, bNum);
+    return e != NULL && e->fetching;
+}
+
+// a demand read of blocks a prefetch is already fetching waits for it rather than reading them a second time.
+// drops the lock meanwhile, so callers do this before looking at the cache
+static void wait_for_prefetches(BlockCache *cache, int count, const int *bNums)
+{
+    for (int i = 0; i < count && cache->fetchingBlocks > 0; i++)
+    {
+        if (!prefetching(cache, bNums[i]))
+            continue;
+        cache->stats.prefetchWaits++;
+        do
+        {
+            pthread_cond_wait(&cache->prefetchDone, &cache->lock);
+        } while (prefetching(cache, bNums[i]));
+    }
+}
+
+static int read_locked(BlockCache *cache, int bNum, void *block)
+{
+    if (cache->c == 0)
+    {
+        cache->stats.misses++;
+        cache->stats.diskReads++;
+        return readBlock(cache->disk, bNum, block);
+    }
+
+    CacheEntry *e;
+    wait_for_prefetches(cache, 1, &bNum);
+    RETURN_IF_ERR(access_block(cache, bNum, true, &e));
+    memcpy(block, e->data, cache->blockSize);
+    return SUCCESS;
+}
+
+static int write_locked(BlockCache *cache, int bNum, const void *block)
+{
+    *write_stamp(cache, bNum) = ++cache->writeSeq;
+    if (cache->c == 0)
+    {
+        cache->stats.misses++;
+        cache->stats.diskWrites++;
+        return writeBlock(cache->disk, bNum, (void *)block);
+    }
+
+    CacheEntry *e;
+    RETURN_IF_ERR(access_block(cache, bNum, false, &e));
+    memcpy(e->data, block, cache->blockSize);
+    if (!e->dirty)
+    {
+        e->dirty = true;
+        cache->stats.dirtyBlocks++;
+    }
+    return SUCCESS;
+}
+
+static int read_blocks_locked(BlockCache *cache, int count, const int *bNums, void *const *blocks)
+{
+    if (cache->c == 0)
+    {
+        cache->stats.misses += count;
+        cache->stats.diskReads += count;
+        return readBlocks(cache->disk, count, bNums, blocks);
+    }
+
+    wait_for_prefetches(cache, count, bNums);
+    int *missIdx = malloc(count * sizeof(int));
+    int *missBlocks = malloc(count * sizeof(int));
+    void **missBufs = malloc(count * sizeof(void *));
+    if (missIdx == NULL || missBlocks == NULL || missBufs == NULL)
+    {
+        perror("malloc() failed in cacheReadBlocks()");
+        free(missIdx);
+        free(missBlocks);
+        free(missBufs);
+        return SYSTEM_ERROR;
+    }
+
+    int err = SUCCESS;
+    int nMiss = 0;
+    for (int i = 0; i < count && err == SUCCESS; i++)
+    {
+        CacheEntry *e = lookup(cache, bNums[i]);
+        if (e != NULL && e->data != NULL)
+        {
+            err = access_block(cache, bNums[i], true, &e);
+            if (err == SUCCESS)
+                memcpy(blocks[i], e->data, cache->blockSize);
+        }
+        else
+        {
+            missIdx[nMiss] = i;
+            missBlocks[nMiss] = bNums[i];
+            missBufs[nMiss] = blocks[i];
+            nMiss++;
+        }
+    }
+
+    if (err == SUCCESS && nMiss > 0)
+    {
+        cache->stats.diskReads += nMiss;
+        err = readBlocks(cache->disk, nMiss, missBlocks, missBufs);
+    }
+    if (err == SUCCESS && (uint32_t)nMiss <= cache->c / 2)
+    { // small enough to keep: install clean copies
+        for (int m = 0; m < nMiss && err == SUCCESS; m++)
+        {
+            CacheEntry *e;
+            err = access_block(cache, missBlocks[m], false, &e);
+            if (err == SUCCESS && e->dirty == false)
+                memcpy(e->data, blocks[missIdx[m]], cache->blockSize);
+        }
+    }
+    else if (err == SUCCESS)
+    {
+        cache->stats.misses += nMiss; // streamed past the cache
+    }
+
+    free(missIdx);
+    free(missBlocks);
+    free(missBufs);
+    return err;
+}
+
+static int write_blocks_locked(BlockCache *cache, int count, const int *bNums, void *const *blocks)
+{
+    if (cache->c != 0 && (uint32_t)count <= cache->c / 2)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            RETURN_IF_ERR(write_locked(cache, bNums[i], blocks[i]));
+        }
+        return SUCCESS;
+    }
+
+    cache->stats.misses += count;
+    cache->stats.diskWrites += count;
+    for (int i = 0; i < count; i++)
+    {
+        *write_stamp(cache, bNums[i]) = ++cache->writeSeq;
+    }
+    RETURN_IF_ERR(writeBlocks(cache->disk, count, bNums, blocks));
+    if (cache->c == 0)
+        return SUCCESS;
+
+    for (int i = 0; i < count; i++)
+    { // keep resident copies coherent; they now match the disk
+        CacheEntry *e = lookup(cache, bNums[i]);
+        if (e != NULL && e->data != NULL)
+        {
+            memcpy(e->data, blocks[i], cache->blockSize);
+            if (e->dirty)
+            {
+                e->dirty = false;
+                cache->stats.dirtyBlocks--;
+            }
+        }
+    }
+    return SUCCESS;
+}
+
+static int flush_locked(BlockCache *cache)
+{
+    uint32_t n = cache->stats.dirtyBlocks;
+    if (n == 0)
+        return SUCCESS;
+
+    CacheEntry **dirty = malloc(n * sizeof(CacheEntry *));
+    int *bNums = malloc(n * sizeof(int));
+    void **bufs = malloc(n * sizeof(void *));
+    if (dirty == NULL || bNums == NULL || bufs == NULL)
+    {
+        perror("malloc() failed in flushCache()");
+        free(dirty);
+        free(bNums);
+        free(bufs);
+        return SYSTEM_ERROR;
+    }
+    uint32_t k = 0;
+    for (int l = LIST_T1; l <= LIST_T2; l++)
+    {
+        for (CacheEntry *e = cache->lists[l].head; e != NULL; e = e->next)
+        {
+            if (e->dirty)
+            {
+                dirty[k] = e;
+                bNums[k] = e->bNum;
+                bufs[k] = e->data;
+                k++;
+            }
+        }
+    }
+
+    cache->stats.diskWrites += k;
+    int err = writeBlocks(cache->disk, k, bNums, bufs);
+    if (err == SUCCESS)
+    {
+        for (uint32_t i = 0; i < k; i++)
+        {
+            dirty[i]->dirty = false;
+        }
+        cache->stats.writebacks += k;
+        cache->stats.dirtyBlocks = 0;
+    }
+    free(dirty);
+    free(bNums);
+    free(bufs);
+    return err;
+}
+
+ //reads into <block> from Block bNum, through the cache
+int cacheRead(BlockCache *cache, int bNum, void *block)
+{
+    pthread_mutex_lock(&cache->lock);
+    int err = read_locked(cache, bNum, block);
+    pthread_mutex_unlock(&cache->lock);
+    return err;
+}
+
+ //writes <block> into the cached copy of Block bNum and marks it dirty (write-back)
+int cacheWrite(BlockCache *cache, int bNum, const void *block)
+{
+    pthread_mutex_lock(&cache->lock);
+    int err = write_locked(cache, bNum, block);
+    pthread_mutex_unlock(&cache->lock);
+    return err;
+}
+
+ //reads <count> blocks through the cache, fetching all misses in one batched disk read
+int cacheReadBlocks(BlockCache *cache, int count, const int *bNums, void *const *blocks)
+{
+    pthread_mutex_lock(&cache->lock);
+    int err = read_blocks_locked(cache, count, bNums, blocks);
+    pthread_mutex_unlock(&cache->lock);
+    return err;
+}
+
+ //writes <count> blocks; small batches are absorbed as dirty blocks, large ones are written through
+int cacheWriteBlocks(BlockCache *cache, int count, const int *bNums, void *const *blocks)
+{
+    pthread_mutex_lock(&cache->lock);
+    int err = write_blocks_locked(cache, count, bNums, blocks);
+    pthread_mutex_unlock(&cache->lock);
+    return err;
+}
+
+ //copies the resident blocks of a batch without going to disk: resident[i] tells which blocks[i] were filled.
+ //returns how many weren't, for a caller fetching those itself (asynchronously) and handing them to cacheInstall()
+int cacheReadResident(BlockCache *cache, int count, const int *bNums, void *const *blocks, bool *resident)
+{
+    pthread_mutex_lock(&cache->lock);
+    int nMiss = 0;
+    for (int i = 0; i < count; i++)
+    {
+        CacheEntry *e = cache->c == 0 ? NULL : lookup(cache, bNums[i]);
+        resident[i] = e != NULL && e->data != NULL && access_block(cache, bNums[i], true, &e) == SUCCESS;
+        if (resident[i])
+            memcpy(blocks[i], e->data, cache->blockSize);
+        else
+            nMiss++;
+    }
+    cache->stats.diskReads += nMiss;
+    if (cache->c == 0 || (uint32_t)nMiss > cache->c / 2)
+        cache->stats.misses += nMiss; // cacheInstall() streams them past the cache
+    pthread_mutex_unlock(&cache->lock);
+    return nMiss;
+}
+
+ //installs clean copies of blocks a cacheReadResident() caller just read from disk, as cacheReadBlocks() would
+int cacheInstall(BlockCache *cache, int count, const int *bNums, void *const *blocks)
+{
+    pthread_mutex_lock(&cache->lock);
+    int err = SUCCESS;
+    if (cache->c != 0 && (uint32_t)count <= cache->c / 2)
+    {
+        for (int i = 0; i < count && err == SUCCESS; i++)
+        {
+            CacheEntry *e = lookup(cache, bNums[i]);
+            if (e != NULL && e->data != NULL)
+                continue; // another reader brought it in meanwhile
+            err = access_block(cache, bNums[i], false, &e);
+            if (err == SUCCESS)
+                memcpy(e->data, blocks[i], cache->blockSize);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return err;
+}
+
+static void free_prefetch(Prefetch *prefetch)
+{
+    free(prefetch->bNums);
+    free(prefetch->bufs);
+    free(prefetch->blocks);
+    free(prefetch);
+}
+
+// ends a batch whose reads returned <result>: installs each block nobody has written, or brought in, meanwhile,
+// forgets the rest and wakes whoever waits for them
+static void finish_prefetch(BlockCache *cache, Prefetch *prefetch, int result)
+{
+    bool install = result == SUCCESS;
+    for (int i = 0; i < prefetch->count; i++)
+    {
+        int bNum = prefetch->bNums[i];
+        CacheEntry *e = lookup(cache, bNum);
+        e->fetching = false;
+        if (e->list != LIST_NONE)
+            continue; // resident or a ghost now (a demand access decides)
+        bool stale = *write_stamp(cache, bNum) > prefetch->writeSeq; // written since the read was issued
+        if (install && !stale)
+            install = make_room_for_miss(cache) == SUCCESS && (cache->nFreeData > 0 || replace(cache, false) == SUCCESS);
+        if (!install || stale)
+        { // forget it (and, once making room has failed, the rest of the batch too)
+            hash_remove(cache, e);
+            e->hnext = cache->freeEntries;
+            cache->freeEntries = e;
+            continue;
+        }
+        e->prefetched = true;
+        e->data = cache->freeData[--cache->nFreeData];
+        memcpy(e->data, prefetch->bufs[i], cache->blockSize);
+        list_push_mru(cache, e, LIST_T1);
+        cache->stats.prefetched++;
+    }
+    cache->fetchingBlocks -= prefetch->count;
+    cache->prefetches--;
+    pthread_cond_broadcast(&cache->prefetchDone);
+}
+
+// DiskCompletion of a cachePrefetch() batch
+static void prefetch_done(void *arg, int result)
+{
+    Prefetch *prefetch = arg;
+    BlockCache *cache = prefetch->cache;
+    pthread_mutex_lock(&cache->lock);
+    finish_prefetch(cache, prefetch, result);
+    pthread_mutex_unlock(&cache->lock);
+    free_prefetch(prefetch);
+}
+
+ //starts reading the non-resident blocks of a batch from disk without waiting; they're installed as clean
+ //copies, referenced once, when the read completes. returns how many of the leading blocks it took: with those
+ //already in flight, at most c/4
+int cachePrefetch(BlockCache *cache, int count, const int *bNums)
+{
+    pthread_mutex_lock(&cache->lock);
+    if ((uint32_t)count > cache->c / 4 - cache->fetchingBlocks)
+        count = (int)(cache->c / 4 - cache->fetchingBlocks);
+    if (count <= 0)
+    {
+        pthread_mutex_unlock(&cache->lock);
+        return 0; // nothing to keep them in, or c/4 of them in flight already
+    }
+    Prefetch *prefetch = calloc(1, sizeof(Prefetch));
+    if (prefetch == NULL || (prefetch->bNums = malloc(count * sizeof(int))) == NULL ||
+        (prefetch->bufs = malloc(count * sizeof(void *))) == NULL ||
+        (prefetch->blocks = malloc((size_t)count * cache->blockSize)) == NULL)
+    {
+        pthread_mutex_unlock(&cache->lock);
+        perror("malloc() failed in cachePrefetch()");
+        if (prefetch != NULL)
+            free_prefetch(prefetch);
+        return SYSTEM_ERROR;
+    }
+    prefetch->cache = cache;
+    prefetch->writeSeq = cache->writeSeq;
+    for (int i = 0; i < count; i++)
+    {
+        if (bNums[i] < 0 || bNums[i] >= cache->nBlocks)
+            continue;
+        CacheEntry *e = lookup(cache, bNums[i]);
+        if (e != NULL && (e->data != NULL || e->fetching))
+            continue; // resident, or another batch is fetching it
+        if (e == NULL)
+            e = new_entry(cache, bNums[i]); // on no list until the block arrives
+        e->fetching = true;
+        prefetch->bufs[prefetch->count] = prefetch->blocks + (size_t)prefetch->count * cache->blockSize;
+        prefetch->bNums[prefetch->count++] = bNums[i];
+    }
+    if (prefetch->count == 0)
+    {
+        pthread_mutex_unlock(&cache->lock);
+        free_prefetch(prefetch);
+        return count;
+    }
+    cache->prefetches++;
+    cache->fetchingBlocks += prefetch->count;
+    cache->stats.diskReads += prefetch->count;
+    pthread_mutex_unlock(&cache->lock);
+
+     //outside the lock: the completion may run before submitReadBlocks() returns
+    int err = submitReadBlocks(cache->disk, prefetch->count, prefetch->bNums, prefetch->bufs, prefetch_done, prefetch);
+    if (err != SUCCESS)
+    {
+        pthread_mutex_lock(&cache->lock);
+        cache->stats.diskReads -= prefetch->count;
+        finish_prefetch(cache, prefetch, err);
+        pthread_mutex_unlock(&cache->lock);
+        free_prefetch(prefetch);
+        return err;
+    }
+    return count;
+}
+
+ //reads the current contents of Block bNum (resident copy, else disk) without touching ARC state or stats
+int cachePeek(BlockCache *cache, int bNum, void *block)
+{
+    pthread_mutex_lock(&cache->lock);
+    CacheEntry *e = cache->c == 0 ? NULL : lookup(cache, bNum);
+    int err = SUCCESS;
+    if (e != NULL && e->data != NULL)
+        memcpy(block, e->data, cache->blockSize);
+    else
+        err = readBlock(cache->disk, bNum, block);
+    pthread_mutex_unlock(&cache->lock);
+    return err;
+}
+
+ //writes every dirty block back with one batched writeBlocks() call
+int flushCache(BlockCache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    int err = flush_locked(cache);
+    pthread_mutex_unlock(&cache->lock);
+    return err;
+}
+
+int closeCache(BlockCache *cache)
+{
+    if (cache == NULL)
+        return SUCCESS;
+    pthread_mutex_lock(&cache->lock);
+    while (cache->prefetches > 0)
+    { // their completions still install into the cache
+        pthread_cond_wait(&cache->prefetchDone, &cache->lock);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    int err = flushCache(cache);
+    pthread_cond_destroy(&cache->prefetchDone);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->entries);
+    free(cache->dataPool);
+    free(cache->freeData);
+    free(cache->buckets);
+    free(cache);
+    return err;
+}
+
+void getCacheStats(const BlockCache *cache, CacheStats *stats)
+{
+    pthread_mutex_t *lock = (pthread_mutex_t *)&cache->lock;
+    pthread_mutex_lock(lock);
+    *stats = cache->stats;
+    stats->residentBlocks = cache->lists[LIST_T1].size + cache->lists[LIST_T2].size;
+    stats->targetRecent = cache->p;
+    pthread_mutex_unlock(lock);
+}
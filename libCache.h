@@ -0,0 +1,57 @@
+#ifndef LIBCACHE_H
+#define LIBCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Adaptive replacement (ARC) block cache sitting between libTinyFS and libDisk.
+// Every call is serialized on a per-cache mutex.
+// T1 holds blocks seen once recently, T2 blocks seen at least twice;
+// B1/B2 are "ghost" lists remembering recently evicted block numbers (no data)
+// so the split between recency and frequency adapts to the workload.
+typedef struct BlockCache BlockCache;
+
+typedef struct {
+    uint64_t hits;              // served from T1/T2
+    uint64_t misses;            // had to go to disk (or was a full-block overwrite)
+    uint64_t ghostHitsRecent;   // misses that hit B1 (grow recency target)
+    uint64_t ghostHitsFrequent; // misses that hit B2 (grow frequency target)
+    uint64_t evictions;         // resident blocks dropped to make room
+    uint64_t writebacks;        // dirty blocks written to disk (eviction or flush)
+    uint64_t diskReads;         // blocks read from disk
+    uint64_t diskWrites;        // blocks written to disk
+    uint64_t prefetched;        // blocks cachePrefetch() installed ahead of demand
+    uint64_t prefetchWaits;     // reads that waited for a block cachePrefetch() was still fetching
+    uint32_t capacityBlocks;    // c
+    uint32_t residentBlocks;    // |T1| + |T2|
+    uint32_t dirtyBlocks;
+    uint32_t targetRecent;      // ARC's adaptive target p for |T1|
+} CacheStats;
+
+// blocks are the disk's block size at open time; budgetBytes is rounded down to whole blocks,
+// 0 disables caching (pass-through)
+BlockCache *openCache(int disk, size_t budgetBytes);
+int cacheRead(BlockCache *cache, int bNum, void *block);
+int cacheWrite(BlockCache *cache, int bNum, const void *block);
+// batched variants: misses are fetched with one readBlocks() call; batches larger than half
+// the cache stream straight to/from disk (resident copies are kept coherent) instead of flushing it
+int cacheReadBlocks(BlockCache *cache, int count, const int *bNums, void *const *blocks);
+int cacheWriteBlocks(BlockCache *cache, int count, const int *bNums, void *const *blocks);
+// the resident blocks of a batch only (resident[i] says which blocks[i] were filled), returning the number of misses;
+// a caller that reads those from disk itself, asynchronously, then installs them as clean copies with cacheInstall()
+int cacheReadResident(BlockCache *cache, int count, const int *bNums, void *const *blocks, bool *resident);
+int cacheInstall(BlockCache *cache, int count, const int *bNums, void *const *blocks);
+// readahead: starts fetching the non-resident blocks of a batch and returns at once with how many of the leading
+// blocks it took (at most c/4 counting those still in flight, 0 without a cache) or an error. they arrive as clean
+// copies on T1 that a first hit leaves there, so a scan can't flood T2. a block written while its read was in flight
+// is dropped instead of installed; cacheRead()/cacheReadBlocks() of one wait for it rather than read it twice,
+// closeCache() for them all
+int cachePrefetch(BlockCache *cache, int count, const int *bNums);
+// current contents of a block (resident copy, else disk) without touching ARC state: for scrubbing
+int cachePeek(BlockCache *cache, int bNum, void *block);
+int flushCache(BlockCache *cache);
+int closeCache(BlockCache *cache); // flushes first
+void getCacheStats(const BlockCache *cache, CacheStats *stats);
+
+#endif
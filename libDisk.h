@@ -1,9 +1,44 @@
 #ifndef LIBDISK_H
 #define LIBDISK_H
 
-int openDisk(char *filename, int nBytes);
+// block size of a freshly opened disk; setDiskBlockSize() switches to any power of two up to the max
+#define DISK_MIN_BLOCK_SIZE 256
+#define DISK_MAX_BLOCK_SIZE 65536
+
+typedef enum {
+    DISK_BACKEND_FILE = 0,  // pread()/pwrite() against the image file
+    DISK_BACKEND_MMAP = 1,  // whole image mmap()ed; block I/O is memcpy, durability via msync()
+} DiskBackend;
+
+// both return the disk number (the first disk opened is 0) or a negative error code
+int openDisk(char *filename, int nBytes); // DISK_BACKEND_FILE
+int openDiskWithBackend(char *filename, int nBytes, DiskBackend backend);
 int readBlock(int disk, int bNum, void *block);
 int writeBlock(int disk, int bNum, void *block);
+// batched positional I/O: adjacent block numbers are merged into single preadv()/pwritev() calls
+int readBlocks(int disk, int count, const int *bNums, void *const *blocks);
+int writeBlocks(int disk, int count, const int *bNums, void *const *blocks);
+
+// asynchronous batches: readBlocks()/writeBlocks() that return at once and call <done>, from a libDisk thread, with
+// SUCCESS or a negative error code when every block has been transferred. <bNums> and the pointer array are copied;
+// the blocks themselves must stay valid, and the disk open, until then. An error returned here means <done> is never called
+typedef void (*DiskCompletion)(void *arg, int result);
+int submitReadBlocks(int disk, int count, const int *bNums, void *const *blocks, DiskCompletion done, void *arg);
+int submitWriteBlocks(int disk, int count, const int *bNums, void *const *blocks, DiskCompletion done, void *arg);
+
+typedef enum {
+    DISK_ASYNC_AUTO = 0,        // io_uring when the kernel provides it, else the thread pool
+    DISK_ASYNC_IO_URING = 1,    // one process-wide ring, adjacent blocks merged into one readv/writev request
+    DISK_ASYNC_THREADS = 2,     // a pool of I/O threads running readBlocks()/writeBlocks(); mapped disks always use it
+} DiskAsyncEngine;
+// picks the engine before the first submission; DISK_ERR_ASYNC_ENGINE_UNAVAILABLE if it can't run or another already does
+int setDiskAsyncEngine(DiskAsyncEngine engine);
+DiskAsyncEngine diskAsyncEngine(void); // the engine running, DISK_ASYNC_AUTO before the first submission
 int closeDisk(int disk);
+int diskNumBlocks(int disk);
+int setDiskBlockSize(int disk, int blockSize);
+int diskBlockSize(int disk);
+int syncDisk(int disk);
+const void *mapBlock(int disk, int bNum);
 
 #endif
\ No newline at end of file
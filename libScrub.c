@@ -0,0 +1,248 @@
+#include "errors.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "libDisk.h"
+#include "libCache.h"
+#include "libScrub.h"
+#include "tinyfs_crc.h"
+
+struct Scrubber {
+    int disk;
+    BlockCache *cache;
+    uint8_t *bitmap;            // copy of the committed bitmap the pass walks
+    uint32_t nBlocks;           // blocks it tracks
+    uint32_t legacyBitmap;      // the raw bitmap block of a legacy image, INVALID_BLOCK if the bitmap is checksummed
+    uint32_t blocksPerSec;
+    int blockSize;              // the disk's, read when the pass starts
+
+    pthread_t thread;
+    pthread_mutex_t lock;       // guards status and stopRequested
+    pthread_cond_t wake;        // signalled by stopScrub() to cut a throttle sleep short
+    bool stopRequested;
+    ScrubStatus status;
+};
+
+#pragma region
+static bool all_zero(const uint8_t *block, int blockSize)
+{
+    for (int i = 0; i < blockSize; i++)
+    {
+        if (block[i] != 0)
+            return false;
+    }
+    return true;
+}
+
+// a block is clean if it verifies as whatever it can be: the superblock at 0, a legacy image's (unchecksummed)
+// bitmap, a never-written zero block, or a bitmap/inode/data/directory/indirect/extent node block
+static bool block_is_clean(const Scrubber *scrub, uint32_t bNum, const uint8_t *block)
+{
+    if (bNum == 0)
+        return verify_superblock_checksum((const Superblock *)block);
+    if (bNum == scrub->legacyBitmap || all_zero(block, scrub->blockSize))
+        return true;
+    return verify_block_checksum(block, scrub->blockSize) || verify_inode_checksum((const Inode *)block);
+}
+
+// a legacy bitmap moves to a new block on every commit: <bNum> may have become it after the pass copied the old one
+static bool is_current_bitmap(const Scrubber *scrub, uint32_t bNum, uint8_t *super)
+{
+    return scrub->legacyBitmap != INVALID_BLOCK && cachePeek(scrub->cache, 0, super) == SUCCESS &&
+           ((const Superblock *)super)->bitmap_block == bNum;
+}
+
+static void record_damage(Scrubber *scrub, uint32_t bNum)
+{
+    pthread_mutex_lock(&scrub->lock);
+    if (scrub->status.blocksDamaged < SCRUB_MAX_REPORTED)
+        scrub->status.damaged[scrub->status.blocksDamaged] = bNum;
+    scrub->status.blocksDamaged++;
+    pthread_mutex_unlock(&scrub->lock);
+    printf("Scrub found damaged block %u.\n", bNum);
+}
+
+// sleeps until <scanned> blocks fit the rate limit, returns false if a stop was requested meanwhile
+static bool throttle(Scrubber *scrub, const struct timespec *start, uint32_t scanned)
+{
+    pthread_mutex_lock(&scrub->lock);
+    if (scrub->blocksPerSec != 0 && !scrub->stopRequested)
+    {
+        struct timespec until = *start;
+        uint64_t ns = (uint64_t)scanned * 1000000000ull / scrub->blocksPerSec;
+        until.tv_sec += ns / 1000000000ull;
+        until.tv_nsec += ns % 1000000000ull;
+        if (until.tv_nsec >= 1000000000L)
+        {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        while (!scrub->stopRequested && pthread_cond_timedwait(&scrub->wake, &scrub->lock, &until) == 0)
+            ;
+    }
+    bool keepGoing = !scrub->stopRequested;
+    pthread_mutex_unlock(&scrub->lock);
+    return keepGoing;
+}
+
+static void finish(Scrubber *scrub, ScrubState state, int err)
+{
+    pthread_mutex_lock(&scrub->lock);
+    scrub->status.state = state;
+    scrub->status.error = err;
+    pthread_mutex_unlock(&scrub->lock);
+}
+
+static void *scrub_thread(void *arg)
+{
+    Scrubber *scrub = arg;
+    int nBlocks = diskNumBlocks(scrub->disk);
+    scrub->blockSize = diskBlockSize(scrub->disk);
+    if (nBlocks < 0 || scrub->blockSize < 0)
+    {
+        finish(scrub, SCRUB_FAILED, DISK_ERR_DISK_INACTIVE);
+        return NULL;
+    }
+    // two blocks for confirming failures, then SCRUB_BATCH_BLOCKS blocks to read into
+    uint8_t *buf = malloc((size_t)(SCRUB_BATCH_BLOCKS + 2) * scrub->blockSize);
+    int err = SUCCESS;
+    if (buf == NULL)
+    {
+        finish(scrub, SCRUB_FAILED, SYSTEM_ERROR);
+        return NULL;
+    }
+    uint8_t *current = buf;
+    uint8_t *super = current + scrub->blockSize;
+    const uint8_t *bitmap = scrub->bitmap;
+    if ((uint32_t)nBlocks > scrub->nBlocks)
+        nBlocks = scrub->nBlocks;
+
+    uint32_t total = 0;
+    for (int b = 0; b < nBlocks; b++)
+        total += (bitmap[b / 8] >> (b % 8)) & 1;
+    pthread_mutex_lock(&scrub->lock);
+    scrub->status.blocksTotal = total;
+    pthread_mutex_unlock(&scrub->lock);
+
+    int bNums[SCRUB_BATCH_BLOCKS];
+    void *bufs[SCRUB_BATCH_BLOCKS];
+    for (int i = 0; i < SCRUB_BATCH_BLOCKS; i++)
+        bufs[i] = buf + (size_t)(i + 2) * scrub->blockSize;
+
+    struct timespec start;
+    clock_gettime(CLOCK_REALTIME, &start); // pthread_cond_timedwait() deadlines are CLOCK_REALTIME
+    uint32_t scanned = 0;
+    int next = 0;
+    ScrubState state = SCRUB_FINISHED;
+    while (next < nBlocks)
+    {
+        // next batch of allocated blocks in ascending order, so libDisk merges them into large reads
+        int count = 0;
+        for (; next < nBlocks && count < SCRUB_BATCH_BLOCKS; next++)
+        {
+            if ((bitmap[next / 8] >> (next % 8)) & 1)
+                bNums[count++] = next;
+        }
+        if (count == 0)
+            break;
+
+        err = readBlocks(scrub->disk, count, bNums, bufs);
+        if (err != SUCCESS)
+        {
+            state = SCRUB_FAILED;
+            break;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            if (block_is_clean(scrub, bNums[i], bufs[i]))
+                continue;
+            // the disk copy may be stale or torn by a concurrent write: confirm against the current copy
+            err = cachePeek(scrub->cache, bNums[i], current);
+            if (err != SUCCESS)
+                break;
+            if (!block_is_clean(scrub, bNums[i], current) && !is_current_bitmap(scrub, bNums[i], super))
+                record_damage(scrub, bNums[i]);
+        }
+        if (err != SUCCESS)
+        {
+            state = SCRUB_FAILED;
+            break;
+        }
+
+        scanned += count;
+        pthread_mutex_lock(&scrub->lock);
+        scrub->status.blocksScanned = scanned;
+        pthread_mutex_unlock(&scrub->lock);
+        if (!throttle(scrub, &start, scanned))
+        {
+            state = next < nBlocks ? SCRUB_STOPPED : SCRUB_FINISHED;
+            break;
+        }
+    }
+    free(buf);
+    finish(scrub, state, state == SCRUB_FAILED ? err : SUCCESS);
+    return NULL;
+}
+#pragma endregion
+
+Scrubber *startScrub(int disk, BlockCache *cache, const uint8_t *bitmap, uint32_t nBlocks, uint32_t legacyBitmap,
+                     uint32_t blocksPerSec)
+{
+    Scrubber *scrub = calloc(1, sizeof(Scrubber));
+    if (scrub == NULL)
+        return NULL;
+    scrub->bitmap = malloc((nBlocks + 7) / 8);
+    if (scrub->bitmap == NULL)
+    {
+        free(scrub);
+        return NULL;
+    }
+    memcpy(scrub->bitmap, bitmap, (nBlocks + 7) / 8);
+    scrub->nBlocks = nBlocks;
+    scrub->disk = disk;
+    scrub->cache = cache;
+    scrub->legacyBitmap = legacyBitmap;
+    scrub->blocksPerSec = blocksPerSec;
+    scrub->status.state = SCRUB_RUNNING;
+    pthread_mutex_init(&scrub->lock, NULL);
+    pthread_cond_init(&scrub->wake, NULL);
+    if (pthread_create(&scrub->thread, NULL, scrub_thread, scrub) != 0)
+    {
+        perror("pthread_create() failed in startScrub()");
+        pthread_cond_destroy(&scrub->wake);
+        pthread_mutex_destroy(&scrub->lock);
+        free(scrub->bitmap);
+        free(scrub);
+        return NULL;
+    }
+    return scrub;
+}
+
+void getScrubStatus(Scrubber *scrub, ScrubStatus *status)
+{
+    pthread_mutex_lock(&scrub->lock);
+    *status = scrub->status;
+    pthread_mutex_unlock(&scrub->lock);
+}
+
+int stopScrub(Scrubber *scrub, ScrubStatus *final)
+{
+    if (scrub == NULL)
+        return SUCCESS;
+    pthread_mutex_lock(&scrub->lock);
+    scrub->stopRequested = true;
+    pthread_cond_signal(&scrub->wake);
+    pthread_mutex_unlock(&scrub->lock);
+    pthread_join(scrub->thread, NULL);
+
+    if (final != NULL)
+        *final = scrub->status;
+    pthread_cond_destroy(&scrub->wake);
+    pthread_mutex_destroy(&scrub->lock);
+    free(scrub->bitmap);
+    free(scrub);
+    return SUCCESS;
+}
@@ -0,0 +1,44 @@
+#ifndef LIBSCRUB_H
+#define LIBSCRUB_H
+
+#include <stdint.h>
+#include "libCache.h"
+
+// Background integrity scrubber. A thread walks every block the bitmap marks as allocated,
+// reads them straight from libDisk in large ascending batches and verifies their checksums.
+// Blocks that fail are re-checked against the cache's current copy before being reported,
+// so blocks the foreground is rewriting (dirty in the cache) are never flagged.
+// An optional blocks/second limit keeps it from starving foreground I/O.
+
+#define SCRUB_BATCH_BLOCKS 64   // blocks verified per readBlocks() call
+#define SCRUB_MAX_REPORTED 32   // damaged block numbers kept in ScrubStatus
+
+typedef enum {
+    SCRUB_IDLE = 0,             // no pass started on this mount
+    SCRUB_RUNNING,
+    SCRUB_FINISHED,             // completed a full pass
+    SCRUB_STOPPED,              // stopped before completing
+    SCRUB_FAILED,               // ended early by an I/O error (see error)
+} ScrubState;
+
+typedef struct {
+    ScrubState state;
+    uint32_t blocksTotal;       // allocated blocks when the pass started
+    uint32_t blocksScanned;
+    uint32_t blocksDamaged;     // failed verification on disk and in the cache
+    uint32_t damaged[SCRUB_MAX_REPORTED]; // first min(blocksDamaged, SCRUB_MAX_REPORTED) of them
+    int error;                  // SUCCESS, or the error that ended the pass
+} ScrubStatus;
+
+typedef struct Scrubber Scrubber;
+
+// starts a pass over <disk> in its own thread, over the blocks of the first <nBlocks> that <bitmap> (copied; block n
+// at bit n % 8 of byte n / 8) marks allocated. <legacyBitmap> is the unchecksummed bitmap block of an image from
+// before bitmaps were checksummed, INVALID_BLOCK otherwise. blocksPerSec 0 runs unthrottled
+Scrubber *startScrub(int disk, BlockCache *cache, const uint8_t *bitmap, uint32_t nBlocks, uint32_t legacyBitmap,
+                     uint32_t blocksPerSec);
+void getScrubStatus(Scrubber *scrub, ScrubStatus *status);
+// asks the thread to stop, waits for it and frees <scrub>; <final> (may be NULL) gets the last status
+int stopScrub(Scrubber *scrub, ScrubStatus *final);
+
+#endif
@@ -1,913 +1,5415 @@
 #include "errors.h"
 #include "tinyfs_crc.h"
 #include "libDisk.h"
+#include "libCache.h"
 #include "libTinyFS_UNIX.h"
 #include "crc32.h"
+#include "libZil.h"
+#include <time.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <endian.h>
 #pragma endregion
 
-// Hard coded such that mountedDisk is always on disk 0 or -1 (unmounted)
-// can make block numbers non static and caches of block numbers from superblock
-static int mountedDisk = -1;
 #define SUPERBLOCK_BLOCK_NUM 0
 #define BITMAP_BLOCK_NUM 1
 #define ROOT_INODE_BLOCK_NUM 2
 #define ROOT_DIR_DATA_BLOCK_NUM 3
-static FileTableEntry file_table[MAX_OPEN_FILES];
+#define ZIL_START_BLOCK_NUM 4
+// a commit writes the bitmap blocks that changed to the spare copy, which last received the ones changed the txg before
+#define BITMAP_CHANGED_OPEN 1 // in the open txg
+#define BITMAP_CHANGED_LAST 2 // in the last committed one (or, after mount, maybe anywhere since the spare was written)
+
+// blocks find_free_run() looks through for a run long enough before settling for the longest one it saw
+#define RUN_SEARCH_BLOCKS (1u << 18)
+// blocks a commit may still need to copy after the data: an inode, its directory's block and inode, the bitmap
+#define TXG_RESERVED_BLOCKS 4
+
+typedef enum {
+    INTENT_CREATE = 1,
+    INTENT_WRITE,                                 // tfs_write(): payload is the whole file
+    INTENT_PWRITE,                                // payload at offset: tfs_pwrite/append/writeByte, truncate growth
+    INTENT_TRUNCATE,                              // shrink to offset bytes
+    INTENT_DELETE,
+    INTENT_RENAME,
+    INTENT_MAKE_RO,
+    INTENT_MAKE_RW,
+    INTENT_MKDIR,
+} IntentType;
+
+// one logged operation, by path (inode blocks move with every commit): the path follows it NUL-terminated, then for
+// INTENT_RENAME the new one, then any payload
+typedef struct {
+    uint8_t type;
+    uint32_t offset;
+} IntentRecord;
+
+// growable list of extents: decoded extent trees, staged new ones, and the blocks a file owns
+typedef struct {
+    Extent *items;
+    uint32_t count;
+    uint32_t capacity;
+} ExtentList;
+
+// dentry cache: (directory, name) -> inode for names a directory block was searched for, including names it turned
+// out not to hold (negative entries), so repeated lookups and creates read no directory block. past
+// DENTRY_CACHE_ENTRIES of them the least recently used unpinned one makes room for the next
+#define DENTRY_CACHE_ENTRIES 16384
+#define DENTRY_BUCKETS (2 * DENTRY_CACHE_ENTRIES)
+#define DENTRY_CHUNK 1024
+#define DENTRY_MAX (1 << 20) // pinned ones may take the table past DENTRY_CACHE_ENTRIES, up to this
+#define ROOT_DENTRY 0        // never evicted
+
+typedef enum {
+    DENTRY_FREE = 0,
+    DENTRY_NEGATIVE,        // the directory has no such name
+    DENTRY_FILE,
+    DENTRY_DIR,
+} DentryKind;
+
+// a positive dentry is also the file's identity while it is cached (its inode block moves with every txg), so it
+// carries the file's lock: shared for reading the file, exclusive for changing it. open descriptors, cached children
+// and operations in progress pin it; only unpinned ones are ever evicted
+typedef struct {
+    char name[8];
+    int parent;             // dentry of the directory holding the name, -1 for the root
+    uint8_t kind;           // DentryKind
+    uint32_t inode_block;   // INVALID_BLOCK unless the dentry is positive
+    int next;               // next dentry in the same hash bucket, or on the free list; -1 ends either
+    int lruPrev;            // while unpinned: neighbours on the eviction list, least recently used first
+    int lruNext;
+    uint32_t refs;          // pins
+    uint32_t *buckets;      // directories: their bucket blocks, once dir_load() has read them
+    uint32_t numBuckets;
+    bool bucketTree;        // the inode maps every bucket with an extent of its own (see dir_store())
+    pthread_rwlock_t lock;
+    uint32_t generation;    // bumped by every change to the file: descriptors' caches of older ones are stale
+    uint32_t incarnation;   // bumped when the file is deleted: descriptors of older ones are dead
+    uint32_t asyncReads;    // tfs_submit_read()s still fetching the file's blocks: changes wait them out (asyncLock)
+} Dentry;
+
+// one slot of the descriptor table
+typedef struct {
+    FileTableEntry file;
+    pthread_mutex_t lock;                         // the descriptor's offset and caches, for callers sharing one
+    int32_t nextFree;                             // next free descriptor while on the free list, -1 ends it
+} Descriptor;
+
+#define ASYNC_WORKERS 4 // threads per instance running tfs_submit_write() requests
+
+// readahead of a sequential reader: the window starts at READAHEAD_MIN_BLOCKS and doubles with every
+// prefetch of the streak, up to the readaheadBytes mount option worth of blocks. off unless asked for: where the disk
+// image sits in the page cache, threadBench's scans run faster reading each block on demand
+#define READAHEAD_MIN_BLOCKS 4
+#define DEFAULT_READAHEAD_BYTES 0
+
+// tfs_statfs()'s longest free run comes from a summary per region of RUN_SUMMARY_WORDS bitmap words: only regions
+// the allocator touched since the last call are rescanned, and neighbours' edge runs join across region bounds
+#define RUN_SUMMARY_WORDS 64
+typedef struct {
+    uint32_t head;          // free blocks at the start of the region
+    uint32_t tail;          // and at its end (the whole region when it's all free)
+    uint32_t longest;       // longest free run inside it
+    bool stale;
+} RunSummary;
+
+typedef struct AsyncRequest AsyncRequest;
+
+// one mounted (or formatting) file system: everything below belongs to it alone,
+// so any number of them can live in one process side by side
+struct tfs_fs {
+    // libDisk disk number of the mounted file system, -1 when unmounted
+    int mountedDisk;
+    // descriptors live in chunks that are allocated as the table grows and never move while mounted, so finding
+    // one takes no lock. free ones form a lock-free stack: opening and closing are O(1) at any table size
+    Descriptor *fileChunks[MAX_OPEN_FILES / FILE_TABLE_CHUNK];
+    int fileChunkCount;
+    uint64_t freeDescriptors;                     // free-list head: descriptor (low half, -1 if empty), ABA tag
+    pthread_mutex_t fileTableLock;                // growing the table
+
+    // any number of threads may call in at once. a reader holds its file's lock (its dentry's) shared; a change
+    // holds it exclusive, then allocLock for everything below it allocates, frees or commits, then dirLock around
+    // directory lookups and updates. order: descriptor lock, file lock, allocLock, dirLock
+    pthread_mutex_t allocLock;                    // bitmap, txg state, superblock, the intent log's contents
+    pthread_mutex_t dirLock;                      // dentry cache and directory blocks; log records go out in its order
+    // every block access below goes through the mounted disk's ARC cache
+    BlockCache *blockCache;
+    TfsMountOptions options;                      // as mounted, logDevice pointing at our own copy
+
+    // geometry of the mounted (or formatting) disk, from superBlock.block_size
+    uint32_t fsBlockSize;
+    uint32_t fsDataSize;                          // file bytes per data block
+
+    // allocation state lives in memory while mounted; txg_commit() writes it back. the bitmaps are 64-bit words
+    // (block n is bit n % 64 of word n / 64) so the allocator tests 64 blocks at a time; bits past the last block are set
+    Superblock superBlock;
+    uint32_t numBlocks;                           // blocks the allocator manages
+    uint32_t bitmapWords;                         // words in each bitmap: all the on-disk bitmap blocks' bits
+    uint64_t *bitmap;                             // allocated blocks
+    uint32_t freeBlocks;                          // free in the bitmap, less the committed blocks the open txg freed
+    uint32_t allocCursor;                         // next-fit: the search for a free block starts here
+    uint8_t *bitmapDirty;                         // per on-disk bitmap block: BITMAP_CHANGED_* flags
+    RunSummary *runSummary;                       // per RUN_SUMMARY_WORDS words of the bitmap
+    uint32_t fileCount;                           // inodes the directory tree names
+
+    // copy-on-write transaction groups: no block the last committed superblock reaches is ever overwritten.
+    // Changes go to newly allocated blocks and the open txg commits by rewriting the superblock to point at them
+    uint64_t *txgAllocated;                       // allocated since the last commit: safe to rewrite in place
+    uint64_t *txgFreed;                           // committed blocks freed since: reusable once the txg commits
+    uint32_t txgDirtyBlocks;                      // allocations and frees in the open txg
+    uint32_t txgFreedBlocks;
+    struct timespec txgOpened;                    // first change of the open txg
+    bool superblockDirty;                         // the superblock changed without any block changing: commit anyway
+
+    // intent log: every operation of the open txg is also recorded there, so tfs_fsync() can make it durable with one
+    // sequential log write instead of a txg commit. a crash loses the txg, and the next mount replays the log on top of
+    // the committed tree. each commit covers the records so far and empties the log
+    Zil *zil;
+    int logDisk;                                  // libDisk disk of the separate log while mounted
+    bool zilGap;                                  // a record couldn't be logged: only a commit makes the txg durable
+                                                  // (atomic: tfs_fsync() reads it without locks)
+    bool zilReplaying;                            // mount is re-running logged operations: no logging, no commits
+
+    // background scrub of the mounted disk; the last pass's result outlives tfs_scrub_stop()
+    Scrubber *scrubber;
+    ScrubStatus lastScrub;
+
+    // dentries live in chunks that never move while mounted, so a descriptor reaches its file's without dirLock
+    Dentry *dentryChunks[DENTRY_MAX / DENTRY_CHUNK];
+    int dentryCount;                              // dentries in the chunks so far
+    int dentriesInUse;
+    int freeDentries;                             // free list head, -1 if empty
+    int *dentryBuckets;                           // DENTRY_BUCKETS chains by (directory, name)
+    int lruHead;                                  // least recently used unpinned dentry, -1 if none
+    int lruTail;
+
+    // asynchronous requests: a read copies what the cache holds and hands the rest to libDisk's async engine, pinning
+    // its file (no change to it starts) until the blocks arrive; a write runs on asyncWorkers. both end in a completion
+    pthread_mutex_t asyncLock;                    // everything below, and changes to Dentry.asyncReads
+    pthread_cond_t asyncWork;                     // a write was queued, or the workers should stop
+    pthread_cond_t asyncChanged;                  // a completion was queued or a read unpinned its file
+    AsyncRequest *asyncQueue;                     // writes waiting for a worker, oldest first
+    AsyncRequest *asyncQueueTail;
+    pthread_t asyncWorkers[ASYNC_WORKERS];
+    int asyncWorkerCount;                         // started by the first tfs_submit_write()
+    bool asyncStopping;
+    int64_t lastToken;
+    uint32_t asyncInFlight;                       // submitted, completion not queued yet
+    TfsCompletion *completions;                   // ring: completionCount of them from completionHead
+    int completionCapacity;                       // kept at least asyncInFlight + completionCount, so queuing never fails
+    int completionHead;
+    int completionCount;
+    int completionFd;                             // eventfd of tfs_completion_fd(), -1 until asked for
+};
+
+// the instance behind the handle-less API (tfs_mount() ... tfs_unmount()), NULL while unmounted
+static tfs_fs *defaultFs = NULL;
+// settings for the next tfs_mkfs()/tfs_mount(), and for tfs_mount2() without options
+static size_t cacheBudget = DEFAULT_CACHE_BUDGET;
+static DiskBackend diskBackend = DISK_BACKEND_FILE;
+static uint32_t readaheadBytes = DEFAULT_READAHEAD_BYTES;
+static uint32_t txgTimeoutMs = DEFAULT_TXG_TIMEOUT_MS;
+static uint32_t txgMaxDirty = DEFAULT_TXG_MAX_DIRTY;
+static char *logDeviceName = NULL;                // tfs_setLogDevice(): separate log file, NULL for the pool's region
+static int logDeviceBytes = 0;
+
+static int collect_inode_blocks(tfs_fs *fs, const Inode *inode, ExtentList *runs, ExtentList *nodes);
+static void dentry_cache_free(tfs_fs *fs);
+static int format_disk(tfs_fs *fs, char *filename, int nBytes, int blockSize);
+static int mount_instance(tfs_fs *fs, char *filename);
+// bodies of the public calls, run with the locks lock_descriptor() and friends take
+static int write_locked(tfs_fs *fs, fileDescriptor FD, const char *buffer, const int size);
+static int delete_locked(tfs_fs *fs, fileDescriptor FD);
+static int read_byte_locked(tfs_fs *fs, fileDescriptor FD, char *buffer);
+static int read_locked(tfs_fs *fs, fileDescriptor FD, char *buffer, int size);
+static int rename_locked(tfs_fs *fs, const char *old_path, const char *new_path);
+static int write_byte_locked(tfs_fs *fs, fileDescriptor FD, int offset, const unsigned char data);
+static int pwrite_locked(tfs_fs *fs, fileDescriptor FD, int offset, const char *buffer, int size);
+static int truncate_locked(tfs_fs *fs, fileDescriptor FD, int size);
+static void drain_async_requests(tfs_fs *fs);
 
 #pragma region
-// doesn't set bitmap
-static uint32_t find_free_block(void)
+static void set_geometry(tfs_fs *fs, uint32_t block_size)
 {
-    Superblock super_block;
-    if (readBlock(mountedDisk, SUPERBLOCK_BLOCK_NUM, &super_block) != SUCCESS)
+    fs->fsBlockSize = block_size;
+    fs->fsDataSize = DATABLOCK_DATA_SIZE(block_size);
+}
+
+static uint64_t free_list_head(fileDescriptor fd, uint32_t tag)
+{
+    return (uint64_t)tag << 32 | (uint32_t)fd;
+}
+
+// descriptor <FD>, NULL if the table never grew that far
+static Descriptor *find_descriptor(tfs_fs *fs, fileDescriptor FD)
+{
+    if (FD < 0 || FD >= MAX_OPEN_FILES)
     {
-        printf("Failed to read super_block in find_free_block().\n");
-        return INVALID_BLOCK;
+        return NULL;
     }
+    Descriptor *chunk = __atomic_load_n(&fs->fileChunks[FD / FILE_TABLE_CHUNK], __ATOMIC_ACQUIRE);
+    return chunk != NULL ? &chunk[FD % FILE_TABLE_CHUNK] : NULL;
+}
 
-    int num_blocks = super_block.fs_size / BLOCK_SIZE;
-    BitmapBlock bitmap;
-    if (readBlock(mountedDisk, super_block.bitmap_block, &bitmap) != SUCCESS)
+// table entry of descriptor <FD>, which the caller holds: its chunk is in place
+static FileTableEntry *file_entry(tfs_fs *fs, fileDescriptor FD)
+{
+    Descriptor *chunk = __atomic_load_n(&fs->fileChunks[FD / FILE_TABLE_CHUNK], __ATOMIC_RELAXED);
+    return &chunk[FD % FILE_TABLE_CHUNK].file;
+}
+
+// an unmounted instance with <options> (NULL: the tfs_set*() defaults)
+static tfs_fs *new_instance(const TfsMountOptions *options)
+{
+    tfs_fs *fs = calloc(1, sizeof(tfs_fs));
+    if (fs == NULL)
     {
-        printf("Failed to read bitmap in find_free_block().\n");
-        return INVALID_BLOCK;
+        return NULL;
     }
-
-    for (int i = 0; i < num_blocks; i++)
+    if (options != NULL)
+    {
+        fs->options = *options;
+    }
+    else
+    {
+        tfs_defaultMountOptions(&fs->options);
+    }
+    if (fs->options.logDevice != NULL)
     {
-        if (!IS_BLOCK_USED(bitmap.bitmap, i))
+        fs->options.logDevice = strdup(fs->options.logDevice);
+        if (fs->options.logDevice == NULL)
         {
-            return (uint32_t)i;
+            free(fs);
+            return NULL;
         }
     }
-    printf("find_free_block() missed\n");
-    return INVALID_BLOCK;
+    fs->mountedDisk = -1;
+    fs->logDisk = -1;
+    set_geometry(fs, BLOCK_SIZE);
+    fs->freeDescriptors = free_list_head(-1, 0);
+    pthread_mutex_init(&fs->fileTableLock, NULL);
+    pthread_mutex_init(&fs->allocLock, NULL);
+    pthread_mutex_init(&fs->dirLock, NULL);
+    pthread_mutex_init(&fs->asyncLock, NULL);
+    pthread_cond_init(&fs->asyncWork, NULL);
+    pthread_cond_init(&fs->asyncChanged, NULL);
+    fs->completionFd = -1;
+    return fs;
 }
 
-static fileDescriptor add_file_descriptor(uint32_t inode_block)
+static void free_bitmaps(tfs_fs *fs)
 {
-    for (int fd = 0; fd < MAX_OPEN_FILES; fd++)
+    free(fs->bitmap);
+    free(fs->txgAllocated);
+    free(fs->txgFreed);
+    free(fs->bitmapDirty);
+    free(fs->runSummary);
+    fs->bitmap = fs->txgAllocated = fs->txgFreed = NULL;
+    fs->bitmapDirty = NULL;
+    fs->runSummary = NULL;
+}
+
+static void free_instance(tfs_fs *fs)
+{
+    for (int c = 0; c < fs->fileChunkCount; c++)
     {
-        if (!file_table[fd].in_use)
+        for (int i = 0; i < FILE_TABLE_CHUNK; i++)
         {
-            file_table[fd].in_use = true;
-            file_table[fd].inode_block = inode_block;
-            file_table[fd].offset = 0;
-            return fd;
+            pthread_mutex_destroy(&fs->fileChunks[c][i].lock);
+            free(fs->fileChunks[c][i].file.extent_map);
+            free(fs->fileChunks[c][i].file.data);
         }
+        free(fs->fileChunks[c]);
     }
-    return FS_ERR_FILE_TABLE_FULL;
+    pthread_mutex_destroy(&fs->fileTableLock);
+    pthread_mutex_destroy(&fs->allocLock);
+    pthread_mutex_destroy(&fs->dirLock);
+    pthread_mutex_destroy(&fs->asyncLock);
+    pthread_cond_destroy(&fs->asyncWork);
+    pthread_cond_destroy(&fs->asyncChanged);
+    free(fs->completions);
+    if (fs->completionFd >= 0)
+    {
+        close(fs->completionFd);
+    }
+    free(fs->options.logDevice);
+    free_bitmaps(fs);
+    dentry_cache_free(fs);
+    free(fs);
 }
 
-// marks <block> number as used and updates the bitmap accordingly
-static void setBlockUsedAndUpdateBitmap(uint32_t block)
+// reads block <bNum> and copies out the Superblock/Inode at its start
+static int read_block_head(tfs_fs *fs, uint32_t bNum, void *head)
 {
-    if (block == INVALID_BLOCK)
-    {
-        printf("Attempted to mark INVALID_BLOCK as used in bitmap.");
-        return;
-    }
+    _Alignas(uint32_t) uint8_t block[fs->fsBlockSize];
+    RETURN_IF_ERR(cacheRead(fs->blockCache, bNum, block));
+    memcpy(head, block, BLOCK_SIZE);
+    return SUCCESS;
+}
 
-    BitmapBlock b;
-    readBlock(mountedDisk, BITMAP_BLOCK_NUM, &b);
-    SET_BLOCK_USED(b.bitmap, block);
-    writeBlock(mountedDisk, BITMAP_BLOCK_NUM, &b);
+// writes the Superblock/Inode <head> as block <bNum>, zero-filling the rest of the block
+static int write_block_head(tfs_fs *fs, uint32_t bNum, const void *head)
+{
+    _Alignas(uint32_t) uint8_t block[fs->fsBlockSize];
+    memcpy(block, head, BLOCK_SIZE);
+    memset(block + BLOCK_SIZE, 0, fs->fsBlockSize - BLOCK_SIZE);
+    return cacheWrite(fs->blockCache, bNum, block);
 }
 
-// clears <block> number and updates the bitmap accordingly
-static void clearBlockUsedAndUpdateBitmap(uint32_t block)
+static bool bit_is_set(const uint64_t *words, uint32_t n)
 {
-    BitmapBlock b;
-    readBlock(mountedDisk, BITMAP_BLOCK_NUM, &b);
-    SET_BLOCK_FREE(b.bitmap, block);
-    writeBlock(mountedDisk, BITMAP_BLOCK_NUM, &b);
+    return (words[n / 64] >> (n % 64)) & 1;
 }
 
-// fills <block> with 0x00s
-static void zeroBlock(uint32_t block)
+static void bit_set(uint64_t *words, uint32_t n)
 {
-    char zero[BLOCK_SIZE] = {0};
-    int err = writeBlock(mountedDisk, block, zero);
-    if (err != SUCCESS)
-    {
-        printf("zeroBlock recieved error.\n");
-        return;
-    }
+    words[n / 64] |= 1ull << (n % 64);
 }
-#pragma endregion
 
-#pragma region
-/* Makes an empty TinyFS file system of size nBytes on an emulated libDisk disk specified by ‘filename’.
-This function should use the emulated disk library to open the specified file, and upon success, format the file to be mountable.
-This includes initializing all data to 0x00, setting magic numbers, initializing and writing the superblock and other metadata, etc.
-Must return a specified success/error code. */
-int tfs_mkfs(char *filename, int nBytes)
+static void bit_clear(uint64_t *words, uint32_t n)
 {
-    RETURN_IF_ERR(openDisk(filename, nBytes));
-    int disk_to_write = 0;
-    mountedDisk = disk_to_write;
-    // VALIDATIONS
+    words[n / 64] &= ~(1ull << (n % 64));
+}
 
-    int numBlocks = nBytes / BLOCK_SIZE;
-    // validate minsize
-    // superblock + bitmap block + root_dir(Inode) + root_dir data block (will essentially be the only inode list)
-    if (numBlocks <= 3)
+// blocks tracked per on-disk bitmap block: the data segment of a checksummed block, or the whole legacy block
+static uint32_t bitmap_block_bits(tfs_fs *fs)
+{
+    return fs->superBlock.bitmap_blocks != 0 ? BITMAP_BITS(fs->fsBlockSize) : fs->fsBlockSize * 8;
+}
+
+// sizes the in-memory bitmaps for a disk of <num_blocks> blocks tracked by <bitmap_blocks> on-disk bitmap blocks
+// (0: one legacy block, which never tracks more than fsBlockSize * 8 of them). all empty, the tail bits set
+static int alloc_bitmaps(tfs_fs *fs, uint32_t num_blocks, uint32_t bitmap_blocks)
+{
+    free_bitmaps(fs);
+    uint32_t per_block = bitmap_blocks != 0 ? BITMAP_BITS(fs->fsBlockSize) : fs->fsBlockSize * 8;
+    uint32_t on_disk = bitmap_blocks != 0 ? bitmap_blocks : 1;
+    fs->numBlocks = num_blocks < (uint64_t)per_block * on_disk ? num_blocks : per_block * on_disk;
+    fs->bitmapWords = (uint32_t)(((uint64_t)per_block * on_disk + 63) / 64);
+    fs->bitmap = calloc(fs->bitmapWords, sizeof(uint64_t));
+    fs->txgAllocated = calloc(fs->bitmapWords, sizeof(uint64_t));
+    fs->txgFreed = calloc(fs->bitmapWords, sizeof(uint64_t));
+    fs->bitmapDirty = calloc(on_disk, 1);
+    uint32_t regions = (fs->bitmapWords + RUN_SUMMARY_WORDS - 1) / RUN_SUMMARY_WORDS;
+    fs->runSummary = calloc(regions, sizeof(RunSummary));
+    if (fs->bitmap == NULL || fs->txgAllocated == NULL || fs->txgFreed == NULL || fs->bitmapDirty == NULL ||
+        fs->runSummary == NULL)
     {
-        printf("Insufficient nBytes space allocated to tfs_mkfs() for (Min 4 blocks)\n");
-        return FS_ERR_INSUFFICIENT_FS_SIZE;
+        free_bitmaps(fs);
+        return SYSTEM_ERROR;
     }
-
-    // VALIDATIONS END
-
-    // wipe disk
-    char null_block[BLOCK_SIZE] = {0};
-    for (int i = 0; i < numBlocks; i++)
+    for (uint32_t n = fs->numBlocks; n < fs->bitmapWords * 64; n++)
+    { // past the end of the disk: never free
+        bit_set(fs->bitmap, n);
+    }
+    for (uint32_t r = 0; r < regions; r++)
     {
-        RETURN_IF_ERR(writeBlock(disk_to_write, i, null_block));
+        fs->runSummary[r].stale = true;
     }
+    fs->freeBlocks = fs->numBlocks;
+    fs->allocCursor = 0;
+    return SUCCESS;
+}
 
-    // write BitmapBlock #1
-    BitmapBlock bitmapB;
-    memset(bitmapB.bitmap, 0, BLOCK_SIZE);
-    SET_BLOCK_USED(bitmapB.bitmap, 0);
-    SET_BLOCK_USED(bitmapB.bitmap, 1);
-    SET_BLOCK_USED(bitmapB.bitmap, 2);
-    SET_BLOCK_USED(bitmapB.bitmap, 3);
-    RETURN_IF_ERR(writeBlock(disk_to_write, 1, &bitmapB));
-    // PRESET BITMAP for post file system creation ABOVE
-
-    // write root_dir data block #3 (DirectoryEntry {"", UINT32_MAX} to initialize)
-    Datablock root_dir_data_block;
-    memset(&root_dir_data_block, 0, BLOCK_SIZE);
-
-    int max_entries = sizeof(root_dir_data_block.data) / sizeof(DirectoryEntry);
-    DirectoryEntry *entry = (DirectoryEntry *)root_dir_data_block.data;
-    for (int i = 0; i < max_entries; i++)
+// <bytes> bytes of <words> from byte <offset> on, as stored on disk: every word little-endian, so block n is
+// bit n % 8 of byte n / 8 whatever the host's byte order
+static void bitmap_get_bytes(const uint64_t *words, size_t offset, uint8_t *out, size_t bytes)
+{
+    for (size_t i = 0; i < bytes;)
     {
-        memset(&entry[i], 0, sizeof(DirectoryEntry)); // zero entire struct
-        entry[i].inode_block = INVALID_BLOCK;
+        size_t skip = (offset + i) % 8;
+        size_t n = 8 - skip < bytes - i ? 8 - skip : bytes - i;
+        uint64_t word = htole64(words[(offset + i) / 8]);
+        memcpy(out + i, (const uint8_t *)&word + skip, n);
+        i += n;
     }
+}
 
-    set_datablock_checksum(&root_dir_data_block);
-    RETURN_IF_ERR(writeBlock(disk_to_write, 3, &root_dir_data_block));
-
-    // write root_dir Inode #2
-    Inode root_dir_inode = {
-        .type = INODE_TYPE_RW_FILE,
-        .size = 0,
-        .direct = {3, INVALID_BLOCK},
-        .indirect = INVALID_BLOCK,
-        .padding = {0}};
-    set_inode_checksum(&root_dir_inode);
-    RETURN_IF_ERR(writeBlock(disk_to_write, 2, &root_dir_inode));
-
-    // write Superblock
-    Superblock superB = {0};
-    superB.type = 0x5A;
-    superB.bitmap_block = BITMAP_BLOCK_NUM;
-    superB.root_dir_inode = ROOT_INODE_BLOCK_NUM;
-    superB.fs_size = nBytes;
-    superB.checksum = 0;
-
-    set_superblock_checksum(&superB);
-    RETURN_IF_ERR(writeBlock(disk_to_write, 0, &superB));
-
-    //
-    // SUPERBLOCK + BITMAP + ROOT_DIR INODE + ROOT_DIR SET UP ATP
-    //
-
-    // allocate datablock + indirect block more to root_dir Inode (indepedent)
-    uint32_t second_block = find_free_block(); // 2nd direct data block ///ERROR: find_free_block() not finding shit | also the first that uses setBlock
-    zeroBlock(second_block);
-    setBlockUsedAndUpdateBitmap(second_block);
-
-    uint32_t third_block = find_free_block(); // indirect data block
-    if (third_block == INVALID_BLOCK)
+// stores on-disk bitmap bytes back into <words> (see bitmap_get_bytes())
+static void bitmap_put_bytes(uint64_t *words, size_t offset, const uint8_t *in, size_t bytes)
+{
+    for (size_t i = 0; i < bytes;)
     {
-        printf("No free block available for indirect block in mkfs.");
-        return FS_ERR_BITMAP_FULL;
+        size_t skip = (offset + i) % 8;
+        size_t n = 8 - skip < bytes - i ? 8 - skip : bytes - i;
+        uint64_t word = htole64(words[(offset + i) / 8]);
+        memcpy((uint8_t *)&word + skip, in + i, n);
+        words[(offset + i) / 8] = le64toh(word);
+        i += n;
     }
+}
 
-    zeroBlock(third_block);
-    setBlockUsedAndUpdateBitmap(third_block);
+// on-disk bitmap block <index> as the first bytes of <block>, block n at bit n % 8 of byte n / 8
+static void bitmap_block_bytes(tfs_fs *fs, uint32_t index, uint8_t *block)
+{
+    uint32_t bytes = bitmap_block_bits(fs) / 8;
+    bitmap_get_bytes(fs->bitmap, (size_t)index * bytes, block, bytes);
+}
 
-    // set up empty indirect block data with checksum
-    Datablock buffer_bock = {0};
-    // invalidate entries
-    Block *indirect_entry = (Block *)buffer_bock.data;
-    for (int i = 0; i < MAX_INDIRECT_BLOCK_POINTERS; i++)
+// loads on-disk bitmap block <index> from <block>, keeping the bits past the last block set
+static void load_bitmap_block(tfs_fs *fs, uint32_t index, const uint8_t *block)
+{
+    uint32_t bytes = bitmap_block_bits(fs) / 8;
+    bitmap_put_bytes(fs->bitmap, (size_t)index * bytes, block, bytes);
+    for (uint32_t n = fs->numBlocks; n < fs->bitmapWords * 64; n++)
     {
-        indirect_entry[i] = INVALID_BLOCK;
+        bit_set(fs->bitmap, n);
     }
-    set_datablock_checksum(&buffer_bock);
-    RETURN_IF_ERR(writeBlock(mountedDisk, third_block, &buffer_bock));
-    //
-
-    Inode newInode = {0}; // block for inode
-    newInode.type = INODE_TYPE_RO_FILE;
-    newInode.size = 0;
-    newInode.direct[0] = ROOT_DIR_DATA_BLOCK_NUM; // already made root_dir block
-    newInode.direct[1] = second_block;
-    newInode.indirect = third_block;
-    memset(newInode.padding, 0, sizeof(newInode.padding));
-    set_inode_checksum(&newInode);
-    RETURN_IF_ERR(writeBlock(mountedDisk, ROOT_INODE_BLOCK_NUM, &newInode));
-
-
-    closeDisk(disk_to_write);
-    mountedDisk = -1;
-    return SUCCESS;
 }
 
-/* tfs_mount(char *filename) “mounts” a TinyFS file system located within an emulated libDisk disk called ‘filename’.
-tfs_unmount(void) “unmounts” the currently mounted file system.
-As part of the mount operation, tfs_mount should verify the file system is the correct type.
-Only one file system may be mounted at a time.
-Use tfs_unmount to cleanly unmount the currently mounted file system.
-Must return a specified success/error code. */
-int tfs_mount(char *filename)
+// recounts the free blocks after the bitmap was loaded, 64 at a time
+static void count_bitmap(tfs_fs *fs)
 {
-    // all errors will unmount disk
-    if (mountedDisk != -1)
+    uint32_t used = 0;
+    for (uint32_t w = 0; w < fs->bitmapWords; w++)
     {
-        printf("A filesystem is already mounted on the disk\n");
-        return FS_ERR_EXISTING_MOUNTED_FS;
+        used += (uint32_t)__builtin_popcountll(fs->bitmap[w] | fs->txgFreed[w]);
     }
+    fs->freeBlocks = fs->bitmapWords * 64 - used;
+}
+
+// a block nothing committed points at (allocated in the open txg), so it can be rewritten in place
+static bool block_is_uncommitted(tfs_fs *fs, uint32_t block)
+{
+    return bit_is_set(fs->txgAllocated, block);
+}
 
-    RETURN_IF_ERR(openDisk(filename, 0));
-    mountedDisk = 0;
+// blocks of word <w> that aren't free
+static uint64_t taken_word(const tfs_fs *fs, uint32_t w)
+{
+    return fs->bitmap[w] | fs->txgFreed[w];
+}
 
-    // validate SUPERBLOCK
-    Superblock super_block;
-    RETURN_IF_ERR(readBlock(mountedDisk, SUPERBLOCK_BLOCK_NUM, &super_block)); // check FS type
-    if (super_block.type != 0x5A)
+// first word in [w, end) with a free block, <end> if none. a full stretch goes four words per test
+static uint32_t next_free_word(const tfs_fs *fs, uint32_t w, uint32_t end)
+{
+    for (; w + 4 <= end; w += 4)
     {
-        ROLLBACK_MOUNT();
-        printf("Attempted to mount invalid file system type\n");
-        return FS_ERR_WRONG_FS_TYPE;
+        if ((taken_word(fs, w) & taken_word(fs, w + 1) & taken_word(fs, w + 2) & taken_word(fs, w + 3)) != UINT64_MAX)
+            break;
     }
-    // verify superblock checksum
-    if (!verify_superblock_checksum(&super_block))
+    while (w < end && taken_word(fs, w) == UINT64_MAX)
     {
-        ROLLBACK_MOUNT();
-        printf("Superblock checksum failed.\n");
-        return FS_ERR_SB_CHECKSUM_FAILED;
+        w++;
     }
-    if (super_block.bitmap_block == INVALID_BLOCK || super_block.root_dir_inode == INVALID_BLOCK)
-    {
-        ROLLBACK_MOUNT();
+    return w;
+}
 
-        printf("Attempted to mount file system with superblock missing data\n");
-        return FS_ERR_MOUNTED_FS_INVALID_SUPERBLOCK;
+// the first free block from <from> on, wrapping around once. INVALID_BLOCK if there is none
+static uint32_t next_free_block(tfs_fs *fs, uint32_t from)
+{
+    uint32_t cursor = from < fs->numBlocks ? from : 0;
+    uint32_t w = cursor / 64;
+    uint64_t taken = taken_word(fs, w) | ((1ull << (cursor % 64)) - 1); // the cursor's word from the cursor on
+    if (taken == UINT64_MAX)
+    {
+        w = next_free_word(fs, w + 1, fs->bitmapWords);
+        if (w == fs->bitmapWords)
+        {
+            w = next_free_word(fs, 0, cursor / 64 + 1);
+            if (w == cursor / 64 + 1)
+            {
+                return INVALID_BLOCK;
+            }
+        }
+        taken = taken_word(fs, w);
     }
+    return w * 64 + (uint32_t)__builtin_ctzll(~taken);
+}
 
-    // validate root_dir_inode
-    Inode root_dir_inode;
-    RETURN_IF_ERR(readBlock(mountedDisk, super_block.root_dir_inode, &root_dir_inode));
-    if (root_dir_inode.direct[0] == INVALID_BLOCK || root_dir_inode.direct[1] == INVALID_BLOCK || root_dir_inode.indirect == INVALID_BLOCK)
+// next-fit: the first free block from the allocation cursor on. doesn't set bitmap
+static uint32_t find_free_block(tfs_fs *fs)
+{
+    uint32_t block = next_free_block(fs, fs->allocCursor);
+    if (block == INVALID_BLOCK)
     {
-        ROLLBACK_MOUNT();
-
-        printf("Attempted to mount file system with root_dir Inode missing data\n");
-        return FS_ERR_MOUNTED_FS_INVALID_ROOT_DIR_INODE;
+        printf("find_free_block() missed\n");
     }
+    return block;
+}
 
-    // validate root_dir
-    Datablock root_dir;
-    RETURN_IF_ERR(readBlock(mountedDisk, root_dir_inode.direct[0], &root_dir));
-
-    int max_entries = sizeof(root_dir.data) / sizeof(DirectoryEntry);
-    DirectoryEntry *entry = (DirectoryEntry *)root_dir.data;
-    for (int i = 0; i < max_entries; i++)
+// free blocks from <start> (free itself) on, counting at most <want>
+static uint32_t free_run_length(tfs_fs *fs, uint32_t start, uint32_t want)
+{
+    uint32_t length = 0;
+    while (length < want && start + length < fs->numBlocks)
     {
-        if (entry[i].inode_block != INVALID_BLOCK &&
-            (entry[i].inode_block >= (super_block.fs_size / BLOCK_SIZE)))
-        {
-            ROLLBACK_MOUNT();
-            printf("Attempted to mount file system with root_dir with DirectoryEntry outside of valid range.\n");
-            return FS_ERR_MOUNTED_FS_INVALID_ROOT_DIR;
-        }
+        uint32_t n = start + length;
+        uint64_t taken = taken_word(fs, n / 64) >> (n % 64);
+        uint32_t left = 64 - n % 64; // bits of the word from n on
+        uint32_t run = taken == 0 ? left : (uint32_t)__builtin_ctzll(taken);
+        length += run;
+        if (run < left)
+            break;
     }
-
-    // validate bitmap_block
-    BitmapBlock bitmap_block;
-    RETURN_IF_ERR(readBlock(mountedDisk, super_block.bitmap_block, &bitmap_block));
-    if (!IS_BLOCK_USED(bitmap_block.bitmap, SUPERBLOCK_BLOCK_NUM) ||
-        !IS_BLOCK_USED(bitmap_block.bitmap, ROOT_DIR_DATA_BLOCK_NUM) ||
-        !IS_BLOCK_USED(bitmap_block.bitmap, ROOT_INODE_BLOCK_NUM) ||
-        !IS_BLOCK_USED(bitmap_block.bitmap, BITMAP_BLOCK_NUM))
+    if (start + length > fs->numBlocks)
     {
-        ROLLBACK_MOUNT();
-
-        printf("Attempted to mount file system with Bitmap block missing data\n");
-        return FS_ERR_MOUNTED_FS_INVALID_BITMAP;
+        length = fs->numBlocks - start;
     }
-
-    return SUCCESS;
+    return length < want ? length : want;
 }
 
-int tfs_unmount(void)
+static void txg_dirtied(tfs_fs *fs)
 {
-    if (mountedDisk == -1)
-        return FS_ERR_NO_FS_MOUNTED;
-    RETURN_IF_ERR(closeDisk(mountedDisk));
-    mountedDisk = -1;
-    return SUCCESS;
+    if (fs->txgDirtyBlocks++ == 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &fs->txgOpened);
+    }
 }
 
-//
-#pragma endregion
-// EVERYTHING ABOVE IS CONCERNED WITH DISK OPERATIONS
-//=========================================================================================================================================
-//  EVERYTHING BELOW IS CONCERNED WITH FILE TABLES AND FILE DESCRIPTORS
-#pragma region
-//
+// the on-disk bitmap block tracking <block> changed, and so may the free runs around it
+static void bitmap_changed(tfs_fs *fs, uint32_t block)
+{
+    fs->bitmapDirty[block / bitmap_block_bits(fs)] |= BITMAP_CHANGED_OPEN;
+    fs->runSummary[block / 64 / RUN_SUMMARY_WORDS].stale = true;
+}
 
-/* Opens a file for reading and writing on the currently mounted file system.
-Creates a dynamic resource table entry for the file (the structure that tracks open files, the internal file pointer, etc.),
-and returns a file descriptor (integer) that can be used to reference this file while the filesystem is mounted. */
-fileDescriptor tfs_open(char *name)
+// marks <block> number as used and updates the bitmap accordingly
+static void setBlockUsedAndUpdateBitmap(tfs_fs *fs, uint32_t block)
 {
-    if (mountedDisk == -1)
-    {
-        printf("tfs_open() called when no file systems were mounted.\n");
-        return FS_ERR_NO_FS_MOUNTED;
-    }
-    if (name == NULL || strlen(name) > 8)
+    if (block == INVALID_BLOCK)
     {
-        return FS_ERR_INVALID_FILENAME;
+        printf("Attempted to mark INVALID_BLOCK as used in bitmap.");
+        return;
     }
-    // validations end
-
-    Datablock root_dir; // directly reads root_dir inode
-    RETURN_IF_ERR(readBlock(mountedDisk, ROOT_DIR_DATA_BLOCK_NUM, &root_dir));
-
-    int max_entries = sizeof(root_dir.data) / sizeof(DirectoryEntry);
-    DirectoryEntry *entry = (DirectoryEntry *)root_dir.data;
-
-    Inode thefile = {0};
-    int cached_index = -1;
-    bool found = false;
-    bool missingInode = false;
 
-    for (int i = 0; i < max_entries; i++)
+    if (!bit_is_set(fs->bitmap, block))
     {
-        if (strcmp(entry[i].name, name) == 0)
-        {
-            cached_index = i;
-            // Problem where Inode Directory is INVALID_BLOCK is handled during FS setups
-            // if (entry[i].inode_block == INVALID_BLOCK)
-            // {
-            //     missingInode = true;
-            // }
-            if (entry[i].inode_block != INVALID_BLOCK)
-            {
-                RETURN_IF_ERR(readBlock(mountedDisk, entry[i].inode_block, &thefile));
-                found = true;
-                break;
-            }
+        bit_set(fs->bitmap, block);
+        if (bit_is_set(fs->txgFreed, block))
+        { // freed and taken back within the txg: the committed tree still reaches it, nothing to count
+            bit_clear(fs->txgFreed, block);
+            fs->txgFreedBlocks--;
         }
+        else
+        { // new in this txg: nothing committed points at it yet
+            bit_set(fs->txgAllocated, block);
+            fs->freeBlocks--;
+        }
+        fs->allocCursor = block + 1;
+        bitmap_changed(fs, block);
+        txg_dirtied(fs);
     }
-    if (cached_index == -1)
-    { // if not in directory at all, find unused slot in dir
-        for (int i = 0; i < max_entries; i++)
-        {
-            if (entry[i].inode_block == INVALID_BLOCK)
-            {
-                cached_index = i;
-                break;
-            }
+}
+
+// clears <block> number and updates the bitmap accordingly
+static void clearBlockUsedAndUpdateBitmap(tfs_fs *fs, uint32_t block)
+{
+    if (bit_is_set(fs->bitmap, block))
+    {
+        bit_clear(fs->bitmap, block);
+        if (block_is_uncommitted(fs, block))
+        { // never committed: reusable right away
+            bit_clear(fs->txgAllocated, block);
+            fs->freeBlocks++;
         }
-        if (cached_index == -1)
-        {
-            printf("tfs_open() tried to craete a new file in a full directory.\n");
-            return FS_ERR_DIRECTORY_FULL;
+        else
+        { // the committed tree may still read it until the next commit
+            bit_set(fs->txgFreed, block);
+            fs->txgFreedBlocks++;
         }
+        bitmap_changed(fs, block);
+        txg_dirtied(fs);
     }
+}
 
-    uint32_t inode_slot;
+// names fill all 8 bytes of an entry, NUL-padded when shorter: an 8-character one has no NUL at all
+static void name_key(const char *name, char key[8])
+{
+    size_t n = strnlen(name, 8);
+    memset(key, 0, 8);
+    memcpy(key, name, n);
+}
 
-    if (!found)
+// FNV-1a of a name: picks its bucket block in a directory, and with the directory its dentry cache chain
+static uint32_t name_hash(const char key[8])
+{
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 8 && key[i] != '\0'; i++)
     {
-        // build an inode (need one block)
-        // and allocate 3 datablocks
-
-        inode_slot = find_free_block();
-        zeroBlock(inode_slot);
-        setBlockUsedAndUpdateBitmap(inode_slot);
-
-        uint32_t first_block = find_free_block(); // 1st direct data block
-        zeroBlock(first_block);
-        setBlockUsedAndUpdateBitmap(first_block);
-
-        uint32_t second_block = find_free_block(); // 2nd direct data block
-        zeroBlock(second_block);
-        setBlockUsedAndUpdateBitmap(second_block);
+        h = (h ^ (uint8_t)key[i]) * 16777619u;
+    }
+    return h;
+}
 
-        uint32_t third_block = find_free_block(); // indirect data block
-        zeroBlock(third_block);
-        setBlockUsedAndUpdateBitmap(third_block);
+static unsigned dentry_bucket(int parent, const char key[8])
+{
+    return (name_hash(key) ^ (uint32_t)parent * 2654435761u) & (DENTRY_BUCKETS - 1);
+}
 
-        // set up empty indirect block data with checksum
-        Datablock buffer_bock = {0};
-        // invalidate entries
-        Block *indirect_entry = (Block *)buffer_bock.data;
-        for (int i = 0; i < MAX_INDIRECT_BLOCK_POINTERS; i++)
-        {
-            indirect_entry[i] = INVALID_BLOCK;
-        }
-        set_datablock_checksum(&buffer_bock);
-        RETURN_IF_ERR(writeBlock(mountedDisk, third_block, &buffer_bock));
-        //
-        Inode newInode = {0}; // block for inode
-        newInode.type = INODE_TYPE_RW_FILE;
-        newInode.size = 0;
-        newInode.direct[0] = first_block;
-        newInode.direct[1] = second_block;
-        newInode.indirect = third_block;
-        memset(newInode.padding, 0, sizeof(newInode.padding));
-        set_inode_checksum(&newInode);
+static Dentry *dentry(tfs_fs *fs, int id)
+{
+    Dentry *chunk = __atomic_load_n(&fs->dentryChunks[id / DENTRY_CHUNK], __ATOMIC_ACQUIRE);
+    return &chunk[id % DENTRY_CHUNK];
+}
 
-        // push inode
-        RETURN_IF_ERR(writeBlock(mountedDisk, inode_slot, &newInode));
+static void lru_unlink(tfs_fs *fs, int id)
+{
+    Dentry *d = dentry(fs, id);
+    *(d->lruPrev != -1 ? &dentry(fs, d->lruPrev)->lruNext : &fs->lruHead) = d->lruNext;
+    *(d->lruNext != -1 ? &dentry(fs, d->lruNext)->lruPrev : &fs->lruTail) = d->lruPrev;
+    d->lruPrev = d->lruNext = -1;
+}
 
-        // commit updates to directory
-        strncpy(entry[cached_index].name, name, sizeof(entry[cached_index].name));
-        entry[cached_index].name[7] = '\0';
+static void lru_append(tfs_fs *fs, int id)
+{
+    Dentry *d = dentry(fs, id);
+    d->lruPrev = fs->lruTail;
+    d->lruNext = -1;
+    *(fs->lruTail != -1 ? &dentry(fs, fs->lruTail)->lruNext : &fs->lruHead) = id;
+    fs->lruTail = id;
+}
 
-        entry[cached_index].inode_block = inode_slot;
-    }
-    else
+// pins dentry <id> against eviction. all dentry cache calls hold dirLock
+static void dentry_hold(tfs_fs *fs, int id)
+{
+    if (dentry(fs, id)->refs++ == 0)
     {
-        inode_slot = entry[cached_index].inode_block;
+        lru_unlink(fs, id);
     }
-    // push updates to directory
-    set_datablock_checksum(&root_dir);
-    RETURN_IF_ERR(writeBlock(mountedDisk, ROOT_DIR_DATA_BLOCK_NUM, &root_dir));
+}
 
-    fileDescriptor fd = add_file_descriptor(inode_slot);
-    // do I need to handle case where fd is null?!!!
-    return fd;
+static void dentry_put(tfs_fs *fs, int id)
+{
+    if (--dentry(fs, id)->refs == 0)
+    {
+        lru_append(fs, id);
+    }
 }
 
-/* Closes the file and removes dynamic resource table entry */
-int tfs_close(fileDescriptor FD)
+static void dentry_unhash(tfs_fs *fs, int id)
 {
-    if (mountedDisk == -1)
+    Dentry *d = dentry(fs, id);
+    int *link = &fs->dentryBuckets[dentry_bucket(d->parent, d->name)];
+    while (*link != -1 && *link != id)
     {
-        return FS_ERR_NO_FS_MOUNTED;
+        link = &dentry(fs, *link)->next;
     }
-    if (FD < 0 || FD >= MAX_OPEN_FILES)
+    if (*link == id) // a negative dentry a rename took the name from is in no chain
     {
-        printf("Attempted to close file descriptor out of range.\n");
-        return FS_ERR_ACCESSED_OUT_OF_FILE_TABLE_RANGE;
+        *link = d->next;
     }
+    d->next = -1;
+}
+
+static void dentry_rehash(tfs_fs *fs, int id, int parent, const char key[8])
+{
+    Dentry *d = dentry(fs, id);
+    unsigned bucket = dentry_bucket(parent, key);
+    memcpy(d->name, key, sizeof(d->name));
+    d->parent = parent;
+    d->next = fs->dentryBuckets[bucket];
+    fs->dentryBuckets[bucket] = id;
+}
+
+// drops unpinned dentry <id> from the cache, unpinning its directory
+static void dentry_evict(tfs_fs *fs, int id)
+{
+    Dentry *d = dentry(fs, id);
+    lru_unlink(fs, id);
+    dentry_unhash(fs, id);
+    dentry_put(fs, d->parent);
+    free(d->buckets);
+    d->buckets = NULL;
+    d->numBuckets = 0;
+    memset(d->name, 0, sizeof(d->name));
+    d->kind = DENTRY_FREE;
+    d->inode_block = INVALID_BLOCK;
+    d->next = fs->freeDentries;
+    fs->freeDentries = id;
+    fs->dentriesInUse--;
+}
 
-    if (!file_table[FD].in_use)
+// takes a free dentry for <id>: evicting the least recently used one once the cache is full, else off the free list,
+// else from a new chunk
+static int dentry_slot(tfs_fs *fs, int *id)
+{
+    if (fs->dentriesInUse >= DENTRY_CACHE_ENTRIES && fs->lruHead != -1)
     {
-        printf("Attempted close on file descriptor not in use.\n");
-        return FS_ERR_FILE_NOT_IN_USE;
+        dentry_evict(fs, fs->lruHead);
+    }
+    if (fs->freeDentries == -1)
+    {
+        if (fs->dentryCount == DENTRY_MAX)
+        {
+            printf("Every dentry is pinned by an open file.\n");
+            return FS_ERR_FILE_TABLE_FULL;
+        }
+        Dentry *chunk = calloc(DENTRY_CHUNK, sizeof(Dentry));
+        if (chunk == NULL)
+        {
+            return SYSTEM_ERROR;
+        }
+        for (int i = 0; i < DENTRY_CHUNK; i++)
+        {
+            pthread_rwlock_init(&chunk[i].lock, NULL);
+            chunk[i].inode_block = INVALID_BLOCK;
+            chunk[i].next = i + 1 < DENTRY_CHUNK ? fs->dentryCount + i + 1 : -1;
+        }
+        __atomic_store_n(&fs->dentryChunks[fs->dentryCount / DENTRY_CHUNK], chunk, __ATOMIC_RELEASE);
+        fs->freeDentries = fs->dentryCount;
+        fs->dentryCount += DENTRY_CHUNK;
     }
+    *id = fs->freeDentries;
+    Dentry *d = dentry(fs, *id);
+    fs->freeDentries = d->next;
+    fs->dentriesInUse++;
+    d->next = -1;
+    d->lruPrev = d->lruNext = -1;
+    d->refs = 0;
+    return SUCCESS;
+}
 
-    file_table[FD].in_use = false;
+// caches <key> of directory <parent>, which no dentry names yet, as a <kind> dentry of <inode_block>
+static int dentry_add(tfs_fs *fs, int parent, const char key[8], uint8_t kind, uint32_t inode_block, int *id)
+{
+    dentry_hold(fs, parent); // a child pins its directory, which also keeps the eviction below off it
+    int add_err = dentry_slot(fs, id);
+    if (add_err != SUCCESS)
+    {
+        dentry_put(fs, parent);
+        return add_err;
+    }
+    Dentry *d = dentry(fs, *id);
+    d->kind = kind;
+    d->inode_block = inode_block;
+    dentry_rehash(fs, *id, parent, key);
+    lru_append(fs, *id);
     return SUCCESS;
 }
 
-/* Writes buffer ‘buffer’ of size ‘size’, which represents an entire file’s contents,
- to the file described by ‘FD’.
- Sets the file pointer to 0 (the start of file) when done. Returns success/error codes. */
-int tfs_write(fileDescriptor FD, const char *buffer, const int size)
+// the cached dentry of <key> in directory <parent>, -1 if there is none. a hit becomes the most recently used
+static int dentry_find(tfs_fs *fs, int parent, const char key[8])
 {
-    if (mountedDisk == -1)
+    for (int id = fs->dentryBuckets[dentry_bucket(parent, key)]; id != -1; id = dentry(fs, id)->next)
     {
-        return FS_ERR_NO_FS_MOUNTED;
+        Dentry *d = dentry(fs, id);
+        if (d->parent == parent && memcmp(d->name, key, 8) == 0)
+        {
+            if (d->refs == 0)
+            {
+                lru_unlink(fs, id);
+                lru_append(fs, id);
+            }
+            return id;
+        }
     }
-    if (!file_table[FD].in_use)
+    return -1;
+}
+
+// writes the path from the root of dentry <id> to <path> (TFS_MAX_PATH + 1 bytes). false if it is longer
+static bool dentry_path(tfs_fs *fs, int id, char *path)
+{
+    const char *names[TFS_MAX_PATH / 2 + 1];
+    int depth = 0;
+    size_t length = 0;
+    for (; id != ROOT_DENTRY; id = dentry(fs, id)->parent)
     {
-        printf("Attempted write to a file not in use.\n");
-        return FS_ERR_FILE_NOT_IN_USE;
+        if (depth == TFS_MAX_PATH / 2 + 1)
+        {
+            return false;
+        }
+        names[depth] = dentry(fs, id)->name;
+        length += strnlen(names[depth++], 8) + 1;
     }
-    if (size < 0)
+    if (length > TFS_MAX_PATH + 1)
     {
-        printf("Attempted write with negative size\n");
-        return FS_ERR_INVALID_WRITE_SIZE;
+        return false;
     }
-    if (size > DATABLOCK_DATA_SIZE * 2 + MAX_INDIRECT_BLOCK_POINTERS * DATABLOCK_DATA_SIZE)
-    {                                                              // still supports ==
-        printf("Attempted write with unsupportedly large size\n"); // must be crazy big
-        return FS_ERR_INVALID_WRITE_SIZE;
+    path[0] = '\0';
+    while (depth-- > 0)
+    {
+        strncat(path, names[depth], 8);
+        if (depth > 0)
+            strcat(path, "/");
     }
+    return true;
+}
 
-    const char *buf_pointer = buffer;
-
-    Inode theinode = {0};
-    RETURN_IF_ERR(readBlock(mountedDisk, file_table[FD].inode_block, &theinode));
+static uint32_t dir_tree_depth(tfs_fs *fs, uint32_t n);
 
-    if (theinode.type != INODE_TYPE_RW_FILE)
+// blocks a change to the inode of dentry <id> may copy beyond TXG_RESERVED_BLOCKS, which covers a file in the root:
+// the bucket block and inode of every directory between it and the root, and the extent nodes above each bucket.
+// holds dirLock
+static uint32_t dentry_chain_blocks(tfs_fs *fs, int id)
+{
+    uint32_t blocks = 0;
+    for (id = dentry(fs, id)->parent; id != -1; id = dentry(fs, id)->parent)
     {
-        printf("Invalid permissions to write to file.\n");
-        return FS_ERR_INVALID_FILE_PERMISSION;
+        blocks += dir_tree_depth(fs, dentry(fs, id)->numBuckets); // the extent nodes above its bucket
+        if (id == ROOT_DENTRY)
+            break;
+        blocks += 2;
     }
+    return blocks;
+}
 
-    int remaining_size = size;
-    int chunk_size;
-
-    // clear indirect datablock group | direct datablocks don't need clearing but indirect datablocks need to be freed.
-    Datablock indirect_block = {0};
-    RETURN_IF_ERR(readBlock(mountedDisk, theinode.indirect, &indirect_block));
-    Block *indirect_entry = (Block *)indirect_block.data;
-    for (int i = 0; i < MAX_INDIRECT_BLOCK_POINTERS; i++)
+static void dentry_cache_free(tfs_fs *fs)
+{
+    for (int c = 0; c < fs->dentryCount / DENTRY_CHUNK; c++)
     {
-        indirect_entry[i] = INVALID_BLOCK;
+        for (int i = 0; i < DENTRY_CHUNK; i++)
+        {
+            pthread_rwlock_destroy(&fs->dentryChunks[c][i].lock);
+            free(fs->dentryChunks[c][i].buckets);
+        }
+        free(fs->dentryChunks[c]);
+        fs->dentryChunks[c] = NULL;
     }
+    free(fs->dentryBuckets);
+    fs->dentryBuckets = NULL;
+    fs->dentryCount = 0;
+    fs->dentriesInUse = 0;
+}
 
-    if (remaining_size > 0)
-    { // first chunk
-        chunk_size = remaining_size > DATABLOCK_DATA_SIZE ? DATABLOCK_DATA_SIZE : remaining_size;
-
-        Datablock buffer_block = {0};
-        memcpy(buffer_block.data, buf_pointer, chunk_size);
-        set_datablock_checksum(&buffer_block);
-        RETURN_IF_ERR(writeBlock(mountedDisk, theinode.direct[0], &buffer_block));
-
-        remaining_size -= chunk_size;
-        buf_pointer += chunk_size;
+// an empty cache but for the root directory, whose inode is <root_inode>
+static int dentry_cache_init(tfs_fs *fs, uint32_t root_inode)
+{
+    fs->dentryBuckets = malloc(DENTRY_BUCKETS * sizeof(int));
+    if (fs->dentryBuckets == NULL)
+    {
+        return SYSTEM_ERROR;
     }
-    if (remaining_size > 0)
-    { // second chunk
-        chunk_size = remaining_size > DATABLOCK_DATA_SIZE ? DATABLOCK_DATA_SIZE : remaining_size;
-
-        Datablock buffer_block = {0};
-        memcpy(buffer_block.data, buf_pointer, chunk_size);
-        set_datablock_checksum(&buffer_block);
-        RETURN_IF_ERR(writeBlock(mountedDisk, theinode.direct[1], &buffer_block));
-
-        remaining_size -= chunk_size;
-        buf_pointer += chunk_size;
+    for (int i = 0; i < DENTRY_BUCKETS; i++)
+    {
+        fs->dentryBuckets[i] = -1;
     }
-    Block *indirect_pointer = (Block *)indirect_block.data;
-    // no need to read existing because gonna overwrite
+    fs->freeDentries = fs->lruHead = fs->lruTail = -1;
+    int root;
+    RETURN_IF_ERR(dentry_slot(fs, &root));
+    Dentry *d = dentry(fs, root);
+    d->parent = -1;
+    d->kind = DENTRY_DIR;
+    d->inode_block = root_inode;
+    d->refs = 1;
+    return SUCCESS;
+}
 
-    int iterator = 0;
-    while (remaining_size > 0)
+// legacy images: the single raw bitmap block moves to a free block every commit
+static int commit_legacy_bitmap(tfs_fs *fs)
+{
+    uint32_t bitmap_block = find_free_block(fs);
+    if (bitmap_block == INVALID_BLOCK)
     {
-        chunk_size = remaining_size > DATABLOCK_DATA_SIZE ? DATABLOCK_DATA_SIZE : remaining_size;
-        indirect_pointer[iterator] = find_free_block();
-
-        Datablock buffer_block = {0};
-        memcpy(buffer_block.data, buf_pointer, chunk_size);
-        set_datablock_checksum(&buffer_block);
-        RETURN_IF_ERR(writeBlock(mountedDisk, indirect_pointer[iterator], &buffer_block));
-        setBlockUsedAndUpdateBitmap(indirect_pointer[iterator]);
-
-        remaining_size -= chunk_size;
-        buf_pointer += chunk_size;
-        iterator++;
+        printf("No free block left to commit the bitmap to.\n");
+        return FS_ERR_BITMAP_FULL;
     }
+    setBlockUsedAndUpdateBitmap(fs, bitmap_block);
+    clearBlockUsedAndUpdateBitmap(fs, fs->superBlock.bitmap_block);
+    fs->superBlock.bitmap_block = bitmap_block;
+    uint8_t block[fs->fsBlockSize];
+    bitmap_block_bytes(fs, 0, block);
+    return cacheWrite(fs->blockCache, bitmap_block, block);
+}
 
-    // update indirect block
-    set_datablock_checksum(&indirect_block);
-    RETURN_IF_ERR(writeBlock(mountedDisk, theinode.indirect, &indirect_block));
-    setBlockUsedAndUpdateBitmap(theinode.indirect);
-
-    // update inode
-    theinode.size = size;
-    set_inode_checksum(&theinode);
-    RETURN_IF_ERR(writeBlock(mountedDisk, file_table[FD].inode_block, &theinode));
-    setBlockUsedAndUpdateBitmap(file_table[FD].inode_block);
-
-    file_table[FD].offset = 0;
+// the spare copy was current two commits ago: it takes every bitmap block changed in the last txg or this one
+static int write_bitmap_copy(tfs_fs *fs)
+{
+    uint8_t block[fs->fsBlockSize];
+    uint32_t spare = fs->superBlock.bitmap_spare;
+    for (uint32_t i = 0; i < fs->superBlock.bitmap_blocks; i++)
+    {
+        if (fs->bitmapDirty[i] == 0)
+            continue;
+        memset(block, 0, fs->fsBlockSize);
+        bitmap_block_bytes(fs, i, block);
+        set_block_checksum(block, fs->fsBlockSize);
+        RETURN_IF_ERR(cacheWrite(fs->blockCache, spare + i, block));
+    }
     return SUCCESS;
 }
 
-/* deletes a file and marks its blocks as free on disk. */
-int tfs_delete(fileDescriptor FD)
+// the superblock about to be written names the other bitmap copy current (or, undoing that, the first one again)
+static void swap_bitmap_copies(tfs_fs *fs)
+{
+    uint32_t spare = fs->superBlock.bitmap_spare;
+    fs->superBlock.bitmap_spare = fs->superBlock.bitmap_block;
+    fs->superBlock.bitmap_block = spare;
+}
+
+/* commits the open transaction group. Everything it changed went to blocks the committed tree doesn't reach,
+so the disk holds both versions until the superblock is rewritten to point at the new one: the bitmap goes to
+its spare copy, every dirty block is written and made durable, and only then the superblock. A crash before that
+last write leaves the previous group intact; blocks written for the lost group are free in its bitmap. The caller
+holds allocLock. */
+static int txg_commit(tfs_fs *fs)
 {
-    if (mountedDisk == -1)
+    if (fs->txgDirtyBlocks == 0 && !fs->superblockDirty)
     {
-        return FS_ERR_NO_FS_MOUNTED;
+        return SUCCESS;
     }
-    if (!file_table[FD].in_use)
+    if (fs->superBlock.bitmap_blocks == 0)
     {
-        printf("Attempted delete on a file not in use.\n");
-        return FS_ERR_FILE_NOT_IN_USE;
+        RETURN_IF_ERR(commit_legacy_bitmap(fs));
+    }
+    else
+    { // a failed commit leaves the flags set: the next attempt rewrites the same blocks to the same copy
+        RETURN_IF_ERR(write_bitmap_copy(fs));
     }
+    RETURN_IF_ERR(flushCache(fs->blockCache));
+    RETURN_IF_ERR(syncDisk(fs->mountedDisk)); // the new tree is durable before anything points at it
 
-    // prevent root_dir Inode deletion
-    if (file_table[FD].inode_block == ROOT_INODE_BLOCK_NUM)
+    fs->superBlock.txg++;
+    if (fs->superBlock.bitmap_blocks != 0)
     {
-        printf("Refused to delete root directory inode.\n");
-        return FS_ERR_PROTECTED_INODE;
+        swap_bitmap_copies(fs);
     }
-
-    int cached_index = file_table[FD].inode_block;
-
-    Inode theinode = {0};
-    RETURN_IF_ERR(readBlock(mountedDisk, file_table[FD].inode_block, &theinode));
-
-    if (theinode.type != INODE_TYPE_RW_FILE)
+    fs->superBlock.features |= SB_FEATURE_COUNTERS;
+    fs->superBlock.free_blocks = fs->freeBlocks + fs->txgFreedBlocks; // as the committed bitmap has it
+    fs->superBlock.file_count = fs->fileCount;
+    if (fs->zil != NULL)
+    { // log chunks written so far describe this txg: replay starts after them. a tfs_fsync() flushing meanwhile
+      // would write records this commit covers, so flushes wait for the reset
+        fs->superBlock.zil_seq = zilQuiesce(fs->zil);
+    }
+    set_superblock_checksum(&fs->superBlock);
+    int commit_err = write_block_head(fs, SUPERBLOCK_BLOCK_NUM, &fs->superBlock);
+    if (commit_err == SUCCESS)
     {
-        printf("Invalid permissions to delete file.\n");
-        return FS_ERR_INVALID_FILE_PERMISSION;
+        commit_err = flushCache(fs->blockCache);
     }
-
-    theinode.checksum = 0; // useless but making sure first ins is invalidate checksum
-    // MAKE SURE THAT ON MOUNT, MKFS, datablock initialized include inode's direct datablock and indirect datablocks
-
-    // clear direct datablocks
-    zeroBlock(theinode.direct[0]);
-    clearBlockUsedAndUpdateBitmap(theinode.direct[0]);
-    zeroBlock(theinode.direct[1]);
-    clearBlockUsedAndUpdateBitmap(theinode.direct[1]);
-
-    // clear indirect datablock group
-    Datablock indirect_block = {0};
-    RETURN_IF_ERR(readBlock(mountedDisk, theinode.indirect, &indirect_block));
-    Block *indirect_entry = (Block *)indirect_block.data;
-    for (int i = 0; i < MAX_INDIRECT_BLOCK_POINTERS; i++)
+    if (commit_err == SUCCESS)
+    {
+        commit_err = syncDisk(fs->mountedDisk);
+    }
+    if (commit_err != SUCCESS)
     {
-        if (indirect_entry[i] != INVALID_BLOCK)
+        if (fs->superBlock.bitmap_blocks != 0)
+        {
+            swap_bitmap_copies(fs);
+        }
+        if (fs->zil != NULL)
         {
-            zeroBlock(indirect_entry[i]); // clear indirect -> datablocks
-            clearBlockUsedAndUpdateBitmap(indirect_entry[i]);
+            zilResume(fs->zil);
         }
+        return commit_err;
     }
-    zeroBlock(theinode.indirect); // clear indirect block itself | no recalc checksum because we're removing entire inode
-    clearBlockUsedAndUpdateBitmap(theinode.indirect);
-
-    zeroBlock(file_table[FD].inode_block);
-    file_table[FD].in_use = false;
-    file_table[FD].inode_block = INVALID_BLOCK;
-    file_table[FD].offset = 0;
 
+    // the new tree is the committed one: its blocks are now immutable and the group's frees reusable.
+    // blocks of the bitmap changed in this txg are still stale in the copy that is now the spare
+    for (uint32_t w = 0; fs->txgFreedBlocks > 0 && w < fs->bitmapWords; w++)
+    {
+        if (fs->txgFreed[w] != 0)
+        {
+            fs->runSummary[w / RUN_SUMMARY_WORDS].stale = true;
+        }
+    }
+    memset(fs->txgAllocated, 0, fs->bitmapWords * sizeof(uint64_t));
+    memset(fs->txgFreed, 0, fs->bitmapWords * sizeof(uint64_t));
+    fs->freeBlocks += fs->txgFreedBlocks;
+    for (uint32_t i = 0; i < fs->superBlock.bitmap_blocks; i++)
+    {
+        fs->bitmapDirty[i] = (fs->bitmapDirty[i] & BITMAP_CHANGED_OPEN) ? BITMAP_CHANGED_LAST : 0;
+    }
+    fs->txgDirtyBlocks = 0;
+    fs->txgFreedBlocks = 0;
+    fs->superblockDirty = false;
+    if (fs->zil != NULL)
+    {
+        zilReset(fs->zil);
+    }
+    __atomic_store_n(&fs->zilGap, false, __ATOMIC_RELEASE);
     return SUCCESS;
 }
 
-/* reads one byte from the file and copies it to ‘buffer’, using the current file pointer location and incrementing it by one upon success.
-If the file pointer is already at the end of the file then tfs_readByte() should return an error and not increment the file pointer. */
-int tfs_readByte(fileDescriptor FD, char *buffer)
+// ends every mutating operation: commits the open txg once it is txgTimeoutMs old or txgMaxDirty blocks big
+static int txg_op_done(tfs_fs *fs)
 {
-    if (mountedDisk == -1)
+    if (fs->txgDirtyBlocks == 0 || fs->zilReplaying)
     {
-        return FS_ERR_NO_FS_MOUNTED;
+        return SUCCESS;
     }
-    if (!file_table[FD].in_use)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t age_ms = (int64_t)(now.tv_sec - fs->txgOpened.tv_sec) * 1000 + (now.tv_nsec - fs->txgOpened.tv_nsec) / 1000000;
+    if (fs->txgDirtyBlocks >= fs->options.txgMaxDirty || age_ms >= (int64_t)fs->options.txgTimeoutMs)
     {
-        printf("Attempted read on a file not in use.\n");
-        return FS_ERR_FILE_NOT_IN_USE;
+        return txg_commit(fs);
     }
+    return SUCCESS;
+}
 
-    // get Inode block
-    Inode theinode = {0};
-    RETURN_IF_ERR(readBlock(mountedDisk, file_table[FD].inode_block, &theinode));
+// resets the open txg to empty, for a freshly mounted tree
+static void txg_reset(tfs_fs *fs)
+{
+    memset(fs->txgAllocated, 0, fs->bitmapWords * sizeof(uint64_t));
+    memset(fs->txgFreed, 0, fs->bitmapWords * sizeof(uint64_t));
+    fs->txgDirtyBlocks = 0;
+    fs->txgFreedBlocks = 0;
+}
 
-    if (file_table[FD].offset >= theinode.size)
+// records a finished operation on <path> (and <new_path>, for a rename) in the intent log. the operation already
+// happened, so a record that doesn't fit only means tfs_fsync() has to fall back to committing the txg
+static void log_intent(tfs_fs *fs, IntentType type, const char *path, const char *new_path, uint32_t offset, const void *payload, uint32_t length)
+{
+    if (fs->zil == NULL || fs->zilReplaying || __atomic_load_n(&fs->zilGap, __ATOMIC_ACQUIRE))
     {
-        printf("tfs_readbyte() EOF reached.\n");
-        return FS_ERR_READ_EOF;
-    }
-
-    int datablock_depth = file_table[FD].offset / DATABLOCK_DATA_SIZE;
-    int datablock_offset = file_table[FD].offset % DATABLOCK_DATA_SIZE;
-    if (datablock_depth < 2)
-    { // one of the two data blocks
-        char internal_buf[BLOCK_SIZE] = {0};
-        RETURN_IF_ERR(readBlock(mountedDisk, theinode.direct[datablock_depth], &internal_buf));
-        *buffer = internal_buf[datablock_offset];
+        return;
     }
-    else
-    { // inside indirect block -> datablock
-        Datablock indirect_block = {0};
-        RETURN_IF_ERR(readBlock(mountedDisk, theinode.indirect, &indirect_block));
-
-        Block *indirect_entry = (Block *)indirect_block.data;
-        if ((datablock_depth - 2) >= MAX_INDIRECT_BLOCK_POINTERS || indirect_entry[datablock_depth - 2] == INVALID_BLOCK) // check datablock still valid
+    uint8_t head[sizeof(IntentRecord) + 2 * (TFS_MAX_PATH + 1)];
+    IntentRecord record = {0};
+    record.type = type;
+    record.offset = offset;
+    uint32_t head_length = sizeof(record);
+    memcpy(head, &record, sizeof(record));
+    for (int i = 0; i < 2; i++)
+    {
+        const char *name = i == 0 ? path : new_path;
+        if (name != NULL)
         {
-            return FS_ERR_READ_EOF;
+            memcpy(head + head_length, name, strlen(name) + 1);
+            head_length += strlen(name) + 1;
         }
-        int datablock_num = indirect_entry[datablock_depth - 2];
-        char internal_buf[BLOCK_SIZE] = {0};
-        RETURN_IF_ERR(readBlock(mountedDisk, datablock_num, &internal_buf));
-        *buffer = internal_buf[datablock_offset];
     }
-
-    file_table[FD].offset++;
-    return SUCCESS;
-}
-
-/* change the file pointer location to offset (absolute). Returns success/error codes.*/
-int tfs_seek(fileDescriptor FD, int offset)
-{
-    if (mountedDisk == -1)
+    if (zilAppend(fs->zil, head, head_length, payload, length, NULL) != SUCCESS)
     {
-        return FS_ERR_NO_FS_MOUNTED;
+        __atomic_store_n(&fs->zilGap, true, __ATOMIC_RELEASE);
     }
+}
 
-    if (!file_table[FD].in_use)
+// log_intent() for an operation on dentry <id>, named by its path. dirLock held
+static void log_dentry_intent(tfs_fs *fs, IntentType type, int id, uint32_t offset, const void *payload, uint32_t length)
+{
+    char path[TFS_MAX_PATH + 1];
+    if (!dentry_path(fs, id, path))
     {
-        printf("Attempted read on a file not in use.\n");
-        return FS_ERR_FILE_NOT_IN_USE;
+        __atomic_store_n(&fs->zilGap, true, __ATOMIC_RELEASE); // moved too deep to log by path
+        return;
     }
+    log_intent(fs, type, path, NULL, offset, payload, length);
+}
 
-    Inode buffer_block = {0};
-    RETURN_IF_ERR(readBlock(mountedDisk, file_table[FD].inode_block, &buffer_block));
+// log_intent() for an operation on the file open as <FD>
+static void log_descriptor_intent(tfs_fs *fs, IntentType type, fileDescriptor FD, uint32_t offset, const void *payload, uint32_t length)
+{
+    pthread_mutex_lock(&fs->dirLock);
+    log_dentry_intent(fs, type, file_entry(fs, FD)->dir_slot, offset, payload, length);
+    pthread_mutex_unlock(&fs->dirLock);
+}
 
-    if (offset < 0 || offset >= buffer_block.size)
+// takes the NUL-terminated path at the start of <*data> (<*length> bytes) into <path>
+static int take_record_path(const char **data, uint32_t *length, char *path)
+{
+    size_t path_length = strnlen(*data, *length);
+    if (path_length == *length || path_length > TFS_MAX_PATH)
     {
-        return FS_ERR_INVALID_OFFSET;
+        return FS_ERR_CORRUPT_LOG_RECORD;
     }
-
-    file_table[FD].offset = offset;
+    memcpy(path, *data, path_length + 1);
+    *data += path_length + 1;
+    *length -= path_length + 1;
     return SUCCESS;
 }
 
-int tfs_rename(const char *old_name, const char *new_name)
+// re-runs one logged operation through the public API during tfs_mount()
+static int replay_intent(const void *data, uint32_t length, void *arg)
 {
-    if (mountedDisk == -1)
+    tfs_fs *fs = arg;
+    IntentRecord record;
+    if (length < sizeof(record))
     {
-        return FS_ERR_NO_FS_MOUNTED;
+        return FS_ERR_CORRUPT_LOG_RECORD;
     }
-
-    if (strlen(new_name) > 8 || old_name == NULL || new_name == NULL)
+    memcpy(&record, data, sizeof(record));
+    const char *payload = (const char *)data + sizeof(record);
+    uint32_t payload_length = length - sizeof(record);
+    char name[TFS_MAX_PATH + 1];
+    char new_name[TFS_MAX_PATH + 1];
+    RETURN_IF_ERR(take_record_path(&payload, &payload_length, name));
+    if (record.type == INTENT_RENAME)
     {
-        printf("Attempted to rename with invalid arguments.\n");
-        return FS_ERR_INVALID_FILENAME;
+        RETURN_IF_ERR(take_record_path(&payload, &payload_length, new_name));
     }
 
-    Datablock root_dir = {0};
-    RETURN_IF_ERR(readBlock(mountedDisk, ROOT_DIR_DATA_BLOCK_NUM, &root_dir)); // statically accesses root_dir
-    DirectoryEntry *entries = (DirectoryEntry *)root_dir.data;
+    switch (record.type)
+    {
+    case INTENT_RENAME:
+        return tfs_rename2(fs, name, new_name);
+    case INTENT_MAKE_RO:
+        return tfs_makeRO2(fs, name);
+    case INTENT_MAKE_RW:
+        return tfs_makeRW2(fs, name);
+    case INTENT_MKDIR:
+        return tfs_mkdir2(fs, name);
+    case INTENT_CREATE:
+    case INTENT_WRITE:
+    case INTENT_PWRITE:
+    case INTENT_TRUNCATE:
+    case INTENT_DELETE:
+        break;
+    default:
+        return FS_ERR_CORRUPT_LOG_RECORD;
+    }
 
-    bool found = false;
-    for (int i = 0; i < MAX_DIRECTORY_SIZE; i++)
+    fileDescriptor fd = tfs_open2(fs, name); // creates the file for INTENT_CREATE
+    if (fd < 0)
     {
-        if (entries[i].inode_block != INVALID_BLOCK && strcmp(entries[i].name, old_name) == 0)
-        {
-            strncpy(entries[i].name, new_name, sizeof(entries[i].name));
-            entries[i].name[7] = '\0';
-            found = true;
-            break;
-        }
+        return fd;
     }
-    if (!found)
+    int replay_err = SUCCESS;
+    if (record.type == INTENT_WRITE)
     {
-        printf("Filename not found in tfs_rename()\n");
-        return FS_ERR_FILE_NOT_FOUND;
+        replay_err = tfs_write2(fs, fd, payload, (int)payload_length);
     }
-
-    set_datablock_checksum(&root_dir);
-    RETURN_IF_ERR(writeBlock(mountedDisk, ROOT_DIR_DATA_BLOCK_NUM, &root_dir));
-    return SUCCESS;
+    else if (record.type == INTENT_PWRITE)
+    {
+        replay_err = record.offset > INT_MAX ? FS_ERR_CORRUPT_LOG_RECORD : tfs_pwrite2(fs, fd, (int)record.offset, payload, (int)payload_length);
+    }
+    else if (record.type == INTENT_TRUNCATE)
+    {
+        replay_err = record.offset > INT_MAX ? FS_ERR_CORRUPT_LOG_RECORD : tfs_truncate2(fs, fd, (int)record.offset);
+    }
+    else if (record.type == INTENT_DELETE)
+    {
+        replay_err = tfs_delete2(fs, fd);
+        if (replay_err == SUCCESS)
+        {
+            return SUCCESS; // released the descriptor
+        }
+    }
+    tfs_close2(fs, fd);
+    return replay_err;
 }
 
-int tfs_readdir(void) // only statically prints the root dir
+// pushes the descriptors from <first> to <last>, already linked through nextFree, onto the free list
+static void push_free_descriptors(tfs_fs *fs, fileDescriptor first, Descriptor *last)
 {
-    Datablock root_dir = {0};
-    RETURN_IF_ERR(readBlock(mountedDisk, ROOT_DIR_DATA_BLOCK_NUM, &root_dir)); // statically accesses root_dir
-    DirectoryEntry *entries = (DirectoryEntry *)root_dir.data;
-
-    printf("Root Directory: ");
+    uint64_t head = __atomic_load_n(&fs->freeDescriptors, __ATOMIC_ACQUIRE);
+    do
+    {
+        __atomic_store_n(&last->nextFree, (int32_t)(uint32_t)head, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&fs->freeDescriptors, &head, free_list_head(first, (uint32_t)(head >> 32) + 1),
+                                          true, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
 
-    for (int i = 0; i < MAX_DIRECTORY_SIZE; i++)
+// takes a descriptor off the free list, -1 if it is empty. the tag makes a head that was popped and pushed
+// back meanwhile (its nextFree read here may be stale) fail the exchange
+static fileDescriptor pop_free_descriptor(tfs_fs *fs)
+{
+    uint64_t head = __atomic_load_n(&fs->freeDescriptors, __ATOMIC_ACQUIRE);
+    while ((int32_t)(uint32_t)head != -1)
     {
-        if (entries[i].inode_block != INVALID_BLOCK)
+        fileDescriptor fd = (int32_t)(uint32_t)head;
+        int32_t next = __atomic_load_n(&find_descriptor(fs, fd)->nextFree, __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&fs->freeDescriptors, &head, free_list_head(next, (uint32_t)(head >> 32) + 1),
+                                        true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
         {
-            printf(" - %s\n", entries[i].name);
+            return fd;
         }
     }
-
-    return SUCCESS;
+    return -1;
 }
 
-int tfs_makeRO(const char *name)
-{ // admin level action
-    if (mountedDisk == -1)
+// adds a chunk of FILE_TABLE_CHUNK descriptors to the free list, unless another thread just did
+static int grow_file_table(tfs_fs *fs)
+{
+    int grow_err = SUCCESS;
+    pthread_mutex_lock(&fs->fileTableLock);
+    if ((int32_t)(uint32_t)__atomic_load_n(&fs->freeDescriptors, __ATOMIC_ACQUIRE) != -1)
     {
-        return FS_ERR_NO_FS_MOUNTED;
+        pthread_mutex_unlock(&fs->fileTableLock);
+        return SUCCESS;
     }
-
-    if (name == NULL || strlen(name) > 8)
+    Descriptor *chunk = NULL;
+    if (fs->fileChunkCount == MAX_OPEN_FILES / FILE_TABLE_CHUNK)
     {
-        printf("Invalid filename argument in tfs_makeRO().\n");
-        return FS_ERR_INVALID_FILENAME;
+        grow_err = FS_ERR_FILE_TABLE_FULL;
     }
-
-    Datablock root_dir = {0};
-    RETURN_IF_ERR(readBlock(mountedDisk, ROOT_DIR_DATA_BLOCK_NUM, &root_dir)); // statically accesses root_dir
-    DirectoryEntry *entries = (DirectoryEntry *)root_dir.data;
-
-    bool found = false;
-    for (int i = 0; i < MAX_DIRECTORY_SIZE; i++)
+    else if ((chunk = calloc(FILE_TABLE_CHUNK, sizeof(Descriptor))) == NULL)
+    {
+        grow_err = SYSTEM_ERROR;
+    }
+    else
     {
-        if (entries[i].inode_block != INVALID_BLOCK && strcmp(entries[i].name, name) == 0)
+        fileDescriptor base = fs->fileChunkCount * FILE_TABLE_CHUNK;
+        for (int i = 0; i < FILE_TABLE_CHUNK; i++)
         {
-            //
-            Inode theinode;
-            RETURN_IF_ERR(readBlock(mountedDisk, entries[i].inode_block, &theinode));
-            theinode.type = INODE_TYPE_RO_FILE;
-            set_inode_checksum(&theinode);
-            RETURN_IF_ERR(writeBlock(mountedDisk, entries[i].inode_block, &theinode));
-            found = true;
-            return SUCCESS;
+            pthread_mutex_init(&chunk[i].lock, NULL);
+            chunk[i].file.dir_slot = -1;
+            chunk[i].file.data_block = INVALID_BLOCK;
+            chunk[i].nextFree = base + i + 1; // lowest first, like the fixed table handed them out
         }
+        __atomic_store_n(&fs->fileChunks[fs->fileChunkCount++], chunk, __ATOMIC_RELEASE);
+        push_free_descriptors(fs, base, &chunk[FILE_TABLE_CHUNK - 1]);
     }
-    printf("Filename not found in tfs_makeRO()\n");
-    return FS_ERR_FILE_NOT_FOUND;
+    pthread_mutex_unlock(&fs->fileTableLock);
+    return grow_err;
 }
 
-int tfs_makeRW(const char *name)
-{ // admin level action
-    if (mountedDisk == -1)
+// claims a descriptor on the file of dentry <file_slot>, pinning it. the caller holds dirLock, so the dentry's
+// incarnation can't move on. no other thread may use the descriptor before tfs_open() hands it out
+static fileDescriptor add_file_descriptor(tfs_fs *fs, int file_slot)
+{
+    fileDescriptor fd;
+    while ((fd = pop_free_descriptor(fs)) == -1)
     {
-        return FS_ERR_NO_FS_MOUNTED;
+        RETURN_IF_ERR(grow_file_table(fs));
     }
+    FileTableEntry *entry = file_entry(fs, fd);
+    entry->dir_slot = file_slot;
+    entry->incarnation = dentry(fs, file_slot)->incarnation;
+    dentry_hold(fs, file_slot);
+    entry->offset = 0;
+    entry->inode_valid = false;
+    entry->map_valid = false;
+    entry->data_block = INVALID_BLOCK;
+    entry->ra_last = UINT32_MAX;
+    entry->ra_window = 0;
+    entry->ra_issued = 0;
+    __atomic_store_n(&entry->in_use, true, __ATOMIC_RELEASE);
+    return fd;
+}
 
-    if (name == NULL || strlen(name) > 8)
-    {
-        printf("Invalid filename argument in tfs_makeRW().\n");
-        return FS_ERR_INVALID_FILENAME;
-    }
+// <type> in the same format (legacy, extent, inline) made read-only or read-write
+static uint8_t inode_type_with_permission(uint8_t type, bool writable)
+{
+    if (INODE_HAS_EXTENTS(type))
+        return writable ? INODE_TYPE_EXTENT_RW_FILE : INODE_TYPE_EXTENT_RO_FILE;
+    if (INODE_IS_INLINE(type))
+        return writable ? INODE_TYPE_INLINE_RW_FILE : INODE_TYPE_INLINE_RO_FILE;
+    return writable ? INODE_TYPE_RW_FILE : INODE_TYPE_RO_FILE;
+}
 
-    Datablock root_dir = {0};
-    RETURN_IF_ERR(readBlock(mountedDisk, ROOT_DIR_DATA_BLOCK_NUM, &root_dir)); // statically accesses root_dir
-    DirectoryEntry *entries = (DirectoryEntry *)root_dir.data;
+// frees table entry <FD> along with its decoded extent map and block buffer. the caller holds its descriptor lock
+static void release_file_descriptor(tfs_fs *fs, fileDescriptor FD)
+{
+    Descriptor *descriptor = find_descriptor(fs, FD);
+    FileTableEntry *entry = &descriptor->file;
+    pthread_mutex_lock(&fs->dirLock);
+    dentry_put(fs, entry->dir_slot);
+    pthread_mutex_unlock(&fs->dirLock);
+    entry->dir_slot = -1;
+    entry->offset = 0;
+    entry->map_valid = false;
+    free(entry->extent_map);
+    entry->extent_map = NULL;
+    entry->extent_count = 0;
+    free(entry->data);
+    entry->data = NULL;
+    entry->data_block = INVALID_BLOCK;
+    __atomic_store_n(&entry->in_use, false, __ATOMIC_RELEASE);
+    push_free_descriptors(fs, FD, descriptor); // last: tfs_open() may hand it out again right away
+}
 
-    bool found = false;
-    for (int i = 0; i < MAX_DIRECTORY_SIZE; i++)
+// drops the cached inode/map/data block of every descriptor open on the file of dentry <file_slot> except <keep>
+// (-1 for none): each notices the new generation at its next access. the caller holds the file's lock exclusive
+static void invalidate_descriptors(tfs_fs *fs, int file_slot, fileDescriptor keep)
+{
+    uint32_t generation = ++dentry(fs, file_slot)->generation;
+    if (keep != -1)
     {
-        if (entries[i].inode_block != INVALID_BLOCK && strcmp(entries[i].name, name) == 0)
-        {
-            //
-            Inode theinode;
-            RETURN_IF_ERR(readBlock(mountedDisk, entries[i].inode_block, &theinode));
-            theinode.type = INODE_TYPE_RW_FILE;
-            set_inode_checksum(&theinode);
-            RETURN_IF_ERR(writeBlock(mountedDisk, entries[i].inode_block, &theinode));
-            found = true;
-            return SUCCESS;
-        }
+        file_entry(fs, keep)->generation = generation;
     }
-    printf("Filename not found in tfs_makeRW()\n");
-    return FS_ERR_FILE_NOT_FOUND;
 }
 
-int tfs_writeByte(fileDescriptor FD, int offset, const unsigned char data)
+// drops what descriptor <FD> cached from an older generation of its file
+static void check_descriptor_generation(tfs_fs *fs, fileDescriptor FD)
 {
-    if (mountedDisk == -1)
-    {
-        return FS_ERR_NO_FS_MOUNTED;
-    }
-    if (!file_table[FD].in_use)
+    FileTableEntry *entry = file_entry(fs, FD);
+    uint32_t generation = dentry(fs, entry->dir_slot)->generation;
+    if (entry->generation != generation)
     {
-        printf("Attempted write on a file not in use.\n");
-        return FS_ERR_FILE_NOT_IN_USE;
+        entry->inode_valid = false;
+        entry->map_valid = false;
+        entry->data_block = INVALID_BLOCK;
+        entry->ra_issued = 0; // the blocks fetched ahead may have moved
+        entry->generation = generation;
     }
+}
 
-    // get Inode block
-    Inode theinode = {0};
-    RETURN_IF_ERR(readBlock(mountedDisk, file_table[FD].inode_block, &theinode));
+// block of the inode of the file open as <FD>: the dentry follows it as the open txg moves it
+static uint32_t descriptor_inode_block(tfs_fs *fs, fileDescriptor FD)
+{
+    return dentry(fs, file_entry(fs, FD)->dir_slot)->inode_block;
+}
 
-    if (theinode.type != INODE_TYPE_RW_FILE)
+// a change to the file (its lock held exclusive) waits out tfs_submit_read()s still fetching its blocks:
+// they hold no lock while libDisk reads, and the change could free or rewrite those blocks under them
+static void wait_for_async_reads(tfs_fs *fs, Dentry *slot)
+{
+    if (__atomic_load_n(&slot->asyncReads, __ATOMIC_ACQUIRE) == 0)
     {
-        printf("Invalid permissions to write to file.\n");
-        return FS_ERR_INVALID_FILE_PERMISSION;
+        return; // none can start while the lock is held exclusive
     }
-
-    if (offset >= theinode.size || offset < 0)
+    pthread_mutex_lock(&fs->asyncLock);
+    while (slot->asyncReads > 0)
     {
-        printf("Attempted tfs_writebyte() from EOF.\n");
-        return FS_ERR_READ_EOF;
+        pthread_cond_wait(&fs->asyncChanged, &fs->asyncLock);
     }
+    pthread_mutex_unlock(&fs->asyncLock);
+}
 
-    int datablock_depth = offset / DATABLOCK_DATA_SIZE;
-    int datablock_offset = offset % DATABLOCK_DATA_SIZE;
-
-    if (datablock_depth < 2)
-    { // one of the two data blocks
-        char internal_buf[BLOCK_SIZE] = {0};
-        RETURN_IF_ERR(readBlock(mountedDisk, theinode.direct[datablock_depth], &internal_buf));
-        internal_buf[datablock_offset] = data;
-        set_datablock_checksum((Datablock *)internal_buf);
-        RETURN_IF_ERR(writeBlock(mountedDisk, theinode.direct[datablock_depth], &internal_buf));
+// locks descriptor <FD> and the lock of the file it is open on, shared or <exclusive>.
+// FS_ERR_FILE_NOT_IN_USE, with nothing left locked, if it isn't open or its file was deleted
+static int lock_descriptor(tfs_fs *fs, fileDescriptor FD, bool exclusive)
+{
+    Descriptor *descriptor = find_descriptor(fs, FD);
+    if (descriptor == NULL)
+    {
+        return FS_ERR_ACCESSED_OUT_OF_FILE_TABLE_RANGE;
     }
-    else
-    { // inside indirect block -> datablock
-        Datablock indirect_block = {0};
-        RETURN_IF_ERR(readBlock(mountedDisk, theinode.indirect, &indirect_block));
-
-        Block *indirect_entry = (Block *)indirect_block.data;
-        if ((datablock_depth - 2) >= MAX_INDIRECT_BLOCK_POINTERS || indirect_entry[datablock_depth - 2] == INVALID_BLOCK) // check datablock still valid
+    pthread_mutex_lock(&descriptor->lock);
+    FileTableEntry *entry = &descriptor->file;
+    if (__atomic_load_n(&entry->in_use, __ATOMIC_ACQUIRE))
+    {
+        Dentry *slot = dentry(fs, entry->dir_slot);
+        if (exclusive)
+            pthread_rwlock_wrlock(&slot->lock);
+        else
+            pthread_rwlock_rdlock(&slot->lock);
+        if (slot->incarnation == entry->incarnation)
         {
-            return FS_ERR_READ_EOF;
+            if (exclusive)
+            {
+                wait_for_async_reads(fs, slot);
+            }
+            return SUCCESS;
         }
-        int datablock_num = indirect_entry[datablock_depth - 2];
-        char internal_buf[BLOCK_SIZE] = {0};
-        RETURN_IF_ERR(readBlock(mountedDisk, datablock_num, &internal_buf));
-        internal_buf[datablock_offset] = data;
-        set_datablock_checksum((Datablock *)internal_buf);
-        RETURN_IF_ERR(writeBlock(mountedDisk, datablock_num, &internal_buf));
+        pthread_rwlock_unlock(&slot->lock);
     }
+    pthread_mutex_unlock(&descriptor->lock);
+    return FS_ERR_FILE_NOT_IN_USE;
+}
 
-    // doesn't auto increment offset like readByte
-    return SUCCESS;
-}
\ No newline at end of file
+static void unlock_descriptor(tfs_fs *fs, fileDescriptor FD)
+{
+    Descriptor *descriptor = find_descriptor(fs, FD);
+    pthread_rwlock_unlock(&dentry(fs, descriptor->file.dir_slot)->lock);
+    pthread_mutex_unlock(&descriptor->lock);
+}
+
+// lock_descriptor() for an operation changing the file: exclusive, then allocLock for the blocks and the txg
+static int lock_descriptor_for_change(tfs_fs *fs, fileDescriptor FD)
+{
+    RETURN_IF_ERR(lock_descriptor(fs, FD, true));
+    pthread_mutex_lock(&fs->allocLock);
+    return SUCCESS;
+}
+
+static void unlock_descriptor_for_change(tfs_fs *fs, fileDescriptor FD)
+{
+    pthread_mutex_unlock(&fs->allocLock);
+    unlock_descriptor(fs, FD);
+}
+
+// makes sure the inode cached by <FD> is the file's inode
+static int load_descriptor_inode(tfs_fs *fs, fileDescriptor FD)
+{
+    FileTableEntry *entry = file_entry(fs, FD);
+    check_descriptor_generation(fs, FD);
+    if (!entry->inode_valid)
+    {
+        RETURN_IF_ERR(read_block_head(fs, descriptor_inode_block(fs, FD), &entry->inode));
+        entry->inode_valid = true;
+    }
+    return SUCCESS;
+}
+
+// makes sure the extent_map of <FD> holds the file's data runs: the extent tree flattened,
+// or a legacy inode's direct and indirect pointers as one-block runs
+static int load_descriptor_map(tfs_fs *fs, fileDescriptor FD)
+{
+    FileTableEntry *entry = file_entry(fs, FD);
+    check_descriptor_generation(fs, FD);
+    if (entry->map_valid)
+    {
+        return SUCCESS;
+    }
+    RETURN_IF_ERR(load_descriptor_inode(fs, FD));
+
+    ExtentList runs = {0};
+    ExtentList nodes = {0};
+    int collect_err = collect_inode_blocks(fs, &entry->inode, &runs, &nodes);
+    free(nodes.items);
+    if (collect_err != SUCCESS)
+    {
+        free(runs.items);
+        return collect_err;
+    }
+    free(entry->extent_map);
+    entry->extent_map = runs.items;
+    entry->extent_count = runs.count;
+    entry->map_valid = true;
+    return SUCCESS;
+}
+
+// block number of the file's <depth>th data block (map must be loaded), INVALID_BLOCK past the mapped range
+static uint32_t descriptor_block(tfs_fs *fs, fileDescriptor FD, int depth)
+{ // binary search for the run covering <depth>
+    const Extent *runs = file_entry(fs, FD)->extent_map;
+    uint32_t lo = 0, hi = file_entry(fs, FD)->extent_count;
+    while (depth >= 0 && lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if ((uint32_t)depth < runs[mid].logical)
+            hi = mid;
+        else if ((uint32_t)depth >= runs[mid].logical + runs[mid].length)
+            lo = mid + 1;
+        else
+            return runs[mid].start + ((uint32_t)depth - runs[mid].logical);
+    }
+    return INVALID_BLOCK;
+}
+
+// the data buffer of <FD>, allocated (one block) on first use
+static uint8_t *descriptor_buffer(tfs_fs *fs, fileDescriptor FD)
+{
+    if (file_entry(fs, FD)->data == NULL)
+    {
+        file_entry(fs, FD)->data = malloc(fs->fsBlockSize);
+    }
+    return file_entry(fs, FD)->data;
+}
+
+// makes sure the data buffer of <FD> holds data block <datablock_num>
+static int load_descriptor_data(tfs_fs *fs, fileDescriptor FD, uint32_t datablock_num)
+{
+    FileTableEntry *entry = file_entry(fs, FD);
+    check_descriptor_generation(fs, FD);
+    if (entry->data_block != datablock_num)
+    {
+        entry->data_block = INVALID_BLOCK;
+        if (descriptor_buffer(fs, FD) == NULL)
+        {
+            return SYSTEM_ERROR;
+        }
+        RETURN_IF_ERR(cacheRead(fs->blockCache, datablock_num, entry->data));
+        entry->data_block = datablock_num;
+    }
+    return SUCCESS;
+}
+
+// sequential-read detection for <FD> (map loaded), which reads data blocks <first>..<last> by depth. a read that
+// stays on the last block or moves on to the next keeps a streak going: once the reader is halfway through the
+// blocks fetched ahead, the next window of them is handed to cachePrefetch() and the window doubles.
+// any other read ends the streak. readahead is only a hint, so failures are ignored
+static void readahead(tfs_fs *fs, fileDescriptor FD, uint32_t first, uint32_t last)
+{
+    FileTableEntry *entry = file_entry(fs, FD);
+    uint32_t max_window = fs->options.readaheadBytes / fs->fsBlockSize;
+    if (max_window == 0)
+    {
+        return; // readahead off
+    }
+    if (first != entry->ra_last && first != entry->ra_last + 1)
+    {
+        entry->ra_window = 0;
+        entry->ra_issued = 0;
+    }
+    else if (entry->ra_window == 0 && first != entry->ra_last)
+    {
+        entry->ra_window = READAHEAD_MIN_BLOCKS < max_window ? READAHEAD_MIN_BLOCKS : max_window;
+    }
+    entry->ra_last = last;
+    if (entry->ra_window == 0)
+    {
+        return;
+    }
+
+    uint32_t ahead = last + 1;
+    uint32_t from = entry->ra_issued > ahead ? entry->ra_issued : ahead;
+    if (from - ahead > entry->ra_window / 2)
+    {
+        return; // still well ahead of the reader
+    }
+    uint32_t file_blocks = (entry->inode.size + fs->fsDataSize - 1) / fs->fsDataSize;
+    uint32_t to = ahead + entry->ra_window < file_blocks ? ahead + entry->ra_window : file_blocks;
+    if (from >= to)
+    {
+        return;
+    }
+    int *block_nums = malloc((to - from) * sizeof(int));
+    if (block_nums == NULL)
+    {
+        return;
+    }
+    int count = 0;
+    for (uint32_t depth = from; depth < to; depth++)
+    {
+        uint32_t block = descriptor_block(fs, FD, (int)depth);
+        if (block == INVALID_BLOCK)
+            break;
+        block_nums[count++] = (int)block;
+    }
+    int taken = cachePrefetch(fs->blockCache, count, block_nums);
+    free(block_nums);
+    if (taken > 0)
+    {
+        entry->ra_issued = from + (uint32_t)taken;
+        entry->ra_window = entry->ra_window * 2 < max_window ? entry->ra_window * 2 : max_window;
+    }
+}
+
+static int extent_list_push(ExtentList *list, Extent extent)
+{
+    if (list->count == list->capacity)
+    {
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 16;
+        Extent *items = realloc(list->items, capacity * sizeof(Extent));
+        if (items == NULL)
+        {
+            return SYSTEM_ERROR;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = extent;
+    return SUCCESS;
+}
+
+// appends every data run below <header>/<entries> to <runs> in logical order,
+// and every extent node block visited to <nodes> (if given)
+static int collect_extents(tfs_fs *fs, const ExtentHeader *header, const Extent *entries, int max_entries, ExtentList *runs, ExtentList *nodes)
+{
+    if (header->count > max_entries || header->depth > EXTENT_MAX_DEPTH)
+    {
+        printf("Corrupt extent tree header.\n");
+        return FS_ERR_CORRUPT_EXTENT_TREE;
+    }
+    for (int i = 0; i < header->count; i++)
+    {
+        if (header->depth == 0)
+        {
+            RETURN_IF_ERR(extent_list_push(runs, entries[i]));
+            continue;
+        }
+        uint8_t node[fs->fsBlockSize];
+        RETURN_IF_ERR(cacheRead(fs->blockCache, entries[i].start, node));
+        if (!verify_block_checksum(node, fs->fsBlockSize))
+        {
+            printf("Extent node checksum failed.\n");
+            return FS_ERR_DATABLOCK_CHECKSUM_FAILED;
+        }
+        ExtentHeader child;
+        Extent child_entries[EXTENT_NODE_SLOTS(fs->fsBlockSize)];
+        memcpy(&child, node, sizeof(child));
+        memcpy(child_entries, node + sizeof(ExtentHeader), sizeof(child_entries));
+        if (child.depth + 1 != header->depth)
+        {
+            printf("Corrupt extent tree depth.\n");
+            return FS_ERR_CORRUPT_EXTENT_TREE;
+        }
+        if (nodes != NULL)
+        {
+            RETURN_IF_ERR(extent_list_push(nodes, (Extent){entries[i].logical, entries[i].start, 1}));
+        }
+        RETURN_IF_ERR(collect_extents(fs, &child, child_entries, EXTENT_NODE_SLOTS(fs->fsBlockSize), runs, nodes));
+    }
+    return SUCCESS;
+}
+
+// every block <inode> owns besides itself: data runs in <runs>, indirect/extent node blocks in <nodes>
+static int collect_inode_blocks(tfs_fs *fs, const Inode *inode, ExtentList *runs, ExtentList *nodes)
+{
+    if (INODE_HAS_EXTENTS(inode->type))
+    {
+        return collect_extents(fs, &inode->extent_header, inode->extents, INODE_EXTENT_SLOTS, runs, nodes);
+    }
+    if (INODE_IS_INLINE(inode->type))
+    {
+        return SUCCESS; // the data lives in the inode
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        if (inode->direct[i] != INVALID_BLOCK)
+        {
+            RETURN_IF_ERR(extent_list_push(runs, (Extent){i, inode->direct[i], 1}));
+        }
+    }
+    if (inode->indirect != INVALID_BLOCK)
+    {
+        _Alignas(uint32_t) uint8_t indirect_block[fs->fsBlockSize];
+        RETURN_IF_ERR(cacheRead(fs->blockCache, inode->indirect, indirect_block));
+        Block *indirect_entry = (Block *)indirect_block;
+        for (uint32_t i = 0; i < MAX_INDIRECT_BLOCK_POINTERS(fs->fsBlockSize); i++)
+        {
+            if (indirect_entry[i] != INVALID_BLOCK)
+            {
+                RETURN_IF_ERR(extent_list_push(runs, (Extent){2 + i, indirect_entry[i], 1}));
+            }
+        }
+        RETURN_IF_ERR(extent_list_push(nodes, (Extent){0, inode->indirect, 1}));
+    }
+    return SUCCESS;
+}
+
+// extent node blocks needed to index <num_runs> data runs
+static uint32_t extent_tree_nodes(tfs_fs *fs, uint32_t num_runs)
+{
+    uint32_t nodes = 0;
+    while (num_runs > INODE_EXTENT_SLOTS)
+    {
+        num_runs = (num_runs + EXTENT_NODE_SLOTS(fs->fsBlockSize) - 1) / EXTENT_NODE_SLOTS(fs->fsBlockSize);
+        nodes += num_runs;
+    }
+    return nodes;
+}
+
+// blocks an operation may allocate for data: free ones, less what a commit needs to copy metadata
+static uint32_t count_free_blocks(tfs_fs *fs)
+{
+    uint32_t free_blocks = fs->freeBlocks;
+    return free_blocks > TXG_RESERVED_BLOCKS ? free_blocks - TXG_RESERVED_BLOCKS : 0;
+}
+
+// checks that <need> blocks can be allocated, <reclaimable> of them from blocks the operation frees that the open
+// txg allocated. committed blocks freed by the open txg only come back once it commits, so it commits early if that helps
+static int reserve_blocks(tfs_fs *fs, uint32_t need, uint32_t reclaimable)
+{
+    if (need > count_free_blocks(fs) + reclaimable && fs->txgFreedBlocks > 0 && !fs->zilReplaying)
+    {
+        RETURN_IF_ERR(txg_commit(fs));
+        reclaimable = 0; // committed now, so freeing them is deferred too
+    }
+    if (need > count_free_blocks(fs) + reclaimable)
+    {
+        printf("Attempted write larger than the free space on disk\n");
+        return FS_ERR_BITMAP_FULL;
+    }
+    return SUCCESS;
+}
+
+/* finds a run of free blocks at most <want> long for a file whose blocks should go near <goal> (INVALID_BLOCK for no
+preference: the allocation cursor): the first run from <goal> on that holds all <want> blocks, so a file continues
+its last run in place when it can and otherwise gets one contiguous extent wherever there is one. Only when no run
+within RUN_SEARCH_BLOCKS is long enough does it settle for the longest it saw, and the caller comes back for the
+rest. returns its length (0 if the disk is full) */
+static uint32_t find_free_run(tfs_fs *fs, uint32_t goal, uint32_t want, uint32_t *start)
+{
+    uint32_t block = next_free_block(fs, goal < fs->numBlocks ? goal : fs->allocCursor);
+    uint32_t best = 0;
+    *start = block;
+    for (uint32_t searched = 0; block != INVALID_BLOCK && searched < RUN_SEARCH_BLOCKS && searched < fs->numBlocks;)
+    {
+        uint32_t length = free_run_length(fs, block, want);
+        if (length > best)
+        {
+            *start = block;
+            best = length;
+            if (best == want)
+                break;
+        }
+        uint32_t next = next_free_block(fs, block + length + 1 < fs->numBlocks ? block + length + 1 : 0);
+        searched += next > block ? next - block : fs->numBlocks - block + next; // wrapping past the end counts too
+        block = next;
+    }
+    return *start == INVALID_BLOCK ? 0 : best;
+}
+
+// writes <runs> into <inode> as an extent tree, allocating and writing node blocks when they don't fit in the inode.
+// the node blocks are added to <fresh>, and released again if a later one fails
+static int store_extents(tfs_fs *fs, Inode *inode, const ExtentList *runs, ExtentList *fresh)
+{
+    Extent *level = malloc((runs->count + 1) * sizeof(Extent));
+    if (level == NULL)
+    {
+        return SYSTEM_ERROR;
+    }
+    memcpy(level, runs->items, runs->count * sizeof(Extent));
+    uint32_t count = runs->count;
+    uint16_t depth = 0;
+    const uint32_t node_slots = EXTENT_NODE_SLOTS(fs->fsBlockSize);
+    uint32_t first_node = fresh->count;
+    int store_err = SUCCESS;
+
+    while (store_err == SUCCESS && count > INODE_EXTENT_SLOTS)
+    { // pack this level into nodes, the nodes become the next level up
+        uint32_t num_nodes = (count + node_slots - 1) / node_slots;
+        for (uint32_t n = 0; store_err == SUCCESS && n < num_nodes; n++)
+        {
+            uint32_t first = n * node_slots;
+            uint32_t in_node = (count - first) < node_slots ? (count - first) : node_slots;
+            uint32_t node_block = find_free_block(fs);
+            if (node_block == INVALID_BLOCK)
+            {
+                store_err = FS_ERR_BITMAP_FULL;
+                break;
+            }
+            store_err = extent_list_push(fresh, (Extent){0, node_block, 1});
+            if (store_err != SUCCESS)
+                break;
+            setBlockUsedAndUpdateBitmap(fs, node_block);
+
+            uint8_t node[fs->fsBlockSize];
+            memset(node, 0, fs->fsBlockSize);
+            ExtentHeader header = {(uint16_t)in_node, depth};
+            memcpy(node, &header, sizeof(header));
+            memcpy(node + sizeof(ExtentHeader), &level[first], in_node * sizeof(Extent));
+            set_block_checksum(node, fs->fsBlockSize);
+            store_err = cacheWrite(fs->blockCache, node_block, node);
+            if (store_err != SUCCESS)
+                break;
+
+            const Extent *last = &level[first + in_node - 1];
+            // nodes only ever shrink the level, so it is safe to overwrite it in place
+            uint32_t logical = level[first].logical;
+            level[n] = (Extent){logical, node_block, last->logical + last->length - logical};
+        }
+        count = num_nodes;
+        depth++;
+    }
+    if (store_err != SUCCESS)
+    {
+        for (uint32_t i = first_node; i < fresh->count; i++)
+            clearBlockUsedAndUpdateBitmap(fs, fresh->items[i].start);
+        fresh->count = first_node;
+        free(level);
+        return store_err;
+    }
+
+    inode->extent_header.count = (uint16_t)count;
+    inode->extent_header.depth = depth;
+    memset(inode->extents, 0, sizeof(inode->extents));
+    memcpy(inode->extents, level, count * sizeof(Extent));
+    free(level);
+    return SUCCESS;
+}
+
+static void free_blocks(tfs_fs *fs, uint32_t start, uint32_t length)
+{
+    for (uint32_t b = 0; b < length; b++)
+    {
+        clearBlockUsedAndUpdateBitmap(fs, start + b);
+    }
+}
+
+/* the blocks a change to a file allocated (<fresh>) and the ones it stops using (<stale>), as runs. neither is
+released while the change can still fail: the inode, and the entry naming it, are written first. only then do the
+stale ones go, and after a failure the fresh ones instead, so the unchanged inode never points at a free block */
+typedef struct {
+    ExtentList fresh;
+    ExtentList stale;
+} BlockChanges;
+
+// allocates the <length> blocks at <start> for <changes>
+static int take_blocks(tfs_fs *fs, BlockChanges *changes, uint32_t start, uint32_t length)
+{
+    RETURN_IF_ERR(extent_list_push(&changes->fresh, (Extent){0, start, length}));
+    for (uint32_t b = 0; b < length; b++)
+    {
+        setBlockUsedAndUpdateBitmap(fs, start + b);
+    }
+    return SUCCESS;
+}
+
+// the stale blocks of <changes> if the change they belong to succeeded (<result>), else the fresh ones
+static void release_block_changes(tfs_fs *fs, BlockChanges *changes, int result)
+{
+    const ExtentList *unused = result == SUCCESS ? &changes->stale : &changes->fresh;
+    for (uint32_t i = 0; i < unused->count; i++)
+    {
+        free_blocks(fs, unused->items[i].start, unused->items[i].length);
+    }
+    free(changes->fresh.items);
+    free(changes->stale.items);
+    memset(changes, 0, sizeof(*changes));
+}
+
+// replaces the extent tree of <inode> with <runs>; the old node blocks become stale
+static int rewrite_extent_tree(tfs_fs *fs, Inode *inode, const ExtentList *runs, BlockChanges *changes)
+{
+    ExtentList old_runs = {0};
+    int tree_err = collect_extents(fs, &inode->extent_header, inode->extents, INODE_EXTENT_SLOTS, &old_runs, &changes->stale);
+    free(old_runs.items);
+    RETURN_IF_ERR(tree_err);
+    return store_extents(fs, inode, runs, &changes->fresh);
+}
+
+// <inode>'s data runs covering the first <num_blocks> file blocks, converting a legacy
+// direct/indirect inode to extents in memory (no data moves, unused pointer blocks become stale)
+static int load_runs_for_update(tfs_fs *fs, Inode *inode, uint32_t num_blocks, ExtentList *runs, BlockChanges *changes)
+{
+    ExtentList all = {0};
+    ExtentList nodes = {0};
+    int load_err = collect_inode_blocks(fs, inode, &all, &nodes);
+    for (uint32_t i = 0; load_err == SUCCESS && i < all.count; i++)
+    {
+        Extent run = all.items[i];
+        if (run.logical >= num_blocks)
+        {
+            if (!INODE_HAS_EXTENTS(inode->type))
+                load_err = extent_list_push(&changes->stale, run); // preallocated legacy block past EOF
+            continue;
+        }
+        Extent *last = runs->count ? &runs->items[runs->count - 1] : NULL;
+        if (last != NULL && last->logical + last->length == run.logical && last->start + last->length == run.start)
+        {
+            last->length += run.length; // legacy pointers that happen to be contiguous
+        }
+        else
+        {
+            load_err = extent_list_push(runs, run);
+        }
+    }
+    for (uint32_t i = 0; load_err == SUCCESS && !INODE_HAS_EXTENTS(inode->type) && i < nodes.count; i++)
+    {
+        load_err = extent_list_push(&changes->stale, nodes.items[i]); // the indirect block
+    }
+    if (load_err == SUCCESS && !INODE_HAS_EXTENTS(inode->type))
+    {
+        inode->type = INODE_TYPE_EXTENT_RW_FILE;
+        inode->direct[0] = INVALID_BLOCK;
+        inode->direct[1] = INVALID_BLOCK;
+        inode->indirect = INVALID_BLOCK;
+        inode->extent_header.count = 0;
+        inode->extent_header.depth = 0;
+    }
+    free(all.items);
+    free(nodes.items);
+    return load_err;
+}
+
+// moves an inline file's bytes into a newly allocated first data block and makes <inode> an extent inode
+// whose tree (the block's run, added to <runs>) is still to be stored. the block goes at the start of a free run
+// near <goal> long enough for the <want> blocks the file is growing to, where there is one
+static int spill_inline(tfs_fs *fs, Inode *inode, ExtentList *runs, uint32_t goal, uint32_t want, BlockChanges *changes)
+{
+    uint8_t block[fs->fsBlockSize];
+    memset(block, 0, fs->fsBlockSize);
+    memcpy(block, inode->inline_data, inode->size);
+    inode->type = INODE_TYPE_EXTENT_RW_FILE;
+    memset(inode->inline_data, 0, sizeof(inode->inline_data));
+    if (inode->size == 0)
+    {
+        return SUCCESS;
+    }
+    uint32_t first;
+    if (find_free_run(fs, goal, want, &first) == 0)
+    {
+        return FS_ERR_BITMAP_FULL;
+    }
+    RETURN_IF_ERR(take_blocks(fs, changes, first, 1));
+    set_block_checksum(block, fs->fsBlockSize);
+    RETURN_IF_ERR(cacheWrite(fs->blockCache, first, block));
+    return extent_list_push(runs, (Extent){0, first, 1});
+}
+
+// file block <logical>'s disk block according to <runs>, INVALID_BLOCK if unmapped
+static uint32_t run_block(const ExtentList *runs, uint32_t logical)
+{
+    for (uint32_t i = runs->count; i-- > 0;) // updates work near the end of the file
+    {
+        const Extent *run = &runs->items[i];
+        if (logical >= run->logical && logical < run->logical + run->length)
+        {
+            return run->start + (logical - run->logical);
+        }
+    }
+    return INVALID_BLOCK;
+}
+
+// pushes <run> onto <list>, extending the last run instead when <run> continues it on disk
+static int extent_list_append(ExtentList *list, Extent run)
+{
+    Extent *last = list->count ? &list->items[list->count - 1] : NULL;
+    if (last != NULL && last->logical + last->length == run.logical && last->start + last->length == run.start)
+    {
+        last->length += run.length;
+        return SUCCESS;
+    }
+    return extent_list_push(list, run);
+}
+
+// moves the blocks of file blocks [first, first + count) that the committed tree reaches to new blocks, rewriting
+// <runs> around them, placed after what precedes them or else near <goal>. the old blocks become stale (and stay
+// readable until the txg commits). sets <moved> if any did
+static int cow_runs(tfs_fs *fs, ExtentList *runs, uint32_t first, uint32_t count, uint32_t goal, bool *moved,
+                    BlockChanges *changes)
+{
+    uint32_t last = first + count;
+    ExtentList out = {0};
+    int cow_err = SUCCESS;
+    for (uint32_t i = 0; cow_err == SUCCESS && i < runs->count; i++)
+    {
+        Extent run = runs->items[i];
+        uint32_t run_end = run.logical + run.length;
+        for (uint32_t logical = run.logical; cow_err == SUCCESS && logical < run_end;)
+        {
+            uint32_t disk_block = run.start + (logical - run.logical);
+            uint32_t piece;
+            if (logical < first || logical >= last)
+            { // outside the range: kept up to where the range starts
+                piece = (logical < first && first < run_end ? first : run_end) - logical;
+                cow_err = extent_list_append(&out, (Extent){logical, disk_block, piece});
+            }
+            else if (block_is_uncommitted(fs, disk_block))
+            { // already this txg's copy
+                piece = 1;
+                cow_err = extent_list_append(&out, (Extent){logical, disk_block, 1});
+            }
+            else
+            {
+                uint32_t stop = last < run_end ? last : run_end;
+                uint32_t want = 1;
+                while (logical + want < stop && !block_is_uncommitted(fs, disk_block + want))
+                {
+                    want++;
+                }
+                Extent *tail = out.count ? &out.items[out.count - 1] : NULL;
+                uint32_t start;
+                piece = find_free_run(fs, tail ? tail->start + tail->length : goal, want, &start);
+                if (piece == 0)
+                {
+                    cow_err = FS_ERR_BITMAP_FULL;
+                    break;
+                }
+                cow_err = take_blocks(fs, changes, start, piece);
+                if (cow_err == SUCCESS)
+                    cow_err = extent_list_push(&changes->stale, (Extent){0, disk_block, piece});
+                if (cow_err == SUCCESS)
+                    cow_err = extent_list_append(&out, (Extent){logical, start, piece});
+                *moved = true;
+            }
+            logical += piece;
+        }
+    }
+    if (cow_err != SUCCESS)
+    {
+        free(out.items);
+        return cow_err;
+    }
+    free(runs->items);
+    *runs = out;
+    return SUCCESS;
+}
+
+/* stores <runs> in the extent tree of <inode> when only file blocks [lo, hi) changed: the leaf mapping them is rebuilt
+from <runs> and written, with every node above it, to new blocks (the inode's own entries change in memory), so the
+cost doesn't grow with the file's fragmentation. A leaf that outgrows its block splits in two and its parent takes the
+extra entry, splitting in turn if it has to. Falls back to rewrite_extent_tree() when the change spans more than one
+leaf or the inode itself would overflow. The old path's nodes become stale */
+static int update_extent_range(tfs_fs *fs, Inode *inode, const ExtentList *runs, uint32_t lo, uint32_t hi,
+                               BlockChanges *changes)
+{
+    const uint32_t slots = EXTENT_NODE_SLOTS(fs->fsBlockSize);
+    uint32_t depth = inode->extent_header.depth;
+    if (depth == 0 || depth > EXTENT_MAX_DEPTH)
+    {
+        return rewrite_extent_tree(fs, inode, runs, changes);
+    }
+    uint8_t *path = malloc((size_t)(depth + 1) * fs->fsBlockSize); // the path's nodes, and one to build new ones in
+    Extent *level = malloc((2 * slots + 1) * sizeof(Extent));
+    if (path == NULL || level == NULL)
+    {
+        free(path);
+        free(level);
+        return SYSTEM_ERROR;
+    }
+    uint32_t node[EXTENT_MAX_DEPTH];    // block of the path's node at height h (0: the leaf)
+    uint32_t count[EXTENT_MAX_DEPTH + 1]; // entries of the node at height h, the inode's at <depth>
+    uint32_t pos[EXTENT_MAX_DEPTH + 1]; // the path's entry in the node at height h
+    uint32_t end = UINT32_MAX;          // first file block past the leaf's span
+    const Extent *entries = inode->extents;
+    count[depth] = inode->extent_header.count;
+    int update_err = SUCCESS;
+    for (uint32_t h = depth; update_err == SUCCESS && h-- > 0;)
+    { // down to the leaf holding <lo>: in each node, the last entry starting at or before it
+        uint32_t p = 0;
+        while (p + 1 < count[h + 1] && entries[p + 1].logical <= lo)
+        {
+            p++;
+        }
+        pos[h + 1] = p;
+        if (p + 1 < count[h + 1] && entries[p + 1].logical < end)
+        {
+            end = entries[p + 1].logical;
+        }
+        node[h] = entries[p].start;
+        uint8_t *block = path + (size_t)h * fs->fsBlockSize;
+        update_err = cacheRead(fs->blockCache, node[h], block);
+        ExtentHeader header;
+        memcpy(&header, block, sizeof(header));
+        if (update_err == SUCCESS &&
+            (!verify_block_checksum(block, fs->fsBlockSize) || header.depth != h || header.count == 0 || header.count > slots))
+        {
+            printf("Corrupt extent node.\n");
+            update_err = FS_ERR_CORRUPT_EXTENT_TREE;
+        }
+        entries = (const Extent *)(block + sizeof(ExtentHeader));
+        count[h] = header.count;
+    }
+
+    // the leaf's new entries: <runs> cut to its span, which the rest of the tree keeps mapping as it does
+    uint32_t first = update_err == SUCCESS ? entries[0].logical : 0;
+    uint32_t n = 0;
+    uint32_t r = 0;
+    while (r < runs->count && runs->items[r].logical + runs->items[r].length <= first)
+    {
+        r++;
+    }
+    for (; update_err == SUCCESS && r < runs->count && runs->items[r].logical < end && n <= 2 * slots; r++)
+    {
+        const Extent *run = &runs->items[r];
+        uint32_t from = run->logical > first ? run->logical : first;
+        uint32_t to = run->logical + run->length < end ? run->logical + run->length : end;
+        if (n < 2 * slots)
+            level[n] = (Extent){from, run->start + (from - run->logical), to - from};
+        n++;
+    }
+    // a leaf splits once it is over full, and each node above it if that leaves it over full too
+    bool splits = n > slots;
+    for (uint32_t h = 1; h < depth; h++)
+    {
+        splits = splits && count[h] + 1 > slots;
+    }
+    if (update_err == SUCCESS && (lo < first || hi > end || n > 2 * slots || (splits && count[depth] + 1 > INODE_EXTENT_SLOTS)))
+    {
+        free(path);
+        free(level);
+        return rewrite_extent_tree(fs, inode, runs, changes);
+    }
+
+    Extent up[2]; // what the path's entry in the level above becomes: one entry, or two after a split
+    uint32_t num_up = 0;
+    uint8_t *built = path + (size_t)depth * fs->fsBlockSize;
+    for (uint32_t h = 0; update_err == SUCCESS && h < depth; h++)
+    {
+        if (h > 0)
+        { // the node's entries with the path's one replaced by what the level below became
+            const Extent *old = (const Extent *)(path + (size_t)h * fs->fsBlockSize + sizeof(ExtentHeader));
+            n = 0;
+            for (uint32_t i = 0; i < count[h]; i++)
+            {
+                if (i != pos[h])
+                    level[n++] = old[i];
+                else
+                    for (uint32_t j = 0; j < num_up; j++)
+                        level[n++] = up[j];
+            }
+        }
+        update_err = extent_list_push(&changes->stale, (Extent){0, node[h], 1});
+        num_up = n > slots ? 2 : 1;
+        for (uint32_t j = 0; update_err == SUCCESS && j < num_up; j++)
+        {
+            uint32_t from = j == 0 ? 0 : n / 2;
+            uint32_t to = num_up == 1 || j == 1 ? n : n / 2;
+            uint32_t copy;
+            if (find_free_run(fs, node[h], 1, &copy) == 0)
+            {
+                update_err = FS_ERR_BITMAP_FULL;
+                break;
+            }
+            update_err = take_blocks(fs, changes, copy, 1);
+            if (update_err != SUCCESS)
+                break;
+            memset(built, 0, fs->fsBlockSize);
+            ExtentHeader header = {(uint16_t)(to - from), (uint16_t)h};
+            memcpy(built, &header, sizeof(header));
+            memcpy(built + sizeof(ExtentHeader), &level[from], (to - from) * sizeof(Extent));
+            set_block_checksum(built, fs->fsBlockSize);
+            update_err = cacheWrite(fs->blockCache, copy, built);
+            const Extent *last = &level[to - 1];
+            up[j] = (Extent){level[from].logical, copy, last->logical + last->length - level[from].logical};
+        }
+    }
+    if (update_err == SUCCESS)
+    { // the inode's entry for the path, after a split followed by the new one
+        memmove(&inode->extents[pos[depth] + num_up], &inode->extents[pos[depth] + 1],
+                (count[depth] - pos[depth] - 1) * sizeof(Extent));
+        memcpy(&inode->extents[pos[depth]], up, num_up * sizeof(Extent));
+        inode->extent_header.count = (uint16_t)(count[depth] + num_up - 1);
+    }
+    free(path);
+    free(level);
+    return update_err;
+}
+
+// bucket blocks of a loaded directory: a power of two
+static uint32_t dir_blocks(const Dentry *dir)
+{
+    return dir->numBuckets;
+}
+
+// depth of the extent tree mapping each of <n> buckets on its own
+static uint32_t dir_tree_depth(tfs_fs *fs, uint32_t n)
+{
+    uint32_t depth = 0;
+    for (uint32_t entries = n; entries > INODE_EXTENT_SLOTS; depth++)
+    {
+        entries = (entries + EXTENT_NODE_SLOTS(fs->fsBlockSize) - 1) / EXTENT_NODE_SLOTS(fs->fsBlockSize);
+    }
+    return depth;
+}
+
+// reads the bucket blocks of directory dentry <dir> if it hasn't been yet. a legacy root is its direct[0] block
+static int dir_load(tfs_fs *fs, int dir)
+{
+    Dentry *d = dentry(fs, dir);
+    if (d->numBuckets > 0)
+    {
+        return SUCCESS;
+    }
+    Inode inode;
+    RETURN_IF_ERR(read_block_head(fs, d->inode_block, &inode));
+    ExtentList runs = {0};
+    ExtentList nodes = {0};
+    int load_err = INODE_IS_DIR(inode.type) ? collect_inode_blocks(fs, &inode, &runs, &nodes)
+                                            : extent_list_push(&runs, (Extent){0, inode.direct[0], 1});
+    free(nodes.items);
+    uint32_t expected = 0;
+    for (uint32_t i = 0; load_err == SUCCESS && i < runs.count; i++)
+    {
+        const Extent *run = &runs.items[i];
+        if (run->logical != expected || run->length == 0 || run->length > DIR_MAX_BLOCKS || run->start >= fs->numBlocks ||
+            run->length > fs->numBlocks - run->start)
+        {
+            load_err = FS_ERR_CORRUPT_DIRECTORY;
+        }
+        expected += run->length;
+    }
+    if (load_err == SUCCESS && (expected == 0 || expected > DIR_MAX_BLOCKS || (expected & (expected - 1)) != 0))
+    {
+        load_err = FS_ERR_CORRUPT_DIRECTORY;
+    }
+    uint32_t *buckets = load_err == SUCCESS ? malloc(expected * sizeof(uint32_t)) : NULL;
+    if (load_err == SUCCESS && buckets == NULL)
+    {
+        load_err = SYSTEM_ERROR;
+    }
+    if (load_err != SUCCESS)
+    {
+        if (load_err != SYSTEM_ERROR)
+            printf("Corrupt directory block map.\n");
+        free(runs.items);
+        return load_err;
+    }
+    for (uint32_t i = 0; i < runs.count; i++)
+    {
+        for (uint32_t b = 0; b < runs.items[i].length; b++)
+        {
+            buckets[runs.items[i].logical + b] = runs.items[i].start + b;
+        }
+    }
+    d->buckets = buckets;
+    d->numBuckets = expected;
+    d->bucketTree = INODE_IS_DIR(inode.type) && runs.count == expected; // one extent per bucket
+    free(runs.items);
+    return SUCCESS;
+}
+
+// bucket block of <key> in loaded directory <dir>
+static uint32_t dir_bucket(tfs_fs *fs, int dir, const char key[8])
+{
+    return name_hash(key) & (dir_blocks(dentry(fs, dir)) - 1);
+}
+
+static int dir_read_block(tfs_fs *fs, int dir, uint32_t k, uint8_t *block)
+{
+    return cacheRead(fs->blockCache, dentry(fs, dir)->buckets[k], block);
+}
+
+// a directory block with every entry free
+static void empty_dir_block(tfs_fs *fs, uint8_t *block)
+{
+    memset(block, 0, fs->fsBlockSize);
+    DirectoryEntry *entries = (DirectoryEntry *)block;
+    for (uint32_t i = 0; i < MAX_DIRECTORY_SIZE(fs->fsBlockSize); i++)
+    {
+        entries[i].inode_block = INVALID_BLOCK;
+    }
+}
+
+static int write_inode_locked(tfs_fs *fs, int id, const Inode *inode);
+
+/* points the inode of directory <dir> at its bucket blocks, one extent per bucket whether or not they are adjacent:
+the tree then has the same shape whatever the blocks, so dir_store_bucket() can find the entry of any bucket by
+its number and rewrite just the nodes above it. A legacy root becomes an INODE_TYPE_DIR on the way. What else the
+old inode owned (extent nodes, a legacy root's preallocated blocks) is only released once the new one is written. */
+static int dir_store(tfs_fs *fs, int dir)
+{
+    Dentry *d = dentry(fs, dir);
+    Inode inode;
+    RETURN_IF_ERR(read_block_head(fs, d->inode_block, &inode));
+    bool legacy = !INODE_IS_DIR(inode.type);
+    ExtentList old_runs = {0};
+    ExtentList old_nodes = {0};
+    ExtentList runs = {0};
+    ExtentList new_nodes = {0};
+    int store_err = collect_inode_blocks(fs, &inode, &old_runs, &old_nodes);
+    if (store_err == SUCCESS && legacy)
+    { // direct[0] is bucket 0 already; older images also preallocated direct[1] and an indirect block
+        inode.type = INODE_TYPE_DIR;
+        inode.direct[0] = INVALID_BLOCK;
+        inode.direct[1] = INVALID_BLOCK;
+        inode.indirect = INVALID_BLOCK;
+        memset(&inode.extent_header, 0, sizeof(inode.extent_header));
+    }
+    for (uint32_t k = 0; store_err == SUCCESS && k < d->numBuckets; k++)
+    {
+        store_err = extent_list_push(&runs, (Extent){k, d->buckets[k], 1});
+    }
+    if (store_err == SUCCESS)
+    {
+        store_err = store_extents(fs, &inode, &runs, &new_nodes);
+    }
+    free(runs.items);
+    if (store_err == SUCCESS)
+    {
+        set_inode_checksum(&inode);
+        store_err = write_inode_locked(fs, dir, &inode);
+        for (uint32_t i = 0; store_err != SUCCESS && i < new_nodes.count; i++)
+        { // the node blocks just written never took over
+            clearBlockUsedAndUpdateBitmap(fs, new_nodes.items[i].start);
+        }
+    }
+    free(new_nodes.items);
+    for (uint32_t i = 0; store_err == SUCCESS && i < old_runs.count; i++)
+    {
+        if (legacy && old_runs.items[i].logical > 0)
+            free_blocks(fs, old_runs.items[i].start, old_runs.items[i].length);
+    }
+    for (uint32_t i = 0; store_err == SUCCESS && i < old_nodes.count; i++)
+    {
+        clearBlockUsedAndUpdateBitmap(fs, old_nodes.items[i].start);
+    }
+    free(old_runs.items);
+    free(old_nodes.items);
+    if (store_err == SUCCESS)
+    {
+        d->bucketTree = true;
+    }
+    return store_err;
+}
+
+/* points the extent tree of directory <dir> at the new block of bucket <k>. Bucket k's entry is entry k of the
+leaves, so the path to it follows from k alone: the leaf is rewritten, and each node above it only if the one below
+had to move because the committed tree still reaches it. The inode is written only if its own entry changed.
+Copies made are released again if a later write fails; the nodes they replace only once the path is complete. */
+static int dir_store_bucket(tfs_fs *fs, int dir, uint32_t k)
+{
+    Dentry *d = dentry(fs, dir);
+    if (!d->bucketTree)
+    {
+        return dir_store(fs, dir); // written before buckets had an extent each (or a legacy root): rewrite it whole
+    }
+    Inode inode;
+    RETURN_IF_ERR(read_block_head(fs, d->inode_block, &inode));
+    const uint32_t slots = EXTENT_NODE_SLOTS(fs->fsBlockSize);
+    uint32_t depth = inode.extent_header.depth;
+    // index[h]: the path's entry among all entries at height h (0: the leaves' entries, one per bucket).
+    // node[h]: the node at height h holding index[h], the inode's entries being at height <depth>
+    uint32_t index[EXTENT_MAX_DEPTH + 1];
+    uint32_t node[EXTENT_MAX_DEPTH];
+    index[0] = k;
+    for (uint32_t h = 1; h <= depth && h <= EXTENT_MAX_DEPTH; h++)
+    {
+        index[h] = index[h - 1] / slots;
+    }
+    if (depth > EXTENT_MAX_DEPTH || depth != dir_tree_depth(fs, d->numBuckets) || index[depth] >= inode.extent_header.count)
+    {
+        printf("Directory extent tree doesn't map its buckets.\n");
+        return FS_ERR_CORRUPT_EXTENT_TREE;
+    }
+    _Alignas(uint32_t) uint8_t block[fs->fsBlockSize];
+    ExtentHeader header;
+    Extent *entries = (Extent *)(block + sizeof(ExtentHeader));
+    if (depth > 0)
+    {
+        node[depth - 1] = inode.extents[index[depth]].start;
+    }
+    for (uint32_t h = depth; h-- > 1;)
+    { // down to the leaf
+        RETURN_IF_ERR(cacheRead(fs->blockCache, node[h], block));
+        memcpy(&header, block, sizeof(header));
+        if (!verify_block_checksum(block, fs->fsBlockSize) || header.depth != h || index[h] % slots >= header.count)
+        {
+            printf("Directory extent tree doesn't map its buckets.\n");
+            return FS_ERR_CORRUPT_EXTENT_TREE;
+        }
+        node[h - 1] = entries[index[h] % slots].start;
+    }
+
+    uint32_t target = d->buckets[k]; // what the entry at height h has to point at
+    uint32_t copies[EXTENT_MAX_DEPTH];
+    uint32_t num_copies = 0;
+    int store_err = SUCCESS;
+    uint32_t h = 0;
+    for (; h < depth; h++)
+    { // back up from the leaf
+        store_err = cacheRead(fs->blockCache, node[h], block);
+        if (store_err != SUCCESS)
+            break;
+        entries[index[h] % slots].start = target;
+        set_block_checksum(block, fs->fsBlockSize);
+        if (block_is_uncommitted(fs, node[h]))
+        { // this txg's copy already: the path above stays as it is
+            store_err = cacheWrite(fs->blockCache, node[h], block);
+            break;
+        }
+        uint32_t copy;
+        if (find_free_run(fs, node[h], 1, &copy) == 0)
+        {
+            store_err = FS_ERR_BITMAP_FULL;
+            break;
+        }
+        setBlockUsedAndUpdateBitmap(fs, copy);
+        copies[num_copies++] = copy;
+        store_err = cacheWrite(fs->blockCache, copy, block);
+        if (store_err != SUCCESS)
+            break;
+        target = copy;
+    }
+    if (store_err == SUCCESS && h == depth)
+    { // every node on the path moved (or there are none): so does the inode's entry
+        inode.extents[index[depth]].start = target;
+        set_inode_checksum(&inode);
+        store_err = write_inode_locked(fs, dir, &inode);
+    }
+    for (uint32_t i = 0; i < num_copies; i++)
+    { // the copies on failure, else the nodes they replaced
+        clearBlockUsedAndUpdateBitmap(fs, store_err == SUCCESS ? node[i] : copies[i]);
+    }
+    return store_err;
+}
+
+// writes bucket block <k> of directory <dir> copy-on-write: a block the committed tree reaches moves, and the
+// directory's extent tree (and, if it has to move, its inode with the entry naming the directory, up to the root)
+// follows it
+static int dir_write_block(tfs_fs *fs, int dir, uint32_t k, uint8_t *block)
+{
+    Dentry *d = dentry(fs, dir);
+    uint32_t old = d->buckets[k];
+    set_block_checksum(block, fs->fsBlockSize);
+    if (block_is_uncommitted(fs, old))
+    {
+        return cacheWrite(fs->blockCache, old, block);
+    }
+    uint32_t moved;
+    if (find_free_run(fs, old, 1, &moved) == 0)
+    {
+        printf("No free block left for a directory block.\n");
+        return FS_ERR_BITMAP_FULL;
+    }
+    setBlockUsedAndUpdateBitmap(fs, moved);
+    int write_err = cacheWrite(fs->blockCache, moved, block);
+    if (write_err == SUCCESS)
+    {
+        d->buckets[k] = moved;
+        write_err = dir_store_bucket(fs, dir, k);
+    }
+    if (write_err != SUCCESS)
+    {
+        d->buckets[k] = old;
+        clearBlockUsedAndUpdateBitmap(fs, moved);
+        return write_err;
+    }
+    clearBlockUsedAndUpdateBitmap(fs, old);
+    return SUCCESS;
+}
+
+/* doubles directory <dir> once a bucket overflows: bucket k splits into k and k + n (n the old block count) by the next
+bit of each name's hash, so every entry moves at most once per doubling and a lookup still reads one block. The
+doubled directory goes to fresh blocks, as few runs as the disk allows, and replaces the old ones only once every
+bucket is written: a failure leaves the directory as it was. */
+static int dir_grow(tfs_fs *fs, int dir)
+{
+    Dentry *d = dentry(fs, dir);
+    uint32_t n = dir_blocks(d);
+    if (2 * n > DIR_MAX_BLOCKS)
+    {
+        printf("Directory can't grow past %u blocks.\n", DIR_MAX_BLOCKS);
+        return FS_ERR_DIRECTORY_FULL;
+    }
+    if (count_free_blocks(fs) < 2 * n + extent_tree_nodes(fs, 2 * n))
+    {
+        printf("No room on disk to grow the directory.\n");
+        return FS_ERR_BITMAP_FULL;
+    }
+    uint32_t *grown = malloc(2 * n * sizeof(uint32_t));
+    if (grown == NULL)
+    {
+        return SYSTEM_ERROR;
+    }
+    int grow_err = SUCCESS;
+    uint32_t allocated = 0;
+    while (allocated < 2 * n)
+    {
+        uint32_t start;
+        uint32_t length = find_free_run(fs, allocated ? grown[allocated - 1] + 1 : d->buckets[0], 2 * n - allocated, &start);
+        if (length == 0)
+        {
+            grow_err = FS_ERR_BITMAP_FULL;
+            break;
+        }
+        for (uint32_t b = 0; b < length; b++)
+        {
+            setBlockUsedAndUpdateBitmap(fs, start + b);
+            grown[allocated++] = start + b;
+        }
+    }
+
+    _Alignas(uint32_t) uint8_t low[fs->fsBlockSize];
+    _Alignas(uint32_t) uint8_t high[fs->fsBlockSize];
+    DirectoryEntry *low_entries = (DirectoryEntry *)low;
+    DirectoryEntry *high_entries = (DirectoryEntry *)high;
+    for (uint32_t k = 0; grow_err == SUCCESS && k < n; k++)
+    {
+        grow_err = cacheRead(fs->blockCache, d->buckets[k], low);
+        if (grow_err != SUCCESS)
+            break;
+        empty_dir_block(fs, high);
+        uint32_t split = 0;
+        for (uint32_t i = 0; i < MAX_DIRECTORY_SIZE(fs->fsBlockSize); i++)
+        {
+            char key[8];
+            name_key(low_entries[i].name, key);
+            if (low_entries[i].inode_block != INVALID_BLOCK && (name_hash(key) & n))
+            {
+                high_entries[split++] = low_entries[i];
+                memset(&low_entries[i], 0, sizeof(DirectoryEntry));
+                low_entries[i].inode_block = INVALID_BLOCK;
+            }
+        }
+        set_block_checksum(low, fs->fsBlockSize);
+        set_block_checksum(high, fs->fsBlockSize);
+        grow_err = cacheWrite(fs->blockCache, grown[k], low);
+        if (grow_err == SUCCESS)
+            grow_err = cacheWrite(fs->blockCache, grown[k + n], high);
+    }
+
+    uint32_t *old = d->buckets;
+    if (grow_err == SUCCESS)
+    {
+        d->buckets = grown;
+        d->numBuckets = 2 * n;
+        grow_err = dir_store(fs, dir);
+        if (grow_err != SUCCESS)
+        {
+            d->buckets = old;
+            d->numBuckets = n;
+        }
+    }
+    // the old buckets, or the ones that never took over
+    uint32_t *unused = grow_err == SUCCESS ? old : grown;
+    uint32_t num_unused = grow_err == SUCCESS ? n : allocated;
+    for (uint32_t k = 0; k < num_unused; k++)
+    {
+        clearBlockUsedAndUpdateBitmap(fs, unused[k]);
+    }
+    free(unused);
+    return grow_err;
+}
+
+// looks <key> up in its bucket block of directory <dir>: <inode_block> gets the inode it names, INVALID_BLOCK if none.
+// the first entry wins, as the linear scan of legacy roots did
+static int dir_find(tfs_fs *fs, int dir, const char key[8], uint32_t *inode_block)
+{
+    RETURN_IF_ERR(dir_load(fs, dir));
+    _Alignas(uint32_t) uint8_t block[fs->fsBlockSize];
+    RETURN_IF_ERR(dir_read_block(fs, dir, dir_bucket(fs, dir, key), block));
+    DirectoryEntry *entries = (DirectoryEntry *)block;
+    *inode_block = INVALID_BLOCK;
+    for (uint32_t i = 0; i < MAX_DIRECTORY_SIZE(fs->fsBlockSize); i++)
+    {
+        char entry_key[8];
+        name_key(entries[i].name, entry_key);
+        if (entries[i].inode_block != INVALID_BLOCK && memcmp(entry_key, key, 8) == 0)
+        {
+            if (entries[i].inode_block >= fs->numBlocks)
+            {
+                printf("Directory entry points outside the disk.\n");
+                return FS_ERR_CORRUPT_DIRECTORY;
+            }
+            *inode_block = entries[i].inode_block;
+            return SUCCESS;
+        }
+    }
+    return SUCCESS;
+}
+
+// adds the entry <key> -> <inode_block> to directory <dir>, which doesn't hold the name, doubling the directory
+// while the name's bucket is full
+static int dir_add_entry(tfs_fs *fs, int dir, const char key[8], uint32_t inode_block)
+{
+    RETURN_IF_ERR(dir_load(fs, dir));
+    _Alignas(uint32_t) uint8_t block[fs->fsBlockSize];
+    DirectoryEntry *entries = (DirectoryEntry *)block;
+    for (;;)
+    {
+        uint32_t k = dir_bucket(fs, dir, key);
+        RETURN_IF_ERR(dir_read_block(fs, dir, k, block));
+        for (uint32_t i = 0; i < MAX_DIRECTORY_SIZE(fs->fsBlockSize); i++)
+        {
+            if (entries[i].inode_block == INVALID_BLOCK)
+            {
+                memset(&entries[i], 0, sizeof(DirectoryEntry));
+                memcpy(entries[i].name, key, sizeof(entries[i].name));
+                entries[i].inode_block = inode_block;
+                return dir_write_block(fs, dir, k, block);
+            }
+        }
+        RETURN_IF_ERR(dir_grow(fs, dir));
+    }
+}
+
+// repoints every entry of directory <dir> naming <key> and inode <old> (shadowed duplicates too) at <inode_block>,
+// or frees them for INVALID_BLOCK
+static int dir_replace_entries(tfs_fs *fs, int dir, const char key[8], uint32_t old, uint32_t inode_block)
+{
+    RETURN_IF_ERR(dir_load(fs, dir));
+    uint32_t k = dir_bucket(fs, dir, key);
+    _Alignas(uint32_t) uint8_t block[fs->fsBlockSize];
+    RETURN_IF_ERR(dir_read_block(fs, dir, k, block));
+    DirectoryEntry *entries = (DirectoryEntry *)block;
+    bool found = false;
+    for (uint32_t i = 0; i < MAX_DIRECTORY_SIZE(fs->fsBlockSize); i++)
+    {
+        char entry_key[8];
+        name_key(entries[i].name, entry_key);
+        if (entries[i].inode_block == old && memcmp(entry_key, key, 8) == 0)
+        {
+            if (inode_block == INVALID_BLOCK)
+                memset(entries[i].name, 0, sizeof(entries[i].name));
+            entries[i].inode_block = inode_block;
+            found = true;
+        }
+    }
+    if (!found)
+    {
+        printf("Directory lost the entry of a cached name.\n");
+        return FS_ERR_CORRUPT_DIRECTORY;
+    }
+    return dir_write_block(fs, dir, k, block);
+}
+
+/* writes the inode of dentry <id> copy-on-write: in place if the open txg already gave it a block, else to a new one
+that the entry naming it in its directory is repointed at (for the root, the superblock, which the commit rewrites
+anyway). Holds allocLock and dirLock, and for a file its lock exclusive. */
+static int write_inode_locked(tfs_fs *fs, int id, const Inode *inode)
+{
+    Dentry *d = dentry(fs, id);
+    uint32_t inode_block = d->inode_block;
+    if (block_is_uncommitted(fs, inode_block))
+    {
+        return write_block_head(fs, inode_block, inode);
+    }
+    uint32_t moved = find_free_block(fs);
+    if (moved == INVALID_BLOCK)
+    {
+        return FS_ERR_BITMAP_FULL;
+    }
+    setBlockUsedAndUpdateBitmap(fs, moved);
+    int write_err = write_block_head(fs, moved, inode);
+    if (write_err != SUCCESS)
+    {
+        clearBlockUsedAndUpdateBitmap(fs, moved);
+        return write_err;
+    }
+    if (d->parent == -1)
+    {
+        fs->superBlock.root_dir_inode = moved;
+    }
+    else
+    {
+        write_err = dir_replace_entries(fs, d->parent, d->name, inode_block, moved);
+        if (write_err != SUCCESS)
+        {
+            clearBlockUsedAndUpdateBitmap(fs, moved);
+            return write_err;
+        }
+    }
+    d->inode_block = moved; // descriptors find it here
+    clearBlockUsedAndUpdateBitmap(fs, inode_block);
+    return SUCCESS;
+}
+
+// write_inode_locked() for a change to the file of dentry <file_slot>, holding its lock exclusive and allocLock
+static int write_inode(tfs_fs *fs, int file_slot, const Inode *inode)
+{
+    if (block_is_uncommitted(fs, dentry(fs, file_slot)->inode_block))
+    {
+        return write_block_head(fs, dentry(fs, file_slot)->inode_block, inode); // no directory involved
+    }
+    pthread_mutex_lock(&fs->dirLock);
+    int write_err = write_inode_locked(fs, file_slot, inode);
+    pthread_mutex_unlock(&fs->dirLock);
+    return write_err;
+}
+
+// the dentry of <key> in directory <dir>: cached, else looked up in the directory's bucket block and cached, as a
+// negative dentry if the name isn't there. holds dirLock
+static int dir_lookup(tfs_fs *fs, int dir, const char key[8], int *id)
+{
+    *id = dentry_find(fs, dir, key);
+    if (*id != -1)
+    {
+        return SUCCESS;
+    }
+    uint32_t inode_block;
+    RETURN_IF_ERR(dir_find(fs, dir, key, &inode_block));
+    uint8_t kind = DENTRY_NEGATIVE;
+    if (inode_block != INVALID_BLOCK)
+    {
+        Inode inode;
+        RETURN_IF_ERR(read_block_head(fs, inode_block, &inode));
+        kind = INODE_IS_DIR(inode.type) ? DENTRY_DIR : DENTRY_FILE;
+    }
+    return dentry_add(fs, dir, key, kind, inode_block, id);
+}
+
+// splits the next '/'-separated name off <*path> into <key>; <last> says whether it was the final one
+static int next_path_name(const char **path, char key[8], bool *last)
+{
+    const char *end = strchr(*path, '/');
+    size_t length = end != NULL ? (size_t)(end - *path) : strlen(*path);
+    if (length == 0 || length > 8)
+    {
+        return FS_ERR_INVALID_FILENAME;
+    }
+    char name[9] = {0};
+    memcpy(name, *path, length);
+    name_key(name, key);
+    *last = end == NULL;
+    *path += end != NULL ? length + 1 : length;
+    return SUCCESS;
+}
+
+// walks <path> (from the root, a leading '/' optional) down to the directory holding its last name: <dir> gets that
+// directory's dentry and <key> the name. holds dirLock
+static int resolve_parent(tfs_fs *fs, const char *path, int *dir, char key[8])
+{
+    if (path == NULL || strlen(path) > TFS_MAX_PATH)
+    {
+        return FS_ERR_INVALID_FILENAME;
+    }
+    if (*path == '/')
+    {
+        path++;
+    }
+    *dir = ROOT_DENTRY;
+    bool last;
+    RETURN_IF_ERR(next_path_name(&path, key, &last));
+    while (!last)
+    {
+        int child;
+        RETURN_IF_ERR(dir_lookup(fs, *dir, key, &child));
+        if (dentry(fs, child)->kind == DENTRY_NEGATIVE)
+        {
+            return FS_ERR_FILE_NOT_FOUND;
+        }
+        if (dentry(fs, child)->kind != DENTRY_DIR)
+        {
+            return FS_ERR_NOT_A_DIRECTORY;
+        }
+        *dir = child;
+        RETURN_IF_ERR(next_path_name(&path, key, &last));
+    }
+    return SUCCESS;
+}
+
+// the dentry <path> resolves to (negative if its last name doesn't exist). holds dirLock
+static int resolve_path(tfs_fs *fs, const char *path, int *id)
+{
+    int dir;
+    char key[8];
+    RETURN_IF_ERR(resolve_parent(fs, path, &dir, key));
+    return dir_lookup(fs, dir, key, id);
+}
+
+/* writes <n> bytes of <buffer> at byte <offset> of FD's file, touching only the blocks involved.
+Growing the file zero-fills any gap between the old end of file and <offset>;
+new blocks extend the last run when the blocks after it are free, else start the nearest run that fits them all.
+Existing blocks are never overwritten once committed: the open txg writes them to new blocks.
+Inline files stay in the inode while they fit and move to a data block once they don't. */
+static int write_range(tfs_fs *fs, fileDescriptor FD, uint32_t offset, const char *buffer, uint32_t n)
+{
+    RETURN_IF_ERR(load_descriptor_inode(fs, FD));
+    Inode theinode = file_entry(fs, FD)->inode;
+    if (!INODE_IS_WRITABLE(theinode.type))
+    {
+        printf("Invalid permissions to write to file.\n");
+        return FS_ERR_INVALID_FILE_PERMISSION;
+    }
+
+    uint32_t old_size = theinode.size;
+    uint32_t end = offset + n;
+    uint32_t new_size = end > old_size ? end : old_size;
+    uint32_t old_blocks = (old_size + fs->fsDataSize - 1) / fs->fsDataSize;
+    uint32_t new_blocks = (new_size + fs->fsDataSize - 1) / fs->fsDataSize;
+    // bytes to produce: the write itself plus the zeroed gap when it starts past the end of file
+    uint32_t region_start = offset < old_size ? offset : old_size;
+    if (end <= region_start)
+    {
+        return SUCCESS; // nothing to write
+    }
+    if (INODE_IS_INLINE(theinode.type) && new_size <= INODE_INLINE_SIZE)
+    { // still fits: the inode block is the only write
+        invalidate_descriptors(fs, file_entry(fs, FD)->dir_slot, -1);
+        memset(theinode.inline_data + region_start, 0, end - region_start);
+        if (n > 0)
+        {
+            memcpy(theinode.inline_data + offset, buffer, n);
+        }
+        theinode.size = new_size;
+        set_inode_checksum(&theinode);
+        RETURN_IF_ERR(write_inode(fs, file_entry(fs, FD)->dir_slot, &theinode));
+        log_descriptor_intent(fs, INTENT_PWRITE, FD, offset, buffer, n);
+        return txg_op_done(fs);
+    }
+
+    uint32_t lo = region_start / fs->fsDataSize;
+    uint32_t count = (end - 1) / fs->fsDataSize - lo + 1;
+    // existing blocks in the range the committed tree still reaches each need a new copy
+    uint32_t held_blocks = INODE_IS_INLINE(theinode.type) ? 0 : old_blocks; // an inline file holds no blocks yet
+    uint32_t copies = 0;
+    if (held_blocks > lo)
+    {
+        RETURN_IF_ERR(load_descriptor_map(fs, FD));
+        for (uint32_t k = lo; k < lo + count && k < held_blocks; k++)
+        {
+            uint32_t block = descriptor_block(fs, FD, k);
+            copies += block != INVALID_BLOCK && !block_is_uncommitted(fs, block);
+        }
+    }
+    // worst case every new block lands in its own run
+    uint32_t growth = new_blocks - held_blocks;
+    if (growth + copies > 0)
+    {
+        pthread_mutex_lock(&fs->dirLock);
+        uint32_t chain = dentry_chain_blocks(fs, file_entry(fs, FD)->dir_slot);
+        pthread_mutex_unlock(&fs->dirLock);
+        RETURN_IF_ERR(reserve_blocks(fs, growth + copies + extent_tree_nodes(fs, growth + copies + old_blocks) + chain, 0));
+    }
+    invalidate_descriptors(fs, file_entry(fs, FD)->dir_slot, -1);
+
+    bool converted = !INODE_HAS_EXTENTS(theinode.type);
+    ExtentList runs = {0};
+    BlockChanges changes = {0};
+    uint32_t goal = descriptor_inode_block(fs, FD) + 1; // a file's blocks start out right after its inode
+    int range_err = INODE_IS_INLINE(theinode.type) ? spill_inline(fs, &theinode, &runs, goal, new_blocks, &changes)
+                                                   : load_runs_for_update(fs, &theinode, old_blocks, &runs, &changes);
+
+    // stage the affected blocks: keep bytes before old EOF that the write doesn't cover, zero the rest.
+    // what survives is read from the current blocks before they get new ones
+    uint8_t *blocks = range_err == SUCCESS ? calloc(count, fs->fsBlockSize) : NULL;
+    int *block_nums = range_err == SUCCESS ? malloc(count * sizeof(int)) : NULL;
+    void **block_bufs = range_err == SUCCESS ? malloc(count * sizeof(void *)) : NULL;
+    int *read_nums = range_err == SUCCESS ? malloc(count * sizeof(int)) : NULL;
+    void **read_bufs = range_err == SUCCESS ? malloc(count * sizeof(void *)) : NULL;
+    if (range_err == SUCCESS && (!blocks || !block_nums || !block_bufs || !read_nums || !read_bufs))
+    {
+        range_err = SYSTEM_ERROR;
+    }
+    int num_reads = 0;
+    for (uint32_t i = 0; range_err == SUCCESS && i < count; i++)
+    {
+        uint32_t k = lo + i;
+        uint32_t block_start = k * fs->fsDataSize;
+        block_bufs[i] = blocks + (size_t)i * fs->fsBlockSize;
+        bool fully_written = offset <= block_start && end >= block_start + fs->fsDataSize;
+        if (k < old_blocks && !fully_written)
+        {
+            read_nums[num_reads] = run_block(&runs, k);
+            read_bufs[num_reads] = block_bufs[i];
+            num_reads++;
+        }
+    }
+    if (range_err == SUCCESS && num_reads > 0)
+    {
+        range_err = cacheReadBlocks(fs->blockCache, num_reads, read_nums, read_bufs);
+    }
+    bool moved = false;
+    if (range_err == SUCCESS && lo < old_blocks)
+    {
+        range_err = cow_runs(fs, &runs, lo, count, goal, &moved, &changes);
+    }
+
+    // allocate the new tail, continuing the last run where possible
+    for (uint32_t allocated = old_blocks; range_err == SUCCESS && allocated < new_blocks;)
+    {
+        Extent *last = runs.count ? &runs.items[runs.count - 1] : NULL;
+        uint32_t start;
+        uint32_t length = find_free_run(fs, last ? last->start + last->length : goal, new_blocks - allocated, &start);
+        if (length == 0)
+        {
+            range_err = FS_ERR_BITMAP_FULL;
+            break;
+        }
+        range_err = take_blocks(fs, &changes, start, length);
+        if (range_err == SUCCESS)
+            range_err = extent_list_append(&runs, (Extent){allocated, start, length});
+        allocated += length;
+    }
+
+    for (uint32_t i = 0; range_err == SUCCESS && i < count; i++)
+    {
+        block_nums[i] = run_block(&runs, lo + i);
+        uint8_t *block = block_bufs[i];
+        uint32_t block_start = (lo + i) * fs->fsDataSize;
+        if (old_size < block_start + fs->fsDataSize)
+        { // nothing past the old end of file survives
+            uint32_t keep = old_size > block_start ? old_size - block_start : 0;
+            memset(block + keep, 0, fs->fsDataSize - keep);
+        }
+        uint32_t from = offset > block_start ? offset : block_start;
+        uint32_t to = end < block_start + fs->fsDataSize ? end : block_start + fs->fsDataSize;
+        if (from < to)
+        {
+            memcpy(block + (from - block_start), buffer + (from - offset), to - from);
+        }
+        set_block_checksum(block, fs->fsBlockSize);
+    }
+    if (range_err == SUCCESS)
+    {
+        range_err = cacheWriteBlocks(fs->blockCache, count, block_nums, block_bufs);
+    }
+    free(blocks);
+    free(block_nums);
+    free(block_bufs);
+    free(read_nums);
+    free(read_bufs);
+
+    if (range_err == SUCCESS && (converted || growth > 0 || moved))
+    {
+        range_err = converted ? rewrite_extent_tree(fs, &theinode, &runs, &changes)
+                              : update_extent_range(fs, &theinode, &runs, lo, lo + count, &changes);
+    }
+    free(runs.items);
+    if (range_err == SUCCESS && (converted || moved || new_size != old_size))
+    {
+        theinode.size = new_size;
+        set_inode_checksum(&theinode);
+        range_err = write_inode(fs, file_entry(fs, FD)->dir_slot, &theinode);
+    }
+    release_block_changes(fs, &changes, range_err);
+    RETURN_IF_ERR(range_err);
+    log_descriptor_intent(fs, INTENT_PWRITE, FD, offset, buffer, n);
+    return txg_op_done(fs);
+}
+#pragma endregion
+
+#pragma region
+// random tag for a new file system's intent log chunks
+static uint32_t new_log_guid(void)
+{
+    uint32_t guid = 0;
+    if (getrandom(&guid, sizeof(guid), 0) != sizeof(guid))
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        guid = (uint32_t)now.tv_nsec ^ (uint32_t)now.tv_sec ^ ((uint32_t)getpid() << 16);
+    }
+    return guid != 0 ? guid : 1;
+}
+
+static void close_intent_log(tfs_fs *fs)
+{
+    closeZil(fs->zil);
+    fs->zil = NULL;
+    if (fs->logDisk != -1)
+    {
+        closeDisk(fs->logDisk);
+        fs->logDisk = -1;
+    }
+    fs->zilGap = false;
+}
+
+/* opens the intent log the superblock describes and replays it on top of the committed tree, moves it to the
+configured log device if it isn't there yet, then commits so the replayed operations never need replaying again */
+static int mount_intent_log(tfs_fs *fs)
+{
+    if (fs->superBlock.log_device == LOG_ON_DEVICE && fs->options.logDevice == NULL)
+    {
+        printf("This file system keeps its intent log on a separate device: tfs_setLogDevice() before tfs_mount().\n");
+        return FS_ERR_LOG_DEVICE_MISSING;
+    }
+    if (fs->options.logDevice != NULL)
+    {
+        int disk = openDiskWithBackend(fs->options.logDevice, fs->options.logDeviceBytes, DISK_BACKEND_FILE);
+        if (disk < 0)
+        {
+            return disk;
+        }
+        fs->logDisk = disk;
+        RETURN_IF_ERR(setDiskBlockSize(fs->logDisk, (int)fs->fsBlockSize));
+    }
+    if (fs->superBlock.zil_guid == 0)
+    { // formatted before the intent log existed
+        fs->superBlock.zil_guid = new_log_guid();
+        fs->superblockDirty = true;
+    }
+
+    if (fs->superBlock.log_device == LOG_ON_DEVICE)
+    {
+        fs->zil = openZil(fs->logDisk, 0, (uint32_t)diskNumBlocks(fs->logDisk), fs->superBlock.zil_guid, fs->superBlock.zil_seq);
+    }
+    else if (fs->superBlock.zil_blocks > 0)
+    {
+        fs->zil = openZil(fs->mountedDisk, fs->superBlock.zil_start, fs->superBlock.zil_blocks, fs->superBlock.zil_guid, fs->superBlock.zil_seq);
+    }
+    if (fs->zil != NULL)
+    {
+        uint32_t replayed = 0;
+        fs->zilReplaying = true;
+        int replay_err = zilReplay(fs->zil, replay_intent, fs, &replayed);
+        fs->zilReplaying = false;
+        if (replay_err != SUCCESS)
+        {
+            printf("Intent log replay stopped after %u operations (error %d), the rest are dropped.\n", replayed, replay_err);
+        }
+        else if (replayed > 0)
+        {
+            printf("Replayed %u operations from the intent log.\n", replayed);
+        }
+    }
+
+    if (fs->options.logDevice != NULL && fs->superBlock.log_device != LOG_ON_DEVICE)
+    { // sequence numbers carry on, so nothing already on the device can pass for a current chunk
+        uint32_t seq = fs->zil != NULL ? zilNextSeq(fs->zil) : fs->superBlock.zil_seq;
+        closeZil(fs->zil);
+        fs->zil = openZil(fs->logDisk, 0, (uint32_t)diskNumBlocks(fs->logDisk), fs->superBlock.zil_guid, seq);
+        fs->superBlock.log_device = LOG_ON_DEVICE;
+        fs->superblockDirty = true;
+    }
+    if (fs->options.logDevice != NULL && fs->zil == NULL)
+    {
+        printf("Intent log device %s is too small.\n", fs->options.logDevice);
+        return FS_ERR_LOG_FULL;
+    }
+    return txg_commit(fs);
+}
+
+/* Makes an empty TinyFS file system of size nBytes on an emulated libDisk disk specified by ‘filename’.
+This function should use the emulated disk library to open the specified file, and upon success, format the file to be mountable.
+This includes initializing all data to 0x00, setting magic numbers, initializing and writing the superblock and other metadata, etc.
+Must return a specified success/error code. */
+int tfs_mkfs(char *filename, int nBytes)
+{
+    return tfs_mkfsWithBlockSize(filename, nBytes, BLOCK_SIZE);
+}
+
+/* tfs_mkfs() with <blockSize> byte blocks: a power of two from 256 B to 64 KiB dividing nBytes.
+The size is recorded in the superblock; tfs_mount() reads it back and sizes every block access by it.
+Bigger blocks mean fewer, larger I/Os (4 KiB matches the page cache and SSD pages) at the cost of a
+whole block per inode and per small file. */
+int tfs_mkfsWithBlockSize(char *filename, int nBytes, int blockSize)
+{
+    if (defaultFs != NULL)
+    {
+        printf("tfs_mkfs() called while a file system is mounted.\n");
+        return FS_ERR_EXISTING_MOUNTED_FS;
+    }
+    // formatting works on a scratch instance of its own, so mounted instances are never disturbed
+    tfs_fs *fs = new_instance(NULL);
+    if (fs == NULL)
+    {
+        return SYSTEM_ERROR;
+    }
+    int format_err = format_disk(fs, filename, nBytes, blockSize);
+    if (fs->blockCache != NULL)
+    {
+        closeCache(fs->blockCache);
+    }
+    if (fs->mountedDisk != -1)
+    {
+        closeDisk(fs->mountedDisk);
+    }
+    free_instance(fs);
+    return format_err;
+}
+
+static int format_disk(tfs_fs *fs, char *filename, int nBytes, int blockSize)
+{
+    int disk_to_write = openDiskWithBackend(filename, nBytes, fs->options.diskBackend);
+    if (disk_to_write < 0)
+    {
+        return disk_to_write;
+    }
+    // VALIDATIONS
+
+    int size_err = setDiskBlockSize(disk_to_write, blockSize);
+    if (size_err == SUCCESS && nBytes % blockSize != 0)
+    {
+        size_err = DISK_ERR_OPEN_DISK_BAD_ALIGNMENT;
+    }
+    if (size_err != SUCCESS)
+    {
+        printf("Invalid block size %d for a %d byte tfs_mkfs() (power of two from %d to %d dividing nBytes)\n",
+               blockSize, nBytes, DISK_MIN_BLOCK_SIZE, DISK_MAX_BLOCK_SIZE);
+        closeDisk(disk_to_write);
+        return size_err;
+    }
+
+    int numBlocks = nBytes / blockSize;
+    // validate minsize
+    // superblock + bitmap block + root_dir(Inode) + root_dir data block (will essentially be the only inode list)
+    if (numBlocks <= 3)
+    {
+        printf("Insufficient nBytes space allocated to tfs_mkfs() for (Min 4 blocks)\n");
+        closeDisk(disk_to_write);
+        return FS_ERR_INSUFFICIENT_FS_SIZE;
+    }
+    fs->mountedDisk = disk_to_write;
+    set_geometry(fs, blockSize);
+
+    // VALIDATIONS END
+
+    // wipe disk, straight to libDisk in batches of adjacent blocks
+    uint8_t *null_block = calloc(1, fs->fsBlockSize);
+    if (null_block == NULL)
+    {
+        closeDisk(disk_to_write);
+        fs->mountedDisk = -1;
+        return SYSTEM_ERROR;
+    }
+    int wipe_blocks[64];
+    void *wipe_bufs[64];
+    for (int i = 0; i < 64; i++)
+    {
+        wipe_bufs[i] = null_block;
+    }
+    for (int i = 0; i < numBlocks; i += 64)
+    {
+        int batch = (numBlocks - i) < 64 ? (numBlocks - i) : 64;
+        for (int j = 0; j < batch; j++)
+        {
+            wipe_blocks[j] = i + j;
+        }
+        int wipe_err = writeBlocks(disk_to_write, batch, wipe_blocks, wipe_bufs);
+        if (wipe_err != SUCCESS)
+        {
+            free(null_block);
+            closeDisk(disk_to_write);
+            fs->mountedDisk = -1;
+            return wipe_err;
+        }
+    }
+    free(null_block);
+
+    fs->blockCache = openCache(disk_to_write, fs->options.cacheBudget);
+    if (fs->blockCache == NULL)
+    {
+        closeDisk(disk_to_write);
+        fs->mountedDisk = -1;
+        return SYSTEM_ERROR;
+    }
+
+    // bitmap (written below, with the superblock): blocks 0-3, block 1 only kept for the layout of legacy images
+    uint32_t bitmap_blocks = ((uint32_t)numBlocks + BITMAP_BITS(fs->fsBlockSize) - 1) / BITMAP_BITS(fs->fsBlockSize);
+    RETURN_IF_ERR(alloc_bitmaps(fs, numBlocks, bitmap_blocks));
+    fs->superBlock.bitmap_blocks = bitmap_blocks; // bitmap_block_bits() goes by it
+    setBlockUsedAndUpdateBitmap(fs, SUPERBLOCK_BLOCK_NUM);
+    setBlockUsedAndUpdateBitmap(fs, BITMAP_BLOCK_NUM);
+    setBlockUsedAndUpdateBitmap(fs, ROOT_INODE_BLOCK_NUM);
+    setBlockUsedAndUpdateBitmap(fs, ROOT_DIR_DATA_BLOCK_NUM);
+    // intent log region right after them, unless the log goes to a separate device, then both bitmap copies
+    uint32_t zil_blocks = fs->options.logDevice != NULL ? 0 : (uint32_t)numBlocks / ZIL_POOL_FRACTION;
+    if (zil_blocks > ZIL_MAX_POOL_BLOCKS)
+    {
+        zil_blocks = ZIL_MAX_POOL_BLOCKS;
+    }
+    uint32_t bitmap_start = ZIL_START_BLOCK_NUM + zil_blocks;
+    if (bitmap_start + 2 * bitmap_blocks >= (uint32_t)numBlocks)
+    {
+        printf("Insufficient nBytes space allocated to tfs_mkfs() for the intent log and bitmap (%u blocks)\n",
+               bitmap_start + 2 * bitmap_blocks);
+        return FS_ERR_INSUFFICIENT_FS_SIZE;
+    }
+    for (uint32_t i = ZIL_START_BLOCK_NUM; i < bitmap_start + 2 * bitmap_blocks; i++)
+    {
+        setBlockUsedAndUpdateBitmap(fs, i);
+    }
+    fs->allocCursor = 0;
+    // PRESET BITMAP for post file system creation ABOVE
+
+    // write root_dir data block #3 (DirectoryEntry {"", UINT32_MAX} to initialize): its only bucket to begin with
+    _Alignas(uint32_t) uint8_t root_dir_data_block[fs->fsBlockSize];
+    empty_dir_block(fs, root_dir_data_block);
+    set_block_checksum(root_dir_data_block, fs->fsBlockSize);
+    RETURN_IF_ERR(cacheWrite(fs->blockCache, ROOT_DIR_DATA_BLOCK_NUM, root_dir_data_block));
+
+    // write root_dir Inode #2: a directory of one block, nothing is allocated ahead of use
+    Inode root_dir_inode = {0};
+    root_dir_inode.type = INODE_TYPE_DIR;
+    root_dir_inode.size = 0;
+    root_dir_inode.direct[0] = INVALID_BLOCK;
+    root_dir_inode.direct[1] = INVALID_BLOCK;
+    root_dir_inode.indirect = INVALID_BLOCK;
+    root_dir_inode.extent_header.count = 1;
+    root_dir_inode.extents[0] = (Extent){0, ROOT_DIR_DATA_BLOCK_NUM, 1}; // already made root_dir block
+    set_inode_checksum(&root_dir_inode);
+    RETURN_IF_ERR(write_block_head(fs, ROOT_INODE_BLOCK_NUM, &root_dir_inode));
+
+    // Superblock (transaction group 0: the freshly formatted tree)
+    memset(&fs->superBlock, 0, sizeof(Superblock));
+    fs->superBlock.type = 0x5A;
+    fs->superBlock.bitmap_block = bitmap_start;
+    fs->superBlock.bitmap_blocks = bitmap_blocks;
+    fs->superBlock.bitmap_spare = bitmap_start + bitmap_blocks;
+    fs->superBlock.features = SB_FEATURE_COUNTERS;
+    fs->superBlock.free_blocks = fs->freeBlocks;
+    fs->superBlock.file_count = 0;
+    fs->superBlock.root_dir_inode = ROOT_INODE_BLOCK_NUM;
+    fs->superBlock.fs_size = nBytes;
+    fs->superBlock.block_size = fs->fsBlockSize;
+    fs->superBlock.txg = 0;
+    fs->superBlock.log_device = fs->options.logDevice != NULL ? LOG_ON_DEVICE : LOG_ON_POOL;
+    fs->superBlock.zil_start = ZIL_START_BLOCK_NUM;
+    fs->superBlock.zil_blocks = zil_blocks;
+    fs->superBlock.zil_seq = 0;
+    fs->superBlock.zil_guid = new_log_guid();
+    set_superblock_checksum(&fs->superBlock);
+
+    //
+    // SUPERBLOCK + BITMAP + ROOT_DIR INODE + ROOT_DIR SET UP ATP
+    //
+
+    uint8_t bitmap_block[fs->fsBlockSize];
+    for (uint32_t i = 0; i < bitmap_blocks; i++)
+    { // both copies start out identical
+        memset(bitmap_block, 0, fs->fsBlockSize);
+        bitmap_block_bytes(fs, i, bitmap_block);
+        set_block_checksum(bitmap_block, fs->fsBlockSize);
+        RETURN_IF_ERR(cacheWrite(fs->blockCache, fs->superBlock.bitmap_block + i, bitmap_block));
+        RETURN_IF_ERR(cacheWrite(fs->blockCache, fs->superBlock.bitmap_spare + i, bitmap_block));
+    }
+    RETURN_IF_ERR(write_block_head(fs, SUPERBLOCK_BLOCK_NUM, &fs->superBlock));
+    RETURN_IF_ERR(closeCache(fs->blockCache)); // flushes the freshly formatted metadata
+    fs->blockCache = NULL;
+    closeDisk(disk_to_write);
+    fs->mountedDisk = -1;
+    return SUCCESS;
+}
+
+/* tfs_mount(char *filename) “mounts” a TinyFS file system located within an emulated libDisk disk called ‘filename’.
+tfs_unmount(void) “unmounts” the currently mounted file system.
+As part of the mount operation, tfs_mount should verify the file system is the correct type.
+Only one file system may be mounted at a time.
+Use tfs_unmount to cleanly unmount the currently mounted file system.
+Must return a specified success/error code. */
+int tfs_mount(char *filename)
+{
+    if (defaultFs != NULL)
+    {
+        printf("A filesystem is already mounted on the disk\n");
+        return FS_ERR_EXISTING_MOUNTED_FS;
+    }
+    int mount_err;
+    defaultFs = tfs_mount2(filename, NULL, &mount_err);
+    return defaultFs != NULL ? SUCCESS : mount_err;
+}
+
+/* tfs_mount() on an instance of its own: any number of file systems can be mounted side by side,
+each with its own cache, descriptor table and intent log. The instance is freed by tfs_unmount2(). */
+tfs_fs *tfs_mount2(char *filename, const TfsMountOptions *options, int *err)
+{
+    tfs_fs *fs = new_instance(options);
+    int mount_err = fs == NULL ? SYSTEM_ERROR : mount_instance(fs, filename);
+    if (err != NULL)
+    {
+        *err = mount_err;
+    }
+    if (mount_err != SUCCESS)
+    {
+        if (fs != NULL)
+        {
+            free_instance(fs);
+        }
+        return NULL;
+    }
+    return fs;
+}
+
+// inodes the root directory names, shadowed duplicates' counted once, for images that don't store the count
+// (they have no subdirectories: the first commit stores it)
+static int count_files(tfs_fs *fs, uint32_t *files)
+{
+    RETURN_IF_ERR(dir_load(fs, ROOT_DENTRY));
+    _Alignas(uint32_t) uint8_t block[fs->fsBlockSize];
+    DirectoryEntry *entries = (DirectoryEntry *)block;
+    *files = 0;
+    for (uint32_t k = 0; k < dir_blocks(dentry(fs, ROOT_DENTRY)); k++)
+    {
+        RETURN_IF_ERR(dir_read_block(fs, ROOT_DENTRY, k, block));
+        for (uint32_t i = 0; i < MAX_DIRECTORY_SIZE(fs->fsBlockSize); i++)
+        {
+            bool seen = entries[i].inode_block == INVALID_BLOCK;
+            for (uint32_t earlier = 0; !seen && earlier < i; earlier++)
+            { // duplicates share a name, so a bucket
+                seen = entries[earlier].inode_block == entries[i].inode_block;
+            }
+            *files += !seen;
+        }
+    }
+    return SUCCESS;
+}
+
+// reads the current bitmap copy <sb> names into memory, checking it covers the disk and marks itself used
+static int load_bitmap(tfs_fs *fs, const Superblock *sb)
+{
+    uint32_t num_blocks = sb->fs_size / fs->fsBlockSize;
+    uint32_t count = sb->bitmap_blocks != 0 ? sb->bitmap_blocks : 1;
+    if (sb->bitmap_blocks != 0 &&
+        (sb->bitmap_blocks != (num_blocks + BITMAP_BITS(fs->fsBlockSize) - 1) / BITMAP_BITS(fs->fsBlockSize) ||
+         sb->bitmap_block > num_blocks - count || sb->bitmap_spare > num_blocks - count))
+    {
+        printf("Attempted to mount file system with a bitmap that doesn't cover the disk\n");
+        return FS_ERR_MOUNTED_FS_INVALID_BITMAP;
+    }
+    if (sb->bitmap_block >= num_blocks)
+    {
+        printf("Attempted to mount file system with Bitmap block missing data\n");
+        return FS_ERR_MOUNTED_FS_INVALID_BITMAP;
+    }
+    fs->superBlock.bitmap_blocks = sb->bitmap_blocks; // bitmap_block_bits() goes by it before the mount completes
+    RETURN_IF_ERR(alloc_bitmaps(fs, num_blocks, sb->bitmap_blocks));
+    uint8_t block[fs->fsBlockSize];
+    for (uint32_t i = 0; i < count; i++)
+    {
+        RETURN_IF_ERR(cacheRead(fs->blockCache, sb->bitmap_block + i, block));
+        if (sb->bitmap_blocks != 0 && !verify_block_checksum(block, fs->fsBlockSize))
+        {
+            printf("Bitmap block %u checksum failed.\n", sb->bitmap_block + i);
+            return FS_ERR_MOUNTED_FS_INVALID_BITMAP;
+        }
+        load_bitmap_block(fs, i, block);
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (!bit_is_set(fs->bitmap, sb->bitmap_block + i) ||
+            (sb->bitmap_blocks != 0 && !bit_is_set(fs->bitmap, sb->bitmap_spare + i)))
+        {
+            printf("Attempted to mount file system with Bitmap block missing data\n");
+            return FS_ERR_MOUNTED_FS_INVALID_BITMAP;
+        }
+    }
+    if (sb->features & SB_FEATURE_COUNTERS)
+    { // the counters the last commit stored hold unless they can't
+        if (sb->free_blocks > fs->numBlocks)
+        {
+            printf("Attempted to mount file system with more free blocks than blocks\n");
+            return FS_ERR_MOUNTED_FS_INVALID_SUPERBLOCK;
+        }
+        fs->freeBlocks = sb->free_blocks;
+    }
+    else
+    {
+        count_bitmap(fs);
+    }
+    // a commit cut short may have left any of the spare copy half written
+    memset(fs->bitmapDirty, sb->bitmap_blocks != 0 ? BITMAP_CHANGED_LAST : 0, count);
+    return SUCCESS;
+}
+
+static int mount_instance(tfs_fs *fs, char *filename)
+{
+    // all errors will unmount disk
+    int disk = openDiskWithBackend(filename, 0, fs->options.diskBackend);
+    if (disk < 0)
+    {
+        return disk;
+    }
+    fs->mountedDisk = disk;
+
+    // validate SUPERBLOCK: its first BLOCK_SIZE bytes say how big every block is, so read them before the cache exists
+    Superblock super_block;
+    int read_err = readBlock(fs->mountedDisk, SUPERBLOCK_BLOCK_NUM, &super_block); // check FS type
+    if (read_err != SUCCESS)
+    {
+        ROLLBACK_MOUNT();
+        return read_err;
+    }
+    if (super_block.type != 0x5A)
+    {
+        ROLLBACK_MOUNT();
+        printf("Attempted to mount invalid file system type\n");
+        return FS_ERR_WRONG_FS_TYPE;
+    }
+    // verify superblock checksum
+    if (!verify_superblock_checksum(&super_block))
+    {
+        ROLLBACK_MOUNT();
+        printf("Superblock checksum failed.\n");
+        return FS_ERR_SB_CHECKSUM_FAILED;
+    }
+    uint32_t block_size = super_block.block_size != 0 ? super_block.block_size : BLOCK_SIZE; // 0: formatted before block sizes were stored
+    if (super_block.bitmap_block == INVALID_BLOCK || super_block.root_dir_inode == INVALID_BLOCK ||
+        block_size > DISK_MAX_BLOCK_SIZE || setDiskBlockSize(fs->mountedDisk, (int)block_size) != SUCCESS)
+    {
+        ROLLBACK_MOUNT();
+
+        printf("Attempted to mount file system with superblock missing data\n");
+        return FS_ERR_MOUNTED_FS_INVALID_SUPERBLOCK;
+    }
+    set_geometry(fs, block_size);
+    fs->blockCache = openCache(fs->mountedDisk, fs->options.cacheBudget);
+    if (fs->blockCache == NULL)
+    {
+        ROLLBACK_MOUNT();
+        return SYSTEM_ERROR;
+    }
+
+    // validate root_dir_inode: a directory, or on legacy images a file type whose direct[0] is the one block
+    Inode root_dir_inode;
+    read_err = read_block_head(fs, super_block.root_dir_inode, &root_dir_inode);
+    if (read_err != SUCCESS)
+    {
+        ROLLBACK_MOUNT();
+        return read_err;
+    }
+    if (INODE_IS_DIR(root_dir_inode.type) ? root_dir_inode.extent_header.count == 0
+                                          : root_dir_inode.direct[0] == INVALID_BLOCK)
+    {
+        ROLLBACK_MOUNT();
+
+        printf("Attempted to mount file system with root_dir Inode missing data\n");
+        return FS_ERR_MOUNTED_FS_INVALID_ROOT_DIR_INODE;
+    }
+
+    // validate bitmap_block
+    read_err = load_bitmap(fs, &super_block);
+    if (read_err != SUCCESS)
+    {
+        ROLLBACK_MOUNT();
+        return read_err;
+    }
+    if (!bit_is_set(fs->bitmap, SUPERBLOCK_BLOCK_NUM) ||
+        super_block.root_dir_inode >= fs->numBlocks || !bit_is_set(fs->bitmap, super_block.root_dir_inode))
+    {
+        ROLLBACK_MOUNT();
+
+        printf("Attempted to mount file system with Bitmap block missing data\n");
+        return FS_ERR_MOUNTED_FS_INVALID_BITMAP;
+    }
+
+    // validate root_dir: the rest of the tree is read as lookups reach it
+    read_err = dentry_cache_init(fs, super_block.root_dir_inode);
+    if (read_err == SUCCESS)
+    {
+        read_err = dir_load(fs, ROOT_DENTRY);
+    }
+    if (read_err == SUCCESS && !bit_is_set(fs->bitmap, dentry(fs, ROOT_DENTRY)->buckets[0]))
+    {
+        printf("Attempted to mount file system with Bitmap block missing data\n");
+        read_err = FS_ERR_MOUNTED_FS_INVALID_BITMAP;
+    }
+    if (read_err == SUCCESS && !(super_block.features & SB_FEATURE_COUNTERS))
+    {
+        read_err = count_files(fs, &fs->fileCount);
+    }
+    if (read_err != SUCCESS)
+    {
+        ROLLBACK_MOUNT();
+        return read_err == FS_ERR_CORRUPT_DIRECTORY ? FS_ERR_MOUNTED_FS_INVALID_ROOT_DIR : read_err;
+    }
+    if (super_block.features & SB_FEATURE_COUNTERS)
+    {
+        fs->fileCount = super_block.file_count;
+    }
+
+    // validated: allocation state stays in memory until unmount, changes collect in a new txg
+    fs->superBlock = super_block;
+    txg_reset(fs);
+    memset(&fs->lastScrub, 0, sizeof(fs->lastScrub));
+
+    int log_err = mount_intent_log(fs);
+    if (log_err != SUCCESS)
+    {
+        close_intent_log(fs);
+        ROLLBACK_MOUNT();
+        return log_err;
+    }
+    return SUCCESS;
+}
+
+int tfs_unmount2(tfs_fs *fs)
+{
+    if (fs == NULL)
+        return FS_ERR_NO_FS_MOUNTED;
+    // no call on <fs> may still be running or start from here on
+    drain_async_requests(fs); // their completions are dropped
+    RETURN_IF_ERR(tfs_scrub_stop2(fs)); // the scrub thread reads the disk we are about to close
+    RETURN_IF_ERR(tfs_sync2(fs));
+    close_intent_log(fs); // empty now that the commit covers everything
+    RETURN_IF_ERR(closeCache(fs->blockCache)); // write back everything still dirty
+    fs->blockCache = NULL;
+    RETURN_IF_ERR(closeDisk(fs->mountedDisk));
+    fs->mountedDisk = -1;
+    free_instance(fs);
+    return SUCCESS;
+}
+
+/* Sets the memory budget (bytes) of the block cache used by the next tfs_mkfs()/tfs_mount().
+0 disables caching so every block access goes straight to libDisk. */
+int tfs_setCacheBudget(size_t nBytes)
+{
+    if (defaultFs != NULL)
+    {
+        printf("tfs_setCacheBudget() called while a file system is mounted.\n");
+        return FS_ERR_EXISTING_MOUNTED_FS;
+    }
+    cacheBudget = nBytes;
+    return SUCCESS;
+}
+
+/* Sets the largest readahead window (bytes) of the next tfs_mount(): a descriptor that keeps reading the block after
+the one before has the blocks that follow prefetched into the cache, in a window that starts at READAHEAD_MIN_BLOCKS
+and doubles up to this. 0 disables readahead. */
+int tfs_setReadahead(uint32_t maxBytes)
+{
+    if (defaultFs != NULL)
+    {
+        printf("tfs_setReadahead() called while a file system is mounted.\n");
+        return FS_ERR_EXISTING_MOUNTED_FS;
+    }
+    readaheadBytes = maxBytes;
+    return SUCCESS;
+}
+
+/* Selects how the next tfs_mkfs()/tfs_mount() accesses the disk image:
+DISK_BACKEND_FILE (pread/pwrite) or DISK_BACKEND_MMAP (whole image mapped, block I/O is a memcpy).
+With the mmap backend the page cache already holds every block, so a small cache budget is usually enough. */
+int tfs_setDiskBackend(DiskBackend backend)
+{
+    if (defaultFs != NULL)
+    {
+        printf("tfs_setDiskBackend() called while a file system is mounted.\n");
+        return FS_ERR_EXISTING_MOUNTED_FS;
+    }
+    if (backend != DISK_BACKEND_FILE && backend != DISK_BACKEND_MMAP)
+    {
+        return DISK_ERR_DISK_OPEN_FAILED;
+    }
+    diskBackend = backend;
+    return SUCCESS;
+}
+
+/* Commits the open transaction group: every change so far is durable (fdatasync/msync) once this returns. */
+int tfs_sync2(tfs_fs *fs)
+{
+    if (fs == NULL)
+        return FS_ERR_NO_FS_MOUNTED;
+    pthread_mutex_lock(&fs->allocLock);
+    int sync_err = txg_commit(fs);
+    pthread_mutex_unlock(&fs->allocLock);
+    return sync_err;
+}
+
+/* Makes every operation so far durable, not only those on <FD>, without committing the transaction group:
+the intent log records since the last commit go out as one sequential write and one fdatasync(). Threads calling
+it at the same time share a single flush (group commit). Without a log, or once a record didn't fit in it,
+it commits the transaction group instead. */
+int tfs_fsync2(tfs_fs *fs, fileDescriptor FD)
+{
+    if (fs == NULL)
+        return FS_ERR_NO_FS_MOUNTED;
+    Descriptor *descriptor = find_descriptor(fs, FD);
+    if (descriptor == NULL || !__atomic_load_n(&descriptor->file.in_use, __ATOMIC_RELAXED))
+    {
+        printf("Attempted fsync on a file not in use.\n");
+        return FS_ERR_FILE_NOT_IN_USE;
+    }
+    // no lock: the log serializes its committers, and waiting for one leaves the file free for writers meanwhile
+    if (fs->zil == NULL || __atomic_load_n(&fs->zilGap, __ATOMIC_ACQUIRE) || zilCommit(fs->zil, zilLastLsn(fs->zil)) != SUCCESS)
+    { // log full or failed: the commit covers its records and empties it
+        pthread_mutex_lock(&fs->allocLock);
+        int sync_err = txg_commit(fs);
+        pthread_mutex_unlock(&fs->allocLock);
+        return sync_err;
+    }
+    return SUCCESS;
+}
+
+/* Keeps the intent log of the next tfs_mkfs()/tfs_mount() in its own file <filename> (created or resized to
+<nBytes> when nBytes > 0, like a disk) instead of the region tfs_mkfs() sets aside: a separate log device, ideally
+faster than the file system's. A file system mounted with one needs it at every later mount.
+NULL keeps the log in the file system for the next tfs_mkfs() and for file systems that never had a separate one. */
+int tfs_setLogDevice(char *filename, int nBytes)
+{
+    if (defaultFs != NULL)
+    {
+        printf("tfs_setLogDevice() called while a file system is mounted.\n");
+        return FS_ERR_EXISTING_MOUNTED_FS;
+    }
+    if (nBytes < 0)
+    {
+        return DISK_ERR_OPEN_DISK_BAD_ALIGNMENT;
+    }
+    char *name = NULL;
+    if (filename != NULL && (name = strdup(filename)) == NULL)
+    {
+        return SYSTEM_ERROR;
+    }
+    free(logDeviceName);
+    logDeviceName = name;
+    logDeviceBytes = nBytes;
+    return SUCCESS;
+}
+
+/* Sets when the open transaction group commits on its own: once it is <timeoutMs> old or has allocated or freed
+<maxDirtyBlocks> blocks, checked as each operation finishes. Bigger groups coalesce more metadata updates
+into each commit; whatever hasn't committed is lost in a crash. timeoutMs 0 commits after every operation. */
+int tfs_setTxgLimits(uint32_t timeoutMs, uint32_t maxDirtyBlocks)
+{
+    txgTimeoutMs = timeoutMs;
+    txgMaxDirty = maxDirtyBlocks;
+    if (defaultFs != NULL)
+    {
+        return tfs_setTxgLimits2(defaultFs, timeoutMs, maxDirtyBlocks);
+    }
+    return SUCCESS;
+}
+
+int tfs_setTxgLimits2(tfs_fs *fs, uint32_t timeoutMs, uint32_t maxDirtyBlocks)
+{
+    if (fs == NULL)
+        return FS_ERR_NO_FS_MOUNTED;
+    pthread_mutex_lock(&fs->allocLock);
+    fs->options.txgTimeoutMs = timeoutMs;
+    fs->options.txgMaxDirty = maxDirtyBlocks;
+    pthread_mutex_unlock(&fs->allocLock);
+    return SUCCESS;
+}
+
+/* Copies the block cache hit/miss/eviction counters of the mounted file system into <stats>. */
+int tfs_cacheStats2(tfs_fs *fs, CacheStats *stats)
+{
+    if (fs == NULL)
+        return FS_ERR_NO_FS_MOUNTED;
+    if (stats == NULL)
+        return UNSPECIFIED_ERROR;
+    getCacheStats(fs->blockCache, stats);
+    return SUCCESS;
+}
+
+// rescans region <r> of the bitmap for its edge and longest free runs
+static void summarize_region(tfs_fs *fs, uint32_t r)
+{
+    uint32_t end = (r + 1) * RUN_SUMMARY_WORDS < fs->bitmapWords ? (r + 1) * RUN_SUMMARY_WORDS : fs->bitmapWords;
+    uint32_t run = 0;
+    uint32_t longest = 0;
+    bool in_head = true;
+    RunSummary *summary = &fs->runSummary[r];
+    for (uint32_t w = r * RUN_SUMMARY_WORDS; w < end; w++)
+    {
+        uint64_t free_bits = ~taken_word(fs, w);
+        for (uint32_t bit = 0; bit < 64;)
+        {
+            uint64_t rest = free_bits >> bit;
+            uint32_t length;
+            if (rest & 1)
+            { // free stretch: ~rest has the bits shifted in set, so it ends by the end of the word
+                length = rest == UINT64_MAX ? 64 : (uint32_t)__builtin_ctzll(~rest);
+                run += length;
+            }
+            else
+            {
+                length = rest == 0 ? 64 - bit : (uint32_t)__builtin_ctzll(rest);
+                if (in_head)
+                {
+                    summary->head = run;
+                    in_head = false;
+                }
+                longest = run > longest ? run : longest;
+                run = 0;
+            }
+            bit += length;
+        }
+    }
+    if (in_head)
+    {
+        summary->head = run;
+    }
+    summary->tail = run;
+    summary->longest = run > longest ? run : longest;
+    summary->stale = false;
+}
+
+// longest run of free blocks: stale regions rescanned, then runs joined across the region bounds
+static uint32_t largest_free_run(tfs_fs *fs)
+{
+    uint32_t regions = (fs->bitmapWords + RUN_SUMMARY_WORDS - 1) / RUN_SUMMARY_WORDS;
+    uint32_t best = 0;
+    uint32_t carry = 0; // free run reaching the end of the regions so far
+    for (uint32_t r = 0; r < regions; r++)
+    {
+        if (fs->runSummary[r].stale)
+        {
+            summarize_region(fs, r);
+        }
+        const RunSummary *summary = &fs->runSummary[r];
+        uint32_t words = (r + 1) * RUN_SUMMARY_WORDS < fs->bitmapWords ? RUN_SUMMARY_WORDS : fs->bitmapWords - r * RUN_SUMMARY_WORDS;
+        if (summary->head == words * 64)
+        { // all free: the run goes on
+            carry += summary->head;
+            continue;
+        }
+        best = carry + summary->head > best ? carry + summary->head : best;
+        best = summary->longest > best ? summary->longest : best;
+        carry = summary->tail;
+    }
+    return carry > best ? carry : best;
+}
+
+/* tfs_statfs() fills <stats> from the counters the allocator keeps as it goes (stored in the superblock by every
+commit, so mounting doesn't count either) and the per-region free run summaries, so polling it costs next to
+nothing however big the disk is. */
+int tfs_statfs2(tfs_fs *fs, TfsStatfs *stats)
+{
+    if (fs == NULL)
+        return FS_ERR_NO_FS_MOUNTED;
+    if (stats == NULL)
+        return UNSPECIFIED_ERROR;
+    pthread_mutex_lock(&fs->allocLock);
+    stats->blockSize = fs->fsBlockSize;
+    stats->totalBlocks = fs->numBlocks;
+    stats->freeBlocks = fs->freeBlocks;
+    stats->usedBlocks = fs->numBlocks - fs->freeBlocks;
+    stats->files = fs->fileCount;
+    stats->largestFreeRun = largest_free_run(fs);
+    pthread_mutex_unlock(&fs->allocLock);
+    return SUCCESS;
+}
+
+static int scrub_stop_locked(tfs_fs *fs)
+{
+    if (fs->scrubber == NULL)
+        return SUCCESS;
+    int stop_err = stopScrub(fs->scrubber, &fs->lastScrub);
+    fs->scrubber = NULL;
+    return stop_err;
+}
+
+/* starts a background pass that verifies the checksum of every allocated block, at most <blocksPerSec>
+blocks per second (0 = unthrottled). Restarts the pass if one is already running. */
+int tfs_scrub_start2(tfs_fs *fs, uint32_t blocksPerSec)
+{
+    if (fs == NULL)
+        return FS_ERR_NO_FS_MOUNTED;
+    pthread_mutex_lock(&fs->allocLock);
+    int scrub_err = scrub_stop_locked(fs);
+    if (scrub_err == SUCCESS)
+    {
+        scrub_err = txg_commit(fs); // the scrubber walks the committed bitmap
+    }
+    uint8_t *bitmap = NULL; // the scrubber reads it as the on-disk bytes
+    if (scrub_err == SUCCESS && (bitmap = malloc((fs->numBlocks + 7) / 8)) == NULL)
+    {
+        scrub_err = SYSTEM_ERROR;
+    }
+    if (scrub_err == SUCCESS)
+    {
+        bitmap_get_bytes(fs->bitmap, 0, bitmap, (fs->numBlocks + 7) / 8);
+        uint32_t legacy_bitmap = fs->superBlock.bitmap_blocks == 0 ? fs->superBlock.bitmap_block : INVALID_BLOCK;
+        fs->scrubber = startScrub(fs->mountedDisk, fs->blockCache, bitmap, fs->numBlocks, legacy_bitmap, blocksPerSec);
+        if (fs->scrubber == NULL)
+        {
+            printf("Failed to start scrub thread.\n");
+            scrub_err = SYSTEM_ERROR;
+        }
+    }
+    free(bitmap);
+    pthread_mutex_unlock(&fs->allocLock);
+    return scrub_err;
+}
+
+/* progress and damaged blocks of the current pass, or of the last one once stopped */
+int tfs_scrub_status2(tfs_fs *fs, ScrubStatus *status)
+{
+    if (fs == NULL)
+        return FS_ERR_NO_FS_MOUNTED;
+    if (status == NULL)
+        return UNSPECIFIED_ERROR;
+    pthread_mutex_lock(&fs->allocLock);
+    if (fs->scrubber != NULL)
+        getScrubStatus(fs->scrubber, status);
+    else
+        *status = fs->lastScrub;
+    pthread_mutex_unlock(&fs->allocLock);
+    return SUCCESS;
+}
+
+/* stops the running pass (if any) and waits for its thread; its final status stays readable */
+int tfs_scrub_stop2(tfs_fs *fs)
+{
+    if (fs == NULL)
+        return FS_ERR_NO_FS_MOUNTED;
+    pthread_mutex_lock(&fs->allocLock);
+    int stop_err = scrub_stop_locked(fs);
+    pthread_mutex_unlock(&fs->allocLock);
+    return stop_err;
+}
+
+//
+#pragma endregion
+// EVERYTHING ABOVE IS CONCERNED WITH DISK OPERATIONS
+//=========================================================================================================================================
+//  EVERYTHING BELOW IS CONCERNED WITH FILE TABLES AND FILE DESCRIPTORS
+#pragma region
+//
+
+// creates what negative dentry <id> names, an empty file or <directory>: a new inode entered in its directory.
+// holds allocLock and dirLock
+static int create_locked(tfs_fs *fs, int id, bool directory)
+{
+    // build an empty inline inode (one block): data blocks are only allocated once a write outgrows it.
+    // a directory starts out as one empty bucket block
+    RETURN_IF_ERR(reserve_blocks(fs, (directory ? 2 : 1) + dentry_chain_blocks(fs, id), 0));
+    uint32_t inode_slot = find_free_block(fs);
+    if (inode_slot == INVALID_BLOCK)
+    {
+        printf("No free block available for a new inode.\n");
+        return FS_ERR_BITMAP_FULL;
+    }
+    setBlockUsedAndUpdateBitmap(fs, inode_slot);
+
+    Inode newInode = {0};
+    newInode.type = directory ? INODE_TYPE_DIR : INODE_TYPE_INLINE_RW_FILE;
+    newInode.size = 0;
+    newInode.direct[0] = INVALID_BLOCK;
+    newInode.direct[1] = INVALID_BLOCK;
+    newInode.indirect = INVALID_BLOCK;
+    int create_err = SUCCESS;
+    uint32_t bucket_block = INVALID_BLOCK;
+    if (directory)
+    {
+        if (find_free_run(fs, inode_slot + 1, 1, &bucket_block) == 0)
+        {
+            printf("No free block available for a new directory.\n");
+            bucket_block = INVALID_BLOCK;
+            create_err = FS_ERR_BITMAP_FULL;
+        }
+        else
+        {
+            setBlockUsedAndUpdateBitmap(fs, bucket_block);
+            _Alignas(uint32_t) uint8_t bucket[fs->fsBlockSize];
+            empty_dir_block(fs, bucket);
+            set_block_checksum(bucket, fs->fsBlockSize);
+            create_err = cacheWrite(fs->blockCache, bucket_block, bucket);
+            newInode.extent_header.count = 1;
+            newInode.extents[0] = (Extent){0, bucket_block, 1};
+        }
+    }
+    set_inode_checksum(&newInode);
+
+    // push inode, then commit updates to directory
+    Dentry *d = dentry(fs, id);
+    if (create_err == SUCCESS)
+        create_err = write_block_head(fs, inode_slot, &newInode);
+    if (create_err == SUCCESS)
+        create_err = dir_add_entry(fs, d->parent, d->name, inode_slot);
+    if (create_err != SUCCESS)
+    { // nothing reaches the new blocks yet
+        clearBlockUsedAndUpdateBitmap(fs, inode_slot);
+        if (bucket_block != INVALID_BLOCK)
+            clearBlockUsedAndUpdateBitmap(fs, bucket_block);
+        return create_err;
+    }
+    d->kind = directory ? DENTRY_DIR : DENTRY_FILE;
+    d->inode_block = inode_slot;
+    fs->fileCount++;
+    log_dentry_intent(fs, directory ? INTENT_MKDIR : INTENT_CREATE, id, 0, NULL, 0);
+    return txg_op_done(fs);
+}
+
+// tfs_open() of <path>, holding dirLock, and allocLock too if it may <create> the file
+static fileDescriptor open_locked(tfs_fs *fs, const char *path, bool create)
+{
+    int id;
+    RETURN_IF_ERR(resolve_path(fs, path, &id)); // a dentry cache hit reads no directory block at all
+    if (dentry(fs, id)->kind == DENTRY_DIR)
+    {
+        printf("tfs_open() of a directory.\n");
+        return FS_ERR_IS_A_DIRECTORY;
+    }
+    if (dentry(fs, id)->kind == DENTRY_NEGATIVE)
+    {
+        if (!create)
+        {
+            return FS_ERR_FILE_NOT_FOUND;
+        }
+        RETURN_IF_ERR(create_locked(fs, id, false));
+    }
+    return add_file_descriptor(fs, id);
+}
+
+/* Opens a file for reading and writing on the currently mounted file system.
+Creates a dynamic resource table entry for the file (the structure that tracks open files, the internal file pointer, etc.),
+and returns a file descriptor (integer) that can be used to reference this file while the filesystem is mounted.
+‘name’ is a file of the root directory or a path through subdirectories; only the last name is created if missing. */
+fileDescriptor tfs_open2(tfs_fs *fs, char *name)
+{
+    if (fs == NULL)
+    {
+        printf("tfs_open() called when no file systems were mounted.\n");
+        return FS_ERR_NO_FS_MOUNTED;
+    }
+    if (name == NULL || strlen(name) > TFS_MAX_PATH)
+    {
+        return FS_ERR_INVALID_FILENAME;
+    }
+    // validations end
+
+    pthread_mutex_lock(&fs->dirLock);
+    fileDescriptor fd = open_locked(fs, name, false);
+    pthread_mutex_unlock(&fs->dirLock);
+    if (fd != FS_ERR_FILE_NOT_FOUND)
+    {
+        return fd;
+    }
+
+    // creating: allocLock comes before dirLock, and another thread may have created it in between
+    pthread_mutex_lock(&fs->allocLock);
+    pthread_mutex_lock(&fs->dirLock);
+    fd = open_locked(fs, name, true);
+    pthread_mutex_unlock(&fs->dirLock);
+    pthread_mutex_unlock(&fs->allocLock);
+    return fd;
+}
+
+/* Creates an empty directory at ‘path’. Its parent directory must already exist. */
+int tfs_mkdir2(tfs_fs *fs, const char *path)
+{
+    if (fs == NULL)
+    {
+        return FS_ERR_NO_FS_MOUNTED;
+    }
+    if (path == NULL || strlen(path) > TFS_MAX_PATH)
+    {
+        printf("Invalid path argument in tfs_mkdir().\n");
+        return FS_ERR_INVALID_FILENAME;
+    }
+    pthread_mutex_lock(&fs->allocLock);
+    pthread_mutex_lock(&fs->dirLock);
+    int id;
+    int mkdir_err = resolve_path(fs, path, &id);
+    if (mkdir_err == SUCCESS && dentry(fs, id)->kind != DENTRY_NEGATIVE)
+    {
+        printf("tfs_mkdir() target name already exists.\n");
+        mkdir_err = FS_ERR_FILE_EXISTS;
+    }
+    if (mkdir_err == SUCCESS)
+    {
+        mkdir_err = create_locked(fs, id, true);
+    }
+    pthread_mutex_unlock(&fs->dirLock);
+    pthread_mutex_unlock(&fs->allocLock);
+    return mkdir_err;
+}
+
+/* Closes the file and removes dynamic resource table entry */
+int tfs_close2(tfs_fs *fs, fileDescriptor FD)
+{
+    if (fs == NULL)
+    {
+        return FS_ERR_NO_FS_MOUNTED;
+    }
+    Descriptor *descriptor = find_descriptor(fs, FD);
+    if (descriptor == NULL)
+    {
+        printf("Attempted to close file descriptor out of range.\n");
+        return FS_ERR_ACCESSED_OUT_OF_FILE_TABLE_RANGE;
+    }
+
+    // not the file's lock: a descriptor whose file was deleted behind it still closes
+    pthread_mutex_lock(&descriptor->lock);
+    if (!__atomic_load_n(&descriptor->file.in_use, __ATOMIC_ACQUIRE))
+    {
+        pthread_mutex_unlock(&descriptor->lock);
+        printf("Attempted close on file descriptor not in use.\n");
+        return FS_ERR_FILE_NOT_IN_USE;
+    }
+
+    release_file_descriptor(fs, FD);
+    pthread_mutex_unlock(&descriptor->lock);
+    return SUCCESS;
+}
+
+/* Writes buffer ‘buffer’ of size ‘size’, which represents an entire file’s contents,
+ to the file described by ‘FD’.
+ Sets the file pointer to 0 (the start of file) when done. Returns success/error codes. */
+int tfs_write2(tfs_fs *fs, fileDescriptor FD, const char *buffer, const int size)
+{
+    if (fs == NULL)
+    {
+        return FS_ERR_NO_FS_MOUNTED;
+    }
+    int lock_err = lock_descriptor_for_change(fs, FD);
+    if (lock_err != SUCCESS)
+    {
+        printf("Attempted write to a file not in use.\n");
+        return lock_err;
+    }
+    int write_err = write_locked(fs, FD, buffer, size);
+    unlock_descriptor_for_change(fs, FD);
+    return write_err;
+}
+
+static int write_locked(tfs_fs *fs, fileDescriptor FD, const char *buffer, const int size)
+{
+    if (size < 0)
+    {
+        printf("Attempted write with negative size\n");
+        return FS_ERR_INVALID_WRITE_SIZE;
+    }
+
+    const char *buf_pointer = buffer;
+
+    RETURN_IF_ERR(load_descriptor_inode(fs, FD));
+    Inode theinode = file_entry(fs, FD)->inode;
+
+    if (!INODE_IS_WRITABLE(theinode.type))
+    {
+        printf("Invalid permissions to write to file.\n");
+        return FS_ERR_INVALID_FILE_PERMISSION;
+    }
+    // every descriptor on this inode (this one included) re-reads it after the rewrite
+    invalidate_descriptors(fs, file_entry(fs, FD)->dir_slot, -1);
+
+    // previous contents are fully replaced: every block they use, in either inode format, becomes stale. none is
+    // reused by the new contents, since the inode still points at them until it is written
+    BlockChanges changes = {0};
+    int write_err = collect_inode_blocks(fs, &theinode, &changes.stale, &changes.stale);
+
+    // small files go in the inode: no data blocks at all
+    bool inline_data = (uint32_t)size <= INODE_INLINE_SIZE;
+    uint32_t num_chunks = inline_data ? 0 : ((uint32_t)size + fs->fsDataSize - 1) / fs->fsDataSize;
+    if (write_err == SUCCESS && num_chunks > 0)
+    {
+        pthread_mutex_lock(&fs->dirLock);
+        uint32_t chain = dentry_chain_blocks(fs, file_entry(fs, FD)->dir_slot);
+        pthread_mutex_unlock(&fs->dirLock);
+        write_err = reserve_blocks(fs, num_chunks + extent_tree_nodes(fs, num_chunks) + chain, 0);
+    }
+
+    // allocate the new contents as few contiguous runs as the bitmap allows, starting next to the inode
+    ExtentList new_runs = {0};
+    uint32_t goal = descriptor_inode_block(fs, FD) + 1;
+    for (uint32_t allocated = 0; write_err == SUCCESS && allocated < num_chunks;)
+    {
+        uint32_t start;
+        Extent *last = new_runs.count ? &new_runs.items[new_runs.count - 1] : NULL;
+        uint32_t length = find_free_run(fs, last ? last->start + last->length : goal, num_chunks - allocated, &start);
+        write_err = length == 0 ? FS_ERR_BITMAP_FULL : extent_list_push(&new_runs, (Extent){allocated, start, length});
+        if (write_err == SUCCESS)
+            write_err = take_blocks(fs, &changes, start, length);
+        allocated += length;
+    }
+
+    // stage every chunk, then push them as one batch (adjacent blocks become single large I/Os)
+    uint8_t *chunks = write_err == SUCCESS ? calloc(num_chunks + 1, fs->fsBlockSize) : NULL;
+    int *chunk_blocks = write_err == SUCCESS ? malloc((num_chunks + 1) * sizeof(int)) : NULL;
+    void **chunk_bufs = write_err == SUCCESS ? malloc((num_chunks + 1) * sizeof(void *)) : NULL;
+    if (write_err == SUCCESS && (chunks == NULL || chunk_blocks == NULL || chunk_bufs == NULL))
+    {
+        write_err = SYSTEM_ERROR;
+    }
+    if (write_err != SUCCESS)
+    {
+        free(chunks);
+        free(chunk_blocks);
+        free(chunk_bufs);
+        free(new_runs.items);
+        release_block_changes(fs, &changes, write_err);
+        return write_err;
+    }
+
+    int remaining_size = size;
+    uint32_t chunk = 0;
+    for (uint32_t r = 0; r < new_runs.count; r++)
+    {
+        for (uint32_t b = 0; b < new_runs.items[r].length; b++, chunk++)
+        {
+            uint8_t *chunk_buf = chunks + (size_t)chunk * fs->fsBlockSize;
+            int chunk_size = remaining_size > (int)fs->fsDataSize ? (int)fs->fsDataSize : remaining_size;
+            memcpy(chunk_buf, buf_pointer, chunk_size);
+            set_block_checksum(chunk_buf, fs->fsBlockSize);
+            chunk_blocks[chunk] = new_runs.items[r].start + b;
+            chunk_bufs[chunk] = chunk_buf;
+
+            remaining_size -= chunk_size;
+            buf_pointer += chunk_size;
+        }
+    }
+
+    write_err = num_chunks > 0 ? cacheWriteBlocks(fs->blockCache, num_chunks, chunk_blocks, chunk_bufs) : SUCCESS;
+    free(chunks);
+    free(chunk_blocks);
+    free(chunk_bufs);
+    if (write_err == SUCCESS)
+    { // legacy inodes are converted: the extent tree (or the inline data) replaces direct/indirect
+        theinode.direct[0] = INVALID_BLOCK;
+        theinode.direct[1] = INVALID_BLOCK;
+        theinode.indirect = INVALID_BLOCK;
+        memset(theinode.inline_data, 0, sizeof(theinode.inline_data));
+        if (inline_data)
+        {
+            theinode.type = INODE_TYPE_INLINE_RW_FILE;
+            if (size > 0)
+            {
+                memcpy(theinode.inline_data, buffer, size);
+            }
+        }
+        else
+        {
+            theinode.type = INODE_TYPE_EXTENT_RW_FILE;
+            write_err = store_extents(fs, &theinode, &new_runs, &changes.fresh);
+        }
+    }
+    free(new_runs.items);
+
+    // update inode
+    if (write_err == SUCCESS)
+    {
+        theinode.size = size;
+        set_inode_checksum(&theinode);
+        write_err = write_inode(fs, file_entry(fs, FD)->dir_slot, &theinode);
+    }
+    release_block_changes(fs, &changes, write_err);
+    RETURN_IF_ERR(write_err);
+    log_descriptor_intent(fs, INTENT_WRITE, FD, 0, buffer, (uint32_t)size);
+    RETURN_IF_ERR(txg_op_done(fs));
+
+    file_entry(fs, FD)->offset = 0;
+    return SUCCESS;
+}
+
+/* deletes a file and marks its blocks as free on disk. */
+int tfs_delete2(tfs_fs *fs, fileDescriptor FD)
+{
+    if (fs == NULL)
+    {
+        return FS_ERR_NO_FS_MOUNTED;
+    }
+    int lock_err = lock_descriptor_for_change(fs, FD);
+    if (lock_err != SUCCESS)
+    {
+        printf("Attempted delete on a file not in use.\n");
+        return lock_err;
+    }
+    int delete_err = delete_locked(fs, FD);
+    Descriptor *descriptor = find_descriptor(fs, FD);
+    pthread_mutex_unlock(&fs->allocLock);
+    pthread_rwlock_unlock(&dentry(fs, descriptor->file.dir_slot)->lock);
+    if (delete_err == SUCCESS)
+    {
+        release_file_descriptor(fs, FD);
+    }
+    pthread_mutex_unlock(&descriptor->lock);
+    return delete_err;
+}
+
+static int delete_locked(tfs_fs *fs, fileDescriptor FD)
+{
+    uint32_t inode_block = descriptor_inode_block(fs, FD);
+    // prevent root_dir Inode deletion
+    if (inode_block == fs->superBlock.root_dir_inode)
+    {
+        printf("Refused to delete root directory inode.\n");
+        return FS_ERR_PROTECTED_INODE;
+    }
+
+    RETURN_IF_ERR(load_descriptor_inode(fs, FD));
+    Inode theinode = file_entry(fs, FD)->inode;
+
+    if (!INODE_IS_WRITABLE(theinode.type))
+    {
+        printf("Invalid permissions to delete file.\n");
+        return FS_ERR_INVALID_FILE_PERMISSION;
+    }
+    invalidate_descriptors(fs, file_entry(fs, FD)->dir_slot, -1);
+
+    theinode.checksum = 0; // useless but making sure first ins is invalidate checksum
+    // MAKE SURE THAT ON MOUNT, MKFS, datablock initialized include inode's direct datablock and indirect datablocks
+
+    // every block the file owns (data, indirect/extent nodes, the inode) is freed once no entry names it. they are not
+    // wiped: the committed tree reaches them until the next commit, and whatever reuses them later writes them whole
+    BlockChanges changes = {0};
+    int delete_err = collect_inode_blocks(fs, &theinode, &changes.stale, &changes.stale);
+    if (delete_err == SUCCESS)
+    {
+        delete_err = extent_list_push(&changes.stale, (Extent){0, inode_block, 1});
+    }
+    if (delete_err != SUCCESS)
+    {
+        release_block_changes(fs, &changes, delete_err);
+        return delete_err;
+    }
+
+    log_descriptor_intent(fs, INTENT_DELETE, FD, 0, NULL, 0); // while the directory still names the file
+
+    // drop the directory entry naming this inode so the name and the inode block can be reused; the dentry stays
+    // cached as a negative one. other descriptors on the file are dead from here on: their incarnation no longer matches
+    pthread_mutex_lock(&fs->dirLock);
+    Dentry *d = dentry(fs, file_entry(fs, FD)->dir_slot);
+    delete_err = dir_replace_entries(fs, d->parent, d->name, inode_block, INVALID_BLOCK);
+    if (delete_err == SUCCESS)
+    {
+        d->incarnation++;
+        d->kind = DENTRY_NEGATIVE;
+        d->inode_block = INVALID_BLOCK;
+    }
+    pthread_mutex_unlock(&fs->dirLock);
+    release_block_changes(fs, &changes, delete_err);
+    RETURN_IF_ERR(delete_err);
+    fs->fileCount--;
+    return txg_op_done(fs);
+}
+
+/* reads one byte from the file and copies it to ‘buffer’, using the current file pointer location and incrementing it by one upon success.
+If the file pointer is already at the end of the file then tfs_readByte() should return an error and not increment the file pointer. */
+int tfs_readByte2(tfs_fs *fs, fileDescriptor FD, char *buffer)
+{
+    if (fs == NULL)
+    {
+        return FS_ERR_NO_FS_MOUNTED;
+    }
+    int lock_err = lock_descriptor(fs, FD, false);
+    if (lock_err != SUCCESS)
+    {
+        printf("Attempted read on a file not in use.\n");
+        return lock_err;
+    }
+    int read_err = read_byte_locked(fs, FD, buffer);
+    unlock_descriptor(fs, FD);
+    return read_err;
+}
+
+static int read_byte_locked(tfs_fs *fs, fileDescriptor FD, char *buffer)
+{
+
+    // inode, block map and current data block all come from the descriptor's cache
+    RETURN_IF_ERR(load_descriptor_inode(fs, FD));
+
+    if (file_entry(fs, FD)->offset >= file_entry(fs, FD)->inode.size)
+    {
+        printf("tfs_readbyte() EOF reached.\n");
+        return FS_ERR_READ_EOF;
+    }
+
+    if (INODE_IS_INLINE(file_entry(fs, FD)->inode.type))
+    {
+        *buffer = file_entry(fs, FD)->inode.inline_data[file_entry(fs, FD)->offset++];
+        return SUCCESS;
+    }
+
+    int datablock_depth = file_entry(fs, FD)->offset / fs->fsDataSize;
+    int datablock_offset = file_entry(fs, FD)->offset % fs->fsDataSize;
+    RETURN_IF_ERR(load_descriptor_map(fs, FD));
+
+    uint32_t datablock_num = descriptor_block(fs, FD, datablock_depth);
+    if (datablock_num == INVALID_BLOCK) // check datablock still valid
+    {
+        return FS_ERR_READ_EOF;
+    }
+    if ((uint32_t)datablock_depth != file_entry(fs, FD)->ra_last)
+    { // first byte of this block: the next ones may already be on their way while it loads
+        readahead(fs, FD, datablock_depth, datablock_depth);
+    }
+    RETURN_IF_ERR(load_descriptor_data(fs, FD, datablock_num));
+    *buffer = file_entry(fs, FD)->data[datablock_offset];
+
+    file_entry(fs, FD)->offset++;
+    return SUCCESS;
+}
+
+/* reads up to ‘size’ bytes from the current file pointer into ‘buffer’ and advances the file pointer by the amount read.
+Returns the number of bytes read, which is short (or 0) at the end of the file, like POSIX read().
+The inode and block map come from the descriptor's cache and every data block in the span is fetched as one batch. */
+int tfs_read2(tfs_fs *fs, fileDescriptor FD, char *buffer, int size)
+{
+    if (fs == NULL)
+    {
+        return FS_ERR_NO_FS_MOUNTED;
+    }
+    if (find_descriptor(fs, FD) == NULL)
+    {
+        printf("Attempted read with file descriptor out of range.\n");
+        return FS_ERR_ACCESSED_OUT_OF_FILE_TABLE_RANGE;
+    }
+    if (size < 0 || (buffer == NULL && size > 0))
+    {
+        printf("Attempted read with invalid size or buffer.\n");
+        return FS_ERR_INVALID_READ_SIZE;
+    }
+    int lock_err = lock_descriptor(fs, FD, false);
+    if (lock_err != SUCCESS)
+    {
+        printf("Attempted read on a file not in use.\n");
+        return lock_err;
+    }
+    int copied = read_locked(fs, FD, buffer, size);
+    unlock_descriptor(fs, FD);
+    return copied;
+}
+
+static int read_locked(tfs_fs *fs, fileDescriptor FD, char *buffer, int size)
+{
+
+    RETURN_IF_ERR(load_descriptor_inode(fs, FD));
+    uint32_t file_size = file_entry(fs, FD)->inode.size;
+
+    int offset = file_entry(fs, FD)->offset;
+    if (size == 0 || offset >= (int)file_size)
+    {
+        return 0; // EOF
+    }
+    int to_read = ((int)file_size - offset) < size ? ((int)file_size - offset) : size;
+    if (INODE_IS_INLINE(file_entry(fs, FD)->inode.type))
+    {
+        memcpy(buffer, file_entry(fs, FD)->inode.inline_data + offset, to_read);
+        file_entry(fs, FD)->offset += to_read;
+        return to_read;
+    }
+
+    int first_depth = offset / fs->fsDataSize;
+    int last_depth = (offset + to_read - 1) / fs->fsDataSize;
+    int num_blocks = last_depth - first_depth + 1;
+    RETURN_IF_ERR(load_descriptor_map(fs, FD));
+
+    uint8_t *blocks = malloc((size_t)num_blocks * fs->fsBlockSize);
+    int *block_nums = malloc(num_blocks * sizeof(int));
+    void **block_bufs = malloc(num_blocks * sizeof(void *));
+    if (blocks == NULL || block_nums == NULL || block_bufs == NULL)
+    {
+        free(blocks);
+        free(block_nums);
+        free(block_bufs);
+        return SYSTEM_ERROR;
+    }
+
+    for (int i = 0; i < num_blocks; i++)
+    {
+        uint32_t datablock_num = descriptor_block(fs, FD, first_depth + i);
+        if (datablock_num == INVALID_BLOCK)
+        { // size claims more blocks than are mapped: stop at the last mapped one
+            num_blocks = i;
+            break;
+        }
+        block_nums[i] = datablock_num;
+        block_bufs[i] = blocks + (size_t)i * fs->fsBlockSize;
+    }
+    readahead(fs, FD, first_depth, last_depth);
+
+    int read_err = cacheReadBlocks(fs->blockCache, num_blocks, block_nums, block_bufs);
+    int copied = 0;
+    if (read_err == SUCCESS)
+    {
+        int datablock_offset = offset % fs->fsDataSize;
+        for (int i = 0; i < num_blocks && copied < to_read; i++)
+        {
+            int span = fs->fsDataSize - datablock_offset;
+            if (span > to_read - copied)
+                span = to_read - copied;
+            memcpy(buffer + copied, (uint8_t *)block_bufs[i] + datablock_offset, span);
+            copied += span;
+            datablock_offset = 0;
+        }
+        if (num_blocks > 0 && descriptor_buffer(fs, FD) != NULL)
+        { // keep the last block for a following tfs_readByte()
+            memcpy(file_entry(fs, FD)->data, block_bufs[num_blocks - 1], fs->fsBlockSize);
+            file_entry(fs, FD)->data_block = block_nums[num_blocks - 1];
+        }
+    }
+    free(blocks);
+    free(block_nums);
+    free(block_bufs);
+    RETURN_IF_ERR(read_err);
+
+    file_entry(fs, FD)->offset += copied;
+    return copied;
+}
+
+/* change the file pointer location to offset (absolute). Returns success/error codes.*/
+int tfs_seek2(tfs_fs *fs, fileDescriptor FD, int offset)
+{
+    if (fs == NULL)
+    {
+        return FS_ERR_NO_FS_MOUNTED;
+    }
+
+    int lock_err = lock_descriptor(fs, FD, false);
+    if (lock_err != SUCCESS)
+    {
+        printf("Attempted read on a file not in use.\n");
+        return lock_err;
+    }
+
+    int seek_err = load_descriptor_inode(fs, FD);
+    if (seek_err == SUCCESS && (offset < 0 || offset >= file_entry(fs, FD)->inode.size))
+    {
+        seek_err = FS_ERR_INVALID_OFFSET;
+    }
+    if (seek_err == SUCCESS)
+    {
+        file_entry(fs, FD)->offset = offset;
+    }
+    unlock_descriptor(fs, FD);
+    return seek_err;
+}
+
+/* renames, or moves to another directory, the file or directory at ‘old_name’ to the path ‘new_name’, which must not
+exist yet. Open descriptors stay on the file. */
+int tfs_rename2(tfs_fs *fs, const char *old_name, const char *new_name)
+{
+    if (fs == NULL)
+    {
+        return FS_ERR_NO_FS_MOUNTED;
+    }
+
+    if (old_name == NULL || new_name == NULL || strlen(new_name) > TFS_MAX_PATH)
+    {
+        printf("Attempted to rename with invalid arguments.\n");
+        return FS_ERR_INVALID_FILENAME;
+    }
+
+    pthread_mutex_lock(&fs->allocLock);
+    pthread_mutex_lock(&fs->dirLock);
+    int rename_err = rename_locked(fs, old_name, new_name);
+    pthread_mutex_unlock(&fs->dirLock);
+    pthread_mutex_unlock(&fs->allocLock);
+    return rename_err;
+}
+
+static int rename_locked(tfs_fs *fs, const char *old_path, const char *new_path)
+{
+    int id;
+    int rename_err = resolve_path(fs, old_path, &id);
+    if (rename_err == FS_ERR_FILE_NOT_FOUND || (rename_err == SUCCESS && dentry(fs, id)->kind == DENTRY_NEGATIVE))
+    {
+        printf("Filename not found in tfs_rename()\n");
+        return FS_ERR_FILE_NOT_FOUND;
+    }
+    RETURN_IF_ERR(rename_err);
+    char logged_path[TFS_MAX_PATH + 1];
+    if (!dentry_path(fs, id, logged_path))
+    {
+        return FS_ERR_INVALID_FILENAME;
+    }
+
+    dentry_hold(fs, id); // resolving the new path may evict dentries, never this one or its directories
+    int dir;
+    char new_key[8];
+    int target = -1;
+    rename_err = resolve_parent(fs, new_path, &dir, new_key);
+    if (rename_err == SUCCESS && !(dir == dentry(fs, id)->parent && memcmp(new_key, dentry(fs, id)->name, 8) == 0))
+    {
+        rename_err = dir_lookup(fs, dir, new_key, &target);
+    }
+    if (rename_err == SUCCESS && target != -1 && dentry(fs, target)->kind != DENTRY_NEGATIVE)
+    {
+        printf("tfs_rename() target name already exists.\n");
+        rename_err = FS_ERR_FILE_EXISTS;
+    }
+    for (int up = dir; rename_err == SUCCESS && target != -1 && up != -1; up = dentry(fs, up)->parent)
+    {
+        if (up == id)
+        {
+            printf("tfs_rename() can't move a directory into itself.\n");
+            rename_err = FS_ERR_INVALID_FILENAME;
+        }
+    }
+    if (rename_err == SUCCESS && target != -1)
+    {
+        Dentry *d = dentry(fs, id);
+        rename_err = dir_add_entry(fs, dir, new_key, d->inode_block);
+        if (rename_err == SUCCESS)
+        {
+            rename_err = dir_replace_entries(fs, d->parent, d->name, d->inode_block, INVALID_BLOCK);
+        }
+        if (rename_err == SUCCESS)
+        { // the dentry keeps its identity (lock, descriptors, cached children) under the new name,
+          // which the target's negative dentry gives up
+            dentry_unhash(fs, target);
+            if (dentry(fs, target)->refs == 0)
+            {
+                dentry_evict(fs, target);
+            }
+            dentry_hold(fs, dir);
+            dentry_unhash(fs, id);
+            dentry_put(fs, d->parent);
+            dentry_rehash(fs, id, dir, new_key);
+            char logged_new_path[TFS_MAX_PATH + 1];
+            if (dentry_path(fs, id, logged_new_path))
+                log_intent(fs, INTENT_RENAME, logged_path, logged_new_path, 0, NULL, 0);
+            else
+                __atomic_store_n(&fs->zilGap, true, __ATOMIC_RELEASE);
+            rename_err = txg_op_done(fs);
+        }
+    }
+    dentry_put(fs, id);
+    return rename_err;
+}
+
+int tfs_readdir2(tfs_fs *fs) // only statically prints the root dir
+{
+    if (fs == NULL)
+    {
+        printf("tfs_readdir() called when no file systems were mounted.\n");
+        return FS_ERR_NO_FS_MOUNTED;
+    }
+    _Alignas(uint32_t) uint8_t root_dir[fs->fsBlockSize];
+    DirectoryEntry *entries = (DirectoryEntry *)root_dir;
+    pthread_mutex_lock(&fs->dirLock);
+    int read_err = dir_load(fs, ROOT_DENTRY);
+    if (read_err == SUCCESS)
+    {
+        printf("Root Directory: ");
+    }
+    for (uint32_t k = 0; read_err == SUCCESS && k < dir_blocks(dentry(fs, ROOT_DENTRY)); k++)
+    {
+        read_err = dir_read_block(fs, ROOT_DENTRY, k, root_dir);
+        for (uint32_t i = 0; read_err == SUCCESS && i < MAX_DIRECTORY_SIZE(fs->fsBlockSize); i++)
+        {
+            if (entries[i].inode_block != INVALID_BLOCK)
+            {
+                printf(" - %.8s\n", entries[i].name);
+            }
+        }
+    }
+    pthread_mutex_unlock(&fs->dirLock);
+    return read_err;
+}
+
+// tfs_makeRO()/tfs_makeRW(): rewrites the type of the file at <path>, holding its lock exclusive
+static int set_file_writable(tfs_fs *fs, const char *path, bool writable)
+{
+    pthread_mutex_lock(&fs->dirLock);
+    int slot;
+    int permission_err = resolve_path(fs, path, &slot);
+    if (permission_err == SUCCESS && dentry(fs, slot)->kind == DENTRY_NEGATIVE)
+    {
+        permission_err = FS_ERR_FILE_NOT_FOUND;
+    }
+    else if (permission_err == SUCCESS && dentry(fs, slot)->kind == DENTRY_DIR)
+    {
+        printf("Directories have no read-only mode.\n");
+        permission_err = FS_ERR_IS_A_DIRECTORY;
+    }
+    uint32_t incarnation = 0;
+    if (permission_err == SUCCESS)
+    {
+        incarnation = dentry(fs, slot)->incarnation;
+        dentry_hold(fs, slot); // stays cached while we wait for its lock
+    }
+    pthread_mutex_unlock(&fs->dirLock);
+    RETURN_IF_ERR(permission_err);
+
+    Dentry *d = dentry(fs, slot);
+    pthread_rwlock_wrlock(&d->lock);
+    if (d->incarnation != incarnation)
+    { // deleted in between
+        permission_err = FS_ERR_FILE_NOT_FOUND;
+    }
+    else
+    {
+        pthread_mutex_lock(&fs->allocLock);
+        Inode theinode;
+        permission_err = read_block_head(fs, d->inode_block, &theinode);
+        if (permission_err == SUCCESS)
+        {
+            theinode.type = inode_type_with_permission(theinode.type, writable);
+            set_inode_checksum(&theinode);
+            invalidate_descriptors(fs, slot, -1);
+            permission_err = write_inode(fs, slot, &theinode);
+        }
+        if (permission_err == SUCCESS)
+        {
+            pthread_mutex_lock(&fs->dirLock);
+            log_dentry_intent(fs, writable ? INTENT_MAKE_RW : INTENT_MAKE_RO, slot, 0, NULL, 0);
+            pthread_mutex_unlock(&fs->dirLock);
+            permission_err = txg_op_done(fs);
+        }
+        pthread_mutex_unlock(&fs->allocLock);
+    }
+    pthread_rwlock_unlock(&d->lock);
+    pthread_mutex_lock(&fs->dirLock);
+    dentry_put(fs, slot);
+    pthread_mutex_unlock(&fs->dirLock);
+    return permission_err;
+}
+
+int tfs_makeRO2(tfs_fs *fs, const char *name)
+{ // admin level action
+    if (fs == NULL)
+    {
+        return FS_ERR_NO_FS_MOUNTED;
+    }
+
+    if (name == NULL || strlen(name) > TFS_MAX_PATH)
+    {
+        printf("Invalid filename argument in tfs_makeRO().\n");
+        return FS_ERR_INVALID_FILENAME;
+    }
+
+    int permission_err = set_file_writable(fs, name, false);
+    if (permission_err == FS_ERR_FILE_NOT_FOUND)
+    {
+        printf("Filename not found in tfs_makeRO()\n");
+    }
+    return permission_err;
+}
+
+int tfs_makeRW2(tfs_fs *fs, const char *name)
+{ // admin level action
+    if (fs == NULL)
+    {
+        return FS_ERR_NO_FS_MOUNTED;
+    }
+
+    if (name == NULL || strlen(name) > TFS_MAX_PATH)
+    {
+        printf("Invalid filename argument in tfs_makeRW().\n");
+        return FS_ERR_INVALID_FILENAME;
+    }
+
+    int permission_err = set_file_writable(fs, name, true);
+    if (permission_err == FS_ERR_FILE_NOT_FOUND)
+    {
+        printf("Filename not found in tfs_makeRW()\n");
+    }
+    return permission_err;
+}
+
+int tfs_writeByte2(tfs_fs *fs, fileDescriptor FD, int offset, const unsigned char data)
+{
+    if (fs == NULL)
+    {
+        return FS_ERR_NO_FS_MOUNTED;
+    }
+    int lock_err = lock_descriptor_for_change(fs, FD);
+    if (lock_err != SUCCESS)
+    {
+        printf("Attempted write on a file not in use.\n");
+        return lock_err;
+    }
+    int write_err = write_byte_locked(fs, FD, offset, data);
+    unlock_descriptor_for_change(fs, FD);
+    return write_err;
+}
+
+static int write_byte_locked(tfs_fs *fs, fileDescriptor FD, int offset, const unsigned char data)
+{
+
+    // get Inode block
+    RETURN_IF_ERR(load_descriptor_inode(fs, FD));
+    const Inode *theinode = &file_entry(fs, FD)->inode;
+
+    if (!INODE_IS_WRITABLE(theinode->type))
+    {
+        printf("Invalid permissions to write to file.\n");
+        return FS_ERR_INVALID_FILE_PERMISSION;
+    }
+
+    if (offset >= theinode->size || offset < 0)
+    {
+        printf("Attempted tfs_writebyte() from EOF.\n");
+        return FS_ERR_READ_EOF;
+    }
+
+    if (INODE_IS_INLINE(theinode->type))
+    { // the byte lives in the inode: update this descriptor's copy and write it through
+        Inode *inode = &file_entry(fs, FD)->inode;
+        inode->inline_data[offset] = data;
+        set_inode_checksum(inode);
+        int write_err = write_inode(fs, file_entry(fs, FD)->dir_slot, inode);
+        if (write_err != SUCCESS)
+        {
+            file_entry(fs, FD)->inode_valid = false;
+            return write_err;
+        }
+        invalidate_descriptors(fs, file_entry(fs, FD)->dir_slot, FD);
+        log_descriptor_intent(fs, INTENT_PWRITE, FD, (uint32_t)offset, &data, 1);
+        return txg_op_done(fs);
+    }
+
+    int datablock_depth = offset / fs->fsDataSize;
+    int datablock_offset = offset % fs->fsDataSize;
+    RETURN_IF_ERR(load_descriptor_map(fs, FD));
+
+    uint32_t datablock_num = descriptor_block(fs, FD, datablock_depth);
+    if (datablock_num == INVALID_BLOCK) // check datablock still valid
+    {
+        return FS_ERR_READ_EOF;
+    }
+    if (!block_is_uncommitted(fs, datablock_num))
+    { // the committed tree reads this block: the byte goes to this txg's copy of it, like any partial write
+        return write_range(fs, FD, (uint32_t)offset, (const char *)&data, 1);
+    }
+    // modify this descriptor's copy of the block in place, then write it through
+    RETURN_IF_ERR(load_descriptor_data(fs, FD, datablock_num));
+    uint8_t *block = file_entry(fs, FD)->data;
+    block[datablock_offset] = data;
+    set_block_checksum(block, fs->fsBlockSize);
+    int write_err = cacheWrite(fs->blockCache, datablock_num, block);
+    if (write_err != SUCCESS)
+    {
+        file_entry(fs, FD)->data_block = INVALID_BLOCK;
+        return write_err;
+    }
+    invalidate_descriptors(fs, file_entry(fs, FD)->dir_slot, FD);
+    log_descriptor_intent(fs, INTENT_PWRITE, FD, (uint32_t)offset, &data, 1);
+
+    // doesn't auto increment offset like readByte
+    return txg_op_done(fs);
+}
+/* writes ‘size’ bytes of ‘buffer’ at byte ‘offset’ of the file without rewriting the rest of it.
+Writing past the end of file grows it, zero-filling any gap. The file pointer is not moved. Returns success/error codes. */
+int tfs_pwrite2(tfs_fs *fs, fileDescriptor FD, int offset, const char *buffer, int size)
+{
+    if (fs == NULL)
+    {
+        return FS_ERR_NO_FS_MOUNTED;
+    }
+    if (find_descriptor(fs, FD) == NULL)
+    {
+        printf("Attempted write with file descriptor out of range.\n");
+        return FS_ERR_ACCESSED_OUT_OF_FILE_TABLE_RANGE;
+    }
+    int lock_err = lock_descriptor_for_change(fs, FD);
+    if (lock_err != SUCCESS)
+    {
+        printf("Attempted write to a file not in use.\n");
+        return lock_err;
+    }
+    int write_err = pwrite_locked(fs, FD, offset, buffer, size);
+    unlock_descriptor_for_change(fs, FD);
+    return write_err;
+}
+
+static int pwrite_locked(tfs_fs *fs, fileDescriptor FD, int offset, const char *buffer, int size)
+{
+    if (offset < 0)
+    {
+        printf("Attempted tfs_pwrite() at a negative offset.\n");
+        return FS_ERR_INVALID_OFFSET;
+    }
+    if (size < 0 || (buffer == NULL && size > 0) || size > INT_MAX - offset)
+    {
+        printf("Attempted write with invalid size or buffer.\n");
+        return FS_ERR_INVALID_WRITE_SIZE;
+    }
+    return write_range(fs, FD, (uint32_t)offset, buffer, (uint32_t)size);
+}
+
+/* writes ‘size’ bytes of ‘buffer’ at the end of the file. The file pointer is not moved. */
+int tfs_append2(tfs_fs *fs, fileDescriptor FD, const char *buffer, int size)
+{
+    if (fs == NULL)
+    {
+        return FS_ERR_NO_FS_MOUNTED;
+    }
+    int lock_err = lock_descriptor_for_change(fs, FD);
+    if (lock_err != SUCCESS)
+    {
+        printf("Attempted append to a file not in use.\n");
+        return lock_err;
+    }
+    int append_err = load_descriptor_inode(fs, FD);
+    uint32_t file_size = file_entry(fs, FD)->inode.size;
+    if (append_err == SUCCESS)
+    { // the end can't move before the write: the file's lock is held throughout
+        append_err = file_size > INT_MAX ? FS_ERR_INVALID_WRITE_SIZE : pwrite_locked(fs, FD, (int)file_size, buffer, size);
+    }
+    unlock_descriptor_for_change(fs, FD);
+    return append_err;
+}
+
+/* sets the file's size to ‘size’: shrinking frees the blocks past the new end, growing zero-fills. */
+int tfs_truncate2(tfs_fs *fs, fileDescriptor FD, int size)
+{
+    if (fs == NULL)
+    {
+        return FS_ERR_NO_FS_MOUNTED;
+    }
+    int lock_err = lock_descriptor_for_change(fs, FD);
+    if (lock_err != SUCCESS)
+    {
+        printf("Attempted truncate on a file not in use.\n");
+        return lock_err;
+    }
+    int truncate_err = truncate_locked(fs, FD, size);
+    unlock_descriptor_for_change(fs, FD);
+    return truncate_err;
+}
+
+static int truncate_locked(tfs_fs *fs, fileDescriptor FD, int size)
+{
+    if (size < 0)
+    {
+        printf("Attempted truncate to a negative size.\n");
+        return FS_ERR_INVALID_WRITE_SIZE;
+    }
+
+    RETURN_IF_ERR(load_descriptor_inode(fs, FD));
+    Inode theinode = file_entry(fs, FD)->inode;
+    if (!INODE_IS_WRITABLE(theinode.type))
+    {
+        printf("Invalid permissions to truncate file.\n");
+        return FS_ERR_INVALID_FILE_PERMISSION;
+    }
+    if ((uint32_t)size >= theinode.size)
+    {
+        return write_range(fs, FD, (uint32_t)size, NULL, 0); // grow (or no-op)
+    }
+    invalidate_descriptors(fs, file_entry(fs, FD)->dir_slot, -1);
+    if (INODE_IS_INLINE(theinode.type))
+    { // bytes past the end of an inline file are kept zeroed
+        memset(theinode.inline_data + size, 0, theinode.size - size);
+        theinode.size = (uint32_t)size;
+        set_inode_checksum(&theinode);
+        RETURN_IF_ERR(write_inode(fs, file_entry(fs, FD)->dir_slot, &theinode));
+        log_descriptor_intent(fs, INTENT_TRUNCATE, FD, (uint32_t)size, NULL, 0);
+        return txg_op_done(fs);
+    }
+
+    // shrink: cut the runs at the new last block and free everything after it
+    uint32_t old_blocks = (theinode.size + fs->fsDataSize - 1) / fs->fsDataSize;
+    uint32_t keep_blocks = ((uint32_t)size + fs->fsDataSize - 1) / fs->fsDataSize;
+    ExtentList runs = {0};
+    BlockChanges changes = {0};
+    int truncate_err = load_runs_for_update(fs, &theinode, old_blocks, &runs, &changes);
+    uint32_t kept = 0;
+    for (uint32_t i = 0; truncate_err == SUCCESS && i < runs.count; i++)
+    {
+        Extent *run = &runs.items[i];
+        if (run->logical >= keep_blocks)
+        {
+            truncate_err = extent_list_push(&changes.stale, *run);
+            continue;
+        }
+        if (run->logical + run->length > keep_blocks)
+        {
+            uint32_t cut = run->logical + run->length - keep_blocks;
+            truncate_err = extent_list_push(&changes.stale, (Extent){keep_blocks, run->start + run->length - cut, cut});
+            run->length -= cut;
+        }
+        runs.items[kept++] = *run;
+    }
+    runs.count = kept;
+    if (truncate_err == SUCCESS)
+    {
+        truncate_err = rewrite_extent_tree(fs, &theinode, &runs, &changes);
+    }
+    free(runs.items);
+    if (truncate_err == SUCCESS)
+    {
+        theinode.size = (uint32_t)size;
+        set_inode_checksum(&theinode);
+        truncate_err = write_inode(fs, file_entry(fs, FD)->dir_slot, &theinode);
+    }
+    release_block_changes(fs, &changes, truncate_err);
+    RETURN_IF_ERR(truncate_err);
+    log_descriptor_intent(fs, INTENT_TRUNCATE, FD, (uint32_t)size, NULL, 0);
+    return txg_op_done(fs);
+}
+#pragma endregion
+
+#pragma region
+// asynchronous requests: tfs_submit_read() and tfs_submit_write() return a token at once, and a completion carrying
+// it goes into the instance's queue when the request is done
+
+struct AsyncRequest {
+    tfs_fs *fs;
+    int64_t token;
+    AsyncRequest *next;                           // the write queue
+
+    // writes: handed to tfs_pwrite2() by a worker
+    fileDescriptor FD;
+    int offset;
+    const char *source;
+    int size;
+
+    // reads: every block of the span, the cached ones copied at submission and the rest fetched by libDisk
+    char *buffer;
+    int copied;                                   // bytes already in buffer (inline files)
+    int firstOffset;                              // of the span in its first block
+    int length;                                   // bytes the span covers
+    int dirSlot;                                  // the pinned file while blocks are missing
+    uint8_t *blocks;
+    int numBlocks;
+    int *blockNums;
+    void **blockBufs;
+    bool *resident;
+    int numMissing;
+    int *missingNums;
+    void **missingBufs;
+};
+
+static void free_async_request(AsyncRequest *request)
+{
+    free(request->blocks);
+    free(request->blockNums);
+    free(request->blockBufs);
+    free(request->resident);
+    free(request->missingNums);
+    free(request->missingBufs);
+    free(request);
+}
+
+// hands out a token and makes room for its completion up front (asyncLock held)
+static int begin_request_locked(tfs_fs *fs, AsyncRequest *request)
+{
+    int needed = fs->completionCount + (int)fs->asyncInFlight + 1;
+    if (needed > fs->completionCapacity)
+    { // unwrap the ring into a bigger one
+        int capacity = fs->completionCapacity > 0 ? 2 * fs->completionCapacity : 64;
+        TfsCompletion *grown = malloc(capacity * sizeof(TfsCompletion));
+        if (grown == NULL)
+        {
+            return SYSTEM_ERROR;
+        }
+        for (int i = 0; i < fs->completionCount; i++)
+        {
+            grown[i] = fs->completions[(fs->completionHead + i) % fs->completionCapacity];
+        }
+        free(fs->completions);
+        fs->completions = grown;
+        fs->completionCapacity = capacity;
+        fs->completionHead = 0;
+    }
+    request->fs = fs;
+    request->token = ++fs->lastToken;
+    fs->asyncInFlight++;
+    return SUCCESS;
+}
+
+// the request was refused after begin_request_locked(): no completion will come
+static void cancel_request(tfs_fs *fs)
+{
+    pthread_mutex_lock(&fs->asyncLock);
+    fs->asyncInFlight--;
+    pthread_cond_broadcast(&fs->asyncChanged);
+    pthread_mutex_unlock(&fs->asyncLock);
+}
+
+// queues the completion of <token> (asyncLock held): begin_request_locked() made room for it
+static void post_completion_locked(tfs_fs *fs, int64_t token, int result)
+{
+    int tail = (fs->completionHead + fs->completionCount) % fs->completionCapacity;
+    fs->completions[tail].token = token;
+    fs->completions[tail].result = result;
+    fs->completionCount++;
+    fs->asyncInFlight--;
+    if (fs->completionFd >= 0)
+    {
+        uint64_t one = 1;
+        if (write(fs->completionFd, &one, sizeof(one)) < 0)
+        {
+            perror("write() to the completion eventfd failed");
+        }
+    }
+    pthread_cond_broadcast(&fs->asyncChanged);
+}
+
+// moves up to <max> completions into <out> (asyncLock held)
+static int take_completions_locked(tfs_fs *fs, TfsCompletion *out, int max)
+{
+    int taken = 0;
+    while (taken < max && fs->completionCount > 0)
+    {
+        out[taken++] = fs->completions[fs->completionHead];
+        fs->completionHead = (fs->completionHead + 1) % fs->completionCapacity;
+        fs->completionCount--;
+    }
+    if (fs->completionCount == 0 && fs->completionFd >= 0)
+    { // nothing left: no longer readable
+        uint64_t count;
+        if (read(fs->completionFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        {
+            perror("read() from the completion eventfd failed");
+        }
+    }
+    return taken;
+}
+
+// sets up a read of <size> bytes at <offset> (descriptor locked): copies inline data or the cached blocks of the span
+// and lists the missing ones
+static int plan_async_read(tfs_fs *fs, fileDescriptor FD, int offset, int size, AsyncRequest *request)
+{
+    RETURN_IF_ERR(load_descriptor_inode(fs, FD));
+    FileTableEntry *entry = file_entry(fs, FD);
+    int file_size = (int)entry->inode.size;
+    if (size == 0 || offset >= file_size)
+    {
+        return SUCCESS; // EOF: completes with 0
+    }
+    int to_read = file_size - offset < size ? file_size - offset : size;
+    if (INODE_IS_INLINE(entry->inode.type))
+    {
+        memcpy(request->buffer, entry->inode.inline_data + offset, to_read);
+        request->copied = to_read;
+        return SUCCESS;
+    }
+
+    int first_depth = offset / fs->fsDataSize;
+    int num_blocks = (offset + to_read - 1) / fs->fsDataSize - first_depth + 1;
+    RETURN_IF_ERR(load_descriptor_map(fs, FD));
+    request->blocks = malloc((size_t)num_blocks * fs->fsBlockSize);
+    request->blockNums = malloc(num_blocks * sizeof(int));
+    request->blockBufs = malloc(num_blocks * sizeof(void *));
+    request->resident = malloc(num_blocks * sizeof(bool));
+    request->missingNums = malloc(num_blocks * sizeof(int));
+    request->missingBufs = malloc(num_blocks * sizeof(void *));
+    if (request->blocks == NULL || request->blockNums == NULL || request->blockBufs == NULL || request->resident == NULL ||
+        request->missingNums == NULL || request->missingBufs == NULL)
+    {
+        return SYSTEM_ERROR;
+    }
+    for (int i = 0; i < num_blocks; i++)
+    {
+        uint32_t datablock_num = descriptor_block(fs, FD, first_depth + i);
+        if (datablock_num == INVALID_BLOCK)
+        { // size claims more blocks than are mapped: stop at the last mapped one, as tfs_read() does
+            num_blocks = i;
+            break;
+        }
+        request->blockNums[i] = datablock_num;
+        request->blockBufs[i] = request->blocks + (size_t)i * fs->fsBlockSize;
+    }
+    request->numBlocks = num_blocks;
+    request->firstOffset = offset % fs->fsDataSize;
+    request->length = to_read;
+
+    cacheReadResident(fs->blockCache, num_blocks, request->blockNums, request->blockBufs, request->resident);
+    for (int i = 0; i < num_blocks; i++)
+    {
+        if (!request->resident[i])
+        {
+            request->missingNums[request->numMissing] = request->blockNums[i];
+            request->missingBufs[request->numMissing] = request->blockBufs[i];
+            request->numMissing++;
+        }
+    }
+    return SUCCESS;
+}
+
+// copies the span out of the read's blocks into the caller's buffer | returns the bytes read in all
+static int copy_async_read(tfs_fs *fs, AsyncRequest *request)
+{
+    int datablock_offset = request->firstOffset;
+    for (int i = 0; i < request->numBlocks && request->copied < request->length; i++)
+    {
+        int span = fs->fsDataSize - datablock_offset;
+        if (span > request->length - request->copied)
+            span = request->length - request->copied;
+        memcpy(request->buffer + request->copied, (uint8_t *)request->blockBufs[i] + datablock_offset, span);
+        request->copied += span;
+        datablock_offset = 0;
+    }
+    return request->copied;
+}
+
+// the read's missing blocks arrived (or failed with <result>): fills the cache and the caller's buffer, unpins the file
+static void finish_async_read(AsyncRequest *request, int result)
+{
+    tfs_fs *fs = request->fs;
+    if (result == SUCCESS && request->numMissing > 0)
+    { // clean copies, like a synchronous read leaves behind; still pinned, so nothing changed them meanwhile
+        cacheInstall(fs->blockCache, request->numMissing, request->missingNums, request->missingBufs);
+    }
+    if (result == SUCCESS)
+    {
+        result = copy_async_read(fs, request);
+    }
+    pthread_mutex_lock(&fs->asyncLock);
+    if (request->numMissing > 0)
+    {
+        __atomic_sub_fetch(&dentry(fs, request->dirSlot)->asyncReads, 1, __ATOMIC_RELEASE);
+    }
+    post_completion_locked(fs, request->token, result);
+    pthread_mutex_unlock(&fs->asyncLock);
+    free_async_request(request);
+}
+
+static void async_read_done(void *arg, int result)
+{
+    finish_async_read(arg, result);
+}
+
+/* starts reading ‘size’ bytes at byte ‘offset’ of the file into ‘buffer’ and returns the request's token (> 0).
+Its completion carries the number of bytes read, short (or 0) at the end of the file, or an error code.
+The file pointer is not moved. */
+int64_t tfs_submit_read2(tfs_fs *fs, fileDescriptor FD, int offset, char *buffer, int size)
+{
+    if (fs == NULL)
+    {
+        return FS_ERR_NO_FS_MOUNTED;
+    }
+    if (offset < 0)
+    {
+        return FS_ERR_INVALID_OFFSET;
+    }
+    if (size < 0 || (buffer == NULL && size > 0))
+    {
+        return FS_ERR_INVALID_READ_SIZE;
+    }
+    AsyncRequest *request = calloc(1, sizeof(AsyncRequest));
+    if (request == NULL)
+    {
+        return SYSTEM_ERROR;
+    }
+    request->buffer = buffer;
+    pthread_mutex_lock(&fs->asyncLock);
+    int submit_err = begin_request_locked(fs, request);
+    pthread_mutex_unlock(&fs->asyncLock);
+    if (submit_err != SUCCESS)
+    {
+        free(request);
+        return submit_err;
+    }
+    int64_t token = request->token; // the request is gone once libDisk completes it
+
+    submit_err = lock_descriptor(fs, FD, false);
+    if (submit_err != SUCCESS)
+    {
+        cancel_request(fs);
+        free_async_request(request);
+        return submit_err;
+    }
+    submit_err = plan_async_read(fs, FD, offset, size, request);
+    int missing = submit_err == SUCCESS ? request->numMissing : 0;
+    if (missing > 0)
+    { // pin the file while the blocks are read without its lock: it can't take a change before we unlock
+        request->dirSlot = file_entry(fs, FD)->dir_slot;
+        Dentry *slot = dentry(fs, request->dirSlot);
+        pthread_mutex_lock(&fs->asyncLock);
+        __atomic_add_fetch(&slot->asyncReads, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&fs->asyncLock);
+        submit_err = submitReadBlocks(fs->mountedDisk, missing, request->missingNums, request->missingBufs,
+                                      async_read_done, request);
+        if (submit_err != SUCCESS)
+        {
+            pthread_mutex_lock(&fs->asyncLock);
+            __atomic_sub_fetch(&slot->asyncReads, 1, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&fs->asyncLock);
+        }
+    }
+    unlock_descriptor(fs, FD);
+
+    if (submit_err != SUCCESS)
+    {
+        cancel_request(fs);
+        free_async_request(request);
+        return submit_err;
+    }
+    if (missing == 0)
+    { // all from memory: complete right away
+        finish_async_read(request, SUCCESS);
+    }
+    return token;
+}
+
+static void *async_worker_main(void *arg)
+{
+    tfs_fs *fs = arg;
+    pthread_mutex_lock(&fs->asyncLock);
+    while (true)
+    {
+        while (fs->asyncQueue == NULL && !fs->asyncStopping)
+        {
+            pthread_cond_wait(&fs->asyncWork, &fs->asyncLock);
+        }
+        AsyncRequest *request = fs->asyncQueue;
+        if (request == NULL)
+        {
+            break; // stopping, and nothing left to run
+        }
+        fs->asyncQueue = request->next;
+        if (fs->asyncQueue == NULL)
+        {
+            fs->asyncQueueTail = NULL;
+        }
+        pthread_mutex_unlock(&fs->asyncLock);
+        int write_err = tfs_pwrite2(fs, request->FD, request->offset, request->source, request->size);
+        pthread_mutex_lock(&fs->asyncLock);
+        post_completion_locked(fs, request->token, write_err == SUCCESS ? request->size : write_err);
+        free_async_request(request);
+    }
+    pthread_mutex_unlock(&fs->asyncLock);
+    return NULL;
+}
+
+/* queues writing ‘size’ bytes of ‘buffer’ at byte ‘offset’ of the file, as tfs_pwrite() does, and returns the
+request's token (> 0). Its completion carries ‘size’, or an error code. */
+int64_t tfs_submit_write2(tfs_fs *fs, fileDescriptor FD, int offset, const char *buffer, int size)
+{
+    if (fs == NULL)
+    {
+        return FS_ERR_NO_FS_MOUNTED;
+    }
+    if (find_descriptor(fs, FD) == NULL)
+    {
+        return FS_ERR_ACCESSED_OUT_OF_FILE_TABLE_RANGE;
+    }
+    if (offset < 0)
+    {
+        return FS_ERR_INVALID_OFFSET;
+    }
+    if (size < 0 || (buffer == NULL && size > 0) || size > INT_MAX - offset)
+    {
+        return FS_ERR_INVALID_WRITE_SIZE;
+    }
+    AsyncRequest *request = calloc(1, sizeof(AsyncRequest));
+    if (request == NULL)
+    {
+        return SYSTEM_ERROR;
+    }
+    request->FD = FD;
+    request->offset = offset;
+    request->source = buffer;
+    request->size = size;
+
+    pthread_mutex_lock(&fs->asyncLock);
+    while (fs->asyncWorkerCount < ASYNC_WORKERS &&
+           pthread_create(&fs->asyncWorkers[fs->asyncWorkerCount], NULL, async_worker_main, fs) == 0)
+    {
+        fs->asyncWorkerCount++;
+    }
+    int submit_err = fs->asyncWorkerCount > 0 ? begin_request_locked(fs, request) : SYSTEM_ERROR;
+    if (submit_err != SUCCESS)
+    {
+        pthread_mutex_unlock(&fs->asyncLock);
+        free(request);
+        return submit_err;
+    }
+    int64_t token = request->token;
+    if (fs->asyncQueueTail != NULL)
+    {
+        fs->asyncQueueTail->next = request;
+    }
+    else
+    {
+        fs->asyncQueue = request;
+    }
+    fs->asyncQueueTail = request;
+    pthread_cond_signal(&fs->asyncWork);
+    pthread_mutex_unlock(&fs->asyncLock);
+    return token;
+}
+
+/* moves up to ‘max’ completions into ‘out’ without waiting. Returns how many. */
+int tfs_poll_completions2(tfs_fs *fs, TfsCompletion *out, int max)
+{
+    if (fs == NULL)
+    {
+        return FS_ERR_NO_FS_MOUNTED;
+    }
+    pthread_mutex_lock(&fs->asyncLock);
+    int taken = take_completions_locked(fs, out, max);
+    pthread_mutex_unlock(&fs->asyncLock);
+    return taken;
+}
+
+/* waits until at least ‘min’ completions are queued, or nothing else is in flight, then moves up to ‘max’ of them
+into ‘out’. Returns how many. */
+int tfs_wait_completions2(tfs_fs *fs, TfsCompletion *out, int min, int max)
+{
+    if (fs == NULL)
+    {
+        return FS_ERR_NO_FS_MOUNTED;
+    }
+    pthread_mutex_lock(&fs->asyncLock);
+    while (fs->completionCount < min && fs->completionCount < max && fs->asyncInFlight > 0)
+    {
+        pthread_cond_wait(&fs->asyncChanged, &fs->asyncLock);
+    }
+    int taken = take_completions_locked(fs, out, max);
+    pthread_mutex_unlock(&fs->asyncLock);
+    return taken;
+}
+
+/* an eventfd that polls readable while completions are queued, for event loops; owned by the instance. */
+int tfs_completion_fd2(tfs_fs *fs)
+{
+    if (fs == NULL)
+    {
+        return FS_ERR_NO_FS_MOUNTED;
+    }
+    pthread_mutex_lock(&fs->asyncLock);
+    if (fs->completionFd < 0)
+    {
+        fs->completionFd = eventfd(fs->completionCount > 0 ? 1 : 0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fs->completionFd < 0)
+        {
+            perror("eventfd() failed in tfs_completion_fd()");
+        }
+    }
+    int fd = fs->completionFd >= 0 ? fs->completionFd : SYSTEM_ERROR;
+    pthread_mutex_unlock(&fs->asyncLock);
+    return fd;
+}
+
+// lets every request in flight finish and stops the workers: tfs_unmount2() is about to close the disk under them
+static void drain_async_requests(tfs_fs *fs)
+{
+    pthread_mutex_lock(&fs->asyncLock);
+    while (fs->asyncInFlight > 0)
+    {
+        pthread_cond_wait(&fs->asyncChanged, &fs->asyncLock);
+    }
+    fs->asyncStopping = true;
+    pthread_cond_broadcast(&fs->asyncWork);
+    pthread_mutex_unlock(&fs->asyncLock);
+    for (int i = 0; i < fs->asyncWorkerCount; i++)
+    {
+        pthread_join(fs->asyncWorkers[i], NULL);
+    }
+    fs->asyncWorkerCount = 0;
+    fs->asyncStopping = false; // a failed unmount leaves the instance mounted, and usable
+}
+#pragma endregion
+
+#pragma region
+// the original single-file-system API: the same calls on the default instance tfs_mount() sets up
+
+void tfs_defaultMountOptions(TfsMountOptions *options)
+{
+    options->cacheBudget = cacheBudget;
+    options->diskBackend = diskBackend;
+    options->txgTimeoutMs = txgTimeoutMs;
+    options->txgMaxDirty = txgMaxDirty;
+    options->logDevice = logDeviceName;
+    options->logDeviceBytes = logDeviceBytes;
+    options->readaheadBytes = readaheadBytes;
+}
+
+int tfs_unmount(void)
+{
+    RETURN_IF_ERR(tfs_unmount2(defaultFs));
+    defaultFs = NULL;
+    return SUCCESS;
+}
+
+fileDescriptor tfs_open(char *name)
+{
+    return tfs_open2(defaultFs, name);
+}
+
+int tfs_close(fileDescriptor FD)
+{
+    return tfs_close2(defaultFs, FD);
+}
+
+int tfs_write(fileDescriptor FD, const char *buffer, const int size)
+{
+    return tfs_write2(defaultFs, FD, buffer, size);
+}
+
+int tfs_delete(fileDescriptor FD)
+{
+    return tfs_delete2(defaultFs, FD);
+}
+
+int tfs_readByte(fileDescriptor FD, char *buffer)
+{
+    return tfs_readByte2(defaultFs, FD, buffer);
+}
+
+int tfs_read(fileDescriptor FD, char *buffer, int size)
+{
+    return tfs_read2(defaultFs, FD, buffer, size);
+}
+
+int tfs_seek(fileDescriptor FD, int offset)
+{
+    return tfs_seek2(defaultFs, FD, offset);
+}
+
+int tfs_writeByte(fileDescriptor FD, int offset, const unsigned char data)
+{
+    return tfs_writeByte2(defaultFs, FD, offset, data);
+}
+
+int tfs_pwrite(fileDescriptor FD, int offset, const char *buffer, int size)
+{
+    return tfs_pwrite2(defaultFs, FD, offset, buffer, size);
+}
+
+int tfs_append(fileDescriptor FD, const char *buffer, int size)
+{
+    return tfs_append2(defaultFs, FD, buffer, size);
+}
+
+int tfs_truncate(fileDescriptor FD, int size)
+{
+    return tfs_truncate2(defaultFs, FD, size);
+}
+
+int tfs_makeRO(const char *name)
+{
+    return tfs_makeRO2(defaultFs, name);
+}
+
+int tfs_makeRW(const char *name)
+{
+    return tfs_makeRW2(defaultFs, name);
+}
+
+int tfs_rename(const char *old_name, const char *new_name)
+{
+    return tfs_rename2(defaultFs, old_name, new_name);
+}
+
+int tfs_readdir(void)
+{
+    return tfs_readdir2(defaultFs);
+}
+
+int tfs_mkdir(const char *path)
+{
+    return tfs_mkdir2(defaultFs, path);
+}
+
+int tfs_sync(void)
+{
+    return tfs_sync2(defaultFs);
+}
+
+int tfs_fsync(fileDescriptor FD)
+{
+    return tfs_fsync2(defaultFs, FD);
+}
+
+int tfs_cacheStats(CacheStats *stats)
+{
+    return tfs_cacheStats2(defaultFs, stats);
+}
+
+int tfs_statfs(TfsStatfs *stats)
+{
+    return tfs_statfs2(defaultFs, stats);
+}
+
+int tfs_scrub_start(uint32_t blocksPerSec)
+{
+    return tfs_scrub_start2(defaultFs, blocksPerSec);
+}
+
+int tfs_scrub_status(ScrubStatus *status)
+{
+    return tfs_scrub_status2(defaultFs, status);
+}
+
+int tfs_scrub_stop(void)
+{
+    return defaultFs != NULL ? tfs_scrub_stop2(defaultFs) : SUCCESS;
+}
+
+int64_t tfs_submit_read(fileDescriptor FD, int offset, char *buffer, int size)
+{
+    return tfs_submit_read2(defaultFs, FD, offset, buffer, size);
+}
+
+int64_t tfs_submit_write(fileDescriptor FD, int offset, const char *buffer, int size)
+{
+    return tfs_submit_write2(defaultFs, FD, offset, buffer, size);
+}
+
+int tfs_poll_completions(TfsCompletion *out, int max)
+{
+    return tfs_poll_completions2(defaultFs, out, max);
+}
+
+int tfs_wait_completions(TfsCompletion *out, int min, int max)
+{
+    return tfs_wait_completions2(defaultFs, out, min, max);
+}
+
+int tfs_completion_fd(void)
+{
+    return tfs_completion_fd2(defaultFs);
+}
+#pragma endregion
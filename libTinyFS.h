@@ -12,11 +12,20 @@
 #include <sys/stat.h>
 #include <stdint.h>
 #include <limits.h>
+#include "libDisk.h"
+#include "libCache.h"
+#include "libScrub.h"
+#include "libZil.h"
 #pragma endregion
 
-#define BLOCK_SIZE 256
+#define BLOCK_SIZE 256 // default block size | Superblock and Inode fill the first BLOCK_SIZE bytes of their block
 #define DEFAULT_DISK_SIZE 10240 
 #define DEFAULT_DISK_NAME “tinyFSDisk” 	
+#define DEFAULT_CACHE_BUDGET (1024 * BLOCK_SIZE) // bytes of ARC block cache per mount
+#define DEFAULT_TXG_TIMEOUT_MS 5000 // an open transaction group commits once it is this old...
+#define DEFAULT_TXG_MAX_DIRTY 4096  // ...or has allocated/freed this many blocks
+#define ZIL_POOL_FRACTION 32 // tfs_mkfs() sets aside 1/32 of the blocks for the intent log...
+#define ZIL_MAX_POOL_BLOCKS 2048 // ...but no more than this many
 typedef int fileDescriptor;
 
 #define INVALID_BLOCK UINT32_MAX
@@ -34,20 +43,57 @@ typedef int fileDescriptor;
 #define SET_BLOCK_USED(bitmap, n)   (bitmap[(n)/8] |=  (1 << ((n)%8)))
 #define SET_BLOCK_FREE(bitmap, n)   (bitmap[(n)/8] &= ~(1 << ((n)%8)))
 
-#define ROLLBACK_MOUNT() do { closeDisk(mountedDisk); mountedDisk = -1; } while(0)
+#define ROLLBACK_MOUNT() do { closeCache(fs->blockCache); fs->blockCache = NULL; closeDisk(fs->mountedDisk); fs->mountedDisk = -1; } while(0)
 
 typedef struct {
     uint8_t type;
-    uint32_t bitmap_block; //points to a block dedicated to bitmap (usually gonna be block#1)
+    uint32_t bitmap_block; //first block of the current bitmap copy (bitmap_blocks 0: the single bitmap block)
     uint32_t root_dir_inode; //points to root directory inode block (usually gonna be block #2)
     uint32_t fs_size;
     uint16_t checksum;
-    uint8_t padding[BLOCK_SIZE - sizeof(uint8_t) - sizeof(uint32_t)*3 - sizeof(uint16_t)];
+    uint8_t log_device; // LOG_ON_POOL: the intent log is zil_blocks blocks from zil_start | LOG_ON_DEVICE: a separate file
+    uint8_t reserved[1];
+    uint32_t block_size; // bytes per block chosen at tfs_mkfs() time, 0 on images formatted before it was stored (256)
+    uint32_t txg; // last committed transaction group | rewriting this block is what commits one
+    uint32_t zil_start; // intent log region inside the file system, 0 blocks on images formatted without one
+    uint32_t zil_blocks;
+    uint32_t zil_seq; // first intent log chunk not covered by the committed txg: replay starts there
+    uint32_t zil_guid; // random at tfs_mkfs(), stamped on every log chunk so another file system's are never replayed
+    uint32_t bitmap_blocks; // blocks per bitmap copy, 0 on images formatted with one bitmap block (moved by each commit)
+    uint32_t bitmap_spare; // first block of the other copy: the next commit writes the bitmap there and swaps the two
+    uint32_t features; // SB_FEATURE_* bits, 0 on images from before any of them
+    uint32_t free_blocks; // SB_FEATURE_COUNTERS: free blocks in the committed bitmap, so mount needn't count them
+    uint32_t file_count; // SB_FEATURE_COUNTERS: inodes the directory tree names, directories included
+    uint8_t padding[BLOCK_SIZE - sizeof(uint32_t)*15 - sizeof(uint16_t) - 2]; // type shares the first (aligned) word
 } Superblock;
+_Static_assert(sizeof(Superblock) == BLOCK_SIZE, "Superblock must be exactly one block");
 
+#define LOG_ON_POOL 0
+#define LOG_ON_DEVICE 1
+
+#define SB_FEATURE_COUNTERS 0x1 // free_blocks and file_count are kept up to date by every commit
+
+// the single bitmap block of older images. tfs_mkfs() now writes BITMAP_BITS(block_size) bits per block, in the
+// data segment of checksummed blocks: two copies of bitmap_blocks consecutive blocks each, right after the intent log
 typedef struct {
-    uint8_t bitmap[BLOCK_SIZE];
+    uint8_t bitmap[BLOCK_SIZE]; // bigger blocks hold block_size * 8 bits
 } BitmapBlock;
+_Static_assert(sizeof(BitmapBlock) == BLOCK_SIZE, "BitmapBlock must be exactly one block");
+
+// one contiguous run of a file | extent-type inodes only
+typedef struct {
+    uint32_t logical;            // first file block the run covers
+    uint32_t start;              // first disk block: data at depth 0, child extent node above
+    uint32_t length;             // number of file blocks covered
+} Extent;
+
+typedef struct {
+    uint16_t count;              // entries in use
+    uint16_t depth;              // 0: entries are data runs | >0: entries point at extent nodes one level down
+} ExtentHeader;
+
+#define INODE_EXTENT_SLOTS ((BLOCK_SIZE - sizeof(uint32_t)*6 - sizeof(ExtentHeader))/sizeof(Extent))
+#define INODE_INLINE_SIZE (sizeof(ExtentHeader) + INODE_EXTENT_SLOTS*sizeof(Extent)) // 232 bytes
 
 typedef struct {
     uint8_t type;
@@ -55,19 +101,32 @@ typedef struct {
     uint32_t direct[2];          // direct data block pointers
     uint32_t indirect;           // block number of an indirect block (contains more pointers)
     uint16_t checksum;
-    uint8_t padding[BLOCK_SIZE - sizeof(uint8_t) - sizeof(uint32_t)*3];
+    uint8_t padding[2];
+    union {
+        struct {
+            ExtentHeader extent_header;  // root of the extent tree (extent types, zero on legacy images)
+            Extent extents[INODE_EXTENT_SLOTS];
+        };
+        uint8_t inline_data[INODE_INLINE_SIZE]; // inline types: the whole file, no data blocks
+    };
 } Inode;
+_Static_assert(sizeof(Inode) == BLOCK_SIZE, "Inode must be exactly one block");
 
 typedef struct {
     uint8_t data[BLOCK_SIZE-sizeof(uint16_t)];
     uint16_t checksum;
-} Datablock; //template for data blocks 
-//used as Directory blocks by accessing as DirectoryEntry*
+} Datablock; //template for data blocks at the default BLOCK_SIZE
+_Static_assert(sizeof(Datablock) == BLOCK_SIZE, "Datablock must be exactly one block");
+//at other block sizes the data is DATABLOCK_DATA_SIZE(block_size) bytes and the checksum is still the last 2
+//used as Directory blocks by accessing as DirectoryEntry* (one hash bucket of a directory each)
 //used as Indirect blocks by accessing as Block* (uint32_t)*
+//used as extent tree nodes by accessing as ExtentHeader* followed by Extent*
    //can essentially replace all uses of uint32_t with Block
 
-#define DATABLOCK_DATA_SIZE (BLOCK_SIZE - sizeof(uint16_t))
-#define MAX_DIRECTORY_SIZE (DATABLOCK_DATA_SIZE/sizeof(DirectoryEntry))
+// geometry of a file system formatted with <bs> byte blocks
+#define DATABLOCK_DATA_SIZE(bs) ((bs) - sizeof(uint16_t))
+#define MAX_DIRECTORY_SIZE(bs) (DATABLOCK_DATA_SIZE(bs)/sizeof(DirectoryEntry)) // entries per directory block
+#define BITMAP_BITS(bs) (DATABLOCK_DATA_SIZE(bs) * 8) // blocks tracked per bitmap block
 
 typedef struct {
     char name[8];
@@ -76,42 +135,192 @@ typedef struct {
 
 typedef uint32_t Block;
 
-#define MAX_INDIRECT_BLOCK_POINTERS ((DATABLOCK_DATA_SIZE)/(sizeof(uint32_t)))
+// a directory is a power of two of blocks, each the bucket of the names that hash to it. one that overflows
+// doubles the directory, splitting every bucket in two; legacy root directories are the one-block case
+#define DIR_MAX_BLOCKS 65536 // 1.3 million entries at 256 B blocks
+// paths name files below the root: components of up to 7 chars (8 are truncated, like plain names) joined by '/'
+#define TFS_MAX_PATH 255
+
+#define MAX_INDIRECT_BLOCK_POINTERS(bs) (DATABLOCK_DATA_SIZE(bs)/sizeof(uint32_t))
+#define EXTENT_NODE_SLOTS(bs) ((DATABLOCK_DATA_SIZE(bs) - sizeof(ExtentHeader))/sizeof(Extent))
+#define EXTENT_MAX_DEPTH 5 // 19 * 20^5 runs at 256 B blocks, more than a 4 GiB disk of them has blocks
 
 //end block stuff
 //================================================================
 //starts file stuff
 
-#define MAX_OPEN_FILES 5
+// descriptors per mounted file system: the table grows a chunk at a time as files are opened
+#define MAX_OPEN_FILES 65536
+#define FILE_TABLE_CHUNK 256
 
 typedef enum {
     INODE_TYPE_RO_FILE = 0x01,
     INODE_TYPE_RW_FILE = 0x02,
+    INODE_TYPE_EXTENT_RO_FILE = 0x03, // block map is an extent tree instead of direct/indirect pointers
+    INODE_TYPE_EXTENT_RW_FILE = 0x04,
+    INODE_TYPE_INLINE_RO_FILE = 0x05, // file of at most INODE_INLINE_SIZE bytes kept in the inode itself
+    INODE_TYPE_INLINE_RW_FILE = 0x06,
+    INODE_TYPE_DIR = 0x07,            // extent tree of hash bucket blocks (legacy roots: RO_FILE with direct[0])
 
 } TYPES;
 
+#define INODE_IS_WRITABLE(type) ((type) == INODE_TYPE_RW_FILE || (type) == INODE_TYPE_EXTENT_RW_FILE || (type) == INODE_TYPE_INLINE_RW_FILE)
+#define INODE_HAS_EXTENTS(type) ((type) == INODE_TYPE_EXTENT_RO_FILE || (type) == INODE_TYPE_EXTENT_RW_FILE || (type) == INODE_TYPE_DIR)
+#define INODE_IS_INLINE(type) ((type) == INODE_TYPE_INLINE_RO_FILE || (type) == INODE_TYPE_INLINE_RW_FILE)
+#define INODE_IS_DIR(type) ((type) == INODE_TYPE_DIR)
+
 typedef struct {
     bool in_use;
-    uint32_t inode_block;   // the block number of the file's inode
+    int dir_slot;           // the file's dentry: holds its inode block number (which moves with every txg) and lock
+    uint32_t incarnation;   // of the dentry at open: a different one means the file was deleted
     int offset;             // current file pointer
+
+    // per-descriptor cache so byte-granular loops run from memory;
+    // dropped whenever any descriptor changes the same inode (the dentry's generation moves on)
+    uint32_t generation;
+    bool inode_valid;
+    Inode inode;            // decoded copy of the inode
+    bool map_valid;
+    Extent *extent_map;     // every data run of the file (legacy pointers as one-block runs), sorted by logical block
+    uint32_t extent_count;
+    uint32_t data_block;    // block number held in data, INVALID_BLOCK if none
+    uint8_t *data;          // current data block (one block, allocated on first use)
+
+    // sequential-read detection: while reads keep moving on to the next data block, the blocks
+    // after it are prefetched into the block cache, in a window that doubles with the streak
+    uint32_t ra_last;       // data block (by depth) of the last read, UINT32_MAX before the first one
+    uint32_t ra_window;     // blocks to keep fetched ahead, 0 while access looks random
+    uint32_t ra_issued;     // depth up to which (exclusive) prefetches have been issued
 } FileTableEntry;
 
+// one mounted file system | the handle-based calls below work on any number of them side by side.
+// any thread may call into an instance at any time, except around its mount and unmount
+typedef struct tfs_fs tfs_fs;
+
+typedef struct {
+    size_t cacheBudget;          // bytes of block cache, 0 disables it
+    DiskBackend diskBackend;
+    uint32_t txgTimeoutMs;       // see tfs_setTxgLimits()
+    uint32_t txgMaxDirty;
+    char *logDevice;             // separate intent log file, NULL for the region inside the file system
+    int logDeviceBytes;          // > 0 creates or resizes logDevice
+    uint32_t readaheadBytes;     // largest readahead window of a sequential reader, 0 turns readahead off
+} TfsMountOptions;
+
+// space and file counts of a mounted file system, as of the call (the open transaction group included)
+typedef struct {
+    uint32_t blockSize;
+    uint32_t totalBlocks;        // blocks the file system manages, metadata and intent log included
+    uint32_t freeBlocks;         // allocatable now: blocks freed by the open group come back once it commits
+    uint32_t usedBlocks;         // totalBlocks - freeBlocks
+    uint32_t files;              // files and directories, the root not counted
+    uint32_t largestFreeRun;     // longest stretch of consecutive free blocks
+} TfsStatfs;
+
+// the outcome of one tfs_submit_read()/tfs_submit_write(), named by the token the submission returned
+typedef struct {
+    int64_t token;
+    int result;                  // bytes transferred (short at the end of the file for reads), or a negative error code
+} TfsCompletion;
+
 //API
 int tfs_mkfs(char *filename, int nBytes);
+// blockSize: power of two from 256 B to 64 KiB, recorded in the superblock so tfs_mount() picks it up
+int tfs_mkfsWithBlockSize(char *filename, int nBytes, int blockSize);
 int tfs_mount(char *filename);
 int tfs_unmount(void);
 
+// name: a file of the root directory, or a path through subdirectories ("logs/2024/jan")
 fileDescriptor tfs_open(char *name);
 int tfs_close(fileDescriptor FD);
 int tfs_write(fileDescriptor FD, const char *buffer, const int size);
 int tfs_delete(fileDescriptor FD);
 int tfs_readByte(fileDescriptor FD, char *buffer);
+int tfs_read(fileDescriptor FD, char *buffer, int size);
 int tfs_seek(fileDescriptor FD, int offset);
 int tfs_writeByte(fileDescriptor FD, int offset, const unsigned char data);
+int tfs_pwrite(fileDescriptor FD, int offset, const char *buffer, int size);
+int tfs_append(fileDescriptor FD, const char *buffer, int size);
+int tfs_truncate(fileDescriptor FD, int size);
 
 int tfs_makeRO(const char *name);
 int tfs_makeRW(const char *name);
 int tfs_rename(const char *old_name, const char *new_name);
 int tfs_readdir(void);
+// creates an empty directory | its parent must exist
+int tfs_mkdir(const char *path);
+
+int tfs_setCacheBudget(size_t nBytes);
+int tfs_setDiskBackend(DiskBackend backend);
+// largest window (bytes) a descriptor reading sequentially prefetches ahead of itself, 0 (the default) disables readahead
+int tfs_setReadahead(uint32_t maxBytes);
+int tfs_sync(void);
+// makes every operation so far durable through the intent log, without committing the transaction group
+int tfs_fsync(fileDescriptor FD);
+// separate intent log file for the next tfs_mkfs()/tfs_mount() | NULL keeps the log inside the file system
+int tfs_setLogDevice(char *filename, int nBytes);
+int tfs_cacheStats(CacheStats *stats);
+// free space and file counts from counters the allocator keeps, no bitmap scan
+int tfs_statfs(TfsStatfs *stats);
+// when the open transaction group commits on its own | timeoutMs 0 commits after every operation
+int tfs_setTxgLimits(uint32_t timeoutMs, uint32_t maxDirtyBlocks);
+
+// background checksum scrub of every allocated block | blocksPerSec 0 = unthrottled
+int tfs_scrub_start(uint32_t blocksPerSec);
+int tfs_scrub_status(ScrubStatus *status);
+int tfs_scrub_stop(void);
+
+// asynchronous positional I/O: returns a token (> 0) at once, or a negative error code if the request was refused.
+// a read takes what the cache holds right away and fetches the rest through libDisk's io_uring (or I/O thread) engine,
+// a write runs on a worker thread. <buffer> must stay valid, and FD open, until the request's completion is reaped.
+// requests in flight together are unordered: wait for a write's completion before reading what it wrote
+int64_t tfs_submit_read(fileDescriptor FD, int offset, char *buffer, int size);
+int64_t tfs_submit_write(fileDescriptor FD, int offset, const char *buffer, int size);
+// moves up to <max> completions into <out> without blocking | returns how many
+int tfs_poll_completions(TfsCompletion *out, int max);
+// blocks until at least <min> completions are there (fewer only once nothing else is in flight) | returns how many
+int tfs_wait_completions(TfsCompletion *out, int min, int max);
+// an eventfd that is readable while completions are waiting, for poll()/epoll() loops
+int tfs_completion_fd(void);
+
+// handle-based API: the calls above are these on a default instance
+void tfs_defaultMountOptions(TfsMountOptions *options); // what the tfs_set*() calls chose
+// NULL options mounts with the defaults | returns NULL on failure, with the error code in *err (may be NULL)
+tfs_fs *tfs_mount2(char *filename, const TfsMountOptions *options, int *err);
+int tfs_unmount2(tfs_fs *fs); // frees fs on success; on failure it stays mounted
+
+fileDescriptor tfs_open2(tfs_fs *fs, char *name);
+int tfs_close2(tfs_fs *fs, fileDescriptor FD);
+int tfs_write2(tfs_fs *fs, fileDescriptor FD, const char *buffer, const int size);
+int tfs_delete2(tfs_fs *fs, fileDescriptor FD);
+int tfs_readByte2(tfs_fs *fs, fileDescriptor FD, char *buffer);
+int tfs_read2(tfs_fs *fs, fileDescriptor FD, char *buffer, int size);
+int tfs_seek2(tfs_fs *fs, fileDescriptor FD, int offset);
+int tfs_writeByte2(tfs_fs *fs, fileDescriptor FD, int offset, const unsigned char data);
+int tfs_pwrite2(tfs_fs *fs, fileDescriptor FD, int offset, const char *buffer, int size);
+int tfs_append2(tfs_fs *fs, fileDescriptor FD, const char *buffer, int size);
+int tfs_truncate2(tfs_fs *fs, fileDescriptor FD, int size);
+
+int tfs_makeRO2(tfs_fs *fs, const char *name);
+int tfs_makeRW2(tfs_fs *fs, const char *name);
+int tfs_rename2(tfs_fs *fs, const char *old_name, const char *new_name);
+int tfs_readdir2(tfs_fs *fs);
+int tfs_mkdir2(tfs_fs *fs, const char *path);
+
+int tfs_sync2(tfs_fs *fs);
+int tfs_fsync2(tfs_fs *fs, fileDescriptor FD);
+int tfs_cacheStats2(tfs_fs *fs, CacheStats *stats);
+int tfs_statfs2(tfs_fs *fs, TfsStatfs *stats);
+int tfs_setTxgLimits2(tfs_fs *fs, uint32_t timeoutMs, uint32_t maxDirtyBlocks);
+
+int tfs_scrub_start2(tfs_fs *fs, uint32_t blocksPerSec);
+int tfs_scrub_status2(tfs_fs *fs, ScrubStatus *status);
+int tfs_scrub_stop2(tfs_fs *fs);
+
+int64_t tfs_submit_read2(tfs_fs *fs, fileDescriptor FD, int offset, char *buffer, int size);
+int64_t tfs_submit_write2(tfs_fs *fs, fileDescriptor FD, int offset, const char *buffer, int size);
+int tfs_poll_completions2(tfs_fs *fs, TfsCompletion *out, int max);
+int tfs_wait_completions2(tfs_fs *fs, TfsCompletion *out, int min, int max);
+int tfs_completion_fd2(tfs_fs *fs);
 
 #endif
\ No newline at end of file
@@ -11,10 +11,19 @@
 #include <sys/stat.h>
 #include <stdint.h>
 #include <limits.h>
+#include "libDisk.h"
+#include "libCache.h"
+#include "libScrub.h"
+#include "libZil.h"
 
 #define BLOCK_SIZE 256
 #define DEFAULT_DISK_SIZE 10240
 #define DEFAULT_DISK_NAME "tinyFSDisk"
+#define DEFAULT_CACHE_BUDGET (1024 * BLOCK_SIZE)
+#define DEFAULT_TXG_TIMEOUT_MS 5000
+#define DEFAULT_TXG_MAX_DIRTY 4096
+#define ZIL_POOL_FRACTION 32
+#define ZIL_MAX_POOL_BLOCKS 2048
 
 typedef int fileDescriptor;
 #define INVALID_BLOCK UINT32_MAX
@@ -23,30 +32,69 @@ typedef int fileDescriptor;
 #define IS_BLOCK_USED(bm,n)           (((bm)[(n)>>3] >> ((n)&7)) & 1)
 #define SET_BLOCK_USED(bm,n)          ((bm)[(n)>>3] |=  (1 << ((n)&7)))
 #define SET_BLOCK_FREE(bm,n)          ((bm)[(n)>>3] &= ~(1 << ((n)&7)))
-#define ROLLBACK_MOUNT()              do { closeDisk(mountedDisk); mountedDisk = -1; } while (0)
+#define ROLLBACK_MOUNT()              do { closeCache(fs->blockCache); fs->blockCache = NULL; closeDisk(fs->mountedDisk); fs->mountedDisk = -1; } while (0)
 
-typedef struct __attribute__((packed)) {
+typedef struct {
     uint8_t  type;
     uint32_t bitmap_block;
     uint32_t root_dir_inode;
     uint32_t fs_size;
     uint16_t checksum;
-    uint8_t  padding[BLOCK_SIZE - 1 - 3*sizeof(uint32_t) - sizeof(uint16_t)];
+    uint8_t  log_device;
+    uint8_t  reserved[1];
+    uint32_t block_size;
+    uint32_t txg;
+    uint32_t zil_start;
+    uint32_t zil_blocks;
+    uint32_t zil_seq;
+    uint32_t zil_guid;
+    uint32_t bitmap_blocks;
+    uint32_t bitmap_spare;
+    uint32_t features;
+    uint32_t free_blocks;
+    uint32_t file_count;
+    uint8_t  padding[BLOCK_SIZE - 15*sizeof(uint32_t) - sizeof(uint16_t) - 2];
 } Superblock;
 _Static_assert(sizeof(Superblock) == BLOCK_SIZE, "Superblock size");
 
+#define LOG_ON_POOL   0
+#define LOG_ON_DEVICE 1
+
+#define SB_FEATURE_COUNTERS 0x1
+
 typedef struct __attribute__((packed)) {
     uint8_t bitmap[BLOCK_SIZE];
 } BitmapBlock;
 _Static_assert(sizeof(BitmapBlock) == BLOCK_SIZE, "BitmapBlock size");
 
-typedef struct __attribute__((packed)) {
+typedef struct {
+    uint32_t logical;
+    uint32_t start;
+    uint32_t length;
+} Extent;
+
+typedef struct {
+    uint16_t count;
+    uint16_t depth;
+} ExtentHeader;
+
+#define INODE_EXTENT_SLOTS             ((BLOCK_SIZE - 6*sizeof(uint32_t) - sizeof(ExtentHeader)) / sizeof(Extent))
+#define INODE_INLINE_SIZE              (sizeof(ExtentHeader) + INODE_EXTENT_SLOTS * sizeof(Extent))
+
+typedef struct {
     uint8_t  type;
     uint32_t size;
     uint32_t direct[2];
     uint32_t indirect;
     uint16_t checksum;
-    uint8_t  padding[BLOCK_SIZE - 1 - 4*sizeof(uint32_t) - sizeof(uint16_t)];
+    uint8_t  padding[2];
+    union {
+        struct {
+            ExtentHeader extent_header;
+            Extent   extents[INODE_EXTENT_SLOTS];
+        };
+        uint8_t  inline_data[INODE_INLINE_SIZE];
+    };
 } Inode;
 _Static_assert(sizeof(Inode) == BLOCK_SIZE, "Inode size");
 
@@ -62,24 +110,82 @@ typedef struct __attribute__((packed)) {
 } DirectoryEntry;
 
 typedef uint32_t Block;
-#define DATABLOCK_DATA_SIZE            (BLOCK_SIZE - sizeof(uint16_t))
-#define MAX_INDIRECT_BLOCK_POINTERS    (DATABLOCK_DATA_SIZE / sizeof(uint32_t))
-#define MAX_DIRECTORY_SIZE             (DATABLOCK_DATA_SIZE / sizeof(DirectoryEntry))
 
-#define MAX_OPEN_FILES 5
+#define DIR_MAX_BLOCKS                 65536
+#define TFS_MAX_PATH                   255
+#define DATABLOCK_DATA_SIZE(bs)        ((bs) - sizeof(uint16_t))
+#define MAX_INDIRECT_BLOCK_POINTERS(bs) (DATABLOCK_DATA_SIZE(bs) / sizeof(uint32_t))
+#define EXTENT_NODE_SLOTS(bs)          ((DATABLOCK_DATA_SIZE(bs) - sizeof(ExtentHeader)) / sizeof(Extent))
+#define EXTENT_MAX_DEPTH               5
+#define MAX_DIRECTORY_SIZE(bs)         (DATABLOCK_DATA_SIZE(bs) / sizeof(DirectoryEntry))
+#define BITMAP_BITS(bs)                (DATABLOCK_DATA_SIZE(bs) * 8)
+
+#define MAX_OPEN_FILES                 65536
+#define FILE_TABLE_CHUNK               256
 
 typedef enum {
     INODE_TYPE_RO_FILE = 0x01,
-    INODE_TYPE_RW_FILE = 0x02
+    INODE_TYPE_RW_FILE = 0x02,
+    INODE_TYPE_EXTENT_RO_FILE = 0x03,
+    INODE_TYPE_EXTENT_RW_FILE = 0x04,
+    INODE_TYPE_INLINE_RO_FILE = 0x05,
+    INODE_TYPE_INLINE_RW_FILE = 0x06,
+    INODE_TYPE_DIR            = 0x07
 } TYPES;
 
+#define INODE_IS_WRITABLE(t)           ((t) == INODE_TYPE_RW_FILE || (t) == INODE_TYPE_EXTENT_RW_FILE || (t) == INODE_TYPE_INLINE_RW_FILE)
+#define INODE_HAS_EXTENTS(t)           ((t) == INODE_TYPE_EXTENT_RO_FILE || (t) == INODE_TYPE_EXTENT_RW_FILE || (t) == INODE_TYPE_DIR)
+#define INODE_IS_INLINE(t)             ((t) == INODE_TYPE_INLINE_RO_FILE || (t) == INODE_TYPE_INLINE_RW_FILE)
+#define INODE_IS_DIR(t)                ((t) == INODE_TYPE_DIR)
+
 typedef struct {
     bool     in_use;
-    uint32_t inode_block;
+    int      dir_slot;
+    uint32_t incarnation;
     int      offset;
+
+    uint32_t  generation;
+    bool      inode_valid;
+    Inode     inode;
+    bool      map_valid;
+    Extent   *extent_map;
+    uint32_t  extent_count;
+    uint32_t  data_block;
+    uint8_t  *data;
+
+    uint32_t  ra_last;
+    uint32_t  ra_window;
+    uint32_t  ra_issued;
 } FileTableEntry;
 
+typedef struct tfs_fs tfs_fs;
+
+typedef struct {
+    size_t      cacheBudget;
+    DiskBackend diskBackend;
+    uint32_t    txgTimeoutMs;
+    uint32_t    txgMaxDirty;
+    char       *logDevice;
+    int         logDeviceBytes;
+    uint32_t    readaheadBytes;
+} TfsMountOptions;
+
+typedef struct {
+    uint32_t blockSize;
+    uint32_t totalBlocks;
+    uint32_t freeBlocks;
+    uint32_t usedBlocks;
+    uint32_t files;
+    uint32_t largestFreeRun;
+} TfsStatfs;
+
+typedef struct {
+    int64_t token;
+    int     result;
+} TfsCompletion;
+
 int tfs_mkfs(char *filename, int nBytes);
+int tfs_mkfsWithBlockSize(char *filename, int nBytes, int blockSize);
 int tfs_mount(char *filename);
 int tfs_unmount(void);
 
@@ -88,12 +194,75 @@ int tfs_close(fileDescriptor FD);
 int tfs_write(fileDescriptor FD, const char *buffer, const int size);
 int tfs_delete(fileDescriptor FD);
 int tfs_readByte(fileDescriptor FD, char *buffer);
+int tfs_read(fileDescriptor FD, char *buffer, int size);
 int tfs_seek(fileDescriptor FD, int offset);
 int tfs_writeByte(fileDescriptor FD, int offset, const unsigned char data);
+int tfs_pwrite(fileDescriptor FD, int offset, const char *buffer, int size);
+int tfs_append(fileDescriptor FD, const char *buffer, int size);
+int tfs_truncate(fileDescriptor FD, int size);
 
 int tfs_makeRO(const char *name);
 int tfs_makeRW(const char *name);
 int tfs_rename(const char *old_name, const char *new_name);
 int tfs_readdir(void);
+int tfs_mkdir(const char *path);
+
+int tfs_setCacheBudget(size_t nBytes);
+int tfs_setDiskBackend(DiskBackend backend);
+int tfs_setReadahead(uint32_t maxBytes);
+int tfs_sync(void);
+int tfs_fsync(fileDescriptor FD);
+int tfs_setLogDevice(char *filename, int nBytes);
+int tfs_cacheStats(CacheStats *stats);
+int tfs_statfs(TfsStatfs *stats);
+int tfs_setTxgLimits(uint32_t timeoutMs, uint32_t maxDirtyBlocks);
+
+int tfs_scrub_start(uint32_t blocksPerSec);
+int tfs_scrub_status(ScrubStatus *status);
+int tfs_scrub_stop(void);
+
+int64_t tfs_submit_read(fileDescriptor FD, int offset, char *buffer, int size);
+int64_t tfs_submit_write(fileDescriptor FD, int offset, const char *buffer, int size);
+int tfs_poll_completions(TfsCompletion *out, int max);
+int tfs_wait_completions(TfsCompletion *out, int min, int max);
+int tfs_completion_fd(void);
+
+void tfs_defaultMountOptions(TfsMountOptions *options);
+tfs_fs *tfs_mount2(char *filename, const TfsMountOptions *options, int *err);
+int tfs_unmount2(tfs_fs *fs);
+
+fileDescriptor tfs_open2(tfs_fs *fs, char *name);
+int tfs_close2(tfs_fs *fs, fileDescriptor FD);
+int tfs_write2(tfs_fs *fs, fileDescriptor FD, const char *buffer, const int size);
+int tfs_delete2(tfs_fs *fs, fileDescriptor FD);
+int tfs_readByte2(tfs_fs *fs, fileDescriptor FD, char *buffer);
+int tfs_read2(tfs_fs *fs, fileDescriptor FD, char *buffer, int size);
+int tfs_seek2(tfs_fs *fs, fileDescriptor FD, int offset);
+int tfs_writeByte2(tfs_fs *fs, fileDescriptor FD, int offset, const unsigned char data);
+int tfs_pwrite2(tfs_fs *fs, fileDescriptor FD, int offset, const char *buffer, int size);
+int tfs_append2(tfs_fs *fs, fileDescriptor FD, const char *buffer, int size);
+int tfs_truncate2(tfs_fs *fs, fileDescriptor FD, int size);
+
+int tfs_makeRO2(tfs_fs *fs, const char *name);
+int tfs_makeRW2(tfs_fs *fs, const char *name);
+int tfs_rename2(tfs_fs *fs, const char *old_name, const char *new_name);
+int tfs_readdir2(tfs_fs *fs);
+int tfs_mkdir2(tfs_fs *fs, const char *path);
+
+int tfs_sync2(tfs_fs *fs);
+int tfs_fsync2(tfs_fs *fs, fileDescriptor FD);
+int tfs_cacheStats2(tfs_fs *fs, CacheStats *stats);
+int tfs_statfs2(tfs_fs *fs, TfsStatfs *stats);
+int tfs_setTxgLimits2(tfs_fs *fs, uint32_t timeoutMs, uint32_t maxDirtyBlocks);
+
+int tfs_scrub_start2(tfs_fs *fs, uint32_t blocksPerSec);
+int tfs_scrub_status2(tfs_fs *fs, ScrubStatus *status);
+int tfs_scrub_stop2(tfs_fs *fs);
+
+int64_t tfs_submit_read2(tfs_fs *fs, fileDescriptor FD, int offset, char *buffer, int size);
+int64_t tfs_submit_write2(tfs_fs *fs, fileDescriptor FD, int offset, const char *buffer, int size);
+int tfs_poll_completions2(tfs_fs *fs, TfsCompletion *out, int max);
+int tfs_wait_completions2(tfs_fs *fs, TfsCompletion *out, int min, int max);
+int tfs_completion_fd2(tfs_fs *fs);
 
 #endif
@@ -0,0 +1,387 @@
+#include "errors.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "libDisk.h"
+#include "libZil.h"
+#include "tinyfs_crc.h"
+
+#define ZIL_MAGIC 0x5A494C31u // "ZIL1"
+
+// start of a chunk's byte stream; the records follow it, each as [uint32_t length][bytes]
+typedef struct {
+    uint32_t magic;
+    uint32_t guid;
+    uint32_t seq;
+    uint32_t blocks;            // chunk length in blocks
+    uint32_t bytes;             // record bytes after the header
+    uint32_t crc;               // crc32c of those bytes
+} ZilChunkHeader;
+
+struct Zil {
+    int disk;
+    uint32_t firstBlock;
+    uint32_t numBlocks;
+    uint32_t guid;
+    uint32_t blockSize;
+    uint32_t payload;           // stream bytes per block: everything but the block checksum
+
+    pthread_mutex_t lock;       // guards everything below
+    pthread_cond_t flushed;     // broadcast whenever a flush ends
+    bool flushing;              // a committer is writing a chunk, the others wait for it
+    bool quiesced;              // a txg commit is covering every record: no flush starts until it resets the log
+    bool failed;                // a flush failed: its records are gone, so nothing after them may become durable
+    uint8_t *pending;           // records appended since the last flush started
+    uint32_t pendingBytes;
+    uint32_t pendingCapacity;
+    uint64_t appendedLsn;       // last record appended
+    uint64_t durableLsn;        // last record on stable storage (or covered by a txg commit)
+    uint32_t writePos;          // first block of the next chunk, relative to firstBlock
+    uint32_t seq;               // sequence number of the next chunk
+};
+
+#pragma region
+// blocks a chunk of <bytes> record bytes takes
+static uint32_t chunk_blocks(const Zil *zil, uint64_t bytes)
+{
+    uint64_t stream = sizeof(ZilChunkHeader) + bytes;
+    return (uint32_t)((stream + zil->payload - 1) / zil->payload);
+}
+
+// copies <n> bytes to offset <at> of a chunk's stream, which fills the first <payload> bytes of each block
+static void chunk_put(const Zil *zil, uint8_t *blocks, uint32_t at, const void *src, uint32_t n)
+{
+    const uint8_t *from = src;
+    while (n > 0)
+    {
+        uint32_t within = at % zil->payload;
+        uint32_t span = zil->payload - within < n ? zil->payload - within : n;
+        memcpy(blocks + (size_t)(at / zil->payload) * zil->blockSize + within, from, span);
+        at += span;
+        from += span;
+        n -= span;
+    }
+}
+
+static void chunk_get(const Zil *zil, const uint8_t *blocks, uint32_t at, void *dst, uint32_t n)
+{
+    uint8_t *to = dst;
+    while (n > 0)
+    {
+        uint32_t within = at % zil->payload;
+        uint32_t span = zil->payload - within < n ? zil->payload - within : n;
+        memcpy(to, blocks + (size_t)(at / zil->payload) * zil->blockSize + within, span);
+        at += span;
+        to += span;
+        n -= span;
+    }
+}
+
+// writes <records> as chunk <seq> at block <pos> of the log in one batch, then makes it durable
+static int write_chunk(Zil *zil, uint32_t pos, uint32_t seq, const uint8_t *records, uint32_t bytes)
+{
+    uint32_t blocks = chunk_blocks(zil, bytes);
+    uint8_t *buf = calloc(blocks, zil->blockSize);
+    int *bNums = malloc(blocks * sizeof(int));
+    void **bufs = malloc(blocks * sizeof(void *));
+    int err = SYSTEM_ERROR;
+    if (buf != NULL && bNums != NULL && bufs != NULL)
+    {
+        ZilChunkHeader header = {ZIL_MAGIC, zil->guid, seq, blocks, bytes, crc32c(records, bytes)};
+        chunk_put(zil, buf, 0, &header, sizeof(header));
+        chunk_put(zil, buf, sizeof(header), records, bytes);
+        for (uint32_t i = 0; i < blocks; i++)
+        {
+            bufs[i] = buf + (size_t)i * zil->blockSize;
+            bNums[i] = (int)(zil->firstBlock + pos + i);
+            set_block_checksum(bufs[i], zil->blockSize);
+        }
+        err = writeBlocks(zil->disk, (int)blocks, bNums, bufs);
+        if (err == SUCCESS)
+            err = syncDisk(zil->disk);
+    }
+    free(buf);
+    free(bNums);
+    free(bufs);
+    return err;
+}
+
+// reads the chunk at block <pos> into a fresh buffer of its blocks; false if no intact chunk <seq> starts there
+static bool read_chunk(Zil *zil, uint32_t pos, uint8_t **chunk, ZilChunkHeader *header)
+{
+    uint8_t *first = malloc(zil->blockSize);
+    if (first == NULL || readBlock(zil->disk, (int)(zil->firstBlock + pos), first) != SUCCESS ||
+        !verify_block_checksum(first, zil->blockSize))
+    {
+        free(first);
+        return false;
+    }
+    chunk_get(zil, first, 0, header, sizeof(*header));
+    if (header->magic != ZIL_MAGIC || header->guid != zil->guid || header->seq != zil->seq ||
+        header->blocks == 0 || header->blocks > zil->numBlocks - pos || chunk_blocks(zil, header->bytes) != header->blocks)
+    {
+        free(first);
+        return false;
+    }
+
+    uint8_t *buf = realloc(first, (size_t)header->blocks * zil->blockSize);
+    if (buf == NULL)
+    {
+        free(first);
+        return false;
+    }
+    bool intact = true;
+    if (header->blocks > 1)
+    {
+        int *bNums = malloc((header->blocks - 1) * sizeof(int));
+        void **bufs = malloc((header->blocks - 1) * sizeof(void *));
+        intact = bNums != NULL && bufs != NULL;
+        for (uint32_t i = 1; intact && i < header->blocks; i++)
+        {
+            bNums[i - 1] = (int)(zil->firstBlock + pos + i);
+            bufs[i - 1] = buf + (size_t)i * zil->blockSize;
+        }
+        intact = intact && readBlocks(zil->disk, (int)header->blocks - 1, bNums, bufs) == SUCCESS;
+        for (uint32_t i = 1; intact && i < header->blocks; i++)
+            intact = verify_block_checksum(buf + (size_t)i * zil->blockSize, zil->blockSize);
+        free(bNums);
+        free(bufs);
+    }
+    if (intact)
+        *chunk = buf;
+    else
+        free(buf);
+    return intact;
+}
+#pragma endregion
+
+Zil *openZil(int disk, uint32_t firstBlock, uint32_t numBlocks, uint32_t guid, uint32_t seq)
+{
+    int blockSize = diskBlockSize(disk);
+    if (blockSize < 0 || numBlocks == 0)
+        return NULL;
+    Zil *zil = calloc(1, sizeof(Zil));
+    if (zil == NULL)
+        return NULL;
+    zil->disk = disk;
+    zil->firstBlock = firstBlock;
+    zil->blockSize = (uint32_t)blockSize;
+    zil->payload = zil->blockSize - sizeof(uint16_t);
+    // chunk byte counts are 32 bits wide
+    zil->numBlocks = numBlocks < UINT32_MAX / zil->payload ? numBlocks : UINT32_MAX / zil->payload;
+    zil->guid = guid;
+    zil->seq = seq;
+    pthread_mutex_init(&zil->lock, NULL);
+    pthread_cond_init(&zil->flushed, NULL);
+    return zil;
+}
+
+void closeZil(Zil *zil)
+{
+    if (zil == NULL)
+        return;
+    pthread_cond_destroy(&zil->flushed);
+    pthread_mutex_destroy(&zil->lock);
+    free(zil->pending);
+    free(zil);
+}
+
+int zilAppend(Zil *zil, const void *head, uint32_t headLength, const void *body, uint32_t bodyLength, uint64_t *lsn)
+{
+    uint64_t length = (uint64_t)headLength + bodyLength;
+    pthread_mutex_lock(&zil->lock);
+    uint64_t total = (uint64_t)zil->pendingBytes + sizeof(uint32_t) + length;
+    if (chunk_blocks(zil, total) > zil->numBlocks)
+    { // even an empty log couldn't take these in one chunk
+        pthread_mutex_unlock(&zil->lock);
+        return FS_ERR_LOG_FULL;
+    }
+    if (total > zil->pendingCapacity)
+    {
+        uint64_t capacity = zil->pendingCapacity ? zil->pendingCapacity : 4096;
+        while (capacity < total)
+            capacity *= 2;
+        if (capacity > UINT32_MAX)
+            capacity = total;
+        uint8_t *grown = realloc(zil->pending, capacity);
+        if (grown == NULL)
+        {
+            pthread_mutex_unlock(&zil->lock);
+            return SYSTEM_ERROR;
+        }
+        zil->pending = grown;
+        zil->pendingCapacity = (uint32_t)capacity;
+    }
+    uint32_t recordLength = (uint32_t)length;
+    memcpy(zil->pending + zil->pendingBytes, &recordLength, sizeof(recordLength));
+    memcpy(zil->pending + zil->pendingBytes + sizeof(recordLength), head, headLength);
+    if (bodyLength > 0)
+        memcpy(zil->pending + zil->pendingBytes + sizeof(recordLength) + headLength, body, bodyLength);
+    zil->pendingBytes = (uint32_t)total;
+    zil->appendedLsn++;
+    if (lsn != NULL)
+        *lsn = zil->appendedLsn;
+    pthread_mutex_unlock(&zil->lock);
+    return SUCCESS;
+}
+
+uint64_t zilLastLsn(Zil *zil)
+{
+    pthread_mutex_lock(&zil->lock);
+    uint64_t lsn = zil->appendedLsn;
+    pthread_mutex_unlock(&zil->lock);
+    return lsn;
+}
+
+/* group commit: whoever finds no flush in progress becomes the leader and writes every record appended so far,
+its own and everyone else's, as one chunk. committers arriving meanwhile queue up behind it and the first of them
+to wake takes all of theirs in the next chunk, so each flush costs one fdatasync() however many callers it serves */
+int zilCommit(Zil *zil, uint64_t lsn)
+{
+    pthread_mutex_lock(&zil->lock);
+    while (zil->durableLsn < lsn && (zil->flushing || zil->quiesced) && !zil->failed)
+        pthread_cond_wait(&zil->flushed, &zil->lock);
+    if (zil->durableLsn >= lsn)
+    {
+        pthread_mutex_unlock(&zil->lock);
+        return SUCCESS;
+    }
+    if (zil->failed)
+    {
+        pthread_mutex_unlock(&zil->lock);
+        return DISK_ERR_DISK_ACCESS_FAILED;
+    }
+    if (chunk_blocks(zil, zil->pendingBytes) > zil->numBlocks - zil->writePos)
+    {
+        pthread_mutex_unlock(&zil->lock);
+        return FS_ERR_LOG_FULL;
+    }
+    // lead: take the batch and write it without holding the lock, so more records can queue for the next one
+    uint8_t *records = zil->pending;
+    uint32_t bytes = zil->pendingBytes;
+    uint64_t batchLsn = zil->appendedLsn;
+    uint32_t pos = zil->writePos;
+    uint32_t seq = zil->seq;
+    zil->pending = NULL;
+    zil->pendingBytes = 0;
+    zil->pendingCapacity = 0;
+    zil->writePos += chunk_blocks(zil, bytes);
+    zil->seq++;
+    zil->flushing = true;
+    pthread_mutex_unlock(&zil->lock);
+
+    int err = write_chunk(zil, pos, seq, records, bytes);
+    free(records);
+
+    pthread_mutex_lock(&zil->lock);
+    zil->flushing = false;
+    if (err != SUCCESS)
+        zil->failed = true;
+    else if (batchLsn > zil->durableLsn)
+        zil->durableLsn = batchLsn;
+    pthread_cond_broadcast(&zil->flushed);
+    pthread_mutex_unlock(&zil->lock);
+    return err;
+}
+
+int zilReplay(Zil *zil, int (*apply)(const void *record, uint32_t length, void *arg), void *arg, uint32_t *replayed)
+{
+    uint32_t count = 0;
+    int err = SUCCESS;
+    uint32_t pos = 0;
+    while (err == SUCCESS && pos < zil->numBlocks)
+    {
+        uint8_t *chunk;
+        ZilChunkHeader header;
+        if (!read_chunk(zil, pos, &chunk, &header))
+            break; // end of the log: never written, stale, or torn by the crash
+        uint8_t *records = malloc(header.bytes ? header.bytes : 1);
+        if (records == NULL)
+        {
+            free(chunk);
+            err = SYSTEM_ERROR;
+            break;
+        }
+        chunk_get(zil, chunk, sizeof(header), records, header.bytes);
+        free(chunk);
+        if (crc32c(records, header.bytes) != header.crc)
+        {
+            free(records);
+            break;
+        }
+        for (uint32_t at = 0; err == SUCCESS && at < header.bytes;)
+        {
+            uint32_t length;
+            if (header.bytes - at < sizeof(length))
+            {
+                err = FS_ERR_CORRUPT_LOG_RECORD;
+                break;
+            }
+            memcpy(&length, records + at, sizeof(length));
+            at += sizeof(length);
+            if (length > header.bytes - at)
+            {
+                err = FS_ERR_CORRUPT_LOG_RECORD;
+                break;
+            }
+            err = apply(records + at, length, arg);
+            count += err == SUCCESS;
+            at += length;
+        }
+        free(records);
+        pos += header.blocks;
+        zil->seq++;
+    }
+    pthread_mutex_lock(&zil->lock);
+    zil->writePos = pos;
+    pthread_mutex_unlock(&zil->lock);
+    if (replayed != NULL)
+        *replayed = count;
+    return err;
+}
+
+uint32_t zilNextSeq(Zil *zil)
+{
+    pthread_mutex_lock(&zil->lock);
+    uint32_t seq = zil->seq;
+    pthread_mutex_unlock(&zil->lock);
+    return seq;
+}
+
+uint32_t zilQuiesce(Zil *zil)
+{
+    pthread_mutex_lock(&zil->lock);
+    while (zil->flushing) // a chunk still landing could overwrite the first one written after the reset
+        pthread_cond_wait(&zil->flushed, &zil->lock);
+    zil->quiesced = true;
+    uint32_t seq = zil->seq;
+    pthread_mutex_unlock(&zil->lock);
+    return seq;
+}
+
+void zilResume(Zil *zil)
+{
+    pthread_mutex_lock(&zil->lock);
+    zil->quiesced = false;
+    pthread_cond_broadcast(&zil->flushed);
+    pthread_mutex_unlock(&zil->lock);
+}
+
+void zilReset(Zil *zil)
+{
+    pthread_mutex_lock(&zil->lock);
+    while (zil->flushing)
+        pthread_cond_wait(&zil->flushed, &zil->lock);
+    zil->quiesced = false;
+    free(zil->pending);
+    zil->pending = NULL;
+    zil->pendingBytes = 0;
+    zil->pendingCapacity = 0;
+    zil->durableLsn = zil->appendedLsn;
+    zil->writePos = 0;
+    zil->failed = false;
+    pthread_cond_broadcast(&zil->flushed); // committers held off by zilQuiesce(): the commit made their records durable
+    pthread_mutex_unlock(&zil->lock);
+}
@@ -0,0 +1,44 @@
+#ifndef LIBZIL_H
+#define LIBZIL_H
+
+#include <stdint.h>
+
+// Intent log (ZIL equivalent): a write-ahead record of operations that the open transaction group
+// so far only holds in memory. zilAppend() buffers records; zilCommit() makes them durable as one
+// chunk of consecutive blocks, i.e. one writeBlocks() call (a single sequential pwritev()) plus one
+// syncDisk(). Callers committing concurrently wait for the flush in progress and then go out
+// together in the next one, so N committers cost one fdatasync() instead of N (group commit).
+// The log is a fixed range of blocks on a libDisk disk: a region of the file system's own disk,
+// or a whole separate log device (SLOG equivalent).
+// Each chunk carries the file system's guid and the next consecutive sequence number, and every
+// block carries its checksum. At mount, zilReplay() hands back the records of every intact chunk
+// from the head of the log. Once a txg commit covers them, zilReset() makes the next chunk start
+// at the head again; stale chunks further in then fail the sequence check.
+
+typedef struct Zil Zil;
+
+// a log in blocks [firstBlock, firstBlock + numBlocks) of <disk>, whose first chunk must be number <seq>
+Zil *openZil(int disk, uint32_t firstBlock, uint32_t numBlocks, uint32_t guid, uint32_t seq);
+void closeZil(Zil *zil);
+
+// buffers one record of <headLength> + <bodyLength> bytes; <lsn> (may be NULL) receives its sequence number.
+// FS_ERR_LOG_FULL if the records buffered since the last flush could never fit in the log
+int zilAppend(Zil *zil, const void *head, uint32_t headLength, const void *body, uint32_t bodyLength, uint64_t *lsn);
+uint64_t zilLastLsn(Zil *zil);
+// returns once every record up to <lsn> is on stable storage.
+// FS_ERR_LOG_FULL when the log has no room left before the next zilReset()
+int zilCommit(Zil *zil, uint64_t lsn);
+
+// calls <apply> on every record of the intact chunks at the head of the log, in order, stopping at the first error.
+// <replayed> (may be NULL) receives the number of records applied
+int zilReplay(Zil *zil, int (*apply)(const void *record, uint32_t length, void *arg), void *arg, uint32_t *replayed);
+// sequence number of the next chunk: a txg commit records it in the superblock before calling zilReset()
+uint32_t zilNextSeq(Zil *zil);
+// a txg commit is about to cover every record so far: waits for the flush in progress, keeps new ones from starting
+// until zilReset() (or zilResume() if the commit fails) and returns the sequence number the next chunk will carry
+uint32_t zilQuiesce(Zil *zil);
+void zilResume(Zil *zil);
+// forgets every record (a txg commit now covers them); the next chunk goes to the head of the log
+void zilReset(Zil *zil);
+
+#endif
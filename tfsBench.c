@@ -0,0 +1,467 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "libTinyFS.h"
+#include "errors.h"
+
+// Microbenchmarks of the single-threaded public calls, for comparing one build against another.
+// Times every call of each operation on its own: tfs_mkfs(), tfs_mount(), tfs_open() creating and
+// looking up files, tfs_write() at several sizes, tfs_readByte() sequential and random,
+// tfs_writeByte(), tfs_rename() and tfs_delete(). Prints one JSON object with ops/sec, p50/p99
+// latency in microseconds and the block reads and writes per operation. Block I/O comes from
+// tfs_cacheStats() and includes a tfs_sync() after each operation's loop, so writes deferred to the
+// transaction group commit are counted against the operations that dirtied them; tfs_mkfs() runs
+// without a mount and reports none. Then fills one directory of a fresh image with small blocks, where
+// it takes hundreds of bucket blocks, and reports the first and last batch of those creates: the
+// run fails if the last batch's creates take more than SCALE_MAX_GROWTH times as long as the first's.
+// Writes to the file given as the only argument instead of stdout. Exits non-zero on any unexpected
+// error.
+
+#define DISK_NAME "tfsBench.disk"
+#define DISK_BYTES (128 * 1024 * 1024)
+#define BENCH_BLOCK_SIZE 4096
+#define NUM_FILES 4096 // created, looked up, renamed and deleted
+#define MKFS_RUNS 8
+#define MOUNT_RUNS 32
+#define WRITE_BYTES (32 * 1024 * 1024) // written per tfs_write() size
+#define WRITE_FILES 16                 // tfs_write() rewrites these in turn
+#define MAX_WRITE_OPS 4096
+#define BYTE_FILE_BYTES (1024 * 1024) // the file tfs_readByte()/tfs_writeByte() work on
+#define BYTE_OPS 65536
+#define SCALE_BLOCK_SIZE 256 // the create scaling image: small blocks make the directory large
+#define SCALE_FILES 65536
+#define SCALE_BATCH 8192
+#define SCALE_MAX_GROWTH 3.0 // last batch's mean create time over the first's
+
+static const int write_sizes[] = {64, 4 * 1024, 64 * 1024, 1024 * 1024};
+
+typedef struct {
+    char op[64];
+    int ops;
+    double seconds;    // sum of the timed calls
+    double p50, p99;   // microseconds
+    double readsPerOp; // blocks, -1 if not known
+    double writesPerOp;
+} Result;
+
+static Result results[32];
+static int numResults;
+static double *latencies; // microseconds, one per call of the operation being measured
+static int failures;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *what, int code)
+{
+    fprintf(stderr, "FAILED: %s (%d)\n", what, code);
+    failures++;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t next_random(uint32_t *state)
+{
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+static void file_name(char *name, char prefix, int i)
+{
+    snprintf(name, 9, "%c%d", prefix, i);
+}
+
+// blocks read and written through the mounted file system's cache so far
+static void block_io(uint64_t *reads, uint64_t *writes)
+{
+    CacheStats stats;
+    if (tfs_cacheStats(&stats) != SUCCESS)
+    {
+        *reads = *writes = 0;
+        return;
+    }
+    *reads = stats.diskReads;
+    *writes = stats.diskWrites;
+}
+
+// state of the operation being measured: each call sits between start_call() and end_call(), all of them between
+// begin() and end()
+static struct {
+    double start;
+    uint64_t reads, writes;
+} measure;
+
+static void begin(void)
+{
+    block_io(&measure.reads, &measure.writes);
+}
+
+static void start_call(void)
+{
+    measure.start = now_seconds();
+}
+
+static void end_call(int i)
+{
+    latencies[i] = (now_seconds() - measure.start) * 1e6;
+}
+
+// adds the result of <ops> calls whose latencies are in latencies[], commits and counts the block I/O since begin()
+static void end(const char *op, int ops, bool counted_io)
+{
+    if (failures > 0)
+        return;
+    Result *r = &results[numResults++];
+    snprintf(r->op, sizeof(r->op), "%s", op);
+    r->ops = ops;
+    r->seconds = 0;
+    for (int i = 0; i < ops; i++)
+        r->seconds += latencies[i] / 1e6;
+    qsort(latencies, ops, sizeof(double), compare_doubles);
+    r->p50 = latencies[ops / 2];
+    r->p99 = latencies[(int)(ops * 0.99)];
+    r->readsPerOp = r->writesPerOp = -1;
+    if (counted_io)
+    {
+        int sync_err = tfs_sync();
+        if (sync_err != SUCCESS)
+            fail("tfs_sync", sync_err);
+        uint64_t reads, writes;
+        block_io(&reads, &writes);
+        r->readsPerOp = (double)(reads - measure.reads) / ops;
+        r->writesPerOp = (double)(writes - measure.writes) / ops;
+    }
+}
+
+static int mount_fresh(void)
+{
+    int mkfs_err = tfs_mkfsWithBlockSize(DISK_NAME, DISK_BYTES, BENCH_BLOCK_SIZE);
+    if (mkfs_err != SUCCESS)
+        return mkfs_err;
+    return tfs_mount(DISK_NAME);
+}
+
+static void bench_mkfs(void)
+{
+    for (int i = 0; i < MKFS_RUNS; i++)
+    {
+        start_call();
+        int mkfs_err = tfs_mkfsWithBlockSize(DISK_NAME, DISK_BYTES, BENCH_BLOCK_SIZE);
+        end_call(i);
+        if (mkfs_err != SUCCESS)
+        {
+            fail("tfs_mkfs", mkfs_err);
+            return;
+        }
+    }
+    end("tfs_mkfs", MKFS_RUNS, false);
+}
+
+// tfs_open() of names that don't exist yet, then of names that do (each followed by an untimed tfs_close())
+static void bench_open(void)
+{
+    char name[9];
+    begin();
+    for (int i = 0; i < NUM_FILES && failures == 0; i++)
+    {
+        file_name(name, 'f', i);
+        start_call();
+        fileDescriptor fd = tfs_open(name);
+        end_call(i);
+        if (fd < 0)
+            fail("tfs_open create", fd);
+        tfs_close(fd);
+    }
+    end("tfs_open create", NUM_FILES, true);
+
+    uint32_t seed = 1;
+    begin();
+    for (int i = 0; i < NUM_FILES && failures == 0; i++)
+    {
+        file_name(name, 'f', next_random(&seed) % NUM_FILES);
+        start_call();
+        fileDescriptor fd = tfs_open(name);
+        end_call(i);
+        if (fd < 0)
+            fail("tfs_open lookup", fd);
+        tfs_close(fd);
+    }
+    end("tfs_open lookup", NUM_FILES, true);
+}
+
+static void bench_write(void)
+{
+    static char buf[1024 * 1024];
+    for (int i = 0; i < (int)sizeof(buf); i++)
+        buf[i] = (char)(i * 7 + i / 251);
+    fileDescriptor fds[WRITE_FILES];
+    char name[9];
+    for (int f = 0; f < WRITE_FILES; f++)
+    {
+        file_name(name, 'w', f);
+        fds[f] = tfs_open(name);
+        if (fds[f] < 0)
+        {
+            fail("tfs_open", fds[f]);
+            return;
+        }
+    }
+    for (int s = 0; s < (int)(sizeof(write_sizes) / sizeof(write_sizes[0])) && failures == 0; s++)
+    {
+        int ops = WRITE_BYTES / write_sizes[s];
+        if (ops > MAX_WRITE_OPS)
+            ops = MAX_WRITE_OPS;
+        begin();
+        for (int i = 0; i < ops && failures == 0; i++)
+        {
+            start_call();
+            int write_err = tfs_write(fds[i % WRITE_FILES], buf, write_sizes[s]);
+            end_call(i);
+            if (write_err != SUCCESS)
+                fail("tfs_write", write_err);
+        }
+        char op[64];
+        snprintf(op, sizeof(op), "tfs_write %d bytes", write_sizes[s]);
+        end(op, ops, true);
+    }
+    for (int f = 0; f < WRITE_FILES; f++)
+        tfs_close(fds[f]);
+}
+
+// tfs_readByte() through a file front to back, at random offsets (each after a tfs_seek(), timed together) and
+// tfs_writeByte() at random offsets
+static void bench_bytes(void)
+{
+    static char buf[BYTE_FILE_BYTES];
+    fileDescriptor fd = tfs_open("bytes");
+    int write_err = fd < 0 ? fd : tfs_write(fd, buf, BYTE_FILE_BYTES);
+    if (write_err != SUCCESS)
+    {
+        fail("tfs_write", write_err);
+        return;
+    }
+    tfs_sync();
+
+    char c;
+    tfs_seek(fd, 0);
+    begin();
+    for (int i = 0; i < BYTE_OPS && failures == 0; i++)
+    {
+        start_call();
+        int read_err = tfs_readByte(fd, &c);
+        end_call(i);
+        if (read_err != SUCCESS)
+            fail("tfs_readByte", read_err);
+    }
+    end("tfs_readByte sequential", BYTE_OPS, true);
+
+    uint32_t seed = 2;
+    begin();
+    for (int i = 0; i < BYTE_OPS && failures == 0; i++)
+    {
+        int offset = next_random(&seed) % BYTE_FILE_BYTES;
+        start_call();
+        int read_err = tfs_seek(fd, offset);
+        if (read_err == SUCCESS)
+            read_err = tfs_readByte(fd, &c);
+        end_call(i);
+        if (read_err != SUCCESS)
+            fail("tfs_readByte", read_err);
+    }
+    end("tfs_readByte random", BYTE_OPS, true);
+
+    begin();
+    for (int i = 0; i < BYTE_OPS && failures == 0; i++)
+    {
+        int offset = next_random(&seed) % BYTE_FILE_BYTES;
+        start_call();
+        write_err = tfs_writeByte(fd, offset, (unsigned char)i);
+        end_call(i);
+        if (write_err != SUCCESS)
+            fail("tfs_writeByte", write_err);
+    }
+    end("tfs_writeByte random", BYTE_OPS, true);
+    tfs_close(fd);
+}
+
+// renames the files bench_open() created, then deletes them (each tfs_delete() after an untimed tfs_open())
+static void bench_rename_delete(void)
+{
+    char name[9], new_name[9];
+    begin();
+    for (int i = 0; i < NUM_FILES && failures == 0; i++)
+    {
+        file_name(name, 'f', i);
+        file_name(new_name, 'r', i);
+        start_call();
+        int rename_err = tfs_rename(name, new_name);
+        end_call(i);
+        if (rename_err != SUCCESS)
+            fail("tfs_rename", rename_err);
+    }
+    end("tfs_rename", NUM_FILES, true);
+
+    begin();
+    for (int i = 0; i < NUM_FILES && failures == 0; i++)
+    {
+        file_name(name, 'r', i);
+        fileDescriptor fd = tfs_open(name);
+        start_call();
+        int delete_err = fd < 0 ? fd : tfs_delete(fd);
+        end_call(i);
+        if (delete_err != SUCCESS)
+            fail("tfs_delete", delete_err);
+    }
+    end("tfs_delete", NUM_FILES, true);
+}
+
+// unmounts the populated image and times mounting it again; block I/O is the mount's own
+static void bench_mount(void)
+{
+    uint64_t reads = 0, writes = 0;
+    for (int i = 0; i < MOUNT_RUNS && failures == 0; i++)
+    {
+        int unmount_err = tfs_unmount();
+        if (unmount_err != SUCCESS)
+        {
+            fail("tfs_unmount", unmount_err);
+            return;
+        }
+        start_call();
+        int mount_err = tfs_mount(DISK_NAME);
+        end_call(i);
+        if (mount_err != SUCCESS)
+        {
+            fail("tfs_mount", mount_err);
+            return;
+        }
+        uint64_t mount_reads, mount_writes;
+        block_io(&mount_reads, &mount_writes); // the cache counts from mount on
+        reads += mount_reads;
+        writes += mount_writes;
+    }
+    end("tfs_mount", MOUNT_RUNS, false);
+    results[numResults - 1].readsPerOp = (double)reads / MOUNT_RUNS;
+    results[numResults - 1].writesPerOp = (double)writes / MOUNT_RUNS;
+}
+
+// tfs_open() creating SCALE_FILES names in the root of a fresh SCALE_BLOCK_SIZE image, in batches of SCALE_BATCH;
+// the first and last batch are reported. A create should cost the same however many names the directory holds
+static void bench_create_scaling(void)
+{
+    int mount_err = tfs_mkfsWithBlockSize(DISK_NAME, DISK_BYTES, SCALE_BLOCK_SIZE);
+    if (mount_err == SUCCESS)
+        mount_err = tfs_mount(DISK_NAME);
+    if (mount_err != SUCCESS)
+    {
+        fail("tfs_mount", mount_err);
+        return;
+    }
+    char name[9];
+    double first = 0;
+    for (int batch = 0; batch < SCALE_FILES / SCALE_BATCH && failures == 0; batch++)
+    {
+        begin();
+        for (int i = 0; i < SCALE_BATCH && failures == 0; i++)
+        {
+            file_name(name, 's', batch * SCALE_BATCH + i);
+            start_call();
+            fileDescriptor fd = tfs_open(name);
+            end_call(i);
+            if (fd < 0)
+                fail("tfs_open create", fd);
+            tfs_close(fd);
+        }
+        if (batch > 0 && batch + 1 < SCALE_FILES / SCALE_BATCH)
+            continue;
+        char op[64];
+        snprintf(op, sizeof(op), "tfs_open create %d-%d of %d (%d B blocks)", batch * SCALE_BATCH + 1,
+                 (batch + 1) * SCALE_BATCH, SCALE_FILES, SCALE_BLOCK_SIZE);
+        end(op, SCALE_BATCH, true);
+        if (failures > 0)
+            break;
+        double mean = results[numResults - 1].seconds / SCALE_BATCH;
+        if (batch == 0)
+            first = mean;
+        else if (mean > first * SCALE_MAX_GROWTH)
+        {
+            fprintf(stderr, "FAILED: creates slowed from %.2f to %.2f us as the directory grew\n", first * 1e6, mean * 1e6);
+            failures++;
+        }
+    }
+    int unmount_err = tfs_unmount();
+    if (unmount_err != SUCCESS)
+        fail("tfs_unmount", unmount_err);
+}
+
+static void print_json(FILE *out)
+{
+    fprintf(out, "{\n  \"blockSize\": %d,\n  \"diskBytes\": %d,\n  \"results\": [\n", BENCH_BLOCK_SIZE, DISK_BYTES);
+    for (int i = 0; i < numResults; i++)
+    {
+        Result *r = &results[i];
+        fprintf(out, "    {\"op\": \"%s\", \"ops\": %d, \"opsPerSec\": %.1f, \"p50Us\": %.3f, \"p99Us\": %.3f, ", r->op,
+                r->ops, r->seconds > 0 ? r->ops / r->seconds : 0, r->p50, r->p99);
+        if (r->readsPerOp < 0)
+            fprintf(out, "\"blockReadsPerOp\": null, \"blockWritesPerOp\": null}");
+        else
+            fprintf(out, "\"blockReadsPerOp\": %.3f, \"blockWritesPerOp\": %.3f}", r->readsPerOp, r->writesPerOp);
+        fprintf(out, "%s\n", i + 1 < numResults ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+int main(int argc, char **argv)
+{
+    latencies = malloc(sizeof(double) * (BYTE_OPS > NUM_FILES ? BYTE_OPS : NUM_FILES));
+    if (latencies == NULL)
+        return 1;
+    bench_mkfs();
+    int mount_err = failures == 0 ? mount_fresh() : SUCCESS;
+    if (mount_err != SUCCESS)
+    {
+        fail("tfs_mount", mount_err);
+        return 1;
+    }
+    if (failures == 0)
+        bench_open();
+    if (failures == 0)
+        bench_write();
+    if (failures == 0)
+        bench_bytes();
+    if (failures == 0)
+        bench_rename_delete();
+    if (failures == 0)
+        bench_mount();
+    int unmount_err = tfs_unmount();
+    if (unmount_err != SUCCESS)
+        fail("tfs_unmount", unmount_err);
+    if (failures == 0)
+        bench_create_scaling();
+    free(latencies);
+    if (failures > 0)
+        return 1;
+
+    FILE *out = argc > 1 ? fopen(argv[1], "w") : stdout;
+    if (out == NULL)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    print_json(out);
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
@@ -0,0 +1,552 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "libTinyFS.h"
+#include "errors.h"
+
+// Multithreaded stress test and scaling benchmark for the thread-safe library.
+// Measures tfs_read()/tfs_readByte() throughput at 1..MAX_THREADS threads, each on its own
+// descriptor, on different files and all on the same file, and prints the speedup against one
+// thread; N threads reading less than MIN_SCALING of N times one thread's rate is a failure
+// wherever at least N CPUs are online. Times tens of thousands of tfs_open()/tfs_close() calls
+// from several threads at once and checks every descriptor handed out is distinct. Then runs
+// readers, writers and open/rename/delete churn against each other, checks every byte read, and
+// with a CPU for each of the STRESS_THREADS threads fails any reader that kept less than
+// MIN_SCALING of its rate alone. Last, remounts without a block cache and compares one thread's
+// random block reads through tfs_read() with tfs_submit_read() keeping 1 to ASYNC_MAX_DEPTH of
+// them in flight, and scans whole files sequentially through a cache smaller than they are, with
+// readahead off and on. Exits non-zero on any wrong byte, unexpected error or missed scaling bound.
+
+#define DISK_NAME "threadBench.disk"
+#define DISK_BYTES (32 * 1024 * 1024)
+#define BENCH_BLOCK_SIZE 4096
+#define NUM_FILES 8
+#define FILE_BYTES (256 * 1024)
+#define READ_CHUNK (16 * 1024)
+#define BYTE_SPAN (16 * 1024) // tfs_readByte() covers the first BYTE_SPAN bytes of a file
+#define MAX_THREADS 8
+#define HANDLES_PER_THREAD 8192 // held open at once: MAX_THREADS of them fill the descriptor table
+#define ASYNC_MAX_DEPTH 256
+#define SCAN_CACHE (1024 * 1024) // block cache of the readahead scans: about half the files, so every pass goes to disk
+#define SCAN_READAHEAD (256 * 1024) // readahead window of the scans with it on (the library's default is off)
+#define RUN_SECONDS 0.3
+#define STRESS_SECONDS 1.0
+#define MIN_SCALING 0.5 // fraction of perfect scaling the readers must reach when each has a CPU
+#define STRESS_THREADS 8
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char pattern(int file, int offset)
+{
+    return (char)(file * 31 + offset * 7 + offset / 251);
+}
+
+static char file_name[NUM_FILES][8];
+static bool stop;                 // __atomic: every thread polls it
+static int failures;
+static long cpus;                 // online: scaling is only checked where every thread has one
+static double single_mbps[2];     // one reader on its own, by ReadMode: set by bench() on different files
+
+static bool stopped(void)
+{
+    return __atomic_load_n(&stop, __ATOMIC_RELAXED);
+}
+
+static void fail(const char *what, int file, int code)
+{
+    printf("FAILED: %s on file %d (%d)\n", what, file, code);
+    __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+}
+
+typedef enum { READ_CHUNKS, READ_BYTES } ReadMode;
+
+typedef struct {
+    pthread_t thread;
+    int file;
+    ReadMode mode;
+    unsigned long long bytes; // read and verified
+} Reader;
+
+static void *reader_main(void *arg)
+{
+    Reader *r = arg;
+    char buf[READ_CHUNK];
+    fileDescriptor fd = tfs_open(file_name[r->file]);
+    if (fd < 0)
+    {
+        fail("tfs_open", r->file, fd);
+        return NULL;
+    }
+    while (!stopped())
+    {
+        int seek_err = tfs_seek(fd, 0);
+        if (seek_err != SUCCESS)
+        {
+            fail("tfs_seek", r->file, seek_err);
+            break;
+        }
+        if (r->mode == READ_CHUNKS)
+        {
+            for (int offset = 0; offset < FILE_BYTES && !stopped(); offset += READ_CHUNK)
+            {
+                int n = tfs_read(fd, buf, READ_CHUNK);
+                if (n != READ_CHUNK)
+                {
+                    fail("tfs_read", r->file, n);
+                    break;
+                }
+                for (int i = 0; i < n; i++)
+                {
+                    if (buf[i] != pattern(r->file, offset + i))
+                    {
+                        fail("tfs_read data", r->file, offset + i);
+                        break;
+                    }
+                }
+                r->bytes += n;
+            }
+        }
+        else
+        {
+            for (int offset = 0; offset < BYTE_SPAN && !stopped(); offset++)
+            {
+                char c;
+                int read_err = tfs_readByte(fd, &c);
+                if (read_err != SUCCESS || c != pattern(r->file, offset))
+                {
+                    fail("tfs_readByte", r->file, read_err);
+                    break;
+                }
+                r->bytes++;
+            }
+        }
+    }
+    tfs_close(fd);
+    return NULL;
+}
+
+// throughput in MB/s of <threads> readers; <same_file> puts them all on file 0
+static double run_readers(int threads, bool same_file, ReadMode mode)
+{
+    Reader readers[MAX_THREADS] = {0};
+    __atomic_store_n(&stop, false, __ATOMIC_RELAXED);
+    for (int t = 0; t < threads; t++)
+    {
+        readers[t].file = same_file ? 0 : t % NUM_FILES;
+        readers[t].mode = mode;
+        pthread_create(&readers[t].thread, NULL, reader_main, &readers[t]);
+    }
+    double start = now_seconds();
+    while (now_seconds() - start < RUN_SECONDS && !stopped())
+        usleep(10000);
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+    unsigned long long bytes = 0;
+    for (int t = 0; t < threads; t++)
+    {
+        pthread_join(readers[t].thread, NULL);
+        bytes += readers[t].bytes;
+    }
+    return bytes / (now_seconds() - start) / 1e6;
+}
+
+static void bench(const char *label, bool same_file, ReadMode mode)
+{
+    double base = 0;
+    for (int threads = 1; threads <= MAX_THREADS && failures == 0; threads *= 2)
+    {
+        double mbps = run_readers(threads, same_file, mode);
+        if (threads == 1)
+        {
+            base = mbps;
+            if (!same_file)
+                single_mbps[mode] = mbps;
+        }
+        printf("%-30s %d threads: %9.1f MB/s  speedup %.2fx\n", label, threads, mbps, base > 0 ? mbps / base : 0);
+        if (threads <= cpus && mbps < MIN_SCALING * threads * base)
+        {
+            printf("FAILED: %s: %d threads read under %.0f%% of %d times one thread's rate\n", label, threads,
+                   MIN_SCALING * 100, threads);
+            failures++;
+        }
+    }
+}
+
+typedef struct {
+    pthread_t thread;
+    fileDescriptor fds[HANDLES_PER_THREAD];
+} Opener;
+
+static void *opener_main(void *arg)
+{
+    Opener *o = arg;
+    for (int i = 0; i < HANDLES_PER_THREAD; i++)
+    {
+        o->fds[i] = tfs_open(file_name[i % NUM_FILES]);
+        if (o->fds[i] < 0)
+        {
+            fail("tfs_open", i % NUM_FILES, o->fds[i]);
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void *closer_main(void *arg)
+{
+    Opener *o = arg;
+    for (int i = 0; i < HANDLES_PER_THREAD && o->fds[i] >= 0; i++)
+    {
+        int close_err = tfs_close(o->fds[i]);
+        if (close_err != SUCCESS)
+        {
+            fail("tfs_close", i % NUM_FILES, close_err);
+        }
+    }
+    return NULL;
+}
+
+// <threads> threads open HANDLES_PER_THREAD descriptors each, all held at once, then close them again
+static void descriptors(int threads)
+{
+    static Opener openers[MAX_THREADS];
+    static bool taken[MAX_OPEN_FILES];
+    memset(openers, 0, sizeof(openers));
+    memset(taken, 0, sizeof(taken));
+    double start = now_seconds();
+    for (int t = 0; t < threads; t++)
+        pthread_create(&openers[t].thread, NULL, opener_main, &openers[t]);
+    for (int t = 0; t < threads; t++)
+        pthread_join(openers[t].thread, NULL);
+    double opened = now_seconds();
+    for (int t = 0; t < threads; t++)
+    {
+        for (int i = 0; i < HANDLES_PER_THREAD && openers[t].fds[i] >= 0; i++)
+        {
+            if (taken[openers[t].fds[i]])
+                fail("descriptor handed out twice", i % NUM_FILES, openers[t].fds[i]);
+            taken[openers[t].fds[i]] = true;
+        }
+    }
+    double checked = now_seconds();
+    for (int t = 0; t < threads; t++)
+        pthread_create(&openers[t].thread, NULL, closer_main, &openers[t]);
+    for (int t = 0; t < threads; t++)
+        pthread_join(openers[t].thread, NULL);
+    double closed = now_seconds();
+    int handles = threads * HANDLES_PER_THREAD;
+    printf("%-30s %d threads: %6d held, %9.0f opens/s  %9.0f closes/s\n", "tfs_open/tfs_close", threads, handles,
+           handles / (opened - start), handles / (closed - checked));
+}
+
+// rewrites file NUM_FILES - 1 whole with one byte value after another while readers check every read sees one value
+static void *rewriter_main(void *arg)
+{
+    (void)arg;
+    static char buf[FILE_BYTES];
+    fileDescriptor fd = tfs_open(file_name[NUM_FILES - 1]);
+    for (int round = 0; fd >= 0 && !stopped(); round++)
+    {
+        memset(buf, 'a' + round % 26, sizeof(buf));
+        int write_err = round % 2 ? tfs_pwrite(fd, 0, buf, sizeof(buf)) : tfs_write(fd, buf, sizeof(buf));
+        if (write_err != SUCCESS)
+            fail("rewrite", NUM_FILES - 1, write_err);
+    }
+    if (fd < 0)
+        fail("tfs_open", NUM_FILES - 1, fd);
+    else
+        tfs_close(fd);
+    return NULL;
+}
+
+static void *torn_reader_main(void *arg)
+{
+    (void)arg;
+    static char buf[FILE_BYTES];
+    fileDescriptor fd = tfs_open(file_name[NUM_FILES - 1]);
+    while (fd >= 0 && !stopped())
+    {
+        tfs_seek(fd, 0);
+        int n = tfs_read(fd, buf, sizeof(buf));
+        if (n != FILE_BYTES)
+        {
+            fail("tfs_read during rewrite", NUM_FILES - 1, n);
+            break;
+        }
+        for (int i = 1; i < n; i++)
+        {
+            if (buf[i] != buf[0])
+            {
+                fail("torn read during rewrite", NUM_FILES - 1, i);
+                break;
+            }
+        }
+    }
+    if (fd >= 0)
+        tfs_close(fd);
+    return NULL;
+}
+
+// appends to, truncates, renames and deletes files of its own, with an fsync now and then
+static void *churn_main(void *arg)
+{
+    int id = (int)(long)arg;
+    char name[8], renamed[8], buf[700];
+    snprintf(name, sizeof(name), "c%d", id);
+    snprintf(renamed, sizeof(renamed), "r%d", id);
+    memset(buf, 'A' + id, sizeof(buf));
+    for (int round = 0; !stopped(); round++)
+    {
+        fileDescriptor fd = tfs_open(name);
+        if (fd < 0)
+        {
+            fail("churn tfs_open", id, fd);
+            break;
+        }
+        int churn_err = SUCCESS;
+        for (int i = 0; i < 8 && churn_err == SUCCESS; i++)
+            churn_err = tfs_append(fd, buf, sizeof(buf));
+        if (churn_err == SUCCESS)
+            churn_err = tfs_truncate(fd, 1000);
+        if (churn_err == SUCCESS && round % 8 == 0)
+            churn_err = tfs_fsync(fd);
+        if (churn_err == SUCCESS)
+            churn_err = tfs_writeByte(fd, 999, 'z');
+        tfs_close(fd);
+        if (churn_err == SUCCESS)
+            churn_err = tfs_rename(name, renamed);
+        if (churn_err == SUCCESS)
+        {
+            fd = tfs_open(renamed);
+            char c = 0;
+            if (fd < 0 || tfs_seek(fd, 999) != SUCCESS || tfs_readByte(fd, &c) != SUCCESS || c != 'z')
+                churn_err = UNSPECIFIED_ERROR;
+            else
+                churn_err = tfs_delete(fd);
+        }
+        if (churn_err != SUCCESS)
+        {
+            fail("churn", id, churn_err);
+            break;
+        }
+    }
+    return NULL;
+}
+
+// STRESS_THREADS threads: two chunk readers, two byte readers, the rewriter, its checker and two churners
+static void stress(void)
+{
+    Reader readers[4] = {0};
+    pthread_t others[4];
+    __atomic_store_n(&stop, false, __ATOMIC_RELAXED);
+    for (int t = 0; t < 4; t++)
+    {
+        readers[t].file = t;
+        readers[t].mode = t % 2 == 0 ? READ_CHUNKS : READ_BYTES;
+        pthread_create(&readers[t].thread, NULL, reader_main, &readers[t]);
+    }
+    pthread_create(&others[0], NULL, rewriter_main, NULL);
+    pthread_create(&others[1], NULL, torn_reader_main, NULL);
+    pthread_create(&others[2], NULL, churn_main, (void *)1L);
+    pthread_create(&others[3], NULL, churn_main, (void *)2L);
+    double start = now_seconds();
+    while (now_seconds() - start < STRESS_SECONDS && !stopped())
+        usleep(10000);
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+    double seconds = now_seconds() - start;
+    for (int t = 0; t < 4; t++)
+        pthread_join(readers[t].thread, NULL);
+    for (int t = 0; t < 4; t++)
+        pthread_join(others[t], NULL);
+    for (int t = 0; t < 4 && failures == 0; t++)
+    { // the readers' files are not being written, so the writers and churn should only cost them lock waits
+        double mbps = readers[t].bytes / seconds / 1e6;
+        if (readers[t].bytes == 0 || (cpus >= STRESS_THREADS && mbps < MIN_SCALING * single_mbps[readers[t].mode]))
+        {
+            printf("FAILED: stress reader %d read %.1f MB/s against %.1f MB/s on its own\n", t, mbps,
+                   single_mbps[readers[t].mode]);
+            failures++;
+        }
+    }
+    printf("stress (readers, rewriter, churn): %s\n", failures == 0 ? "ok" : "FAILED");
+}
+
+// random block-sized reads of file 0 through the uncached instance <fs>: synchronous, then <depth> requests in flight
+static void async_bench(tfs_fs *fs, int depth)
+{
+    static char bufs[ASYNC_MAX_DEPTH][BENCH_BLOCK_SIZE];
+    static int offsets[ASYNC_MAX_DEPTH];
+    static int64_t tokens[ASYNC_MAX_DEPTH];
+    TfsCompletion done[ASYNC_MAX_DEPTH];
+    fileDescriptor fd = tfs_open2(fs, file_name[0]);
+    unsigned seed = 1;
+    long ops = 0;
+    double start = now_seconds();
+    int in_flight = 0;
+    while (failures == 0 && (now_seconds() - start < RUN_SECONDS || in_flight > 0))
+    {
+        for (int slot = 0; slot < depth && now_seconds() - start < RUN_SECONDS; slot++)
+        {
+            if (tokens[slot] > 0)
+                continue;
+            offsets[slot] = (int)(rand_r(&seed) % (FILE_BYTES / BENCH_BLOCK_SIZE)) * BENCH_BLOCK_SIZE;
+            if (depth == 1)
+            { // the synchronous baseline
+                if (tfs_seek2(fs, fd, offsets[slot]) != SUCCESS || tfs_read2(fs, fd, bufs[slot], BENCH_BLOCK_SIZE) != BENCH_BLOCK_SIZE ||
+                    bufs[slot][17] != pattern(0, offsets[slot] + 17))
+                    fail("tfs_read", 0, offsets[slot]);
+                ops++;
+                continue;
+            }
+            tokens[slot] = tfs_submit_read2(fs, fd, offsets[slot], bufs[slot], BENCH_BLOCK_SIZE);
+            if (tokens[slot] <= 0)
+            {
+                fail("tfs_submit_read", 0, (int)tokens[slot]);
+                break;
+            }
+            in_flight++;
+        }
+        int n = depth == 1 ? 0 : tfs_wait_completions2(fs, done, 1, depth);
+        for (int i = 0; i < n; i++)
+        {
+            int slot = 0;
+            while (tokens[slot] != done[i].token)
+                slot++;
+            if (done[i].result != BENCH_BLOCK_SIZE || bufs[slot][17] != pattern(0, offsets[slot] + 17))
+                fail("tfs_submit_read data", 0, done[i].result);
+            tokens[slot] = 0;
+            in_flight--;
+            ops++;
+        }
+    }
+    double seconds = now_seconds() - start;
+    tfs_close2(fs, fd);
+    printf("%-30s depth %3d: %9.0f reads/s\n", depth == 1 ? "tfs_read, uncached" : "tfs_submit_read, uncached", depth, ops / seconds);
+}
+
+// sequential scans of one file after another (all but the one stress() rewrote) through a fresh mount with a
+// SCAN_CACHE cache and <readahead_bytes> of readahead (0: off), counting the block reads that had to wait for the disk
+static void readahead_bench(ReadMode mode, uint32_t readahead_bytes)
+{
+    static char chunk[READ_CHUNK];
+    TfsMountOptions options;
+    tfs_defaultMountOptions(&options);
+    options.cacheBudget = SCAN_CACHE;
+    options.readaheadBytes = readahead_bytes;
+    int mount_err;
+    tfs_fs *fs = tfs_mount2(DISK_NAME, &options, &mount_err);
+    if (fs == NULL)
+    {
+        fail("tfs_mount2", -1, mount_err);
+        return;
+    }
+    CacheStats before, after;
+    tfs_cacheStats2(fs, &before);
+    unsigned long long bytes = 0;
+    double start = now_seconds();
+    for (int f = 0; failures == 0 && now_seconds() - start < RUN_SECONDS; f = (f + 1) % (NUM_FILES - 1))
+    {
+        fileDescriptor fd = tfs_open2(fs, file_name[f]);
+        for (int offset = 0; fd >= 0 && offset < FILE_BYTES && failures == 0;)
+        {
+            if (mode == READ_BYTES)
+            {
+                int read_err = tfs_readByte2(fs, fd, chunk);
+                if (read_err != SUCCESS || chunk[0] != pattern(f, offset))
+                    fail("tfs_readByte scan", f, read_err);
+                offset++;
+                continue;
+            }
+            int got = tfs_read2(fs, fd, chunk, READ_CHUNK);
+            if (got != READ_CHUNK || chunk[0] != pattern(f, offset) || chunk[READ_CHUNK - 1] != pattern(f, offset + READ_CHUNK - 1))
+                fail("tfs_read scan", f, got);
+            offset += READ_CHUNK;
+        }
+        if (fd < 0)
+            fail("tfs_open2", f, fd);
+        tfs_close2(fs, fd);
+        bytes += FILE_BYTES;
+    }
+    double seconds = now_seconds() - start;
+    tfs_cacheStats2(fs, &after);
+    int unmount_err = tfs_unmount2(fs);
+    if (unmount_err != SUCCESS)
+        fail("tfs_unmount2", -1, unmount_err);
+    double blocks = (double)bytes / BENCH_BLOCK_SIZE;
+    printf("%-30s readahead %3u KiB: %9.1f MB/s  per block %.3f misses, %.3f waits for a prefetch\n",
+           mode == READ_BYTES ? "tfs_readByte scan" : "tfs_read scan", readahead_bytes / 1024, bytes / seconds / 1e6,
+           (after.misses - before.misses) / blocks, (after.prefetchWaits - before.prefetchWaits) / blocks);
+}
+
+int main(void)
+{
+    static char buf[FILE_BYTES];
+    tfs_setCacheBudget(DISK_BYTES); // the whole image fits: reads are memory-bound, as scaling needs
+    if (tfs_mkfsWithBlockSize(DISK_NAME, DISK_BYTES, BENCH_BLOCK_SIZE) != SUCCESS || tfs_mount(DISK_NAME) != SUCCESS)
+    {
+        printf("Failed to set up %s\n", DISK_NAME);
+        return 1;
+    }
+    for (int f = 0; f < NUM_FILES; f++)
+    {
+        snprintf(file_name[f], sizeof(file_name[f]), "f%d", f);
+        for (int i = 0; i < FILE_BYTES; i++)
+            buf[i] = pattern(f, i);
+        fileDescriptor fd = tfs_open(file_name[f]);
+        if (fd < 0 || tfs_write(fd, buf, FILE_BYTES) != SUCCESS)
+        {
+            printf("Failed to write %s\n", file_name[f]);
+            return 1;
+        }
+        tfs_close(fd);
+    }
+    tfs_sync();
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("%ld CPUs online\n", cpus);
+    bench("tfs_read, different files", false, READ_CHUNKS);
+    bench("tfs_read, same file", true, READ_CHUNKS);
+    bench("tfs_readByte, different files", false, READ_BYTES);
+    bench("tfs_readByte, same file", true, READ_BYTES);
+    for (int threads = 1; threads <= MAX_THREADS && failures == 0; threads *= 2)
+        descriptors(threads);
+    if (failures == 0)
+        stress();
+
+    int unmount_err = tfs_unmount();
+    if (unmount_err != SUCCESS)
+        fail("tfs_unmount", -1, unmount_err);
+
+    TfsMountOptions uncached;
+    tfs_defaultMountOptions(&uncached);
+    uncached.cacheBudget = 0; // every read goes to libDisk
+    int mount_err;
+    tfs_fs *fs = tfs_mount2(DISK_NAME, &uncached, &mount_err);
+    if (fs == NULL)
+    {
+        fail("tfs_mount2", -1, mount_err);
+        return 1;
+    }
+    for (int depth = 1; depth <= ASYNC_MAX_DEPTH && failures == 0; depth *= 4)
+        async_bench(fs, depth);
+    printf("async engine: %s\n", diskAsyncEngine() == DISK_ASYNC_IO_URING ? "io_uring" : "I/O threads");
+    unmount_err = tfs_unmount2(fs);
+    if (unmount_err != SUCCESS)
+        fail("tfs_unmount2", -1, unmount_err);
+
+    for (int mode = READ_CHUNKS; mode <= READ_BYTES && failures == 0; mode++)
+    {
+        readahead_bench(mode, 0);
+        readahead_bench(mode, SCAN_READAHEAD);
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -3,6 +3,18 @@
 #include "tinyfs_crc.h"
 #include <string.h> // for memcpy, optional
 
+// Images formatted before the structs were sized to exactly one block were checksummed
+// over the old (oversized) struct, i.e. the block followed by a zeroed tail.
+#define LEGACY_SUPERBLOCK_TAIL 4
+#define LEGACY_INODE_TAIL 12
+
+static uint16_t legacy_checksum(const void *block, size_t tail)
+{
+    uint8_t buf[BLOCK_SIZE + LEGACY_INODE_TAIL] = {0};
+    memcpy(buf, block, BLOCK_SIZE);
+    return (uint16_t)(crc32(buf, BLOCK_SIZE + tail) & 0xFFFF);
+}
+
 // --------------------- Superblock ---------------------
 
 void set_superblock_checksum(Superblock *sb) {
@@ -14,7 +26,7 @@ bool verify_superblock_checksum(const Superblock *sb) {
     Superblock temp = *sb;
     temp.checksum = 0;
     uint16_t expected = (uint16_t)(crc32(&temp, sizeof(Superblock)) & 0xFFFF);
-    return sb->checksum == expected;
+    return sb->checksum == expected || sb->checksum == legacy_checksum(&temp, LEGACY_SUPERBLOCK_TAIL);
 }
 
 // ------------------------ Inode ------------------------
@@ -28,17 +40,26 @@ bool verify_inode_checksum(const Inode *inode) {
     Inode temp = *inode;
     temp.checksum = 0;
     uint16_t expected = (uint16_t)(crc32(&temp, sizeof(Inode)) & 0xFFFF);
-    return inode->checksum == expected;
+    return inode->checksum == expected || inode->checksum == legacy_checksum(&temp, LEGACY_INODE_TAIL);
 }
 
 // ---------------------- Datablock ----------------------
 
 void set_datablock_checksum(Datablock *db) {
-    db->checksum = 0;
-    db->checksum = (uint16_t)(crc32(db->data, sizeof(db->data)) & 0xFFFF);
+    set_block_checksum(db, sizeof(Datablock));
 }
 
 bool verify_datablock_checksum(const Datablock *db) {
-    uint16_t expected = (uint16_t)(crc32(db->data, sizeof(db->data)) & 0xFFFF);
-    return db->checksum == expected;
+    return verify_block_checksum(db, sizeof(Datablock));
+}
+
+void set_block_checksum(void *block, uint32_t block_size) {
+    uint16_t checksum = (uint16_t)(crc32(block, block_size - sizeof(uint16_t)) & 0xFFFF);
+    memcpy((uint8_t *)block + block_size - sizeof(uint16_t), &checksum, sizeof(checksum));
+}
+
+bool verify_block_checksum(const void *block, uint32_t block_size) {
+    uint16_t stored;
+    memcpy(&stored, (const uint8_t *)block + block_size - sizeof(uint16_t), sizeof(stored));
+    return stored == (uint16_t)(crc32(block, block_size - sizeof(uint16_t)) & 0xFFFF);
 }
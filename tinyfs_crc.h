@@ -16,4 +16,8 @@ bool verify_inode_checksum(const Inode *inode);
 void set_datablock_checksum(Datablock *db);
 bool verify_datablock_checksum(const Datablock *db);
 
+// Datablock checksum for any block size: the last 2 bytes of the block cover the rest
+void set_block_checksum(void *block, uint32_t block_size);
+bool verify_block_checksum(const void *block, uint32_t block_size);
+
 #endif